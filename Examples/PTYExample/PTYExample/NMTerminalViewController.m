@@ -1,6 +1,9 @@
 #import "NMTerminalViewController.h"
 #import <NMSSH/NMSSH.h>
 
+// Lines of the scrollback shown in the text view
+static const NSUInteger kNMTerminalVisibleLines = 500;
+
 @interface NMTerminalViewController () <NMSSHSessionDelegate, NMSSHChannelDelegate>
 
 @property (nonatomic, strong) dispatch_queue_t sshQueue;
@@ -8,6 +11,7 @@
 @property (nonatomic, assign) dispatch_once_t onceToken;
 @property (nonatomic, strong) dispatch_semaphore_t semaphore;
 @property (nonatomic, strong) NSMutableString *lastCommand;
+@property (nonatomic, strong) NMSSHScrollbackBuffer *scrollback;
 @property (nonatomic, assign) BOOL keyboardInteractive;
 
 @end
@@ -22,6 +26,7 @@
     self.textView.editable = NO;
     self.textView.selectable = NO;
     self.lastCommand = [[NSMutableString alloc] init];
+    self.scrollback = [[NMSSHScrollbackBuffer alloc] initWithCapacity:1024 * 1024 maximumLines:10000];
 
     self.sshQueue = dispatch_queue_create("NMSSH.queue", DISPATCH_QUEUE_SERIAL);
 }
@@ -80,6 +85,7 @@
 
             self.session.channel.delegate = self;
             self.session.channel.requestPty = YES;
+            self.session.channel.scrollbackBuffer = self.scrollback;
 
             NSError *error;
             [self.session.channel startShell:&error];
@@ -106,7 +112,15 @@
 }
 
 - (void)appendToTextView:(NSString *)text {
-    self.textView.text = [NSString stringWithFormat:@"%@%@", self.textView.text, text];
+    [self.scrollback appendData:[text dataUsingEncoding:NSUTF8StringEncoding]];
+    [self renderScrollback];
+}
+
+- (void)renderScrollback {
+    // Only the end of the output is shown, however long the session ran.
+    // The shell appends its output to the scrollback on its own.
+    NSString *output = [[self.scrollback lastLines:kNMTerminalVisibleLines] componentsJoinedByString:@"\n"];
+    self.textView.text = [output stringByAppendingString:self.lastCommand];
     [self.textView scrollRangeToVisible:NSMakeRange([self.textView.text length] - 1, 1)];
 }
 
@@ -126,15 +140,14 @@
 }
 
 - (void)channel:(NMSSHChannel *)channel didReadData:(NSString *)message {
-    NSString *msg = [message copy];
     dispatch_async(dispatch_get_main_queue(), ^{
-        [self appendToTextView:msg];
+        [self renderScrollback];
     });
 }
 
 - (void)channel:(NMSSHChannel *)channel didReadError:(NSString *)error {
     dispatch_async(dispatch_get_main_queue(), ^{
-        [self appendToTextView:[NSString stringWithFormat:@"[ERROR] %@", error]];
+        [self renderScrollback];
     });
 }
 
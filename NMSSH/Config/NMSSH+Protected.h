@@ -6,6 +6,7 @@
 #import <sys/socket.h>
 #import <arpa/inet.h>
 #import "socket_helper.h"
+#import "NMSSHSession.h"
 
 #define kNMSSHBufferSize (0x4000)
 
@@ -16,4 +17,168 @@
 
 #define strlen (unsigned int)strlen
 
+@interface NMSSHSession ()
+
+/**
+ Serial queue every libssh2 call made on the session is funneled through.
+
+ Dispatch sources reading the session socket must target this queue.
+ */
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong, readonly) dispatch_queue_t queue;
+#else
+@property (nonatomic, assign, readonly) dispatch_queue_t queue;
+#endif
+
+/** A Boolean value indicating whether the caller is running on the session queue. */
+- (BOOL)isOnQueue;
+
+/** performBlockAndWait: returning the BOOL result of the block. */
+- (BOOL)performBoolBlockAndWait:(BOOL (^)(void))block;
+
+/** performBlockAndWait: returning the object result of the block. */
+- (id)performObjectBlockAndWait:(id (^)(void))block;
+
+/** Queue an asynchronous operation, it is started once all the previous ones finished. */
+- (NMSSHOperation *)enqueueOperation:(NMSSHOperation *)operation;
+
+/** Run the queued operations again, after an operation step returned kNMSSHStepSuspend. */
+- (void)resumeOperations;
+
+/** Whether an operation of a class above the given one is ready to run. */
+- (BOOL)hasOperationsAbovePriority:(NMSSHOperationPriority)priority;
+
+/** The deadline of the running performWithDeadline:block:, if any. */
+@property (atomic, strong, readonly) NMSSHDeadline *deadline;
+
+/** The earliest of the current deadline and the given timeout, ignored when not positive. */
+- (NMSSHDeadline *)deadlineWithTimeout:(NSNumber *)timeout;
+
+/** Read the channel whenever the socket gets readable, until it is removed. */
+- (void)addPumpedChannel:(NMSSHChannel *)channel;
+
+/** Stop reading the channel, the socket source goes away with the last one. */
+- (void)removePumpedChannel:(NMSSHChannel *)channel;
+
+/** Run the handler on the session queue whenever the channels are read, until it is removed. It returns whether it waits for data of its channels; the socket is also waited for while libssh2 has output to flush. */
+- (id)addPumpHandler:(BOOL (^)(void))handler;
+
+/** Stop running a handler, the token is the value returned by addPumpHandler:. */
+- (void)removePumpHandler:(id)token;
+
+/** Read the channels soon, e.g. after a channel resumed its reads. */
+- (void)schedulePump;
+
+@end
+
+@interface NMSSHChannel ()
+
+/** Whether the session should read the channel: its stream is open and its reads are not suspended. */
+- (BOOL)canPumpReads;
+
+/** Whether libssh2 already holds data or an EOF for the channel, that no socket event will announce. */
+- (BOOL)hasBufferedInput;
+
+/** Read the stream until libssh2 has nothing left for the channel. */
+- (void)readShell;
+
+@end
+
+// Results of an operation step, the negative values are libssh2 errors and
+// LIBSSH2_ERROR_EAGAIN waits for the session socket
+#define kNMSSHStepDone     (0)
+#define kNMSSHStepContinue (1)
+#define kNMSSHStepSuspend  (2)
+#define kNMSSHStepFailed   (-1)
+
+typedef int (^NMSSHOperationStep)(NMSSHOperation *operation);
+
+@interface NMSSHDeadline ()
+
+/** Remaining time for libssh2_session_set_timeout(), at least 1ms unless distant (0). */
+- (long)remainingMilliseconds;
+
+/** The deadline as a dispatch time. */
+- (dispatch_time_t)dispatchTime;
+
+@end
+
+@interface NMSSHOperation ()
+
+/** The session running the operation. */
+@property (nonatomic, weak) NMSSHSession *session;
+
+/** The queue the completion handler is called on, the callback queue of the session unless set before it is queued. */
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_queue_t callbackQueue;
+#else
+@property (nonatomic, assign) dispatch_queue_t callbackQueue;
+#endif
+
+/** Set by a step before returning kNMSSHStepFailed, the session last error is used otherwise. */
+@property (nonatomic, strong) NSError *error;
+
+/** The time limit of the operation, set by the session when started from performWithDeadline:block:. */
+@property (atomic, strong) NMSSHDeadline *deadline;
+
+/** Whether the operation is failed when the session gets disconnected, defaults to YES. */
+@property (nonatomic, assign) BOOL requiresSession;
+
+/** The priority class of the operation, set before it is queued. */
+@property (atomic, readwrite) NMSSHOperationPriority priority;
+
+/** Whether the operation runs alone: the operations queued after it wait until it finished, whatever their class. */
+@property (nonatomic, assign, getter = isExclusive) BOOL exclusive;
+
+/** Whether the last step returned LIBSSH2_ERROR_EAGAIN, i.e. a libssh2 call is in progress. */
+@property (nonatomic, readonly, getter = isWaiting) BOOL waiting;
+
+/** Whether the operation ran at least once, it may hold remote resources. */
+@property (nonatomic, readonly, getter = isStarted) BOOL started;
+
+/**
+ Create a new operation.
+
+ @param steps Steps run in order, each one until it returns kNMSSHStepDone
+ @param cleanup Step always run last, even if the operation failed or was cancelled
+ @param completion Called on the callback queue of the session
+ */
+- (instancetype)initWithSteps:(NSArray<NMSSHOperationStep> *)steps
+                      cleanup:(NMSSHOperationStep)cleanup
+                   completion:(void (^)(NSError *error))completion;
+
+/** Run the steps until one has to wait, returns kNMSSHStepDone once finished. */
+- (int)run;
+
+/** Complete the libssh2 call in progress, the session must be in blocking mode. */
+- (void)settle;
+
+/** Finish the operation without running any step if it was cancelled or its deadline passed. */
+- (BOOL)finishIfAbandoned;
+
+/** Fail the operation if not finished yet, without running any step, a `nil` error means cancelled. */
+- (void)finishWithError:(NSError *)error;
+
+/** Call the completion handler. */
+- (void)finish;
+
+@end
+
+@interface NMSSHCommandResult ()
+
+/** Set by whoever ran the command. */
+@property (nonatomic, readwrite, strong) NSString *command;
+@property (nonatomic, readwrite, strong) NSData *standardOutput;
+@property (nonatomic, readwrite, strong) NSData *standardError;
+@property (nonatomic, readwrite, assign) int exitStatus;
+
+@end
+
+@interface NMSSHExpectMatch ()
+
+/** Set by the channel, the matcher does not keep the output it scanned. */
+@property (nonatomic, readwrite, strong) NSData *precedingData;
+
+@end
+
 #endif
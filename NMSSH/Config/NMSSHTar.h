@@ -0,0 +1,85 @@
+#import "NMSSH.h"
+
+/** Receives the bytes of a stream, returns NO to abort it. */
+typedef BOOL (^NMSSHStreamSink)(const void *bytes, size_t length);
+
+/**
+ NMSSHGzipStream compresses or decompresses a gzip stream chunk by chunk.
+ */
+@interface NMSSHGzipStream : NSObject
+
+/** A compressor at the given zlib level, from 1 (fastest) to 9 (smallest). */
+- (instancetype)initCompressorWithLevel:(int)level sink:(NMSSHStreamSink)sink;
+
+/** A decompressor. */
+- (instancetype)initDecompressorWithSink:(NMSSHStreamSink)sink;
+
+/** Process the next chunk, the result is handed to the sink. */
+- (BOOL)processBytes:(const void *)bytes length:(size_t)length;
+
+/** Flush the end of the stream to the sink. */
+- (BOOL)finish;
+
+/**
+ Estimate how well data compresses.
+
+ @returns The size of the data compressed at level 1 divided by its size
+ */
++ (double)compressionRatioOfData:(NSData *)data;
+
+@end
+
+/**
+ NMSSHTarWriter generates a POSIX tar stream on the fly.
+
+ Names longer than the ustar fields and files of 8 GiB or more are described
+ by pax extended headers.
+ */
+@interface NMSSHTarWriter : NSObject
+
+- (instancetype)initWithSink:(NMSSHStreamSink)sink;
+
+/** Bytes handed to the sink so far. */
+@property (nonatomic, readonly) uint64_t length;
+
+/** Append a directory, `path` is relative to the root of the archive. */
+- (BOOL)appendDirectory:(NSString *)path mode:(mode_t)mode modificationTime:(time_t)modificationTime;
+
+/**
+ Append a regular file, read from the file descriptor.
+
+ @param progress Called with the number of bytes of the file written so far,
+        returns NO to abort
+ */
+- (BOOL)appendFile:(NSString *)path
+        descriptor:(int)descriptor
+              size:(uint64_t)size
+              mode:(mode_t)mode
+  modificationTime:(time_t)modificationTime
+          progress:(BOOL (^)(uint64_t written))progress;
+
+/** Terminate the archive. */
+- (BOOL)finish;
+
+@end
+
+/**
+ NMSSHTarReader extracts a tar stream under a directory as it arrives.
+
+ ustar, pax and GNU long name entries are understood. Only directories and
+ regular files are extracted, entries escaping the destination are refused.
+ */
+@interface NMSSHTarReader : NSObject
+
+- (instancetype)initWithDestination:(NSString *)destination;
+
+/** Bytes consumed so far. */
+@property (nonatomic, readonly) uint64_t length;
+
+/** Consume the next chunk of the stream. */
+- (BOOL)consumeBytes:(const void *)bytes length:(size_t)length;
+
+/** Check that the archive is complete and apply the directory times. */
+- (BOOL)finish;
+
+@end
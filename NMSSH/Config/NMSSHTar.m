@@ -0,0 +1,602 @@
+#import "NMSSHTar.h"
+#import "NMSSH+Protected.h"
+
+#import <sys/time.h>
+#import <zlib.h>
+
+#define kNMSSHTarBlockSize (512)
+
+// Size of the chunks files are read in and streams are (de)compressed to
+#define kNMSSHTarChunkSize (256 * 1024)
+
+// Sizes from 8 GiB on do not fit the 11 octal digits of a ustar header
+#define kNMSSHTarMaximumOctalSize (8ULL * 1024 * 1024 * 1024)
+
+// -----------------------------------------------------------------------------
+#pragma mark - GZIP STREAM
+// -----------------------------------------------------------------------------
+
+@interface NMSSHGzipStream () {
+    z_stream _stream;
+}
+@property (nonatomic, copy) NMSSHStreamSink sink;
+@property (nonatomic, strong) NMSSHBuffer *output;
+@property (nonatomic, assign) BOOL compressor;
+@property (nonatomic, assign) BOOL ended;
+@end
+
+@implementation NMSSHGzipStream
+
+- (instancetype)initCompressorWithLevel:(int)level sink:(NMSSHStreamSink)sink {
+    if ((self = [super init])) {
+        [self setSink:sink];
+        [self setCompressor:YES];
+        [self setOutput:[[NMSSHBufferPool sharedPool] newBufferWithLength:kNMSSHTarChunkSize]];
+
+        // A window of 15 bits plus 16 selects the gzip format
+        if (deflateInit2(&_stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return nil;
+        }
+    }
+
+    return self;
+}
+
+- (instancetype)initDecompressorWithSink:(NMSSHStreamSink)sink {
+    if ((self = [super init])) {
+        [self setSink:sink];
+        [self setCompressor:NO];
+        [self setOutput:[[NMSSHBufferPool sharedPool] newBufferWithLength:kNMSSHTarChunkSize]];
+
+        if (inflateInit2(&_stream, 15 + 16) != Z_OK) {
+            return nil;
+        }
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    if (self.compressor) {
+        deflateEnd(&_stream);
+    }
+    else {
+        inflateEnd(&_stream);
+    }
+}
+
+- (BOOL)runWithFlush:(int)flush {
+    for (;;) {
+        _stream.next_out = [self.output mutableBytes];
+        _stream.avail_out = (uInt)[self.output length];
+
+        int rc = self.compressor ? deflate(&_stream, flush) : inflate(&_stream, flush);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            NMSSHLogError(@"zlib error %d: %s", rc, _stream.msg ?: "");
+            return NO;
+        }
+
+        size_t produced = [self.output length] - _stream.avail_out;
+        if (produced > 0 && !self.sink([self.output bytes], produced)) {
+            return NO;
+        }
+
+        if (rc == Z_STREAM_END) {
+            [self setEnded:YES];
+            return YES;
+        }
+
+        // Done once the input is consumed and zlib has nothing left to hand out
+        if (_stream.avail_out != 0 && (_stream.avail_in == 0 || rc == Z_BUF_ERROR)) {
+            return YES;
+        }
+    }
+}
+
+- (BOOL)processBytes:(const void *)bytes length:(size_t)length {
+    if (self.ended) {
+        return length == 0;
+    }
+
+    _stream.next_in = (Bytef *)bytes;
+    _stream.avail_in = (uInt)length;
+
+    return [self runWithFlush:Z_NO_FLUSH];
+}
+
+- (BOOL)finish {
+    if (!self.compressor) {
+        return self.ended;
+    }
+
+    _stream.next_in = NULL;
+    _stream.avail_in = 0;
+
+    return [self runWithFlush:Z_FINISH] && self.ended;
+}
+
++ (double)compressionRatioOfData:(NSData *)data {
+    if ([data length] == 0) {
+        return 1;
+    }
+
+    uLongf compressedLength = compressBound((uLong)[data length]);
+    NSMutableData *compressed = [NSMutableData dataWithLength:compressedLength];
+    if (compress2([compressed mutableBytes], &compressedLength, [data bytes], (uLong)[data length], 1) != Z_OK) {
+        return 1;
+    }
+
+    return (double)compressedLength / [data length];
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - TAR WRITER
+// -----------------------------------------------------------------------------
+
+static void NMSSHTarWriteOctal(char *field, size_t size, uint64_t value) {
+    // size - 1 digits and a terminating null character
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+static unsigned int NMSSHTarChecksum(const char *header) {
+    unsigned int sum = 0;
+    for (int i = 0; i < kNMSSHTarBlockSize; i++) {
+        // The checksum field itself counts as spaces
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+    }
+
+    return sum;
+}
+
+static void NMSSHTarAppendPaxRecord(NSMutableData *records, NSString *key, NSString *value) {
+    // The length prefix counts its own digits
+    NSUInteger bodyLength = [[NSString stringWithFormat:@" %@=%@\n", key, value] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    NSUInteger length = bodyLength + 1;
+    while ([[NSString stringWithFormat:@"%lu", (unsigned long)length] length] + bodyLength != length) {
+        length = [[NSString stringWithFormat:@"%lu", (unsigned long)length] length] + bodyLength;
+    }
+
+    [records appendData:[[NSString stringWithFormat:@"%lu %@=%@\n", (unsigned long)length, key, value] dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+@interface NMSSHTarWriter ()
+@property (nonatomic, copy) NMSSHStreamSink sink;
+@property (nonatomic, readwrite) uint64_t length;
+@property (nonatomic, strong) NMSSHBuffer *buffer;
+@end
+
+@implementation NMSSHTarWriter
+
+- (instancetype)initWithSink:(NMSSHStreamSink)sink {
+    if ((self = [super init])) {
+        [self setSink:sink];
+    }
+
+    return self;
+}
+
+- (BOOL)writeBytes:(const void *)bytes length:(size_t)length {
+    if (!self.sink(bytes, length)) {
+        return NO;
+    }
+
+    [self setLength:self.length + length];
+    return YES;
+}
+
+- (BOOL)padBlock {
+    static const char zeros[kNMSSHTarBlockSize];
+    size_t padding = (size_t)((kNMSSHTarBlockSize - self.length % kNMSSHTarBlockSize) % kNMSSHTarBlockSize);
+
+    return padding == 0 || [self writeBytes:zeros length:padding];
+}
+
+- (BOOL)writeHeaderForPath:(NSString *)path type:(char)type size:(uint64_t)size mode:(mode_t)mode modificationTime:(time_t)modificationTime {
+    NSData *name = [path dataUsingEncoding:NSUTF8StringEncoding];
+    BOOL longName = [name length] > 100;
+    BOOL largeSize = size >= kNMSSHTarMaximumOctalSize;
+
+    if (longName || largeSize) {
+        NSMutableData *records = [NSMutableData data];
+        if (longName) {
+            NMSSHTarAppendPaxRecord(records, @"path", path);
+        }
+        if (largeSize) {
+            NMSSHTarAppendPaxRecord(records, @"size", [NSString stringWithFormat:@"%llu", (unsigned long long)size]);
+        }
+
+        if (![self writeHeaderForPath:@"././@PaxHeader" type:'x' size:[records length] mode:0644 modificationTime:modificationTime] ||
+            ![self writeBytes:[records bytes] length:[records length]] || ![self padBlock]) {
+            return NO;
+        }
+    }
+
+    char header[kNMSSHTarBlockSize] = { 0 };
+    memcpy(header, [name bytes], MIN([name length], 100));
+    NMSSHTarWriteOctal(header + 100, 8, mode & 07777);
+    NMSSHTarWriteOctal(header + 108, 8, 0);
+    NMSSHTarWriteOctal(header + 116, 8, 0);
+    NMSSHTarWriteOctal(header + 124, 12, largeSize ? 0 : size);
+    NMSSHTarWriteOctal(header + 136, 12, (uint64_t)MAX(modificationTime, 0));
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    snprintf(header + 148, 8, "%06o", NMSSHTarChecksum(header));
+    header[155] = ' ';
+
+    return [self writeBytes:header length:sizeof(header)];
+}
+
+- (BOOL)appendDirectory:(NSString *)path mode:(mode_t)mode modificationTime:(time_t)modificationTime {
+    return [self writeHeaderForPath:[path stringByAppendingString:@"/"] type:'5' size:0 mode:mode modificationTime:modificationTime];
+}
+
+- (BOOL)appendFile:(NSString *)path
+        descriptor:(int)descriptor
+              size:(uint64_t)size
+              mode:(mode_t)mode
+  modificationTime:(time_t)modificationTime
+          progress:(BOOL (^)(uint64_t))progress {
+    if (![self writeHeaderForPath:path type:'0' size:size mode:mode modificationTime:modificationTime]) {
+        return NO;
+    }
+
+    if (!self.buffer) {
+        [self setBuffer:[[NMSSHBufferPool sharedPool] newBufferWithLength:kNMSSHTarChunkSize]];
+    }
+
+    uint64_t written = 0;
+    while (written < size) {
+        ssize_t nread = read(descriptor, [self.buffer mutableBytes], (size_t)MIN((uint64_t)[self.buffer length], size - written));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // The header promised size bytes, a file shrinking meanwhile breaks the archive
+        if (nread <= 0) {
+            NMSSHLogError(@"%@ changed while being archived", path);
+            return NO;
+        }
+
+        if (![self writeBytes:[self.buffer bytes] length:nread]) {
+            return NO;
+        }
+
+        written += nread;
+        if (progress && !progress(written)) {
+            return NO;
+        }
+    }
+
+    return [self padBlock];
+}
+
+- (BOOL)finish {
+    static const char zeros[2 * kNMSSHTarBlockSize];
+    return [self writeBytes:zeros length:sizeof(zeros)];
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - TAR READER
+// -----------------------------------------------------------------------------
+
+typedef NS_ENUM(NSInteger, NMSSHTarReaderState) {
+    NMSSHTarReaderHeader,
+    NMSSHTarReaderData,
+    NMSSHTarReaderPadding,
+    NMSSHTarReaderEnd
+};
+
+static uint64_t NMSSHTarReadNumber(const char *field, size_t size) {
+    // GNU base-256 encoding, used for values too large for octal
+    if ((unsigned char)field[0] & 0x80) {
+        uint64_t value = (unsigned char)field[0] & 0x3F;
+        for (size_t i = 1; i < size; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+
+        return value;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < size && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = (value << 3) | (uint64_t)(field[i] - '0');
+        }
+    }
+
+    return value;
+}
+
+static NSString *NMSSHTarReadString(const char *field, size_t size) {
+    return [[NSString alloc] initWithBytes:field length:strnlen(field, size) encoding:NSUTF8StringEncoding];
+}
+
+@interface NMSSHTarReader () {
+    char _header[kNMSSHTarBlockSize];
+}
+@property (nonatomic, strong) NSString *destination;
+@property (nonatomic, readwrite) uint64_t length;
+@property (nonatomic, assign) NMSSHTarReaderState state;
+@property (nonatomic, assign) size_t headerLength;
+@property (nonatomic, assign) NSUInteger zeroBlocks;
+@property (nonatomic, assign) uint64_t remaining;
+@property (nonatomic, assign) uint64_t padding;
+
+// The entry being extracted
+@property (nonatomic, assign) char type;
+@property (nonatomic, assign) int file;
+@property (nonatomic, assign) mode_t mode;
+@property (nonatomic, assign) time_t modificationTime;
+@property (nonatomic, strong) NSMutableData *extended;
+
+// Overrides of the next entry from pax and GNU headers
+@property (nonatomic, strong) NSString *nextPath;
+@property (nonatomic, strong) NSNumber *nextSize;
+
+// Directories get their mode and times once their content is extracted
+@property (nonatomic, strong) NSMutableArray *directories;
+@end
+
+@implementation NMSSHTarReader
+
+- (instancetype)initWithDestination:(NSString *)destination {
+    if ((self = [super init])) {
+        [self setDestination:destination];
+        [self setState:NMSSHTarReaderHeader];
+        [self setFile:-1];
+        [self setDirectories:[NSMutableArray array]];
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    if (self.file >= 0) {
+        close(self.file);
+    }
+}
+
+- (NSString *)destinationForPath:(NSString *)path {
+    NSMutableArray *components = [NSMutableArray array];
+
+    for (NSString *component in [path componentsSeparatedByString:@"/"]) {
+        if ([component length] == 0 || [component isEqualToString:@"."]) {
+            continue;
+        }
+
+        // Entries must stay inside the destination
+        if ([component isEqualToString:@".."] || [path hasPrefix:@"/"]) {
+            NMSSHLogError(@"Refusing to extract %@", path);
+            return nil;
+        }
+
+        [components addObject:component];
+    }
+
+    if ([components count] == 0) {
+        return self.destination;
+    }
+
+    return [self.destination stringByAppendingPathComponent:[NSString pathWithComponents:components]];
+}
+
+- (BOOL)readHeader {
+    BOOL empty = YES;
+    for (int i = 0; i < kNMSSHTarBlockSize && empty; i++) {
+        empty = (_header[i] == 0);
+    }
+
+    // Two empty blocks end the archive
+    if (empty) {
+        [self setZeroBlocks:self.zeroBlocks + 1];
+        if (self.zeroBlocks == 2) {
+            [self setState:NMSSHTarReaderEnd];
+        }
+        return YES;
+    }
+
+    [self setZeroBlocks:0];
+
+    if (NMSSHTarReadNumber(_header + 148, 8) != NMSSHTarChecksum(_header)) {
+        NMSSHLogError(@"Corrupted tar header");
+        return NO;
+    }
+
+    NSString *path = self.nextPath;
+    if (!path) {
+        path = NMSSHTarReadString(_header, 100);
+
+        NSString *prefix = NMSSHTarReadString(_header + 345, 155);
+        if (memcmp(_header + 257, "ustar", 5) == 0 && [prefix length] > 0) {
+            path = [NSString stringWithFormat:@"%@/%@", prefix, path];
+        }
+    }
+
+    uint64_t size = self.nextSize ? [self.nextSize unsignedLongLongValue] : NMSSHTarReadNumber(_header + 124, 12);
+    [self setNextPath:nil];
+    [self setNextSize:nil];
+
+    [self setType:_header[156]];
+    [self setMode:(mode_t)(NMSSHTarReadNumber(_header + 100, 8) & 07777)];
+    [self setModificationTime:(time_t)NMSSHTarReadNumber(_header + 136, 12)];
+    [self setRemaining:size];
+    [self setPadding:(kNMSSHTarBlockSize - size % kNMSSHTarBlockSize) % kNMSSHTarBlockSize];
+    [self setExtended:nil];
+
+    switch (self.type) {
+        case 'x':
+        case 'L':
+            // pax extended header or GNU long name, describing the next entry
+            [self setExtended:[NSMutableData data]];
+            break;
+
+        case '5': {
+            NSString *directory = [self destinationForPath:path];
+            if (!directory || ![[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil]) {
+                return NO;
+            }
+
+            [self.directories addObject:@[directory, @(self.mode), @(self.modificationTime)]];
+            break;
+        }
+
+        case '0':
+        case '\0':
+        case '7': {
+            NSString *file = [self destinationForPath:path];
+            if (!file || ![[NSFileManager defaultManager] createDirectoryAtPath:[file stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil]) {
+                return NO;
+            }
+
+            [self setFile:open([file fileSystemRepresentation], O_WRONLY|O_CREAT|O_TRUNC, 0600)];
+            if (self.file < 0) {
+                NMSSHLogError(@"Can't create local file %@", file);
+                return NO;
+            }
+            break;
+        }
+
+        default:
+            // Links, devices and global headers are skipped
+            NMSSHLogWarn(@"Skipping tar entry %@ of type %c", path, self.type);
+            break;
+    }
+
+    [self setState:NMSSHTarReaderData];
+    return self.remaining > 0 || [self finishEntry];
+}
+
+- (BOOL)finishEntry {
+    BOOL success = YES;
+
+    if (self.file >= 0) {
+        struct timeval times[2] = { { self.modificationTime, 0 }, { self.modificationTime, 0 } };
+        fchmod(self.file, self.mode);
+        futimes(self.file, times);
+        success = (close(self.file) == 0);
+        [self setFile:-1];
+    }
+
+    if (self.type == 'L') {
+        [self setNextPath:NMSSHTarReadString([self.extended bytes], [self.extended length])];
+    }
+    else if (self.type == 'x') {
+        // Records are "<length> <key>=<value>\n"
+        NSString *records = [[NSString alloc] initWithData:self.extended encoding:NSUTF8StringEncoding];
+        for (NSString *record in [records componentsSeparatedByString:@"\n"]) {
+            NSRange space = [record rangeOfString:@" "];
+            NSRange equal = [record rangeOfString:@"="];
+            if (space.location == NSNotFound || equal.location == NSNotFound || equal.location < space.location) {
+                continue;
+            }
+
+            NSString *key = [record substringWithRange:NSMakeRange(space.location + 1, equal.location - space.location - 1)];
+            NSString *value = [record substringFromIndex:equal.location + 1];
+            if ([key isEqualToString:@"path"]) {
+                [self setNextPath:value];
+            }
+            else if ([key isEqualToString:@"size"]) {
+                [self setNextSize:@(strtoull([value UTF8String], NULL, 10))];
+            }
+        }
+    }
+
+    [self setExtended:nil];
+    [self setState:self.padding > 0 ? NMSSHTarReaderPadding : NMSSHTarReaderHeader];
+
+    return success;
+}
+
+- (BOOL)consumeBytes:(const void *)bytes length:(size_t)length {
+    const char *cursor = bytes;
+    [self setLength:self.length + length];
+
+    while (length > 0) {
+        size_t consumed = 0;
+
+        switch (self.state) {
+            case NMSSHTarReaderHeader:
+                consumed = MIN(kNMSSHTarBlockSize - self.headerLength, length);
+                memcpy(_header + self.headerLength, cursor, consumed);
+                [self setHeaderLength:self.headerLength + consumed];
+
+                if (self.headerLength == kNMSSHTarBlockSize) {
+                    [self setHeaderLength:0];
+                    if (![self readHeader]) {
+                        return NO;
+                    }
+                }
+                break;
+
+            case NMSSHTarReaderData:
+                consumed = (size_t)MIN(self.remaining, (uint64_t)length);
+
+                if (self.extended) {
+                    [self.extended appendBytes:cursor length:consumed];
+                }
+                else if (self.file >= 0) {
+                    for (size_t written = 0; written < consumed;) {
+                        ssize_t rc = write(self.file, cursor + written, consumed - written);
+                        if (rc < 0 && errno == EINTR) {
+                            continue;
+                        }
+
+                        if (rc <= 0) {
+                            NMSSHLogError(@"Failed to write to local file");
+                            return NO;
+                        }
+
+                        written += rc;
+                    }
+                }
+
+                [self setRemaining:self.remaining - consumed];
+                if (self.remaining == 0 && ![self finishEntry]) {
+                    return NO;
+                }
+                break;
+
+            case NMSSHTarReaderPadding:
+                consumed = (size_t)MIN(self.padding, (uint64_t)length);
+                [self setPadding:self.padding - consumed];
+                if (self.padding == 0) {
+                    [self setState:NMSSHTarReaderHeader];
+                }
+                break;
+
+            case NMSSHTarReaderEnd:
+                // tar pads the archive to a whole record
+                consumed = length;
+                break;
+        }
+
+        cursor += consumed;
+        length -= consumed;
+    }
+
+    return YES;
+}
+
+- (BOOL)finish {
+    // Deepest directories first, a read-only parent would refuse the change
+    for (NSArray *directory in [self.directories reverseObjectEnumerator]) {
+        const char *path = [directory[0] fileSystemRepresentation];
+        struct timeval times[2] = { { [directory[2] longValue], 0 }, { [directory[2] longValue], 0 } };
+        chmod(path, (mode_t)[directory[1] unsignedShortValue]);
+        utimes(path, times);
+    }
+
+    if (self.state != NMSSHTarReaderEnd) {
+        NMSSHLogError(@"Truncated tar stream");
+        return NO;
+    }
+
+    return YES;
+}
+
+@end
@@ -0,0 +1,31 @@
+#import "NMSSH.h"
+
+/**
+ Length of the longest prefix of the bytes that is valid UTF-8.
+
+ ASCII runs are checked 16 bytes at a time with SSE2 or NEON where available.
+ A sequence cut at the end of the bytes is not part of the prefix.
+ */
+NSUInteger NMSSHUTF8ValidPrefixLength(const void *bytes, NSUInteger length);
+
+/**
+ NMSSHUTF8Decoder decodes a UTF-8 stream chunk by chunk.
+
+ A character split between two chunks is kept until the next one completes it,
+ invalid sequences are replaced by U+FFFD instead of failing the whole chunk.
+ */
+@interface NMSSHUTF8Decoder : NSObject
+
+/** Decode the next chunk, an incomplete sequence at its end is kept. */
+- (NSString *)decodeBytes:(const void *)bytes length:(NSUInteger)length;
+
+/** Decode the next chunk, an incomplete sequence at its end is kept. */
+- (NSString *)decodeData:(NSData *)data;
+
+/** End the stream, an incomplete sequence kept is replaced by U+FFFD. */
+- (NSString *)finish;
+
+/** Drop the incomplete sequence kept, if any. */
+- (void)reset;
+
+@end
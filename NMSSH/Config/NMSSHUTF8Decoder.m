@@ -0,0 +1,227 @@
+#import "NMSSHUTF8Decoder.h"
+#import "NMSSH+Protected.h"
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
+#define kNMSSHUTF8Replacement @"\uFFFD"
+
+// -----------------------------------------------------------------------------
+#pragma mark - VALIDATION
+// -----------------------------------------------------------------------------
+
+/// YES if none of the 16 bytes has its high bit set
+static inline BOOL NMSSHUTF8IsASCIIBlock(const uint8_t *bytes) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)bytes)) == 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return vmaxvq_u8(vld1q_u8(bytes)) < 0x80;
+#else
+    uint64_t words[2];
+    memcpy(words, bytes, sizeof(words));
+    return ((words[0] | words[1]) & 0x8080808080808080ULL) == 0;
+#endif
+}
+
+/**
+ Length of the sequence starting at the bytes, or 0 if it is not valid.
+
+ For a sequence that is not valid, validPrefix is set to the number of bytes
+ that could still start a valid sequence. It equals available when the
+ sequence is only cut short.
+ */
+static NSUInteger NMSSHUTF8SequenceLength(const uint8_t *bytes, NSUInteger available, NSUInteger *validPrefix) {
+    uint8_t lead = bytes[0];
+    uint8_t low = 0x80, high = 0xBF;
+    NSUInteger needed;
+
+    // Ranges of Table 3-7 of the Unicode standard: no overlong forms, no
+    // surrogates, nothing past U+10FFFF
+    if (lead < 0x80) {
+        return 1;
+    }
+    else if (lead >= 0xC2 && lead <= 0xDF) {
+        needed = 2;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF) {
+        needed = 3;
+        low = lead == 0xE0 ? 0xA0 : low;
+        high = lead == 0xED ? 0x9F : high;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4) {
+        needed = 4;
+        low = lead == 0xF0 ? 0x90 : low;
+        high = lead == 0xF4 ? 0x8F : high;
+    }
+    else {
+        *validPrefix = 0;
+        return 0;
+    }
+
+    NSUInteger i = 1;
+    for (; i < needed && i < available; i++) {
+        if (bytes[i] < low || bytes[i] > high) {
+            break;
+        }
+
+        low = 0x80;
+        high = 0xBF;
+    }
+
+    if (i == needed) {
+        return needed;
+    }
+
+    *validPrefix = i;
+    return 0;
+}
+
+NSUInteger NMSSHUTF8ValidPrefixLength(const void *bytes, NSUInteger length) {
+    const uint8_t *input = bytes;
+    NSUInteger i = 0;
+
+    while (i < length) {
+        while (i + 16 <= length && NMSSHUTF8IsASCIIBlock(input + i)) {
+            i += 16;
+        }
+
+        if (i == length) {
+            break;
+        }
+
+        if (input[i] < 0x80) {
+            i++;
+            continue;
+        }
+
+        NSUInteger validPrefix;
+        NSUInteger sequence = NMSSHUTF8SequenceLength(input + i, length - i, &validPrefix);
+        if (sequence == 0) {
+            break;
+        }
+
+        i += sequence;
+    }
+
+    return i;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - DECODER
+// -----------------------------------------------------------------------------
+
+@interface NMSSHUTF8Decoder () {
+    // Start of a sequence cut at the end of the previous chunk
+    uint8_t _pending[4];
+    NSUInteger _pendingLength;
+}
+@end
+
+@implementation NMSSHUTF8Decoder
+
+- (void)reset {
+    _pendingLength = 0;
+}
+
+- (NSString *)decodeData:(NSData *)data {
+    return [self decodeBytes:[data bytes] length:[data length]];
+}
+
+- (NSString *)finish {
+    NSString *rest = _pendingLength > 0 ? kNMSSHUTF8Replacement : @"";
+    [self reset];
+
+    return rest;
+}
+
+- (NSString *)decodeBytes:(const void *)bytes length:(NSUInteger)length {
+    const uint8_t *input = bytes;
+    NSMutableString *result = nil;
+
+    if (_pendingLength > 0) {
+        result = [NSMutableString string];
+        NSUInteger used = [self completePendingWithBytes:input length:length result:result];
+        input += used;
+        length -= used;
+
+        if (_pendingLength > 0) {
+            return result;
+        }
+    }
+
+    NSUInteger valid = NMSSHUTF8ValidPrefixLength(input, length);
+
+    // Usual case, the chunk is decoded without any intermediate copy
+    if (valid == length && !result) {
+        return [[NSString alloc] initWithBytes:input length:length encoding:NSUTF8StringEncoding];
+    }
+
+    result = result ?: [NSMutableString stringWithCapacity:length];
+
+    while (YES) {
+        if (valid > 0) {
+            [result appendString:[[NSString alloc] initWithBytes:input length:valid encoding:NSUTF8StringEncoding]];
+            input += valid;
+            length -= valid;
+        }
+
+        if (length == 0) {
+            break;
+        }
+
+        NSUInteger validPrefix;
+        NMSSHUTF8SequenceLength(input, length, &validPrefix);
+
+        // Cut short, the next chunk may complete it
+        if (validPrefix == length) {
+            memcpy(_pending, input, length);
+            _pendingLength = length;
+            break;
+        }
+
+        // The maximal valid subpart is replaced at once, as recommended by the
+        // Unicode standard
+        [result appendString:kNMSSHUTF8Replacement];
+        NSUInteger skipped = MAX(validPrefix, 1);
+        input += skipped;
+        length -= skipped;
+
+        valid = NMSSHUTF8ValidPrefixLength(input, length);
+    }
+
+    return result;
+}
+
+/// Feed the kept sequence from the chunk, returns the number of bytes used
+- (NSUInteger)completePendingWithBytes:(const uint8_t *)bytes length:(NSUInteger)length result:(NSMutableString *)result {
+    NSUInteger kept = _pendingLength;
+    NSUInteger taken = MIN(length, sizeof(_pending) - kept);
+    memcpy(_pending + kept, bytes, taken);
+
+    NSUInteger validPrefix;
+    NSUInteger sequence = NMSSHUTF8SequenceLength(_pending, kept + taken, &validPrefix);
+
+    if (sequence > 0) {
+        [result appendString:[[NSString alloc] initWithBytes:_pending length:sequence encoding:NSUTF8StringEncoding]];
+        _pendingLength = 0;
+
+        return sequence - kept;
+    }
+
+    // Still cut short, the chunk was too small
+    if (validPrefix == kept + taken) {
+        _pendingLength = kept + taken;
+        return taken;
+    }
+
+    // The kept bytes were a valid start, at least all of them are replaced
+    [result appendString:kNMSSHUTF8Replacement];
+    _pendingLength = 0;
+
+    return validPrefix - kept;
+}
+
+@end
@@ -1,3 +1,7 @@
 #import "libssh2.h"
 
-int waitsocket(int socket_fd, LIBSSH2_SESSION *session);
\ No newline at end of file
+int waitsocket(int socket_fd, LIBSSH2_SESSION *session);
+
+/// Like waitsocket(), also returning as soon as `wakeup_fd` is readable, e.g.
+/// the read end of a pipe written to when the caller has something new to do
+int waitsocketorwakeup(int socket_fd, int wakeup_fd, LIBSSH2_SESSION *session);
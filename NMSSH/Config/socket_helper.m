@@ -32,3 +32,40 @@ int waitsocket(int socket_fd, LIBSSH2_SESSION *session) {
     
     return rc;
 }
+
+int waitsocketorwakeup(int socket_fd, int wakeup_fd, LIBSSH2_SESSION *session) {
+    struct timeval timeout;
+
+    fd_set readfd;
+    fd_set writefd;
+
+    int rc;
+    int dir;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 500000;
+
+    FD_ZERO(&readfd);
+    FD_ZERO(&writefd);
+    FD_SET(wakeup_fd, &readfd);
+
+    // Now make sure we wait in the correct direction
+    dir = libssh2_session_block_directions(session);
+
+    if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) {
+        FD_SET(socket_fd, &readfd);
+    }
+
+    if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+        FD_SET(socket_fd, &writefd);
+    }
+
+    rc = select(MAX(socket_fd, wakeup_fd) + 1, &readfd, &writefd, NULL, &timeout);
+
+    // Consume the wakeups, the caller looks for what woke it up
+    if (rc > 0 && FD_ISSET(wakeup_fd, &readfd)) {
+        char drain[64];
+        while (read(wakeup_fd, drain, sizeof(drain)) > 0);
+    }
+
+    return rc;
+}
@@ -1,6 +1,11 @@
 #import "NMSSH.h"
 
-@class NMSSHSession, NMSFTPFile;
+@class NMSSHSession, NMSFTPFile, NMSSHOperation;
+
+typedef NS_ENUM(NSInteger, NMSFTPError) {
+    NMSFTPNotConnectedError,
+    NMSFTPStreamError
+};
 
 /**
  NMSFTP provides functionality for working with SFTP servers.
@@ -13,9 +18,22 @@
 /** Property that keeps track of connection status to the server */
 @property (nonatomic, readonly, getter = isConnected) BOOL connected;
 
-/** Property that set/get read buffer size */
+/** Property that set/get read buffer size, buffers come from NMSSHBufferPool */
 @property (nonatomic) NSUInteger bufferSize;
 
+/**
+ Priority class of the operations of the SFTP session.
+
+ The methods taking a completion handler are scheduled, and so are the
+ synchronous `contentsAtPath:` and `writeStream:toFileAtPath:` families: they
+ wait for an operation sending one chunk per step, so other users of the
+ session get in between the chunks. Called from the session queue, e.g. in a
+ `performWithDeadline:block:` of the session, they run right away like the
+ other synchronous methods. Set NMSSHOperationPriorityBulk to keep large
+ transfers out of the way of interactive channels.
+ */
+@property (nonatomic, assign) NMSSHOperationPriority priority;
+
 ///-----------------------------------------------------------------------------
 /// @name Initializer
 /// ----------------------------------------------------------------------------
@@ -307,4 +325,138 @@
  */
 - (BOOL)copyContentsOfPath:(nonnull NSString *)fromPath toFileAtPath:(nonnull NSString *)toPath progress:(BOOL (^_Nullable)(NSUInteger copied, NSUInteger totalBytes))progress;
 
+/// ----------------------------------------------------------------------------
+/// @name Asynchronous operations
+/// ----------------------------------------------------------------------------
+
+/**
+ Asynchronously create and connect to a SFTP session.
+
+ The asynchronous methods never wait on any thread, see NMSSHOperation. Failed
+ libssh2 calls are reported with the error code of the session and the path
+ involved under the `path` key of the user info.
+
+ @param completionHandler Called with `nil` once connected, or the reason of
+     the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)connectWithCompletionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously move or rename an item.
+
+ @param sourcePath Item to move
+ @param destPath Destination to move the item to
+ @param completionHandler Called with `nil` once moved, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)moveItemAtPath:(nonnull NSString *)sourcePath
+                                    toPath:(nonnull NSString *)destPath
+                         completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously create a directory at the specified path.
+
+ @param path Path to directory
+ @param completionHandler Called with `nil` once created, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)createDirectoryAtPath:(nonnull NSString *)path
+                                completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously remove the directory at the specified path.
+
+ @param path Path to directory
+ @param completionHandler Called with `nil` once removed, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)removeDirectoryAtPath:(nonnull NSString *)path
+                                completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously get a list of files for a directory path.
+
+ @param path Path to directory
+ @param completionHandler Called with the sorted list of files, or the reason
+     of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)contentsOfDirectoryAtPath:(nonnull NSString *)path
+                                    completionHandler:(nullable void (^)(NSArray<NMSFTPFile *> * _Nullable contents, NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously get the information about a file, symbolic links are followed.
+
+ @param path Path to file
+ @param completionHandler Called with the file information, or the reason of
+     the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)infoForFileAtPath:(nonnull NSString *)path
+                            completionHandler:(nullable void (^)(NMSFTPFile * _Nullable file, NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously remove file at the specified path.
+
+ @param path Path to file
+ @param completionHandler Called with `nil` once removed, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)removeFileAtPath:(nonnull NSString *)path
+                           completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously read the contents of a file.
+
+ @param path File path
+ @param completionHandler Called with the contents of the file, or the reason
+     of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)contentsAtPath:(nonnull NSString *)path
+                         completionHandler:(nullable void (^)(NSData * _Nullable contents, NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously overwrite the contents of a file.
+
+ If no file exists, one is created.
+
+ @param contents Bytes to write
+ @param path File path to write bytes at
+ @param completionHandler Called with `nil` once written, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)writeContents:(nonnull NSData *)contents
+                             toFileAtPath:(nonnull NSString *)path
+                        completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously overwrite the contents of a file with a local file.
+
+ If no file exists, one is created.
+
+ @param localPath File path to read bytes at
+ @param path File path to write bytes at
+ @param completionHandler Called with `nil` once written, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)writeFileAtPath:(nonnull NSString *)localPath
+                               toFileAtPath:(nonnull NSString *)path
+                          completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously overwrite the contents of a file with a stream.
+
+ If no file exists, one is created. The stream is read on the session queue.
+
+ @param inputStream Stream to read bytes from
+ @param path File path to write bytes at
+ @param completionHandler Called with `nil` once written, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)writeStream:(nonnull NSInputStream *)inputStream
+                           toFileAtPath:(nonnull NSString *)path
+                      completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
 @end
@@ -9,6 +9,32 @@
 - (BOOL)writeStream:(NSInputStream *)inputStream toSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle;
 - (BOOL)writeStream:(NSInputStream *)inputStream toSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle progress:(BOOL (^)(NSUInteger))progress;
 - (BOOL)readContentsAtPath:(NSString *)path toStream:(NSOutputStream *)stream progress:(BOOL (^)(NSUInteger, NSUInteger))progress;
+- (BOOL)writeContentsOfStream:(NSInputStream *)inputStream toFileAtPath:(NSString *)path progress:(BOOL (^)(NSUInteger))progress;
+@end
+
+// State shared by the steps of an asynchronous transfer
+@interface NMSFTPTransfer : NSObject
+@property (nonatomic, assign) LIBSSH2_SFTP_HANDLE *handle;
+@property (nonatomic, strong) NMSSHBuffer *buffer;
+@property (nonatomic, assign) NSUInteger offset;
+@property (nonatomic, assign) NSUInteger length;
+
+// Progress of the file, reported to the progress blocks
+@property (nonatomic, assign) NSUInteger transferred;
+@property (nonatomic, assign) NSUInteger fileSize;
+
+// Time the server may stall the transfer for, 0 waits forever
+@property (nonatomic, assign) NSTimeInterval idleTimeout;
+@end
+
+@implementation NMSFTPTransfer
+
+- (void)renewDeadlineOfOperation:(NMSSHOperation *)operation {
+    if (self.idleTimeout > 0) {
+        [operation setDeadline:[NMSSHDeadline deadlineWithTimeout:self.idleTimeout]];
+    }
+}
+
 @end
 
 @implementation NMSFTP
@@ -43,25 +69,29 @@
 // -----------------------------------------------------------------------------
 
 - (BOOL)connect {
-    // Set blocking mode
-    libssh2_session_set_blocking(self.session.rawSession, 1);
+    return [self.session performBoolBlockAndWait:^BOOL{
+        // Set blocking mode
+        libssh2_session_set_blocking(self.session.rawSession, 1);
 
-    [self setSftpSession:libssh2_sftp_init(self.session.rawSession)];
+        [self setSftpSession:libssh2_sftp_init(self.session.rawSession)];
 
-    if (!self.sftpSession) {
-        NMSSHLogError(@"Unable to init SFTP session");
-        return NO;
-    }
+        if (!self.sftpSession) {
+            NMSSHLogError(@"Unable to init SFTP session");
+            return NO;
+        }
 
-    [self setConnected:YES];
-    [self setBufferSize:kNMSSHBufferSize];
+        [self setConnected:YES];
+        [self setBufferSize:kNMSSHBufferSize];
 
-    return self.isConnected;
+        return self.isConnected;
+    }];
 }
 
 - (void)disconnect {
-    libssh2_sftp_shutdown(self.sftpSession);
-    [self setConnected:NO];
+    [self.session performBlockAndWait:^{
+        libssh2_sftp_shutdown(self.sftpSession);
+        [self setConnected:NO];
+    }];
 }
 
 // -----------------------------------------------------------------------------
@@ -69,7 +99,9 @@
 // -----------------------------------------------------------------------------
 
 - (BOOL)moveItemAtPath:(NSString *)sourcePath toPath:(NSString *)destPath {
-    return libssh2_sftp_rename(self.sftpSession, [sourcePath UTF8String], [destPath UTF8String]) == 0;
+    return [self.session performBoolBlockAndWait:^BOOL{
+        return libssh2_sftp_rename(self.sftpSession, [sourcePath UTF8String], [destPath UTF8String]) == 0;
+    }];
 }
 
 // -----------------------------------------------------------------------------
@@ -92,77 +124,94 @@
 }
 
 - (BOOL)directoryExistsAtPath:(NSString *)path {
-    LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
+    return [self.session performBoolBlockAndWait:^BOOL{
+        LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
 
-    if (!handle) {
-        return NO;
-    }
+        if (!handle) {
+            return NO;
+        }
 
-    LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
-    int rc = libssh2_sftp_fstat(handle, &fileAttributes);
-    libssh2_sftp_close(handle);
+        LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+        int rc = libssh2_sftp_fstat(handle, &fileAttributes);
+        libssh2_sftp_close(handle);
 
-    return rc == 0 && LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions);
+        return rc == 0 && LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions);
+    }];
 }
 
 - (BOOL)createDirectoryAtPath:(NSString *)path {
-    int rc = libssh2_sftp_mkdir(self.sftpSession, [path UTF8String],
-                                LIBSSH2_SFTP_S_IRWXU|
-                                LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IXGRP|
-                                LIBSSH2_SFTP_S_IROTH|LIBSSH2_SFTP_S_IXOTH);
+    return [self.session performBoolBlockAndWait:^BOOL{
+        int rc = libssh2_sftp_mkdir(self.sftpSession, [path UTF8String],
+                                    LIBSSH2_SFTP_S_IRWXU|
+                                    LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IXGRP|
+                                    LIBSSH2_SFTP_S_IROTH|LIBSSH2_SFTP_S_IXOTH);
 
-    return rc == 0;
+        return rc == 0;
+    }];
 }
 
 - (BOOL)removeDirectoryAtPath:(NSString *)path {
-    return libssh2_sftp_rmdir(self.sftpSession, [path UTF8String]) == 0;
+    return [self.session performBoolBlockAndWait:^BOOL{
+        return libssh2_sftp_rmdir(self.sftpSession, [path UTF8String]) == 0;
+    }];
 }
 
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path {
-    LIBSSH2_SFTP_HANDLE *handle = [self openDirectoryAtPath:path];
+    return [self.session performObjectBlockAndWait:^id{
+        LIBSSH2_SFTP_HANDLE *handle = [self openDirectoryAtPath:path];
 
-    if (!handle) {
-        return nil;
-    }
+        if (!handle) {
+            return nil;
+        }
 
-    NSArray *ignoredFiles = @[@".", @".."];
-    NSMutableArray *contents = [NSMutableArray array];
+        NSMutableArray *contents = [NSMutableArray array];
 
-    int rc;
-    do {
-        char buffer[512];
-        LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+        int rc;
+        do {
+            char buffer[512];
+            LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
 
-        rc = libssh2_sftp_readdir(handle, buffer, sizeof(buffer), &fileAttributes);
+            rc = libssh2_sftp_readdir(handle, buffer, sizeof(buffer), &fileAttributes);
 
-        if (rc > 0) {
-            NSString *fileName = [[NSString alloc] initWithBytes:buffer length:rc encoding:NSUTF8StringEncoding];
-            if (![ignoredFiles containsObject:fileName]) {
-                // Append a "/" at the end of all directories
-                if (LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions)) {
-                    fileName = [fileName stringByAppendingString:@"/"];
+            if (rc > 0) {
+                NMSFTPFile *file = [self fileWithDirectoryEntry:buffer length:rc attributes:fileAttributes];
+                if (file) {
+                    [contents addObject:file];
                 }
-
-                NMSFTPFile *file = [[NMSFTPFile alloc] initWithFilename:fileName];
-                [file populateValuesFromSFTPAttributes:fileAttributes];
-                [contents addObject:file];
             }
+        } while (rc > 0);
+
+        if (rc < 0) {
+            NMSSHLogError(@"Unable to read directory");
         }
-    } while (rc > 0);
 
-    if (rc < 0) {
-        NMSSHLogError(@"Unable to read directory");
-    }
+        rc = libssh2_sftp_closedir(handle);
 
-    rc = libssh2_sftp_closedir(handle);
+        if (rc < 0) {
+            NMSSHLogError(@"Failed to close directory");
+        }
 
-    if (rc < 0) {
-        NMSSHLogError(@"Failed to close directory");
+        return [contents sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2) {
+            return [obj1 compare:obj2];
+        }];
+    }];
+}
+
+- (NMSFTPFile *)fileWithDirectoryEntry:(const char *)buffer length:(int)length attributes:(LIBSSH2_SFTP_ATTRIBUTES)fileAttributes {
+    NSString *fileName = [[NSString alloc] initWithBytes:buffer length:length encoding:NSUTF8StringEncoding];
+    if ([fileName isEqualToString:@"."] || [fileName isEqualToString:@".."]) {
+        return nil;
     }
 
-    return [contents sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2) {
-        return [obj1 compare:obj2];
-    }];
+    // Append a "/" at the end of all directories
+    if (LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions)) {
+        fileName = [fileName stringByAppendingString:@"/"];
+    }
+
+    NMSFTPFile *file = [[NMSFTPFile alloc] initWithFilename:fileName];
+    [file populateValuesFromSFTPAttributes:fileAttributes];
+
+    return file;
 }
 
 // -----------------------------------------------------------------------------
@@ -170,24 +219,26 @@
 // -----------------------------------------------------------------------------
 
 - (NMSFTPFile *)infoForFileAtPath:(NSString *)path {
-    LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
+    return [self.session performObjectBlockAndWait:^id{
+        LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
 
-    if (!handle) {
-        return nil;
-    }
+        if (!handle) {
+            return nil;
+        }
 
-    LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
-    ssize_t rc = libssh2_sftp_fstat(handle, &fileAttributes);
-    libssh2_sftp_close(handle);
+        LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+        ssize_t rc = libssh2_sftp_fstat(handle, &fileAttributes);
+        libssh2_sftp_close(handle);
 
-    if (rc < 0) {
-        return nil;
-    }
+        if (rc < 0) {
+            return nil;
+        }
 
-    NMSFTPFile *file = [[NMSFTPFile alloc] initWithFilename:path.lastPathComponent];
-    [file populateValuesFromSFTPAttributes:fileAttributes];
+        NMSFTPFile *file = [[NMSFTPFile alloc] initWithFilename:path.lastPathComponent];
+        [file populateValuesFromSFTPAttributes:fileAttributes];
 
-    return file;
+        return file;
+    }];
 }
 
 - (LIBSSH2_SFTP_HANDLE *)openFileAtPath:(NSString *)path flags:(unsigned long)flags mode:(long)mode {
@@ -206,28 +257,34 @@
 }
 
 - (BOOL)fileExistsAtPath:(NSString *)path {
-    LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
+    return [self.session performBoolBlockAndWait:^BOOL{
+        LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path flags:LIBSSH2_FXF_READ mode:0];
 
-    if (!handle) {
-        return NO;
-    }
+        if (!handle) {
+            return NO;
+        }
 
-    LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
-    int rc = libssh2_sftp_fstat(handle, &fileAttributes);
-    libssh2_sftp_close(handle);
+        LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+        int rc = libssh2_sftp_fstat(handle, &fileAttributes);
+        libssh2_sftp_close(handle);
 
-    return rc == 0 && !LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions);
+        return rc == 0 && !LIBSSH2_SFTP_S_ISDIR(fileAttributes.permissions);
+    }];
 }
 
 - (BOOL)createSymbolicLinkAtPath:(NSString *)linkPath
              withDestinationPath:(NSString *)destPath {
-    int rc = libssh2_sftp_symlink(self.sftpSession, [destPath UTF8String], (char *)[linkPath UTF8String]);
+    return [self.session performBoolBlockAndWait:^BOOL{
+        int rc = libssh2_sftp_symlink(self.sftpSession, [destPath UTF8String], (char *)[linkPath UTF8String]);
 
-    return rc == 0;
+        return rc == 0;
+    }];
 }
 
 - (BOOL)removeFileAtPath:(NSString *)path {
-    return libssh2_sftp_unlink(self.sftpSession, [path UTF8String]) == 0;
+    return [self.session performBoolBlockAndWait:^BOOL{
+        return libssh2_sftp_unlink(self.sftpSession, [path UTF8String]) == 0;
+    }];
 }
 
 - (NSData *)contentsAtPath:(NSString *)path {
@@ -236,18 +293,25 @@
 
 - (NSData *)contentsAtPath:(NSString *)path progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
     NSOutputStream *outputStream = [NSOutputStream outputStreamToMemory];
-    
-    BOOL success = [self readContentsAtPath:path toStream:outputStream progress:progress];
-    
-    if (success) {
-        return [outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
-    } else {
+
+    if (![self contentsAtPath:path toStream:outputStream progress:progress]) {
         return nil;
     }
+
+    return [outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
 }
 
 - (BOOL)contentsAtPath:(NSString *)path toStream:(NSOutputStream *)outputStream progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
-    return [self readContentsAtPath:path toStream:outputStream progress:progress];
+    // Nested in an operation of the session, the queue can't be given up
+    if ([self.session isOnQueue]) {
+        return [self.session performBoolBlockAndWait:^BOOL{
+            return [self readContentsAtPath:path toStream:outputStream progress:progress];
+        }];
+    }
+
+    return [self waitForTransfer:^NMSSHOperation *(NSTimeInterval idleTimeout, void (^completion)(NSError *)) {
+        return [self readOperationForPath:path toStream:outputStream progress:progress idleTimeout:idleTimeout completion:completion];
+    }];
 }
 
 - (BOOL)readContentsAtPath:(NSString *)path toStream:(NSOutputStream *)outputStream progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
@@ -267,14 +331,14 @@
         [outputStream open];
     }
     
-    char buffer[self.bufferSize];
+    NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
     ssize_t rc;
     NSUInteger got = 0;
-    while ((rc = libssh2_sftp_read(handle, buffer, (ssize_t)sizeof(buffer))) > 0) {
+    while ((rc = libssh2_sftp_read(handle, [buffer mutableBytes], [buffer length])) > 0) {
         NSUInteger remainingBytes = rc;
         NSInteger writeResult;
         do {
-            writeResult = [outputStream write:(const uint8_t *)&buffer maxLength:remainingBytes];
+            writeResult = [outputStream write:(const uint8_t *)[buffer bytes] + (rc - remainingBytes) maxLength:remainingBytes];
             remainingBytes -= MAX(0, writeResult);
         } while (remainingBytes > 0 && writeResult > 0);
         
@@ -323,6 +387,28 @@
 }
 
 - (BOOL)writeStream:(NSInputStream *)inputStream toFileAtPath:(NSString *)path progress:(BOOL (^)(NSUInteger))progress {
+    // Nested in an operation of the session, the queue can't be given up
+    if ([self.session isOnQueue]) {
+        return [self.session performBoolBlockAndWait:^BOOL{
+            return [self writeContentsOfStream:inputStream toFileAtPath:path progress:progress];
+        }];
+    }
+
+    if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
+        [inputStream open];
+    }
+
+    if (![inputStream hasBytesAvailable]) {
+        NMSSHLogWarn(@"No bytes available in the stream");
+        return NO;
+    }
+
+    return [self waitForTransfer:^NMSSHOperation *(NSTimeInterval idleTimeout, void (^completion)(NSError *)) {
+        return [self writeOperationForStream:inputStream toFileAtPath:path progress:progress idleTimeout:idleTimeout completion:completion];
+    }];
+}
+
+- (BOOL)writeContentsOfStream:(NSInputStream *)inputStream toFileAtPath:(NSString *)path progress:(BOOL (^)(NSUInteger))progress {
     if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
         [inputStream open];
     }
@@ -354,36 +440,38 @@
 }
 
 - (BOOL)resumeStream:(NSInputStream *)inputStream toFileAtPath:(NSString *)path progress:(BOOL (^)( NSUInteger, NSUInteger ))progress {
-    if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
-        [inputStream open];
-    }
-    
-    if (![inputStream hasBytesAvailable]) {
-        NMSSHLogWarn(@"No bytes available in the stream");
-        return NO;
-    }
-    
-    LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path
-                                                 flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
-                                                  mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
-    
-    if (!handle) {
-        [inputStream close];
-        return NO;
-    }
-    
-    NMSSHLogVerbose(@"Resume destFile %@", path);
+    return [self.session performBoolBlockAndWait:^BOOL{
+        if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
+            [inputStream open];
+        }
 
-    BOOL success = [self resumeStream:inputStream toSFTPHandle:handle progress:progress];
+        if (![inputStream hasBytesAvailable]) {
+            NMSSHLogWarn(@"No bytes available in the stream");
+            return NO;
+        }
 
-    libssh2_sftp_close(handle);
-    [inputStream close];
-    
-    return success;
+        LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path
+                                                     flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
+                                                      mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
+
+        if (!handle) {
+            [inputStream close];
+            return NO;
+        }
+
+        NMSSHLogVerbose(@"Resume destFile %@", path);
+
+        BOOL success = [self resumeStream:inputStream toSFTPHandle:handle progress:progress];
+
+        libssh2_sftp_close(handle);
+        [inputStream close];
+
+        return success;
+    }];
 }
 
 - (BOOL)resumeStream:(NSInputStream *)inputStream toSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle progress:(BOOL (^)( NSUInteger, NSUInteger ))progress {
-    uint8_t buffer[self.bufferSize];
+    NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
     NSInteger bytesRead = -1;
     long rc = 0;
     NSUInteger delta = 0;
@@ -401,9 +489,9 @@
     [inputStream setProperty:[NSNumber numberWithUnsignedLongLong:attributes.filesize] forKey:NSStreamFileCurrentOffsetKey];
     
     while (rc >= 0 && [inputStream hasBytesAvailable]) {
-        bytesRead = [inputStream read:buffer maxLength:self.bufferSize];
+        bytesRead = [inputStream read:[buffer mutableBytes] maxLength:[buffer length]];
         if (bytesRead > 0) {
-            uint8_t *ptr = buffer;
+            uint8_t *ptr = [buffer mutableBytes];
             do {
                 rc = libssh2_sftp_write(handle, (const char *)ptr, bytesRead);
                 if(rc < 0){
@@ -433,40 +521,42 @@
 }
 
 - (BOOL)appendStream:(NSInputStream *)inputStream toFileAtPath:(NSString *)path {
-    if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
-        [inputStream open];
-    }
+    return [self.session performBoolBlockAndWait:^BOOL{
+        if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
+            [inputStream open];
+        }
 
-    if (![inputStream hasBytesAvailable]) {
-        NMSSHLogWarn(@"No bytes available in the stream");
-        return NO;
-    }
+        if (![inputStream hasBytesAvailable]) {
+            NMSSHLogWarn(@"No bytes available in the stream");
+            return NO;
+        }
 
-    LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path
-                                                 flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
-                                                  mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
+        LIBSSH2_SFTP_HANDLE *handle = [self openFileAtPath:path
+                                                     flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
+                                                      mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
 
-    if (!handle) {
-        [inputStream close];
-        return NO;
-    }
+        if (!handle) {
+            [inputStream close];
+            return NO;
+        }
 
-    LIBSSH2_SFTP_ATTRIBUTES attributes;
-    if (libssh2_sftp_fstat(handle, &attributes) < 0) {
-        [inputStream close];
-        NMSSHLogError(@"Unable to get attributes of file %@", path);
-        return NO;
-    }
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+        if (libssh2_sftp_fstat(handle, &attributes) < 0) {
+            [inputStream close];
+            NMSSHLogError(@"Unable to get attributes of file %@", path);
+            return NO;
+        }
 
-    libssh2_sftp_seek64(handle, attributes.filesize);
-    NMSSHLogVerbose(@"Seek to position %ld", (long)attributes.filesize);
+        libssh2_sftp_seek64(handle, attributes.filesize);
+        NMSSHLogVerbose(@"Seek to position %ld", (long)attributes.filesize);
 
-    BOOL success = [self writeStream:inputStream toSFTPHandle:handle];
+        BOOL success = [self writeStream:inputStream toSFTPHandle:handle];
 
-    libssh2_sftp_close(handle);
-    [inputStream close];
+        libssh2_sftp_close(handle);
+        [inputStream close];
 
-    return success;
+        return success;
+    }];
 }
 
 - (BOOL)writeStream:(NSInputStream *)inputStream toSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle {
@@ -474,15 +564,15 @@
 }
 
 - (BOOL)writeStream:(NSInputStream *)inputStream toSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle progress:(BOOL (^)(NSUInteger))progress {
-    uint8_t buffer[self.bufferSize];
+    NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
     NSInteger bytesRead = -1;
     long rc = 0;
     NSUInteger total = 0;
     
     while (rc >= 0 && [inputStream hasBytesAvailable]) {
-        bytesRead = [inputStream read:buffer maxLength:self.bufferSize];
+        bytesRead = [inputStream read:[buffer mutableBytes] maxLength:[buffer length]];
         if (bytesRead > 0) {
-            uint8_t *ptr = buffer;
+            uint8_t *ptr = [buffer mutableBytes];
             do {
                 rc = libssh2_sftp_write(handle, (const char *)ptr, bytesRead);
                 if(rc < 0){
@@ -509,50 +599,506 @@
 
 - (BOOL)copyContentsOfPath:(NSString *)fromPath toFileAtPath:(NSString *)toPath progress:(BOOL (^)(NSUInteger, NSUInteger))progress
 {
-    // Open handle for reading.
-    LIBSSH2_SFTP_HANDLE *fromHandle = [self openFileAtPath:fromPath flags:LIBSSH2_FXF_READ mode:0];
-    
-    // Open handle for writing.
-    LIBSSH2_SFTP_HANDLE *toHandle = [self openFileAtPath:toPath
-                                                 flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
-                                                  mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
-    
-    // Get information about the file to copy.
-    NMSFTPFile *file = [self infoForFileAtPath:fromPath];
-    if (!file) {
-        NMSSHLogWarn(@"contentsAtPath:progress: failed to get file attributes");
-        return NO;
+    return [self.session performBoolBlockAndWait:^BOOL{
+        // Open handle for reading.
+        LIBSSH2_SFTP_HANDLE *fromHandle = [self openFileAtPath:fromPath flags:LIBSSH2_FXF_READ mode:0];
+
+        // Open handle for writing.
+        LIBSSH2_SFTP_HANDLE *toHandle = [self openFileAtPath:toPath
+                                                     flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_READ
+                                                      mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH];
+
+        // Get information about the file to copy.
+        NMSFTPFile *file = [self infoForFileAtPath:fromPath];
+        if (!file) {
+            NMSSHLogWarn(@"contentsAtPath:progress: failed to get file attributes");
+            return NO;
+        }
+
+        NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
+        ssize_t bytesRead;
+        off_t copied = 0;
+        long rc = 0;
+        while ((bytesRead = libssh2_sftp_read(fromHandle, [buffer mutableBytes], [buffer length])) > 0) {
+            if (bytesRead > 0) {
+                char *ptr = [buffer mutableBytes];
+                do {
+                    rc = libssh2_sftp_write(toHandle, (const char *)ptr, (NSInteger)bytesRead);
+                    if(rc < 0){
+                        NMSSHLogWarn(@"libssh2_sftp_write failed (Error %li)", rc);
+                        break;
+                    }
+                    copied += rc;
+                    ptr += rc;
+                    bytesRead -= rc;
+                    if (progress && !progress((NSUInteger)copied, (NSUInteger)[file.fileSize integerValue])) {
+                        libssh2_sftp_close(fromHandle);
+                        libssh2_sftp_close(toHandle);
+                        return NO;
+                    }
+                }while(bytesRead);
+            }
+        }
+
+        libssh2_sftp_close(fromHandle);
+        libssh2_sftp_close(toHandle);
+
+        return YES;
+    }];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - ASYNCHRONOUS OPERATIONS
+// -----------------------------------------------------------------------------
+
+- (NSError *)errorForPath:(NSString *)path {
+    NSError *error = [self.session lastError];
+    NSMutableDictionary *userInfo = [NSMutableDictionary dictionaryWithDictionary:[error userInfo]];
+    [userInfo setObject:path forKey:@"path"];
+
+    if ([error code] == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+        NMSSHLogError(@"SFTP error %lu", libssh2_sftp_last_error(self.sftpSession));
+        [userInfo setObject:[NSString stringWithFormat:@"%lu", libssh2_sftp_last_error(self.sftpSession)]
+                     forKey:NSLocalizedFailureReasonErrorKey];
     }
-    
-    char buffer[self.bufferSize];
-    ssize_t bytesRead;
-    off_t copied = 0;
-    long rc = 0;
-    while ((bytesRead = libssh2_sftp_read(fromHandle, buffer, (ssize_t)sizeof(buffer))) > 0) {
-        if (bytesRead > 0) {
-            char *ptr = buffer;
-            do {
-                rc = libssh2_sftp_write(toHandle, (const char *)ptr, (NSInteger)bytesRead);
-                if(rc < 0){
-                    NMSSHLogWarn(@"libssh2_sftp_write failed (Error %li)", rc);
-                    break;
-                }
-                copied += rc;
-                ptr += rc;
-                bytesRead -= rc;
-                if (progress && !progress((NSUInteger)copied, (NSUInteger)[file.fileSize integerValue])) {
-                    libssh2_sftp_close(fromHandle);
-                    libssh2_sftp_close(toHandle);
-                    return NO;
-                }
-            }while(bytesRead);
+
+    return [NSError errorWithDomain:@"NMSSH" code:[error code] userInfo:userInfo];
+}
+
+- (NMSSHOperation *)enqueueOperation:(NMSSHOperation *)operation {
+    [operation setPriority:self.priority];
+
+    return [self.session enqueueOperation:operation];
+}
+
+- (NSError *)notConnectedError {
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:NMSFTPNotConnectedError
+                           userInfo:@{ NSLocalizedDescriptionKey : @"SFTP session not connected" }];
+}
+
+- (NMSSHOperation *)connectWithCompletionHandler:(void (^)(NSError *))completionHandler {
+    NMSSHOperationStep initStep = ^int(NMSSHOperation *operation) {
+        if (self.sftpSession && self.isConnected) {
+            return kNMSSHStepDone;
+        }
+
+        LIBSSH2_SFTP *sftpSession = libssh2_sftp_init(self.session.rawSession);
+        if (!sftpSession) {
+            if (libssh2_session_last_errno(self.session.rawSession) == LIBSSH2_ERROR_EAGAIN) {
+                return LIBSSH2_ERROR_EAGAIN;
+            }
+
+            NMSSHLogError(@"Unable to init SFTP session");
+            return kNMSSHStepFailed;
+        }
+
+        [self setSftpSession:sftpSession];
+        [self setConnected:YES];
+        [self setBufferSize:kNMSSHBufferSize];
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[initStep] cleanup:nil completion:completionHandler];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperationStep)openStepForPath:(NSString *)path
+                                flags:(unsigned long)flags
+                                 mode:(long)mode
+                                 type:(int)type
+                             transfer:(NMSFTPTransfer *)transfer {
+    return ^int(NMSSHOperation *operation) {
+        if (!self.sftpSession) {
+            [operation setError:[self notConnectedError]];
+            return kNMSSHStepFailed;
+        }
+
+        LIBSSH2_SFTP_HANDLE *handle = libssh2_sftp_open_ex(self.sftpSession, [path UTF8String], strlen([path UTF8String]), flags, mode, type);
+        if (handle) {
+            [transfer setHandle:handle];
+            [transfer setBuffer:[[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize ?: kNMSSHBufferSize]];
+            return kNMSSHStepDone;
+        }
+
+        if (libssh2_session_last_errno(self.session.rawSession) == LIBSSH2_ERROR_EAGAIN) {
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+
+        NMSSHLogError(@"Could not open %@", path);
+        [operation setError:[self errorForPath:path]];
+        return kNMSSHStepFailed;
+    };
+}
+
+- (NMSSHOperationStep)closeStepWithTransfer:(NMSFTPTransfer *)transfer {
+    return ^int(NMSSHOperation *operation) {
+        if (!transfer.handle) {
+            return kNMSSHStepDone;
+        }
+
+        int rc = libssh2_sftp_close_handle(transfer.handle);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+
+        [transfer setHandle:NULL];
+        return rc;
+    };
+}
+
+- (NMSSHOperation *)performCall:(int (^)(void))call
+                         atPath:(NSString *)path
+              completionHandler:(void (^)(NSError *))completionHandler {
+    NMSSHOperationStep step = ^int(NMSSHOperation *operation) {
+        if (!self.sftpSession) {
+            [operation setError:[self notConnectedError]];
+            return kNMSSHStepFailed;
+        }
+
+        int rc = call();
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            [operation setError:[self errorForPath:path]];
+        }
+
+        return rc;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[step] cleanup:nil completion:completionHandler];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperation *)moveItemAtPath:(NSString *)sourcePath
+                            toPath:(NSString *)destPath
+                 completionHandler:(void (^)(NSError *))completionHandler {
+    return [self performCall:^int{
+        return libssh2_sftp_rename_ex(self.sftpSession,
+                                      [sourcePath UTF8String], strlen([sourcePath UTF8String]),
+                                      [destPath UTF8String], strlen([destPath UTF8String]),
+                                      LIBSSH2_SFTP_RENAME_OVERWRITE|LIBSSH2_SFTP_RENAME_ATOMIC|LIBSSH2_SFTP_RENAME_NATIVE);
+    } atPath:sourcePath completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)createDirectoryAtPath:(NSString *)path completionHandler:(void (^)(NSError *))completionHandler {
+    return [self performCall:^int{
+        return libssh2_sftp_mkdir_ex(self.sftpSession, [path UTF8String], strlen([path UTF8String]),
+                                     LIBSSH2_SFTP_S_IRWXU|
+                                     LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IXGRP|
+                                     LIBSSH2_SFTP_S_IROTH|LIBSSH2_SFTP_S_IXOTH);
+    } atPath:path completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)removeDirectoryAtPath:(NSString *)path completionHandler:(void (^)(NSError *))completionHandler {
+    return [self performCall:^int{
+        return libssh2_sftp_rmdir_ex(self.sftpSession, [path UTF8String], strlen([path UTF8String]));
+    } atPath:path completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)removeFileAtPath:(NSString *)path completionHandler:(void (^)(NSError *))completionHandler {
+    return [self performCall:^int{
+        return libssh2_sftp_unlink_ex(self.sftpSession, [path UTF8String], strlen([path UTF8String]));
+    } atPath:path completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)contentsOfDirectoryAtPath:(NSString *)path
+                            completionHandler:(void (^)(NSArray<NMSFTPFile *> *, NSError *))completionHandler {
+    NMSFTPTransfer *transfer = [[NMSFTPTransfer alloc] init];
+    NSMutableArray *contents = [NSMutableArray array];
+
+    NMSSHOperationStep openStep = [self openStepForPath:path flags:0 mode:0 type:LIBSSH2_SFTP_OPENDIR transfer:transfer];
+    NMSSHOperationStep readStep = ^int(NMSSHOperation *operation) {
+        char buffer[512];
+        LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+        int rc;
+
+        while ((rc = libssh2_sftp_readdir(transfer.handle, buffer, sizeof(buffer), &fileAttributes)) > 0) {
+            NMSFTPFile *file = [self fileWithDirectoryEntry:buffer length:rc attributes:fileAttributes];
+            if (file) {
+                [contents addObject:file];
+            }
+        }
+
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            NMSSHLogError(@"Unable to read directory");
+            [operation setError:[self errorForPath:path]];
+        }
+
+        return rc;
+    };
+    NMSSHOperationStep closeStep = [self closeStepWithTransfer:transfer];
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[openStep, readStep, closeStep]
+                                                              cleanup:closeStep
+                                                           completion:^(NSError *error) {
+        if (completionHandler) {
+            completionHandler(error ? nil : [contents sortedArrayUsingSelector:@selector(compare:)], error);
+        }
+    }];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperation *)infoForFileAtPath:(NSString *)path
+                    completionHandler:(void (^)(NMSFTPFile *, NSError *))completionHandler {
+    __block LIBSSH2_SFTP_ATTRIBUTES fileAttributes;
+
+    return [self performCall:^int{
+        return libssh2_sftp_stat_ex(self.sftpSession, [path UTF8String], strlen([path UTF8String]), LIBSSH2_SFTP_STAT, &fileAttributes);
+    } atPath:path completionHandler:^(NSError *error) {
+        if (!completionHandler) {
+            return;
+        }
+
+        if (error) {
+            completionHandler(nil, error);
+            return;
+        }
+
+        NMSFTPFile *file = [[NMSFTPFile alloc] initWithFilename:path.lastPathComponent];
+        [file populateValuesFromSFTPAttributes:fileAttributes];
+        completionHandler(file, nil);
+    }];
+}
+
+- (NMSSHOperation *)contentsAtPath:(NSString *)path
+                 completionHandler:(void (^)(NSData *, NSError *))completionHandler {
+    NMSFTPTransfer *transfer = [[NMSFTPTransfer alloc] init];
+    NSMutableData *contents = [NSMutableData data];
+
+    NMSSHOperationStep openStep = [self openStepForPath:path flags:LIBSSH2_FXF_READ mode:0 type:LIBSSH2_SFTP_OPENFILE transfer:transfer];
+    NMSSHOperationStep readStep = ^int(NMSSHOperation *operation) {
+        ssize_t rc;
+
+        // SFTP reads are pipelined, the call stays in progress on EAGAIN and
+        // has to be repeated before the SFTP instance can be used again
+        while ((rc = libssh2_sftp_read(transfer.handle, [transfer.buffer mutableBytes], [transfer.buffer length])) > 0) {
+            [contents appendBytes:[transfer.buffer bytes] length:rc];
+        }
+
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            [operation setError:[self errorForPath:path]];
         }
+
+        return (int)rc;
+    };
+    NMSSHOperationStep closeStep = [self closeStepWithTransfer:transfer];
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[openStep, readStep, closeStep]
+                                                              cleanup:closeStep
+                                                           completion:^(NSError *error) {
+        if (completionHandler) {
+            completionHandler(error ? nil : [contents copy], error);
+        }
+    }];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperation *)writeContents:(NSData *)contents
+                     toFileAtPath:(NSString *)path
+                completionHandler:(void (^)(NSError *))completionHandler {
+    return [self writeStream:[NSInputStream inputStreamWithData:contents] toFileAtPath:path completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)writeFileAtPath:(NSString *)localPath
+                       toFileAtPath:(NSString *)path
+                  completionHandler:(void (^)(NSError *))completionHandler {
+    return [self writeStream:[NSInputStream inputStreamWithFileAtPath:localPath] toFileAtPath:path completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)writeStream:(NSInputStream *)inputStream
+                   toFileAtPath:(NSString *)path
+              completionHandler:(void (^)(NSError *))completionHandler {
+    return [self enqueueOperation:[self writeOperationForStream:inputStream
+                                                   toFileAtPath:path
+                                                       progress:nil
+                                                    idleTimeout:0
+                                                     completion:completionHandler]];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SCHEDULED TRANSFERS
+// -----------------------------------------------------------------------------
+
+// The synchronous transfers run as operations of the SFTP priority, one chunk
+// per step, so they don't hold the session queue for the whole file. Like a
+// blocking call, they give up once the server stalled for the session timeout.
+- (BOOL)waitForTransfer:(NMSSHOperation *(^)(NSTimeInterval idleTimeout, void (^completion)(NSError *error)))transfer {
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    __block NSError *transferError = nil;
+
+    NMSSHOperation *operation = transfer([self.session.timeout doubleValue], ^(NSError *error) {
+        transferError = error;
+        dispatch_semaphore_signal(done);
+    });
+
+    // The callback queue of the session may be the calling one
+    [operation setCallbackQueue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)];
+    [self enqueueOperation:operation];
+
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(done);
+#endif
+
+    if (transferError) {
+        NMSSHLogWarn(@"SFTP transfer failed: %@", [transferError localizedDescription]);
     }
-    
-    libssh2_sftp_close(fromHandle);
-    libssh2_sftp_close(toHandle);
-    
-    return YES;
+
+    return transferError == nil;
+}
+
+- (NMSSHOperation *)readOperationForPath:(NSString *)path
+                                toStream:(NSOutputStream *)outputStream
+                                progress:(BOOL (^)(NSUInteger, NSUInteger))progress
+                             idleTimeout:(NSTimeInterval)idleTimeout
+                              completion:(void (^)(NSError *))completion {
+    NMSFTPTransfer *transfer = [[NMSFTPTransfer alloc] init];
+    [transfer setIdleTimeout:idleTimeout];
+
+    NMSSHOperationStep openStep = [self openStepForPath:path flags:LIBSSH2_FXF_READ mode:0 type:LIBSSH2_SFTP_OPENFILE transfer:transfer];
+    NMSSHOperationStep statStep = ^int(NMSSHOperation *operation) {
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+        int rc = libssh2_sftp_fstat(transfer.handle, &attributes);
+        if (rc < 0) {
+            if (rc != LIBSSH2_ERROR_EAGAIN) {
+                NMSSHLogWarn(@"Unable to get the attributes of %@", path);
+                [operation setError:[self errorForPath:path]];
+            }
+
+            return rc;
+        }
+
+        [transfer setFileSize:(NSUInteger)attributes.filesize];
+        return kNMSSHStepDone;
+    };
+    NMSSHOperationStep readStep = ^int(NMSSHOperation *operation) {
+        if ([outputStream streamStatus] == NSStreamStatusNotOpen) {
+            [outputStream open];
+        }
+
+        ssize_t rc = libssh2_sftp_read(transfer.handle, [transfer.buffer mutableBytes], [transfer.buffer length]);
+        if (rc <= 0) {
+            if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+                [operation setError:[self errorForPath:path]];
+            }
+
+            return (int)rc;
+        }
+
+        NSUInteger written = 0;
+        while (written < (NSUInteger)rc) {
+            NSInteger result = [outputStream write:(const uint8_t *)[transfer.buffer bytes] + written maxLength:rc - written];
+            if (result <= 0) {
+                NMSSHLogError(@"Unable to write the stream");
+                [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                        code:NMSFTPStreamError
+                                                    userInfo:@{ NSLocalizedDescriptionKey : @"Unable to write the stream" }]];
+                return kNMSSHStepFailed;
+            }
+
+            written += result;
+        }
+
+        [transfer setTransferred:transfer.transferred + rc];
+        [transfer renewDeadlineOfOperation:operation];
+
+        // Aborted like a cancelled operation, once the handle is closed
+        if (progress && !progress(transfer.transferred, transfer.fileSize)) {
+            [operation cancel];
+        }
+
+        return kNMSSHStepContinue;
+    };
+    NMSSHOperationStep closeStep = [self closeStepWithTransfer:transfer];
+    NMSSHOperationStep cleanup = ^int(NMSSHOperation *operation) {
+        [outputStream close];
+
+        return closeStep(operation);
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[openStep, statStep, readStep, closeStep]
+                                                              cleanup:cleanup
+                                                           completion:completion];
+    [transfer renewDeadlineOfOperation:operation];
+
+    return operation;
+}
+
+- (NMSSHOperation *)writeOperationForStream:(NSInputStream *)inputStream
+                               toFileAtPath:(NSString *)path
+                                   progress:(BOOL (^)(NSUInteger))progress
+                                idleTimeout:(NSTimeInterval)idleTimeout
+                                 completion:(void (^)(NSError *))completion {
+    NMSFTPTransfer *transfer = [[NMSFTPTransfer alloc] init];
+    [transfer setIdleTimeout:idleTimeout];
+
+    NMSSHOperationStep openStep = [self openStepForPath:path
+                                                  flags:LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC
+                                                   mode:LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH
+                                                   type:LIBSSH2_SFTP_OPENFILE
+                                               transfer:transfer];
+    NMSSHOperationStep writeStep = ^int(NMSSHOperation *operation) {
+        if ([inputStream streamStatus] == NSStreamStatusNotOpen) {
+            [inputStream open];
+        }
+
+        // Refill the buffer once it has been sent entirely
+        if (transfer.offset == transfer.length) {
+            NSInteger bytesRead = [inputStream read:[transfer.buffer mutableBytes] maxLength:[transfer.buffer length]];
+            if (bytesRead < 0) {
+                NMSSHLogError(@"Unable to read the stream");
+                [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                        code:NMSFTPStreamError
+                                                    userInfo:@{ NSLocalizedDescriptionKey : @"Unable to read the stream" }]];
+                return kNMSSHStepFailed;
+            }
+
+            if (bytesRead == 0) {
+                return kNMSSHStepDone;
+            }
+
+            [transfer setOffset:0];
+            [transfer setLength:bytesRead];
+        }
+
+        ssize_t rc = libssh2_sftp_write(transfer.handle, (const char *)[transfer.buffer bytes] + transfer.offset, transfer.length - transfer.offset);
+        if (rc < 0) {
+            if (rc != LIBSSH2_ERROR_EAGAIN) {
+                NMSSHLogWarn(@"libssh2_sftp_write failed (Error %zi)", rc);
+                [operation setError:[self errorForPath:path]];
+            }
+
+            return (int)rc;
+        }
+
+        [transfer setOffset:transfer.offset + rc];
+        [transfer setTransferred:transfer.transferred + rc];
+        [transfer renewDeadlineOfOperation:operation];
+
+        // Aborted like a cancelled operation, once the handle is closed
+        if (progress && !progress(transfer.transferred)) {
+            [operation cancel];
+        }
+
+        return kNMSSHStepContinue;
+    };
+    NMSSHOperationStep closeStep = [self closeStepWithTransfer:transfer];
+    NMSSHOperationStep cleanup = ^int(NMSSHOperation *operation) {
+        [inputStream close];
+
+        return closeStep(operation);
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[openStep, writeStep, closeStep]
+                                                              cleanup:cleanup
+                                                           completion:completion];
+    [transfer renewDeadlineOfOperation:operation];
+
+    return operation;
 }
 
 @end
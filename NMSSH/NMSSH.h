@@ -9,12 +9,22 @@
 #import "NMSSHSessionDelegate.h"
 #import "NMSSHChannelDelegate.h"
 
+#import "NMSSHDeadline.h"
+#import "NMSSHOperation.h"
 #import "NMSSHSession.h"
 #import "NMSSHChannel.h"
 #import "NMSFTP.h"
 #import "NMSFTPFile.h"
 #import "NMSSHConfig.h"
 #import "NMSSHHostConfig.h"
+#import "NMSSHSOCKSProxy.h"
+#import "NMSSHBufferPool.h"
+#import "NMSSHExpect.h"
+#import "NMSSHCommandServer.h"
+#import "NMSSHScrollbackBuffer.h"
+#import "NMSSHShellRecorder.h"
+#import "NMSSHMessageFramer.h"
+#import "NMSSHLineSplitter.h"
 
 #import "NMSSHLogger.h"
 
@@ -0,0 +1,86 @@
+#import "NMSSH.h"
+
+/** Allocation statistics of a NMSSHBufferPool, see -[NMSSHBufferPool statistics]. */
+typedef struct {
+    /** Buffers handed out since launch */
+    uint64_t allocations;
+    /** Allocations served by the cache of the calling thread */
+    uint64_t threadCacheHits;
+    /** Allocations served by the cache shared by all the threads */
+    uint64_t sharedCacheHits;
+    /** Allocations that had to ask the system for memory */
+    uint64_t systemAllocations;
+    /** Bytes held by the buffers currently in use */
+    uint64_t bytesInUse;
+    /** Highest value reached by bytesInUse */
+    uint64_t peakBytesInUse;
+    /** Bytes kept by the shared cache for later allocations */
+    uint64_t bytesCached;
+} NMSSHBufferPoolStatistics;
+
+/**
+ NMSSHBuffer is a chunk of memory borrowed from a NMSSHBufferPool.
+
+ The memory goes back to the pool when the buffer is deallocated, like
+ NSMutableData the buffer must be kept alive while its bytes are used.
+ */
+@interface NMSSHBuffer : NSObject
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/** The requested length of the buffer, in bytes (read-only). */
+@property (nonatomic, readonly) NSUInteger length;
+
+/** The memory of the buffer, valid for `length` bytes. */
+- (nonnull void *)mutableBytes NS_RETURNS_INNER_POINTER;
+
+/** The memory of the buffer, valid for `length` bytes. */
+- (nonnull const void *)bytes NS_RETURNS_INNER_POINTER;
+
+@end
+
+/**
+ NMSSHBufferPool recycles the transfer buffers of the channels and of NMSFTP.
+
+ Buffers are rounded up to a power of two size class, between 4 KiB and
+ 16 MiB. Released buffers are first kept by the releasing thread, up to two
+ per size class below 256 KiB, then by a cache shared by all the threads, up to
+ `maximumCachedBytes`. Larger requests bypass the caches.
+
+ Since the buffers live on the heap, `bufferSize` can be raised to megabytes
+ for bulk transfers without risking a stack overflow.
+ */
+@interface NMSSHBufferPool : NSObject
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ The pool used by NMSSH.
+
+ @returns Shared buffer pool
+ */
++ (nonnull instancetype)sharedPool;
+
+/** Upper bound of the memory kept by the shared cache, defaults to 32 MiB */
+@property (atomic, assign) NSUInteger maximumCachedBytes;
+
+/** A snapshot of the allocation statistics (read-only). */
+@property (atomic, readonly) NMSSHBufferPoolStatistics statistics;
+
+/**
+ Borrow a buffer from the pool.
+
+ The content of the buffer is undefined.
+
+ @param length Requested length, in bytes
+ @returns Buffer of at least `length` bytes
+ */
+- (nonnull NMSSHBuffer *)newBufferWithLength:(NSUInteger)length;
+
+/**
+ Release the memory kept by the shared cache and by the cache of the calling
+ thread. The caches of the other threads are released when they exit.
+ */
+- (void)purge;
+
+@end
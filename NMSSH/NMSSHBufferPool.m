@@ -0,0 +1,315 @@
+#import "NMSSHBufferPool.h"
+#import "NMSSH+Protected.h"
+
+#import <pthread.h>
+#import <stdatomic.h>
+
+// Size classes are powers of two from 4 KiB (1 << 12) to 16 MiB (1 << 24)
+#define kNMSSHBufferMinimumShift (12)
+#define kNMSSHBufferMaximumShift (24)
+#define kNMSSHBufferClasses (kNMSSHBufferMaximumShift - kNMSSHBufferMinimumShift + 1)
+
+// Threads keep at most two buffers of each class up to 256 KiB (1 << 18)
+#define kNMSSHBufferThreadClasses (18 - kNMSSHBufferMinimumShift + 1)
+#define kNMSSHBufferThreadDepth (2)
+
+#define kNMSSHBufferDefaultCachedBytes (32 * 1024 * 1024)
+
+typedef struct {
+    void *buffers[kNMSSHBufferThreadClasses][kNMSSHBufferThreadDepth];
+    unsigned int count[kNMSSHBufferThreadClasses];
+} NMSSHBufferThreadCache;
+
+// Free buffers of the shared cache are chained through their first bytes
+typedef struct NMSSHBufferLink {
+    struct NMSSHBufferLink *next;
+} NMSSHBufferLink;
+
+static pthread_key_t threadCacheKey;
+static pthread_mutex_t sharedCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static NMSSHBufferLink *sharedCache[kNMSSHBufferClasses];
+static uint64_t sharedCacheBytes;
+static _Atomic uint64_t maximumCachedBytes = kNMSSHBufferDefaultCachedBytes;
+
+static _Atomic uint64_t allocations;
+static _Atomic uint64_t threadCacheHits;
+static _Atomic uint64_t sharedCacheHits;
+static _Atomic uint64_t systemAllocations;
+static _Atomic uint64_t bytesInUse;
+static _Atomic uint64_t peakBytesInUse;
+
+// -----------------------------------------------------------------------------
+#pragma mark - SIZE CLASSES
+// -----------------------------------------------------------------------------
+
+/// Index of the smallest class holding length bytes, -1 if none does
+static int NMSSHBufferSizeClass(NSUInteger length) {
+    int shift = kNMSSHBufferMinimumShift;
+    while (shift <= kNMSSHBufferMaximumShift && ((NSUInteger)1 << shift) < length) {
+        shift++;
+    }
+
+    return shift <= kNMSSHBufferMaximumShift ? shift - kNMSSHBufferMinimumShift : -1;
+}
+
+static NSUInteger NMSSHBufferClassSize(int sizeClass) {
+    return (NSUInteger)1 << (sizeClass + kNMSSHBufferMinimumShift);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SHARED CACHE
+// -----------------------------------------------------------------------------
+
+static void *NMSSHBufferSharedTake(int sizeClass) {
+    pthread_mutex_lock(&sharedCacheLock);
+
+    NMSSHBufferLink *link = sharedCache[sizeClass];
+    if (link) {
+        sharedCache[sizeClass] = link->next;
+        sharedCacheBytes -= NMSSHBufferClassSize(sizeClass);
+    }
+
+    pthread_mutex_unlock(&sharedCacheLock);
+
+    return link;
+}
+
+static void NMSSHBufferSharedGive(void *buffer, int sizeClass) {
+    NSUInteger size = NMSSHBufferClassSize(sizeClass);
+
+    pthread_mutex_lock(&sharedCacheLock);
+
+    BOOL kept = sharedCacheBytes + size <= atomic_load_explicit(&maximumCachedBytes, memory_order_relaxed);
+    if (kept) {
+        NMSSHBufferLink *link = buffer;
+        link->next = sharedCache[sizeClass];
+        sharedCache[sizeClass] = link;
+        sharedCacheBytes += size;
+    }
+
+    pthread_mutex_unlock(&sharedCacheLock);
+
+    if (!kept) {
+        free(buffer);
+    }
+}
+
+static void NMSSHBufferSharedPurge(void) {
+    NMSSHBufferLink *lists[kNMSSHBufferClasses];
+
+    pthread_mutex_lock(&sharedCacheLock);
+    memcpy(lists, sharedCache, sizeof(lists));
+    memset(sharedCache, 0, sizeof(sharedCache));
+    sharedCacheBytes = 0;
+    pthread_mutex_unlock(&sharedCacheLock);
+
+    for (int sizeClass = 0; sizeClass < kNMSSHBufferClasses; sizeClass++) {
+        NMSSHBufferLink *link = lists[sizeClass];
+        while (link) {
+            NMSSHBufferLink *next = link->next;
+            free(link);
+            link = next;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - THREAD CACHES
+// -----------------------------------------------------------------------------
+
+/// Hand the buffers of an exiting thread over to the shared cache
+static void NMSSHBufferThreadCacheDestroy(void *value) {
+    NMSSHBufferThreadCache *cache = value;
+
+    for (int sizeClass = 0; sizeClass < kNMSSHBufferThreadClasses; sizeClass++) {
+        for (unsigned int i = 0; i < cache->count[sizeClass]; i++) {
+            NMSSHBufferSharedGive(cache->buffers[sizeClass][i], sizeClass);
+        }
+    }
+
+    free(cache);
+}
+
+static NMSSHBufferThreadCache *NMSSHBufferThreadCacheGet(BOOL create) {
+    NMSSHBufferThreadCache *cache = pthread_getspecific(threadCacheKey);
+
+    if (!cache && create) {
+        cache = calloc(1, sizeof(NMSSHBufferThreadCache));
+        pthread_setspecific(threadCacheKey, cache);
+    }
+
+    return cache;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - ALLOCATION
+// -----------------------------------------------------------------------------
+
+static void NMSSHBufferCountInUse(int64_t delta) {
+    uint64_t inUse = atomic_fetch_add_explicit(&bytesInUse, (uint64_t)delta, memory_order_relaxed) + (uint64_t)delta;
+    if (delta <= 0) {
+        return;
+    }
+
+    uint64_t peak = atomic_load_explicit(&peakBytesInUse, memory_order_relaxed);
+    while (inUse > peak && !atomic_compare_exchange_weak_explicit(&peakBytesInUse, &peak, inUse, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void *NMSSHBufferAllocate(NSUInteger length, int sizeClass) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+
+    void *buffer = NULL;
+
+    if (sizeClass >= 0 && sizeClass < kNMSSHBufferThreadClasses) {
+        NMSSHBufferThreadCache *cache = NMSSHBufferThreadCacheGet(NO);
+        if (cache && cache->count[sizeClass] > 0) {
+            buffer = cache->buffers[sizeClass][--cache->count[sizeClass]];
+            atomic_fetch_add_explicit(&threadCacheHits, 1, memory_order_relaxed);
+        }
+    }
+
+    if (!buffer && sizeClass >= 0) {
+        buffer = NMSSHBufferSharedTake(sizeClass);
+        if (buffer) {
+            atomic_fetch_add_explicit(&sharedCacheHits, 1, memory_order_relaxed);
+        }
+    }
+
+    if (!buffer) {
+        buffer = malloc(sizeClass >= 0 ? NMSSHBufferClassSize(sizeClass) : MAX(length, 1));
+        atomic_fetch_add_explicit(&systemAllocations, 1, memory_order_relaxed);
+    }
+
+    return buffer;
+}
+
+static void NMSSHBufferRelease(void *buffer, int sizeClass) {
+    if (sizeClass < 0) {
+        free(buffer);
+        return;
+    }
+
+    if (sizeClass < kNMSSHBufferThreadClasses) {
+        NMSSHBufferThreadCache *cache = NMSSHBufferThreadCacheGet(YES);
+        if (cache && cache->count[sizeClass] < kNMSSHBufferThreadDepth) {
+            cache->buffers[sizeClass][cache->count[sizeClass]++] = buffer;
+            return;
+        }
+    }
+
+    NMSSHBufferSharedGive(buffer, sizeClass);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - BUFFER
+// -----------------------------------------------------------------------------
+
+@interface NMSSHBuffer () {
+    void *_memory;
+    int _sizeClass;
+    NSUInteger _capacity;
+}
+@end
+
+@implementation NMSSHBuffer
+
+- (instancetype)initWithLength:(NSUInteger)length {
+    if ((self = [super init])) {
+        _length = length;
+        _sizeClass = NMSSHBufferSizeClass(length);
+        _capacity = _sizeClass >= 0 ? NMSSHBufferClassSize(_sizeClass) : length;
+        _memory = NMSSHBufferAllocate(length, _sizeClass);
+
+        if (!_memory) {
+            return nil;
+        }
+
+        NMSSHBufferCountInUse((int64_t)_capacity);
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    if (_memory) {
+        NMSSHBufferCountInUse(-(int64_t)_capacity);
+        NMSSHBufferRelease(_memory, _sizeClass);
+    }
+}
+
+- (void *)mutableBytes {
+    return _memory;
+}
+
+- (const void *)bytes {
+    return _memory;
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - POOL
+// -----------------------------------------------------------------------------
+
+@implementation NMSSHBufferPool
+
++ (instancetype)sharedPool {
+    static NMSSHBufferPool *sharedPool = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        pthread_key_create(&threadCacheKey, NMSSHBufferThreadCacheDestroy);
+        sharedPool = [[self alloc] initPool];
+    });
+
+    return sharedPool;
+}
+
+- (instancetype)initPool {
+    return [super init];
+}
+
+- (NSUInteger)maximumCachedBytes {
+    return (NSUInteger)atomic_load_explicit(&maximumCachedBytes, memory_order_relaxed);
+}
+
+- (void)setMaximumCachedBytes:(NSUInteger)bytes {
+    atomic_store_explicit(&maximumCachedBytes, bytes, memory_order_relaxed);
+}
+
+- (NMSSHBufferPoolStatistics)statistics {
+    NMSSHBufferPoolStatistics statistics;
+    statistics.allocations = atomic_load_explicit(&allocations, memory_order_relaxed);
+    statistics.threadCacheHits = atomic_load_explicit(&threadCacheHits, memory_order_relaxed);
+    statistics.sharedCacheHits = atomic_load_explicit(&sharedCacheHits, memory_order_relaxed);
+    statistics.systemAllocations = atomic_load_explicit(&systemAllocations, memory_order_relaxed);
+    statistics.bytesInUse = atomic_load_explicit(&bytesInUse, memory_order_relaxed);
+    statistics.peakBytesInUse = atomic_load_explicit(&peakBytesInUse, memory_order_relaxed);
+
+    pthread_mutex_lock(&sharedCacheLock);
+    statistics.bytesCached = sharedCacheBytes;
+    pthread_mutex_unlock(&sharedCacheLock);
+
+    return statistics;
+}
+
+- (NMSSHBuffer *)newBufferWithLength:(NSUInteger)length {
+    NMSSHBuffer *buffer = [[NMSSHBuffer alloc] initWithLength:length];
+    if (!buffer) {
+        NMSSHLogError(@"Unable to allocate a buffer of %lu bytes", (unsigned long)length);
+        [NSException raise:NSMallocException format:@"Unable to allocate a buffer of %lu bytes", (unsigned long)length];
+    }
+
+    return buffer;
+}
+
+- (void)purge {
+    NMSSHBufferThreadCache *cache = NMSSHBufferThreadCacheGet(NO);
+    if (cache) {
+        pthread_setspecific(threadCacheKey, NULL);
+        NMSSHBufferThreadCacheDestroy(cache);
+    }
+
+    NMSSHBufferSharedPurge();
+}
+
+@end
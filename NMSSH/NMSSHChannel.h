@@ -1,6 +1,13 @@
 #import "NMSSH.h"
 
 @class NMSSHSession;
+@class NMSSHOperation;
+@class NMSSHExpectPattern;
+@class NMSSHExpectMatch;
+@class NMSSHScrollbackBuffer;
+@class NMSSHShellRecorder;
+@class NMSSHMessageFramer;
+@class NMSSHCommandResult;
 @protocol NMSSHChannelDelegate;
 
 typedef NS_ENUM(NSInteger, NMSSHChannelError) {
@@ -11,7 +18,8 @@ typedef NS_ENUM(NSInteger, NMSSHChannelError) {
     NMSSHChannelAllocationError,
     NMSSHChannelRequestShellError,
     NMSSHChannelWriteError,
-    NMSSHChannelReadError
+    NMSSHChannelReadError,
+    NMSSHChannelExpectTimeout
 };
 
 typedef NS_ENUM(NSInteger, NMSSHChannelPtyTerminal) {
@@ -23,12 +31,23 @@ typedef NS_ENUM(NSInteger, NMSSHChannelPtyTerminal) {
     NMSSHChannelPtyTerminalXterm
 };
 
+typedef NS_ENUM(NSInteger, NMSSHChannelDeliveryMode) {
+    NMSSHChannelDeliveryImmediate, // Every read is delivered as it arrives
+    NMSSHChannelDeliveryCoalesced  // Reads are batched and delivered on deliveryQueue
+};
+
+typedef NS_ENUM(NSInteger, NMSSHChannelCompression) {
+    NMSSHChannelCompressionNone,
+    NMSSHChannelCompressionGzip,
+    NMSSHChannelCompressionAutomatic // Uploads: gzip when a sample of the stream compresses well
+};
+
 typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
     NMSSHChannelTypeClosed, // Channel = NULL
     NMSSHChannelTypeExec,
     NMSSHChannelTypeShell,
     NMSSHChannelTypeSCP,
-    NMSSHChannelTypeSubsystem // Not supported by NMSSH framework
+    NMSSHChannelTypeSubsystem // Started by startSubsystem:
 };
 
 /**
@@ -39,9 +58,33 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
 /** A valid NMSSHSession instance */
 @property (nonatomic, nonnull, readonly) NMSSHSession *session;
 
-/** Size of the buffers used by the channel, defaults to 0x4000 */
+/** Size of the buffers used by the channel, defaults to 0x4000, see NMSSHBufferPool */
 @property (nonatomic, assign) NSUInteger bufferSize;
 
+/**
+ Initial receive window of the channel, defaults to 2 MiB.
+
+ The server sends no more than the window before waiting for an
+ acknowledgement, which caps the throughput at the window divided by the round
+ trip time. Raise it for bulk transfers on high-latency links.
+ */
+@property (nonatomic, assign) NSUInteger windowSize;
+
+/** Largest packet the server may send on the channel, defaults to 32 KiB */
+@property (nonatomic, assign) NSUInteger packetSize;
+
+/**
+ Grow the receive window while the server keeps exhausting it, up to
+ maximumWindowSize, defaults to `NO`.
+
+ Applies to command execution and SCP downloads. SCP channels are opened by
+ libssh2 with the default window, growth is the only way to widen them.
+ */
+@property (nonatomic, assign) BOOL automaticWindowGrowth;
+
+/** Upper bound of automatic window growth, defaults to 32 MiB */
+@property (nonatomic, assign) NSUInteger maximumWindowSize;
+
 /// ----------------------------------------------------------------------------
 /// @name Setting the Delegate
 /// ----------------------------------------------------------------------------
@@ -77,6 +120,12 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
 /** The last response from a shell command execution */
 @property (nonatomic, nullable, readonly) NSString *lastResponse;
 
+/** Exit status of the last executed command, valid once the command completed */
+@property (nonatomic, readonly) int lastExitStatus;
+
+/** Name of the signal that killed the last executed command, e.g. `KILL` */
+@property (nonatomic, nullable, readonly) NSString *lastExitSignal;
+
 /** Request a pseudo terminal before executing a command */
 @property (nonatomic, assign) BOOL requestPty;
 
@@ -110,6 +159,140 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
  */
 - (nullable NSString *)execute:(nonnull NSString *)command error:(NSError * _Nullable * _Nullable)error timeout:(nonnull NSNumber *)timeout;
 
+/**
+ Execute a shell command on the server, streaming its output.
+
+ The output is handed over untouched, chunk by chunk, as soon as it arrives,
+ so binary and arbitrarily large outputs are fine. Nothing is accumulated,
+ the memory used stays constant. A non-zero exit status is not an error, it is
+ available in lastExitStatus along with lastExitSignal once the method returns.
+
+ The sinks are called on the session queue, they may not call the session.
+
+ @param command Any shell script that is available on the server
+ @param standardOutput Called with each chunk of standard output
+ @param standardError Called with each chunk of standard error output
+ @param error Error handler
+ @param timeout The time to wait (in seconds) before giving up on the request
+ @returns `YES` if the command ran to completion
+ */
+- (BOOL)execute:(nonnull NSString *)command
+ standardOutput:(nullable void (^)(NSData * _Nonnull data))standardOutput
+  standardError:(nullable void (^)(NSData * _Nonnull data))standardError
+          error:(NSError * _Nullable * _Nullable)error
+        timeout:(nonnull NSNumber *)timeout;
+
+/**
+ Execute a shell command on the server, streaming its standard input.
+
+ The input stream is read while the output is streamed, like
+ -execute:standardOutput:standardError:error:timeout:. Input is sent as fast as
+ the server grants window, and EOF is sent once the stream ends, so commands
+ like `cat > file` or `tar x` terminate. Use
+ +[NSInputStream inputStreamWithFileAtPath:] to feed a file, and a bound pair
+ of streams (see NSStream) to feed generated data.
+
+ The stream is read on the session queue as its bytes become available, the
+ output keeps being streamed meanwhile. A stream that is not open yet is
+ opened, and closed once the command completed; a stream opened by the caller
+ is left open. Disable requestPty to pass binary input, a terminal would
+ interpret it.
+
+ @param command Any shell script that is available on the server
+ @param standardInput Stream read until its end into the standard input
+ @param standardOutput Called with each chunk of standard output
+ @param standardError Called with each chunk of standard error output
+ @param error Error handler
+ @param timeout The time to wait (in seconds) before giving up on the request
+ @returns `YES` if the command ran to completion
+ */
+- (BOOL)execute:(nonnull NSString *)command
+  standardInput:(nonnull NSInputStream *)standardInput
+ standardOutput:(nullable void (^)(NSData * _Nonnull data))standardOutput
+  standardError:(nullable void (^)(NSData * _Nonnull data))standardError
+          error:(NSError * _Nullable * _Nullable)error
+        timeout:(nonnull NSNumber *)timeout;
+
+/**
+ Asynchronously execute a shell command on the server.
+
+ The command runs on a channel of its own, without waiting on any thread, see
+ NMSSHOperation. A non-zero exit status is reported as a
+ `NMSSHChannelExecutionError` error described by the standard error output.
+
+ @param command Any shell script that is available on the server
+ @param completionHandler Called with the standard output of the command and
+     the reason of the failure, if any. The output is also passed along a
+     `NMSSHChannelExecutionError` and is nil when the command did not complete
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)execute:(nonnull NSString *)command
+                  completionHandler:(nullable void (^)(NSString * _Nullable response, NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously execute a shell command on the server, streaming its output.
+
+ Like -execute:standardOutput:standardError:error:timeout:, the sinks are
+ called on the session queue with each chunk of output as it arrives.
+
+ @param command Any shell script that is available on the server
+ @param standardOutput Called with each chunk of standard output
+ @param standardError Called with each chunk of standard error output
+ @param completionHandler Called with the exit status and the exit signal of
+     the command, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)execute:(nonnull NSString *)command
+                     standardOutput:(nullable void (^)(NSData * _Nonnull data))standardOutput
+                      standardError:(nullable void (^)(NSData * _Nonnull data))standardError
+                  completionHandler:(nullable void (^)(int exitStatus, NSString * _Nullable exitSignal, NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously execute a shell command on the server, line by line.
+
+ The output is split into lines as it arrives, see NMSSHLineSplitter: it is
+ never buffered whole, and the lines are slices of the read buffer. The
+ handler is called on the session queue with every line of both outputs,
+ without its line feed. The bytes are only valid during the call.
+
+ @param command Any shell script that is available on the server
+ @param lineHandler Called with each line, and whether it was printed on the
+     standard error output
+ @param completionHandler Called with the exit status and the exit signal of
+     the command, or the reason of the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)execute:(nonnull NSString *)command
+                        lineHandler:(nonnull void (^)(const char * _Nonnull line, NSUInteger length, BOOL standardError))lineHandler
+                  completionHandler:(nullable void (^)(int exitStatus, NSString * _Nullable exitSignal, NSError * _Nullable error))completionHandler;
+
+/** Commands of executeCommands: running at once, defaults to 10, the `MaxSessions` default of OpenSSH */
+@property (nonatomic, assign) NSUInteger maximumConcurrentCommands;
+
+/**
+ Asynchronously execute independent shell commands on the server, each on a
+ channel of its own.
+
+ Opening a channel, setting its environment, requesting its pty and starting
+ its command each wait for a reply of the server. Instead of one command after
+ the other, the requests of up to `maximumConcurrentCommands` commands are in
+ flight together and the commands run concurrently. libssh2 opens one channel
+ at a time, the other commands go on meanwhile.
+
+ Unlike execute:completionHandler:, a non-zero exit status is not an error.
+
+ @param commands Shell scripts that are available on the server
+ @param resultHandler Called on the `callbackQueue` of the session as each
+     command completes, with its index in `commands` and its result, or the
+     reason of its failure
+ @param completionHandler Called once every command completed, with the reason
+     of the failure of the whole batch, e.g. a cancellation
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)executeCommands:(nonnull NSArray<NSString *> *)commands
+                              resultHandler:(nullable void (^)(NSUInteger index, NMSSHCommandResult * _Nullable result, NSError * _Nullable error))resultHandler
+                          completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
 /// ----------------------------------------------------------------------------
 /// @name Remote shell session
 /// ----------------------------------------------------------------------------
@@ -117,6 +300,67 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
 /** User-defined environment variables for the session, defaults to `nil` */
 @property (nonatomic, nullable, strong) NSDictionary *environmentVariables;
 
+/**
+ Command started by startShell: instead of the login shell of the user,
+ defaults to `nil`. The channel then behaves like a shell running it, e.g.
+ `/bin/sh` for a shell whatever the login shell is, without any banner.
+ */
+@property (nonatomic, nullable, copy) NSString *shellCommand;
+
+/**
+ How the shell output is handed to the delegate, defaults to
+ `NMSSHChannelDeliveryImmediate`.
+
+ In immediate mode the delegate is called for every read, which may be a few
+ bytes long, on a serial background queue of the channel unless deliveryQueue
+ is set. In coalesced mode the output is accumulated up to coalescingSize
+ bytes or coalescingInterval seconds, then delivered on deliveryQueue. Either
+ way the delegate is not called on the session queue, unless deliveryQueue is
+ set to it. The shell stops reading from the server while more than
+ maximumPendingBytes are waiting for the delegate, the SSH flow control then
+ throttles the remote process.
+
+ Change the delivery settings before starting the shell.
+ */
+@property (nonatomic, assign) NMSSHChannelDeliveryMode deliveryMode;
+
+/** The queue shell output is delivered on, defaults to the `callbackQueue` of the session in coalesced mode */
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, nullable, strong) dispatch_queue_t deliveryQueue;
+#else
+@property (nonatomic, nullable, assign) dispatch_queue_t deliveryQueue;
+#endif
+
+/** Output size triggering a coalesced delivery, defaults to 64 KiB */
+@property (nonatomic, assign) NSUInteger coalescingSize;
+
+/** Longest time output is held before a coalesced delivery, defaults to 10 ms */
+@property (nonatomic, assign) NSTimeInterval coalescingInterval;
+
+/** Delivered output not yet consumed by the delegate before reads stop, defaults to 1 MiB */
+@property (nonatomic, assign) NSUInteger maximumPendingBytes;
+
+/**
+ Keeps the end of the shell output, both standard output and standard error,
+ as it is read. `nil` by default.
+
+    channel.scrollbackBuffer = [[NMSSHScrollbackBuffer alloc] initWithCapacity:1024 * 1024
+                                                                   maximumLines:10000];
+
+ The buffer is appended to on the session queue, before the output is
+ delivered to the delegate.
+ */
+@property (nonatomic, nullable, strong) NMSSHScrollbackBuffer *scrollbackBuffer;
+
+/**
+ Records the shell: output, input and terminal resizes. `nil` by default.
+
+ Set it before starting the shell, the recorder is closed when the shell
+ closes. Recording only copies the bytes into the buffer of the recorder, the
+ file is written on a background queue.
+ */
+@property (nonatomic, nullable, strong) NMSSHShellRecorder *recorder;
+
 /**
  Request a remote shell on the channel.
 
@@ -130,10 +374,39 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
 - (BOOL)startShell:(NSError * _Nullable * _Nullable)error;
 
 /**
- Close a remote shell on an active channel.
+ Close a remote shell or subsystem on an active channel.
  */
 - (void)closeShell;
 
+/**
+ Start a subsystem on the channel, such as `netconf` or `sftp`.
+
+ A subsystem streams like a shell, without a pseudo terminal: its output is
+ delivered to the delegate according to deliveryMode, and it is written to
+ with writeData:completionHandler: or writeMessage:completionHandler:. Reads
+ and writes never block the session queue, so any number of subsystems and
+ shells can run on the same session. Close it with closeShell.
+
+    channel.messageFramer = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingDelimiter];
+    [channel startSubsystem:@"netconf" error:&error];
+    [channel writeMessage:hello completionHandler:nil];
+
+ @param name Name of the subsystem
+ @param error Error handler
+ @returns Subsystem initialization success
+ */
+- (BOOL)startSubsystem:(nonnull NSString *)name error:(NSError * _Nullable * _Nullable)error;
+
+/**
+ Splits the standard output of a shell or subsystem into messages. `nil` by
+ default.
+
+ When set, the delegate receives channel:didReadMessage: instead of
+ channel:didReadData: and channel:didReadRawData:. The framer is reset when
+ the shell starts. A stream that breaks the framing is closed.
+ */
+@property (nonatomic, nullable, strong) NMSSHMessageFramer *messageFramer;
+
 /**
  Write a command on the remote shell.
 
@@ -180,6 +453,39 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
  */
 - (BOOL)writeData:(nonnull NSData *)data error:(NSError * _Nullable * _Nullable)error timeout:(nonnull NSNumber *)timeout;
 
+/** Latency budget of writeData:completionHandler: to coalesce writes, defaults to 5 ms */
+@property (nonatomic, assign) NSTimeInterval writeCoalescingInterval;
+
+/**
+ Priority class of the asynchronous writes and commands of the channel.
+
+ Set NMSSHOperationPriorityInteractive on a terminal so that keystrokes are
+ not queued behind bulk transfers sharing the session.
+ */
+@property (nonatomic, assign) NMSSHOperationPriority priority;
+
+/**
+ Queue data to be written to the remote shell, without waiting.
+
+ Writes may be queued from any thread, they are sent in order. Small writes
+ made within writeCoalescingInterval of each other, such as keystrokes, are
+ merged into fewer SSH packets. Data is only sent as the channel window
+ allows, no thread waits for the server meanwhile.
+
+ @param data Data to write
+ @param completionHandler Called on the `callbackQueue` of the session once
+     the data has been handed to the server, or with the reason of the failure
+ */
+- (void)writeData:(nonnull NSData *)data completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Queue a message to be written, framed by messageFramer if set.
+
+ @param message Message to write
+ @param completionHandler Called like the one of writeData:completionHandler:
+ */
+- (void)writeMessage:(nonnull NSData *)message completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
 /**
  Request size for the remote pseudo terminal.
 
@@ -191,10 +497,64 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
  */
 - (BOOL)requestSizeWidth:(NSUInteger)width height:(NSUInteger)height;
 
+/**
+ Shell output kept for the expectations, defaults to 64 KiB.
+
+ Output not consumed by an expectation is kept, so a prompt printed before
+ expect:error:timeout: is called is still found. Beyond this size the oldest
+ bytes are dropped.
+ */
+@property (nonatomic, assign) NSUInteger expectBufferSize;
+
+/**
+ Wait for one of several patterns in the output of the shell, like expect(1).
+
+ The output is matched as it is read, whatever the delivery mode, see
+ NMSSHExpect. The output up to the end of the match is consumed, the output
+ following it is left for the next expectation. The delegate still receives
+ the whole output. Only one expectation may be awaited at a time.
+
+ This method can't be called from the session queue, e.g. from the delegate in
+ immediate delivery mode.
+
+ @param patterns Patterns to look for, earlier patterns win ties
+ @param error Error handler, `NMSSHChannelExpectTimeout` once every pattern
+     timed out
+ @param timeout Seconds after which the patterns without a timeout of their
+     own stop being awaited, 0 to wait forever
+ @returns The first match, or `nil`
+ */
+- (nullable NMSSHExpectMatch *)expect:(nonnull NSArray<NMSSHExpectPattern *> *)patterns
+                                error:(NSError * _Nullable * _Nullable)error
+                              timeout:(nonnull NSNumber *)timeout;
+
+/**
+ Asynchronously wait for one of several patterns in the output of the shell.
+
+ Like expect:error:timeout:, without blocking the calling thread.
+
+ @param patterns Patterns to look for, earlier patterns win ties
+ @param timeout Seconds after which the patterns without a timeout of their
+     own stop being awaited, 0 to wait forever
+ @param completionHandler Called on the `callbackQueue` of the session with the
+     first match, or the reason of the failure
+ */
+- (void)expect:(nonnull NSArray<NMSSHExpectPattern *> *)patterns
+       timeout:(nonnull NSNumber *)timeout
+completionHandler:(nullable void (^)(NMSSHExpectMatch * _Nullable match, NSError * _Nullable error))completionHandler;
+
 /// ----------------------------------------------------------------------------
 /// @name SCP file transfer
 /// ----------------------------------------------------------------------------
 
+/**
+ Flush downloaded files to permanent storage before reporting success,
+ defaults to `NO`.
+
+ Downloads are otherwise complete once the data reached the system cache.
+ */
+@property (nonatomic, assign) BOOL synchronizesDownloads;
+
 /**
  Upload a local file to a remote server.
 
@@ -241,14 +601,100 @@ typedef NS_ENUM(NSInteger, NMSSHChannelType)  {
  If to: specifies a directory, the file name from the original file will be
  used.
 
+ The file is memory-mapped and sent without intermediate copies, files larger
+ than 4 GB are supported. The file must not be truncated during the upload.
+
  @param localPath Path to a file on the local computer
  @param remotePath Path to save the file to
- @param progress Method called periodically with number of bytes uploaded. Returns NO to abort.
+ @param progress Method called at most ten times per second, and once the
+        upload completes, with number of bytes uploaded. Returns NO to abort.
  @returns SCP upload success
  */
 - (BOOL)uploadFile:(nonnull NSString *)localPath
                 to:(nonnull NSString *)remotePath
           progress:(BOOL (^_Nullable)(NSUInteger))progress;
 
+/**
+ Upload a local directory tree to a remote server, like `scp -r -p`.
+
+ The whole tree is sent over a single channel. The local directory is walked
+ in the background while files are being sent. Modes, access and modification
+ times are preserved. If to: is an existing directory the tree is created
+ inside it, otherwise it is created as to:.
+
+ @param localPath Path to a directory on the local computer
+ @param remotePath Path to save the tree to
+ @param progress Method called periodically with the number of bytes uploaded
+        over all files. Returns NO to abort.
+ @returns SCP upload success
+ */
+- (BOOL)uploadDirectory:(nonnull NSString *)localPath
+                     to:(nonnull NSString *)remotePath
+               progress:(BOOL (^_Nullable)(NSUInteger))progress;
+
+/**
+ Download a remote directory tree from a server, like `scp -r -p`.
+
+ The whole tree is received over a single channel, preserving modes, access
+ and modification times. If to: is an existing directory the tree is created
+ inside it, otherwise it is created as to:. Names sent by the server are
+ checked, the tree cannot escape to:.
+
+ @param remotePath Path to a directory on the remote server
+ @param localPath Path to save the tree to
+ @param progress Method called periodically with the number of bytes
+        downloaded over all files. Returns NO to abort.
+ @returns SCP download success
+ */
+- (BOOL)downloadDirectory:(nonnull NSString *)remotePath
+                       to:(nonnull NSString *)localPath
+                 progress:(BOOL (^_Nullable)(NSUInteger))progress;
+
+/**
+ Upload a local directory tree as a tar stream, piped into `tar x` on the
+ remote server.
+
+ The archive is generated on the fly while the tree is walked, nothing is
+ written to disk. Unlike uploadDirectory:to:progress: files are not
+ acknowledged one by one, which makes this mode much faster for trees of many
+ small files. The server needs a POSIX `tar`, and `gzip` support for
+ compression.
+
+ The tree is created inside to:, which is created if needed.
+
+ @param localPath Path to a directory on the local computer
+ @param remotePath Directory to extract the tree in
+ @param compression Compression of the stream, NMSSHChannelCompressionAutomatic
+        samples the beginning of the archive
+ @param progress Method called periodically with the number of bytes of the
+        archive generated so far. Returns NO to abort.
+ @returns Upload success, including the exit status of the remote `tar`
+ */
+- (BOOL)uploadDirectoryWithTar:(nonnull NSString *)localPath
+                            to:(nonnull NSString *)remotePath
+                   compression:(NMSSHChannelCompression)compression
+                      progress:(BOOL (^_Nullable)(NSUInteger))progress;
+
+/**
+ Download a remote directory tree as the tar stream of a remote `tar c`.
+
+ The stream is extracted as it arrives, nothing is written to disk but the
+ files of the tree. Only directories and regular files are extracted, entries
+ escaping to: are refused.
+
+ The tree is created inside to:, which is created if needed.
+
+ @param remotePath Path to a directory on the remote server
+ @param localPath Directory to extract the tree in
+ @param compression Compression of the stream, NMSSHChannelCompressionAutomatic
+        is not compressed since nothing can be sampled before the stream starts
+ @param progress Method called periodically with the number of bytes of the
+        archive extracted so far. Returns NO to abort.
+ @returns Download success, including the exit status of the remote `tar`
+ */
+- (BOOL)downloadDirectoryWithTar:(nonnull NSString *)remotePath
+                              to:(nonnull NSString *)localPath
+                     compression:(NMSSHChannelCompression)compression
+                        progress:(BOOL (^_Nullable)(NSUInteger))progress;
 
 @end
@@ -1,5 +1,33 @@
 #import "NMSSHChannel.h"
 #import "NMSSH+Protected.h"
+#import "NMSSHTar.h"
+#import "NMSSHUTF8Decoder.h"
+#import "NMSSHMessageFramer.h"
+
+#import <fts.h>
+#import <sys/time.h>
+
+// Uploads are staged through this many buffers of this size, read from disk
+// while the previous one is sent
+#define kNMSSHUploadStages (2)
+#define kNMSSHUploadStageSize (1024 * 1024)
+
+// Shortest interval between two progress callbacks of a transfer, in seconds
+#define kNMSSHProgressInterval (0.1)
+
+// Downloads are staged through this many buffers of this size, written to
+// disk while the next ones are received
+#define kNMSSHDownloadStages (4)
+#define kNMSSHDownloadStageSize (1024 * 1024)
+
+// Entries the directory walker of a recursive upload may get ahead of the channel
+#define kNMSSHSCPWalkerBacklog (1024)
+
+// Tar uploads are compressed automatically when this many bytes at the start of
+// the archive shrink below the threshold at the fast level of gzip
+#define kNMSSHTarSampleSize (256 * 1024)
+#define kNMSSHTarCompressionThreshold (0.7)
+#define kNMSSHTarCompressionLevel (1)
 
 @interface NMSSHChannel ()
 @property (nonatomic, strong) NMSSHSession *session;
@@ -8,12 +36,206 @@
 @property (nonatomic, readwrite) NMSSHChannelType type;
 @property (nonatomic, assign) const char *ptyTerminalName;
 @property (nonatomic, strong) NSString *lastResponse;
+@property (nonatomic, readwrite) int lastExitStatus;
+@property (nonatomic, strong) NSString *lastExitSignal;
+
+// Whether the session reads the stream for the channel
+@property (nonatomic, assign, getter = isPumped) BOOL pumped;
+
+// Coalesced shell output, only touched on the session queue
+@property (nonatomic, strong) NSMutableData *pendingOutput;
+@property (nonatomic, strong) NSMutableData *pendingError;
+@property (nonatomic, assign) NSUInteger deliveringBytes;
+@property (nonatomic, assign) BOOL readSuspended;
+@property (nonatomic, assign) BOOL flushScheduled;
 
+// Immediate output is delivered in read order, off the session queue
 #if OS_OBJECT_USE_OBJC
-@property (nonatomic, strong) dispatch_source_t source;
+@property (nonatomic, strong) dispatch_queue_t immediateQueue;
 #else
-@property (nonatomic, assign) dispatch_source_t source;
+@property (nonatomic, assign) dispatch_queue_t immediateQueue;
 #endif
+
+// Subsystem started by openShell: instead of a shell
+@property (nonatomic, copy) NSString *subsystemName;
+@property (nonatomic, assign) BOOL framingFailed;
+
+// Shell output decoded in read order, characters may span reads
+@property (nonatomic, strong) NMSSHUTF8Decoder *outputDecoder;
+@property (nonatomic, strong) NMSSHUTF8Decoder *errorDecoder;
+
+// Queued shell input, only touched on the session queue
+@property (nonatomic, strong) NSMutableData *pendingInput;
+@property (nonatomic, strong) NSMutableArray *pendingInputHandlers;
+@property (nonatomic, assign) BOOL writeScheduled;
+@property (nonatomic, assign) BOOL writeInFlight;
+
+// Output awaited by expect:, only touched on the session queue
+@property (nonatomic, strong) NSMutableData *expectBacklog;
+@property (nonatomic, strong) NMSSHExpect *expectMatcher;
+@property (nonatomic, copy) void (^expectHandler)(NMSSHExpectMatch *, NSError *);
+@property (nonatomic, assign) NSInteger expectBase;
+@property (nonatomic, assign) NSUInteger expectGeneration;
+@end
+
+typedef NS_ENUM(NSInteger, NMSSHSCPEntryType) {
+    NMSSHSCPEntryFile,
+    NMSSHSCPEntryDirectory,
+    NMSSHSCPEntryEndOfDirectory
+};
+
+// A message of the SCP protocol, produced by the walker of a recursive upload
+@interface NMSSHSCPEntry : NSObject
+@property (nonatomic, assign) NMSSHSCPEntryType type;
+@property (nonatomic, strong) NSString *path;
+@property (nonatomic, strong) NSString *name;
+@property (nonatomic, assign) mode_t mode;
+@property (nonatomic, assign) uint64_t size;
+@property (nonatomic, assign) time_t modificationTime;
+@property (nonatomic, assign) time_t accessTime;
+@end
+
+@implementation NMSSHSCPEntry
+@end
+
+// Walks a local tree on a background queue, ahead of the channel sending it
+@interface NMSSHSCPWalker : NSObject
+@property (nonatomic, strong) NSCondition *condition;
+@property (nonatomic, strong) NSMutableArray *entries;
+@property (nonatomic, assign) BOOL finished;
+@property (nonatomic, assign) BOOL cancelled;
+@property (nonatomic, assign) BOOL failed;
+@end
+
+@implementation NMSSHSCPWalker
+
+- (instancetype)initWithPath:(NSString *)path {
+    if ((self = [super init])) {
+        [self setCondition:[[NSCondition alloc] init]];
+        [self setEntries:[NSMutableArray array]];
+
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self walk:path];
+        });
+    }
+
+    return self;
+}
+
+- (void)walk:(NSString *)path {
+    char *paths[] = { (char *)[path fileSystemRepresentation], NULL };
+    FTS *fts = fts_open(paths, FTS_LOGICAL | FTS_NOCHDIR, NULL);
+    BOOL failed = (fts == NULL);
+    FTSENT *node;
+
+    while (!failed && !self.cancelled && (node = fts_read(fts)) != NULL) {
+        NMSSHSCPEntry *entry = [[NMSSHSCPEntry alloc] init];
+
+        switch (node->fts_info) {
+            case FTS_D:
+                [entry setType:NMSSHSCPEntryDirectory];
+                break;
+
+            case FTS_DP:
+                [entry setType:NMSSHSCPEntryEndOfDirectory];
+                break;
+
+            case FTS_F:
+                [entry setType:NMSSHSCPEntryFile];
+                break;
+
+            case FTS_ERR:
+            case FTS_NS:
+                NMSSHLogError(@"Unable to read %s: %s", node->fts_path, strerror(node->fts_errno));
+                failed = YES;
+                continue;
+
+            default:
+                // Unreadable directories, cycles, sockets and dangling links are skipped like scp does
+                NMSSHLogWarn(@"Skipping %s", node->fts_path);
+                continue;
+        }
+
+        if (entry.type != NMSSHSCPEntryEndOfDirectory) {
+            [entry setPath:[NSString stringWithUTF8String:node->fts_path]];
+            [entry setName:node->fts_level == FTS_ROOTLEVEL ? [path lastPathComponent] : [NSString stringWithUTF8String:node->fts_name]];
+            [entry setMode:node->fts_statp->st_mode & 07777];
+            [entry setSize:(uint64_t)node->fts_statp->st_size];
+            [entry setModificationTime:node->fts_statp->st_mtime];
+            [entry setAccessTime:node->fts_statp->st_atime];
+        }
+
+        [self.condition lock];
+        while ([self.entries count] >= kNMSSHSCPWalkerBacklog && !self.cancelled) {
+            [self.condition wait];
+        }
+        [self.entries addObject:entry];
+        [self.condition signal];
+        [self.condition unlock];
+    }
+
+    if (fts) {
+        fts_close(fts);
+    }
+
+    [self.condition lock];
+    [self setFailed:failed];
+    [self setFinished:YES];
+    [self.condition signal];
+    [self.condition unlock];
+}
+
+- (NMSSHSCPEntry *)nextEntry {
+    [self.condition lock];
+    while ([self.entries count] == 0 && !self.finished) {
+        [self.condition wait];
+    }
+
+    NMSSHSCPEntry *entry = [self.entries firstObject];
+    if (entry) {
+        [self.entries removeObjectAtIndex:0];
+        [self.condition signal];
+    }
+    [self.condition unlock];
+
+    return entry;
+}
+
+- (void)cancel {
+    [self.condition lock];
+    [self setCancelled:YES];
+    [self.condition signal];
+    [self.condition unlock];
+}
+
+@end
+
+typedef NS_ENUM(NSInteger, NMSSHBatchCommandState) {
+    NMSSHBatchCommandOpening,
+    NMSSHBatchCommandSettingEnvironment,
+    NMSSHBatchCommandRequestingPty,
+    NMSSHBatchCommandStarting,
+    NMSSHBatchCommandReading,
+    NMSSHBatchCommandClosing,
+    NMSSHBatchCommandFreeing,
+    NMSSHBatchCommandFinished
+};
+
+// A command of executeCommands:, on a channel of its own
+@interface NMSSHBatchCommand : NSObject
+@property (nonatomic, assign) NSUInteger index;
+@property (nonatomic, assign) LIBSSH2_CHANNEL *channel;
+@property (nonatomic, assign) NMSSHBatchCommandState state;
+@property (nonatomic, assign) NSUInteger environmentIndex;
+@property (nonatomic, assign) BOOL closing;
+@property (nonatomic, assign) unsigned long windowTarget;
+@property (nonatomic, strong) NMSSHCommandResult *result;
+@property (nonatomic, strong) NSMutableData *standardOutput;
+@property (nonatomic, strong) NSMutableData *standardError;
+@property (nonatomic, strong) NSError *error;
+@end
+
+@implementation NMSSHBatchCommand
 @end
 
 @implementation NMSSHChannel
@@ -29,6 +251,22 @@
         [self setRequestPty:NO];
         [self setPtyTerminalType:NMSSHChannelPtyTerminalVanilla];
         [self setType:NMSSHChannelTypeClosed];
+        [self setDeliveryMode:NMSSHChannelDeliveryImmediate];
+        [self setCoalescingSize:64 * 1024];
+        [self setCoalescingInterval:0.01];
+        [self setMaximumPendingBytes:1024 * 1024];
+        [self setWriteCoalescingInterval:0.005];
+        [self setWindowSize:LIBSSH2_CHANNEL_WINDOW_DEFAULT];
+        [self setPacketSize:LIBSSH2_CHANNEL_PACKET_DEFAULT];
+        [self setAutomaticWindowGrowth:NO];
+        [self setMaximumWindowSize:32 * 1024 * 1024];
+        [self setPendingInput:[NSMutableData data]];
+        [self setPendingInputHandlers:[NSMutableArray array]];
+        [self setExpectBufferSize:64 * 1024];
+        [self setExpectBacklog:[NSMutableData data]];
+        [self setMaximumConcurrentCommands:10];
+        [self setImmediateQueue:dispatch_queue_create("NMSSH.channelDelivery", DISPATCH_QUEUE_SERIAL)];
+        dispatch_set_target_queue(self.immediateQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
 
         // Make sure we were provided a valid session
         if (![self.session isKindOfClass:[NMSSHSession class]]) {
@@ -39,10 +277,16 @@
     return self;
 }
 
+#if !(OS_OBJECT_USE_OBJC)
+- (void)dealloc {
+    dispatch_release(_immediateQueue);
+}
+#endif
+
 - (BOOL)openChannel:(NSError *__autoreleasing *)error {
     if (self.channel != NULL) {
         NMSSHLogWarn(@"The channel will be closed before continue");
-        if (self.type == NMSSHChannelTypeShell) {
+        if ([self hasStream]) {
             [self closeShell];
         }
         else {
@@ -54,7 +298,8 @@
     libssh2_session_set_blocking(self.session.rawSession, 1);
 
     // Open up the channel
-    LIBSSH2_CHANNEL *channel = libssh2_channel_open_session(self.session.rawSession);
+    LIBSSH2_CHANNEL *channel = libssh2_channel_open_ex(self.session.rawSession, "session", sizeof("session") - 1,
+                                                       (unsigned int)self.windowSize, (unsigned int)self.packetSize, NULL, 0);
 
     if (channel == NULL){
         NMSSHLogError(@"Unable to open a session");
@@ -80,8 +325,8 @@
 
     int rc = 0;
 
-    // If requested, try to allocate a pty
-    if (self.requestPty) {
+    // If requested, try to allocate a pty, subsystems never get one
+    if (self.requestPty && !self.subsystemName) {
         rc = libssh2_channel_request_pty(self.channel, self.ptyTerminalName);
 
         if (rc != 0) {
@@ -118,12 +363,42 @@
             libssh2_channel_wait_closed(self.channel);
         }
 
+        if (self.type == NMSSHChannelTypeExec) {
+            [self setLastExitStatus:libssh2_channel_get_exit_status(self.channel)];
+            [self setLastExitSignal:[self exitSignalOfChannel:self.channel]];
+        }
+
         libssh2_channel_free(self.channel);
         [self setType:NMSSHChannelTypeClosed];
         [self setChannel:NULL];
     }
 }
 
+- (void)growReceiveWindowOfChannel:(LIBSSH2_CHANNEL *)channel target:(unsigned long *)target {
+    if (!self.automaticWindowGrowth) {
+        return;
+    }
+
+    unsigned long window = libssh2_channel_window_read_ex(channel, NULL, NULL);
+
+    // A nearly exhausted window means the server was waiting for credit,
+    // the link holds more than the window: double it
+    if (window < *target / 4 && *target < self.maximumWindowSize) {
+        *target = MIN(*target * 2, (unsigned long)self.maximumWindowSize);
+        NMSSHLogVerbose(@"Growing channel window to %lu bytes", *target);
+    }
+
+    // libssh2 only tops the window up to its initial size, larger targets are
+    // maintained here. The adjustment is sent in blocking mode: a retried
+    // adjustment could be accounted twice by libssh2, the message is tiny.
+    if (window < *target / 2) {
+        int blocking = libssh2_session_get_blocking(self.session.rawSession);
+        libssh2_session_set_blocking(self.session.rawSession, 1);
+        libssh2_channel_receive_window_adjust2(channel, *target - window, 0, NULL);
+        libssh2_session_set_blocking(self.session.rawSession, blocking);
+    }
+}
+
 - (BOOL)sendEOF {
     int rc;
 
@@ -176,22 +451,230 @@
 }
 
 - (NSString *)execute:(NSString *)command error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    __block NSError *executionError = nil;
+    NSString *response = [self.session performObjectBlockAndWait:^id{
+        NSError *blockError = nil;
+        NSString *blockResponse = [self executeCommand:command error:&blockError timeout:timeout];
+        executionError = blockError;
+
+        return blockResponse;
+    }];
+
+    if (error && executionError) {
+        *error = executionError;
+    }
+
+    return response;
+}
+
+- (NSString *)executeCommand:(NSString *)command error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    NMSSHUTF8Decoder *decoder = [[NMSSHUTF8Decoder alloc] init];
+    NSMutableString *output = [NSMutableString string];
+    NSMutableData *errorOutput = [NSMutableData data];
+    NSError *executionError = nil;
+
+    [self setLastResponse:nil];
+
+    // Decoded as it arrives, a character may span reads
+    BOOL completed = [self streamCommand:command standardOutput:^(NSData *data) {
+        [output appendString:[decoder decodeData:data]];
+    } standardError:^(NSData *data) {
+        [errorOutput appendData:data];
+    } error:&executionError timeout:timeout];
+
+    if (completed && self.lastExitStatus != 0) {
+        executionError = [self exitStatusErrorForCommand:command exitStatus:self.lastExitStatus standardError:errorOutput];
+    }
+
+    // A command that timed out still returns what it printed so far
+    if (completed || [executionError code] == NMSSHChannelExecutionTimeout) {
+        [output appendString:[decoder finish]];
+        [self setLastResponse:[output copy]];
+    }
+
+    if (error && executionError) {
+        *error = executionError;
+    }
+
+    return self.lastResponse;
+}
+
+- (NSError *)exitStatusErrorForCommand:(NSString *)command
+                            exitStatus:(int)exitStatus
+                         standardError:(NSData *)errorOutput {
+    NSString *desc = [[NSString alloc] initWithData:errorOutput encoding:NSUTF8StringEncoding];
+    if ([desc length] == 0) {
+        desc = @"An unspecified error occurred";
+    }
+
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:NMSSHChannelExecutionError
+                           userInfo:@{ @"command"                       : command,
+                                       NSLocalizedDescriptionKey        : desc,
+                                       NSLocalizedFailureReasonErrorKey : [NSString stringWithFormat:@"%i", exitStatus] }];
+}
+
+- (BOOL)execute:(NSString *)command
+ standardOutput:(void (^)(NSData *))standardOutput
+  standardError:(void (^)(NSData *))standardError
+          error:(NSError *__autoreleasing *)error
+        timeout:(NSNumber *)timeout {
+    __block NSError *executionError = nil;
+    BOOL completed = [self.session performBoolBlockAndWait:^BOOL{
+        NSError *blockError = nil;
+        BOOL blockCompleted = [self streamCommand:command standardOutput:standardOutput standardError:standardError error:&blockError timeout:timeout];
+        executionError = blockError;
+
+        return blockCompleted;
+    }];
+
+    if (error && executionError) {
+        *error = executionError;
+    }
+
+    return completed;
+}
+
+- (BOOL)execute:(NSString *)command
+  standardInput:(NSInputStream *)standardInput
+ standardOutput:(void (^)(NSData *))standardOutput
+  standardError:(void (^)(NSData *))standardError
+          error:(NSError *__autoreleasing *)error
+        timeout:(NSNumber *)timeout {
+    __block NSError *executionError = nil;
+    BOOL completed = [self.session performBoolBlockAndWait:^BOOL{
+        // A stream opened by the caller is left for the caller to close
+        BOOL opened = NO;
+        if ([standardInput streamStatus] == NSStreamStatusNotOpen) {
+            [standardInput open];
+            opened = YES;
+        }
+
+        int inputWakeup[2] = { -1, -1 };
+        dispatch_queue_t inputQueue = [self scheduleInputStream:standardInput wakeup:inputWakeup];
+
+        NSError *blockError = nil;
+        BOOL blockCompleted = [self streamCommand:command inputWakeup:inputWakeup[0] standardInput:^NSInteger(void *buffer, NSUInteger length) {
+            // Reading a stream with nothing available would block the session
+            // queue, output keeps being serviced until input arrives
+            NSStreamStatus status = [standardInput streamStatus];
+            if (status == NSStreamStatusAtEnd) {
+                return 0;
+            }
+
+            if (status != NSStreamStatusError && ![standardInput hasBytesAvailable]) {
+                return LIBSSH2_ERROR_EAGAIN;
+            }
+
+            NSInteger nread = [standardInput read:buffer maxLength:length];
+            if (nread < 0) {
+                NMSSHLogError(@"Failed reading standard input: %@", [standardInput streamError]);
+            }
+
+            return nread;
+        } standardOutput:standardOutput standardError:standardError error:&blockError timeout:timeout];
+        executionError = blockError;
+
+        [self unscheduleInputStream:standardInput queue:inputQueue wakeup:inputWakeup];
+        if (opened) {
+            [standardInput close];
+        }
+
+        return blockCompleted;
+    }];
+
+    if (error && executionError) {
+        *error = executionError;
+    }
+
+    return completed;
+}
+
+- (BOOL)streamCommand:(NSString *)command
+       standardOutput:(void (^)(NSData *))standardOutput
+        standardError:(void (^)(NSData *))standardError
+                error:(NSError *__autoreleasing *)error
+              timeout:(NSNumber *)timeout {
+    return [self streamCommand:command inputWakeup:-1 standardInput:nil standardOutput:standardOutput standardError:standardError error:error timeout:timeout];
+}
+
+static void NMSSHInputStreamCallback(CFReadStreamRef stream, CFStreamEventType type, void *info) {
+    char wakeup = 0;
+    write((int)(intptr_t)info, &wakeup, 1);
+}
+
+/// Wake up the command loop through a pipe when the stream has input, rather
+/// than polling it. Returns the queue of the stream callbacks, NULL when the
+/// stream can't be scheduled and `wakeup` is left closed.
+- (dispatch_queue_t)scheduleInputStream:(NSInputStream *)stream wakeup:(int *)wakeup {
+    if (pipe(wakeup) != 0) {
+        wakeup[0] = wakeup[1] = -1;
+        return NULL;
+    }
+
+    fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+
+    // Custom subclasses of NSInputStream may not support clients
+    CFStreamClientContext context = { 0, (void *)(intptr_t)wakeup[1], NULL, NULL, NULL };
+    CFOptionFlags events = kCFStreamEventHasBytesAvailable | kCFStreamEventEndEncountered | kCFStreamEventErrorOccurred;
+    if (!CFReadStreamSetClient((__bridge CFReadStreamRef)stream, events, NMSSHInputStreamCallback, &context)) {
+        close(wakeup[0]);
+        close(wakeup[1]);
+        wakeup[0] = wakeup[1] = -1;
+        return NULL;
+    }
+
+    dispatch_queue_t queue = dispatch_queue_create("NMSSH.standardInput", DISPATCH_QUEUE_SERIAL);
+    CFReadStreamSetDispatchQueue((__bridge CFReadStreamRef)stream, queue);
+
+    return queue;
+}
+
+- (void)unscheduleInputStream:(NSInputStream *)stream queue:(dispatch_queue_t)queue wakeup:(int *)wakeup {
+    if (!queue) {
+        return;
+    }
+
+    CFReadStreamSetDispatchQueue((__bridge CFReadStreamRef)stream, NULL);
+    CFReadStreamSetClient((__bridge CFReadStreamRef)stream, kCFStreamEventNone, NULL, NULL);
+
+    // A callback already queued still writes to the pipe
+    dispatch_sync(queue, ^{});
+    close(wakeup[0]);
+    close(wakeup[1]);
+
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(queue);
+#endif
+}
+
+/// `standardInput` fills a buffer like read(2): bytes read, 0 at the end, -1 on
+/// error, LIBSSH2_ERROR_EAGAIN when no input is available yet. `inputWakeup`,
+/// if not -1, becomes readable when it is worth asking again.
+- (BOOL)streamCommand:(NSString *)command
+          inputWakeup:(int)inputWakeup
+        standardInput:(NSInteger (^)(void *buffer, NSUInteger length))standardInput
+       standardOutput:(void (^)(NSData *))standardOutput
+        standardError:(void (^)(NSData *))standardError
+                error:(NSError *__autoreleasing *)error
+              timeout:(NSNumber *)timeout {
     NMSSHLogInfo(@"Exec command %@", command);
 
     // In case of error...
     NSMutableDictionary *userInfo = [NSMutableDictionary dictionaryWithObject:command forKey:@"command"];
 
+    [self setLastExitStatus:0];
+    [self setLastExitSignal:nil];
+
     if (![self openChannel:error]) {
-        return nil;
+        return NO;
     }
 
-    [self setLastResponse:nil];
-
-    int rc = 0;
     [self setType:NMSSHChannelTypeExec];
 
     // Try executing command
-    rc = libssh2_channel_exec(self.channel, [command UTF8String]);
+    int rc = libssh2_channel_exec(self.channel, [command UTF8String]);
 
     if (rc != 0) {
         if (error) {
@@ -205,87 +688,134 @@
 
         NMSSHLogError(@"Error executing command");
         [self closeChannel];
-        return nil;
+        return NO;
     }
 
     // Set non-blocking mode
     libssh2_session_set_blocking(self.session.rawSession, 0);
 
-    // Set the timeout for blocking session
-    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent() + [timeout doubleValue];
+    // The timeout can only shorten the deadline of the session
+    NMSSHDeadline *deadline = [self.session deadlineWithTimeout:timeout];
 
-    // Fetch response from output buffer
-    NSMutableString *response = [[NSMutableString alloc] init];
-    for (;;) {
-        ssize_t rc;
-        char buffer[self.bufferSize];
-        char errorBuffer[self.bufferSize];
+    // Chunks are handed over as they arrive, only one buffer is ever held
+    NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
+    unsigned long windowTarget = self.windowSize;
 
-        do {
-            rc = libssh2_channel_read(self.channel, buffer, (ssize_t)sizeof(buffer));
+    // Input is staged a buffer at a time, the next one is read once the server
+    // granted window for all of it
+    NMSSHBuffer *inputBuffer = standardInput ? [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize] : nil;
+    NSUInteger inputOffset = 0;
+    NSUInteger inputLength = 0;
+    BOOL inputEnded = NO;
+    BOOL inputClosed = (standardInput == nil);
 
-            if (rc > 0) {
-                [response appendFormat:@"%@", [[NSString alloc] initWithBytes:buffer length:rc encoding:NSUTF8StringEncoding]];
-            }
+    for (;;) {
+        BOOL wrote = NO;
+
+        // Nobody reads the input of a command that already finished
+        if (!inputClosed && libssh2_channel_eof(self.channel) == 1) {
+            inputClosed = YES;
+        }
 
-            // Store all errors that might occur
-            if (libssh2_channel_get_exit_status(self.channel)) {
+        if (!inputClosed && !inputEnded && inputOffset == inputLength) {
+            NSInteger nread = standardInput([inputBuffer mutableBytes], [inputBuffer length]);
+            if (nread < 0 && nread != LIBSSH2_ERROR_EAGAIN) {
                 if (error) {
-                    ssize_t erc = libssh2_channel_read_stderr(self.channel, errorBuffer, (ssize_t)sizeof(errorBuffer));
+                    [userInfo setObject:@"Failed reading standard input" forKey:NSLocalizedDescriptionKey];
+                    *error = [NSError errorWithDomain:@"NMSSH"
+                                                 code:NMSSHChannelWriteError
+                                             userInfo:userInfo];
+                }
 
-                    NSString *desc = [[NSString alloc] initWithBytes:errorBuffer length:erc encoding:NSUTF8StringEncoding];
-                    if (!desc) {
-                        desc = @"An unspecified error occurred";
-                    }
+                [self closeChannel];
+                return NO;
+            }
 
-                    [userInfo setObject:desc forKey:NSLocalizedDescriptionKey];
-                    [userInfo setObject:[NSString stringWithFormat:@"%zi", erc] forKey:NSLocalizedFailureReasonErrorKey];
+            if (nread != LIBSSH2_ERROR_EAGAIN) {
+                inputOffset = 0;
+                inputLength = nread;
+                inputEnded = (nread == 0);
+            }
+        }
 
-                    *error = [NSError errorWithDomain:@"NMSSH"
-                                                 code:NMSSHChannelExecutionError
-                                             userInfo:userInfo];
+        if (!inputClosed) {
+            ssize_t wrc = 0;
+            if (inputEnded) {
+                wrc = libssh2_channel_send_eof(self.channel);
+                inputClosed = (wrc == 0);
+            }
+            else if (inputOffset < inputLength) {
+                // Short writes and EAGAIN mean the remote window is exhausted
+                wrc = libssh2_channel_write(self.channel, (const char *)[inputBuffer bytes] + inputOffset, inputLength - inputOffset);
+                if (wrc > 0) {
+                    inputOffset += wrc;
                 }
             }
 
-            if (libssh2_channel_eof(self.channel) == 1 || rc == 0) {
-                while ((rc  = libssh2_channel_read(self.channel, buffer, (ssize_t)sizeof(buffer))) > 0) {
-                    [response appendFormat:@"%@", [[NSString alloc] initWithBytes:buffer length:rc encoding:NSUTF8StringEncoding] ];
+            if (wrc < 0 && wrc != LIBSSH2_ERROR_EAGAIN) {
+                if (error) {
+                    [userInfo setObject:[[self.session lastError] localizedDescription] forKey:NSLocalizedDescriptionKey];
+                    *error = [NSError errorWithDomain:@"NMSSH"
+                                                 code:NMSSHChannelWriteError
+                                             userInfo:userInfo];
                 }
 
-                [self setLastResponse:[response copy]];
+                NMSSHLogError(@"Error writing standard input");
                 [self closeChannel];
+                return NO;
+            }
+
+            wrote = (wrc > 0 || inputClosed);
+        }
 
-                return self.lastResponse;
+        ssize_t rc = libssh2_channel_read(self.channel, [buffer mutableBytes], [buffer length]);
+        if (rc > 0) {
+            [self growReceiveWindowOfChannel:self.channel target:&windowTarget];
+
+            if (standardOutput) {
+                standardOutput([NSData dataWithBytes:[buffer bytes] length:rc]);
             }
+        }
 
-            // Check if the connection timed out
-            if ([timeout longValue] > 0 && time < CFAbsoluteTimeGetCurrent()) {
-                if (error) {
-                    NSString *desc = @"Connection timed out";
+        ssize_t erc = libssh2_channel_read_stderr(self.channel, [buffer mutableBytes], [buffer length]);
+        if (erc > 0 && standardError) {
+            standardError([NSData dataWithBytes:[buffer bytes] length:erc]);
+        }
 
-                    [userInfo setObject:desc forKey:NSLocalizedDescriptionKey];
+        if ((rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) || (erc < 0 && erc != LIBSSH2_ERROR_EAGAIN)) {
+            break;
+        }
 
-                    *error = [NSError errorWithDomain:@"NMSSH"
-                                                 code:NMSSHChannelExecutionTimeout
-                                             userInfo:userInfo];
-                }
+        if (rc > 0 || erc > 0 || wrote) {
+            continue;
+        }
 
-                while ((rc  = libssh2_channel_read(self.channel, buffer, (ssize_t)sizeof(buffer))) > 0) {
-                    [response appendFormat:@"%@", [[NSString alloc] initWithBytes:buffer length:rc encoding:NSUTF8StringEncoding] ];
-                }
+        if (libssh2_channel_eof(self.channel) == 1) {
+            [self closeChannel];
+            return YES;
+        }
 
-                [self setLastResponse:[response copy]];
-                [self closeChannel];
+        // Check if the connection timed out
+        if (deadline.isExpired) {
+            if (error) {
+                [userInfo setObject:@"Connection timed out" forKey:NSLocalizedDescriptionKey];
 
-                return self.lastResponse;
+                *error = [NSError errorWithDomain:@"NMSSH"
+                                             code:NMSSHChannelExecutionTimeout
+                                         userInfo:userInfo];
             }
-        } while (rc > 0);
 
-        if (rc != LIBSSH2_ERROR_EAGAIN) {
-            break;
+            [self closeChannel];
+            return NO;
         }
 
-        waitsocket(CFSocketGetNative([self.session socket]), self.session.rawSession);
+        // Input arriving ends the wait as well as the socket does
+        if (inputWakeup >= 0 && !inputClosed) {
+            waitsocketorwakeup(CFSocketGetNative([self.session socket]), inputWakeup, self.session.rawSession);
+        }
+        else {
+            waitsocket(CFSocketGetNative([self.session socket]), self.session.rawSession);
+        }
     }
 
     // If we've got this far, it means fetching execution response failed
@@ -299,387 +829,2245 @@
     NMSSHLogError(@"Error fetching response from command");
     [self closeChannel];
 
-    return nil;
+    return NO;
 }
 
-// -----------------------------------------------------------------------------
-#pragma mark - REMOTE SHELL SESSION
-// -----------------------------------------------------------------------------
+- (NMSSHOperation *)execute:(NSString *)command completionHandler:(void (^)(NSString *, NSError *))completionHandler {
+    NMSSHUTF8Decoder *decoder = [[NMSSHUTF8Decoder alloc] init];
+    NSMutableString *output = [NSMutableString string];
+    NSMutableData *errorOutput = [NSMutableData data];
+
+    // Decoded as it arrives, a character may span reads
+    return [self execute:command standardOutput:^(NSData *data) {
+        [output appendString:[decoder decodeData:data]];
+    } standardError:^(NSData *data) {
+        [errorOutput appendData:data];
+    } completionHandler:^(int exitStatus, NSString *exitSignal, NSError *error) {
+        if (!completionHandler) {
+            return;
+        }
 
-- (BOOL)startShell:(NSError *__autoreleasing *)error  {
-    NMSSHLogInfo(@"Starting shell");
+        if (error) {
+            completionHandler(nil, error);
+            return;
+        }
 
-    if (![self openChannel:error]) {
-        return NO;
-    }
+        // Like the synchronous call, a failed command still returns what it printed
+        if (exitStatus != 0) {
+            error = [self exitStatusErrorForCommand:command exitStatus:exitStatus standardError:errorOutput];
+        }
 
-    // Set non-blocking mode
-    libssh2_session_set_blocking(self.session.rawSession, 0);
+        [output appendString:[decoder finish]];
+        completionHandler([output copy], error);
+    }];
+}
 
-    // Fetch response from output buffer
-#if !(OS_OBJECT_USE_OBJC)
-    if (self.source) {
-        dispatch_release(self.source);
-    }
-#endif
+- (NMSSHOperation *)execute:(NSString *)command
+             standardOutput:(void (^)(NSData *))standardOutput
+              standardError:(void (^)(NSData *))standardError
+          completionHandler:(void (^)(int, NSString *, NSError *))completionHandler {
+    return [self execute:command outputBytes:standardOutput ? ^(const void *bytes, NSUInteger length) {
+        standardOutput([NSData dataWithBytes:bytes length:length]);
+    } : nil errorBytes:standardError ? ^(const void *bytes, NSUInteger length) {
+        standardError([NSData dataWithBytes:bytes length:length]);
+    } : nil endOfOutput:nil completionHandler:completionHandler];
+}
 
-    [self setLastResponse:nil];
-    [self setSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, CFSocketGetNative([self.session socket]),
-                                           0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0))];
-    dispatch_source_set_event_handler(self.source, ^{
-        NMSSHLogVerbose(@"Data available on the socket!");
-        ssize_t rc, erc=0;
-        char buffer[self.bufferSize];
+- (NMSSHOperation *)execute:(NSString *)command
+                lineHandler:(void (^)(const char *, NSUInteger, BOOL))lineHandler
+          completionHandler:(void (^)(int, NSString *, NSError *))completionHandler {
+    NMSSHLineSplitter *outputSplitter = [[NMSSHLineSplitter alloc] init];
+    NMSSHLineSplitter *errorSplitter = [[NMSSHLineSplitter alloc] init];
+    NMSSHLineHandler outputLine = ^(const char *line, NSUInteger length) {
+        lineHandler(line, length, NO);
+    };
+    NMSSHLineHandler errorLine = ^(const char *line, NSUInteger length) {
+        lineHandler(line, length, YES);
+    };
 
-        while (self.channel != NULL) {
+    // Lines are sliced out of the read buffer, only lines spanning reads are copied
+    return [self execute:command outputBytes:^(const void *bytes, NSUInteger length) {
+        [outputSplitter splitBytes:bytes length:length handler:outputLine];
+    } errorBytes:^(const void *bytes, NSUInteger length) {
+        [errorSplitter splitBytes:bytes length:length handler:errorLine];
+    } endOfOutput:^{
+        [outputSplitter finishWithHandler:outputLine];
+        [errorSplitter finishWithHandler:errorLine];
+    } completionHandler:completionHandler];
+}
 
-            rc = libssh2_channel_read(self.channel, buffer, (ssize_t)sizeof(buffer));
-            erc = libssh2_channel_read_stderr(self.channel, buffer, (ssize_t)sizeof(buffer));
+/// The sinks get the read buffer itself, endOfOutput is called once both outputs ended
+- (NMSSHOperation *)execute:(NSString *)command
+                outputBytes:(void (^)(const void *bytes, NSUInteger length))outputBytes
+                 errorBytes:(void (^)(const void *bytes, NSUInteger length))errorBytes
+                endOfOutput:(void (^)(void))endOfOutput
+          completionHandler:(void (^)(int, NSString *, NSError *))completionHandler {
+    NMSSHLogInfo(@"Exec command %@", command);
 
-            if (!(rc >=0 || erc >= 0)) {
-                NMSSHLogVerbose(@"Return code of response %ld, error %ld", (long)rc, (long)erc);
+    // The operation uses its own channel, the shell of the receiver stays usable
+    __block LIBSSH2_CHANNEL *channel = NULL;
+    __block NSUInteger environmentIndex = 0;
+    __block BOOL closing = NO;
+    __block int exitStatus = 0;
+    __block NSString *exitSignal = nil;
+    NSArray *environmentKeys = [self.environmentVariables allKeys] ?: @[];
+    NSDictionary *environment = [self.environmentVariables copy];
+    NSDictionary *userInfo = @{ @"command" : command };
+    BOOL requestPty = self.requestPty;
+    const char *ptyTerminalName = self.ptyTerminalName;
+    NSUInteger bufferSize = self.bufferSize;
+    unsigned int windowSize = (unsigned int)self.windowSize;
+    unsigned int packetSize = (unsigned int)self.packetSize;
+    __block unsigned long windowTarget = windowSize;
+    NMSSHSession *session = self.session;
+
+    NMSSHOperationStep openStep = ^int(NMSSHOperation *operation) {
+        channel = libssh2_channel_open_ex(session.rawSession, "session", sizeof("session") - 1, windowSize, packetSize, NULL, 0);
+        if (channel) {
+            return kNMSSHStepDone;
+        }
 
-                if (rc == LIBSSH2_ERROR_SOCKET_RECV || erc == LIBSSH2_ERROR_SOCKET_RECV) {
-                    NMSSHLogVerbose(@"Error received, closing channel...");
-                    [self closeShell];
-                }
-                return;
-            }
-            else if (rc > 0) {
-                NSData *data = [[NSData alloc] initWithBytes:buffer length:rc];
-                NSString *response = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-                [self setLastResponse:[response copy]];
+        if (libssh2_session_last_errno(session.rawSession) == LIBSSH2_ERROR_EAGAIN) {
+            return LIBSSH2_ERROR_EAGAIN;
+        }
 
-                if (response && self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadData:)]) {
-                    [self.delegate channel:self didReadData:self.lastResponse];
-                }
+        NMSSHLogError(@"Unable to open a session");
+        [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                code:NMSSHChannelAllocationError
+                                            userInfo:@{ NSLocalizedDescriptionKey : @"Channel allocation error" }]];
+        return kNMSSHStepFailed;
+    };
 
-                if (self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadRawData:)]) {
-                    [self.delegate channel:self didReadRawData:data];
+    NMSSHOperationStep setenvStep = ^int(NMSSHOperation *operation) {
+        while (environmentIndex < [environmentKeys count]) {
+            NSString *key = environmentKeys[environmentIndex];
+            NSString *value = environment[key];
+
+            if ([key isKindOfClass:[NSString class]] && [value isKindOfClass:[NSString class]]) {
+                int rc = libssh2_channel_setenv(channel, [key UTF8String], [value UTF8String]);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
                 }
             }
-            else if (erc > 0) {
-                NSData *data = [[NSData alloc] initWithBytes:buffer length:erc];
-                NSString *response = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
 
-                if (response && self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadError:)]) {
-                    [self.delegate channel:self didReadError:response];
-                }
+            environmentIndex++;
+        }
 
-                if (self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadRawError:)]) {
-                    [self.delegate channel:self didReadRawError:data];
-                }
-            }
-            else if (libssh2_channel_eof(self.channel) == 1) {
-                NMSSHLogVerbose(@"Host EOF received, closing channel...");
-                [self closeShell];
-                return;
-            }
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperationStep ptyStep = ^int(NMSSHOperation *operation) {
+        if (!requestPty) {
+            return kNMSSHStepDone;
+        }
+
+        int rc = libssh2_channel_request_pty(channel, ptyTerminalName);
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            NMSSHLogError(@"Error requesting pseudo terminal");
+            NSString *description = [NSString stringWithFormat:@"Error requesting %s pty: %@", ptyTerminalName, [[session lastError] localizedDescription]];
+            [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                    code:NMSSHChannelRequestPtyError
+                                                userInfo:@{ NSLocalizedDescriptionKey : description }]];
         }
-    });
 
-    dispatch_source_set_cancel_handler(self.source, ^{
-        NMSSHLogVerbose(@"Shell source cancelled");
+        return rc;
+    };
 
-        if (self.delegate && [self.delegate respondsToSelector:@selector(channelShellDidClose:)]) {
-            [self.delegate channelShellDidClose:self];
+    NMSSHOperationStep execStep = ^int(NMSSHOperation *operation) {
+        int rc = libssh2_channel_exec(channel, [command UTF8String]);
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            NMSSHLogError(@"Error executing command");
+            NSMutableDictionary *info = [userInfo mutableCopy];
+            [info setObject:[[session lastError] localizedDescription] forKey:NSLocalizedDescriptionKey];
+            [info setObject:[NSString stringWithFormat:@"%i", rc] forKey:NSLocalizedFailureReasonErrorKey];
+            [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                    code:NMSSHChannelExecutionError
+                                                userInfo:info]];
         }
-    });
 
-    dispatch_resume(self.source);
+        return rc;
+    };
 
-    int rc = 0;
+    NMSSHOperationStep readStep = ^int(NMSSHOperation *operation) {
+        NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:bufferSize];
+        BOOL progress = NO;
+        ssize_t rc;
 
-    // Try opening the shell
-    while ((rc = libssh2_channel_shell(self.channel)) == LIBSSH2_ERROR_EAGAIN) {
-        waitsocket(CFSocketGetNative([self.session socket]), [self.session rawSession]);
-    }
+        // The sinks run on the session queue, a slow sink slows the command down
+        while ((rc = libssh2_channel_read(channel, [buffer mutableBytes], [buffer length])) > 0) {
+            if (outputBytes) {
+                outputBytes([buffer bytes], rc);
+            }
+            progress = YES;
+        }
 
-    if (rc != 0) {
-        NMSSHLogError(@"Shell request error");
-        if (error) {
-            *error = [NSError errorWithDomain:@"NMSSH"
-                                         code:NMSSHChannelRequestShellError
-                                     userInfo:@{ NSLocalizedDescriptionKey : [[self.session lastError] localizedDescription] }];
+        if (progress) {
+            [self growReceiveWindowOfChannel:channel target:&windowTarget];
         }
 
-        [self closeShell];
-        return NO;
-    }
+        ssize_t erc;
+        while ((erc = libssh2_channel_read_stderr(channel, [buffer mutableBytes], [buffer length])) > 0) {
+            if (errorBytes) {
+                errorBytes([buffer bytes], erc);
+            }
+            progress = YES;
+        }
 
-    NMSSHLogVerbose(@"Shell allocated");
-    [self setType:NMSSHChannelTypeShell];
+        if ((rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) || (erc < 0 && erc != LIBSSH2_ERROR_EAGAIN)) {
+            NMSSHLogError(@"Error fetching response from command");
+            NSMutableDictionary *info = [userInfo mutableCopy];
+            [info setObject:[[session lastError] localizedDescription] forKey:NSLocalizedDescriptionKey];
+            [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                    code:NMSSHChannelExecutionResponseError
+                                                userInfo:info]];
+            return kNMSSHStepFailed;
+        }
 
-    return YES;
-}
+        if (libssh2_channel_eof(channel) == 1) {
+            if (endOfOutput) {
+                endOfOutput();
+            }
+
+            return kNMSSHStepDone;
+        }
+
+        // Keep going while the server sends data, the socket is waited for otherwise
+        return progress ? kNMSSHStepContinue : LIBSSH2_ERROR_EAGAIN;
+    };
+
+    NMSSHOperationStep closeStep = ^int(NMSSHOperation *operation) {
+        if (!closing) {
+            int rc = libssh2_channel_close(channel);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return rc;
+            }
+
+            closing = YES;
+        }
+
+        int rc = libssh2_channel_wait_closed(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+
+        exitStatus = libssh2_channel_get_exit_status(channel);
+        exitSignal = [self exitSignalOfChannel:channel];
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperationStep cleanup = ^int(NMSSHOperation *operation) {
+        if (!channel) {
+            return kNMSSHStepDone;
+        }
+
+        int rc = libssh2_channel_free(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+
+        channel = NULL;
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[openStep, setenvStep, ptyStep, execStep, readStep, closeStep]
+                                                              cleanup:cleanup
+                                                           completion:^(NSError *error) {
+        if (completionHandler) {
+            completionHandler(exitStatus, exitSignal, error);
+        }
+    }];
+
+    [operation setPriority:self.priority];
+
+    return [session enqueueOperation:operation];
+}
+
+- (NMSSHOperation *)executeCommands:(NSArray<NSString *> *)commands
+                      resultHandler:(void (^)(NSUInteger, NMSSHCommandResult *, NSError *))resultHandler
+                  completionHandler:(void (^)(NSError *))completionHandler {
+    NMSSHLogInfo(@"Exec %lu commands", (unsigned long)[commands count]);
+
+    NSArray *copiedCommands = [commands copy];
+    NSMutableArray<NMSSHBatchCommand *> *active = [NSMutableArray array];
+    NSUInteger maximumActive = MAX(self.maximumConcurrentCommands, 1);
+    __block NSUInteger nextIndex = 0;
+    __block NMSSHBatchCommand *opening = nil;
+    __block NMSSHBatchCommand *interrupted = nil;
+    NMSSHSession *session = self.session;
+
+    // The settings are those of the channel when the batch is queued
+    NSDictionary *environment = [self.environmentVariables copy] ?: @{};
+    BOOL requestPty = self.requestPty;
+    const char *ptyTerminalName = self.ptyTerminalName;
+    NSUInteger bufferSize = self.bufferSize;
+    unsigned int windowSize = (unsigned int)self.windowSize;
+    unsigned int packetSize = (unsigned int)self.packetSize;
+
+
+    // Every request of a command waits for the reply of the server, the
+    // requests of all the commands are sent before any reply is awaited.
+    // libssh2 keeps the state of a request in its channel, except for the
+    // channel opening which is kept in the session: one command at a time
+    // opens its channel, while the other ones go on.
+    NMSSHOperationStep batchStep = ^int(NMSSHOperation *operation) {
+        NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:bufferSize];
+        BOOL progress = NO;
+        NSUInteger idlePasses = 0;
+
+        // A call waiting for its reply reads the packets of the other
+        // commands too, one more pass lets the earlier commands find theirs
+        while (idlePasses < 2) {
+            BOOL advanced = NO;
+
+            if (!opening && [active count] < maximumActive && nextIndex < [copiedCommands count]) {
+                opening = [[NMSSHBatchCommand alloc] init];
+                [opening setIndex:nextIndex++];
+                [opening setWindowTarget:windowSize];
+                [opening setStandardOutput:[NSMutableData data]];
+                [opening setStandardError:[NSMutableData data]];
+                [active addObject:opening];
+            }
+
+            // A request whose packet was only partly sent is completed before
+            // any other packet goes out
+            NSArray *commandsToAdvance = interrupted ? @[interrupted] : [active copy];
+            if (interrupted) {
+                advanced = YES;
+            }
+
+            for (NMSSHBatchCommand *command in commandsToAdvance) {
+                NMSSHBatchCommandState state = [command state];
+                BOOL read = NO;
+                int rc = [self advanceBatchCommand:command
+                                           command:copiedCommands[command.index]
+                                       environment:environment
+                                        requestPty:requestPty
+                                   ptyTerminalName:ptyTerminalName
+                                        windowSize:windowSize
+                                        packetSize:packetSize
+                                            buffer:buffer
+                                              read:&read];
+
+                advanced = advanced || read || [command state] != state;
+                progress = progress || read || [command state] != state;
+
+                if (command == opening && [command state] != NMSSHBatchCommandOpening) {
+                    opening = nil;
+                }
+
+                if (rc == LIBSSH2_ERROR_EAGAIN &&
+                    (libssh2_session_block_directions(session.rawSession) & LIBSSH2_SESSION_BLOCK_OUTBOUND)) {
+                    interrupted = command;
+                    return LIBSSH2_ERROR_EAGAIN;
+                }
+
+                interrupted = nil;
+
+                if ([command state] == NMSSHBatchCommandFinished) {
+                    [active removeObject:command];
+
+                    if (resultHandler) {
+                        dispatch_async(operation.callbackQueue ?: dispatch_get_main_queue(), ^{
+                            resultHandler(command.index, command.error ? nil : command.result, command.error);
+                        });
+                    }
+                }
+            }
+
+            idlePasses = advanced ? 0 : idlePasses + 1;
+        }
+
+        if ([active count] == 0 && nextIndex == [copiedCommands count]) {
+            return kNMSSHStepDone;
+        }
+
+        // Without an opening in progress, the requests waiting for a reply
+        // are kept by their channels and the other users may come in
+        return progress && !opening ? kNMSSHStepContinue : LIBSSH2_ERROR_EAGAIN;
+    };
+
+    NMSSHOperationStep cleanup = ^int(NMSSHOperation *operation) {
+        for (NMSSHBatchCommand *command in [active copy]) {
+            if (command.channel) {
+                int rc = libssh2_channel_free(command.channel);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
+                }
+
+                [command setChannel:NULL];
+            }
+
+            [active removeObject:command];
+        }
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[batchStep]
+                                                              cleanup:cleanup
+                                                           completion:completionHandler];
+    [operation setPriority:self.priority];
+
+    return [session enqueueOperation:operation];
+}
+
+/// Run the command as far as it goes without waiting, returns LIBSSH2_ERROR_EAGAIN or kNMSSHStepDone once finished
+- (int)advanceBatchCommand:(NMSSHBatchCommand *)command
+                   command:(NSString *)commandLine
+               environment:(NSDictionary *)environment
+                requestPty:(BOOL)requestPty
+           ptyTerminalName:(const char *)ptyTerminalName
+                windowSize:(unsigned int)windowSize
+                packetSize:(unsigned int)packetSize
+                    buffer:(NMSSHBuffer *)buffer
+                      read:(BOOL *)read {
+    LIBSSH2_SESSION *session = self.session.rawSession;
+    int rc = 0;
+
+    while (YES) {
+        switch (command.state) {
+            case NMSSHBatchCommandOpening: {
+                LIBSSH2_CHANNEL *channel = libssh2_channel_open_ex(session, "session", sizeof("session") - 1, windowSize, packetSize, NULL, 0);
+                if (!channel) {
+                    if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
+                        return LIBSSH2_ERROR_EAGAIN;
+                    }
+
+                    NMSSHLogError(@"Unable to open a session");
+                    [command setError:[NSError errorWithDomain:@"NMSSH"
+                                                          code:NMSSHChannelAllocationError
+                                                      userInfo:@{ NSLocalizedDescriptionKey : @"Channel allocation error",
+                                                                  @"command"                : commandLine }]];
+                    [command setState:NMSSHBatchCommandFinished];
+                    break;
+                }
+
+                [command setChannel:channel];
+                [command setState:NMSSHBatchCommandSettingEnvironment];
+                break;
+            }
+
+            case NMSSHBatchCommandSettingEnvironment: {
+                NSArray *keys = [environment allKeys];
+                while (command.environmentIndex < [keys count]) {
+                    NSString *key = keys[command.environmentIndex];
+                    NSString *value = environment[key];
+
+                    if ([key isKindOfClass:[NSString class]] && [value isKindOfClass:[NSString class]]) {
+                        rc = libssh2_channel_setenv(command.channel, [key UTF8String], [value UTF8String]);
+                        if (rc == LIBSSH2_ERROR_EAGAIN) {
+                            return rc;
+                        }
+                    }
+
+                    [command setEnvironmentIndex:command.environmentIndex + 1];
+                }
+
+                [command setState:requestPty ? NMSSHBatchCommandRequestingPty : NMSSHBatchCommandStarting];
+                break;
+            }
+
+            case NMSSHBatchCommandRequestingPty:
+                rc = libssh2_channel_request_pty(command.channel, ptyTerminalName);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
+                }
+
+                if (rc < 0) {
+                    NMSSHLogError(@"Error requesting pseudo terminal");
+                    NSString *description = [NSString stringWithFormat:@"Error requesting %s pty: %@", ptyTerminalName, [[self.session lastError] localizedDescription]];
+                    [command setError:[NSError errorWithDomain:@"NMSSH"
+                                                          code:NMSSHChannelRequestPtyError
+                                                      userInfo:@{ NSLocalizedDescriptionKey : description,
+                                                                  @"command"                : commandLine }]];
+                    [command setState:NMSSHBatchCommandFreeing];
+                    break;
+                }
+
+                [command setState:NMSSHBatchCommandStarting];
+                break;
+
+            case NMSSHBatchCommandStarting:
+                rc = libssh2_channel_exec(command.channel, [commandLine UTF8String]);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
+                }
+
+                if (rc < 0) {
+                    NMSSHLogError(@"Error executing command");
+                    [command setError:[NSError errorWithDomain:@"NMSSH"
+                                                          code:NMSSHChannelExecutionError
+                                                      userInfo:@{ NSLocalizedDescriptionKey        : [[self.session lastError] localizedDescription],
+                                                                  NSLocalizedFailureReasonErrorKey : [NSString stringWithFormat:@"%i", rc],
+                                                                  @"command"                       : commandLine }]];
+                    [command setState:NMSSHBatchCommandFreeing];
+                    break;
+                }
+
+                [command setState:NMSSHBatchCommandReading];
+                break;
+
+            case NMSSHBatchCommandReading: {
+                ssize_t orc, erc;
+                while ((orc = libssh2_channel_read(command.channel, [buffer mutableBytes], [buffer length])) > 0) {
+                    [command.standardOutput appendBytes:[buffer bytes] length:orc];
+                    *read = YES;
+                }
+
+                while ((erc = libssh2_channel_read_stderr(command.channel, [buffer mutableBytes], [buffer length])) > 0) {
+                    [command.standardError appendBytes:[buffer bytes] length:erc];
+                    *read = YES;
+                }
+
+                if (*read) {
+                    unsigned long windowTarget = command.windowTarget;
+                    [self growReceiveWindowOfChannel:command.channel target:&windowTarget];
+                    [command setWindowTarget:windowTarget];
+                }
+
+                if ((orc < 0 && orc != LIBSSH2_ERROR_EAGAIN) || (erc < 0 && erc != LIBSSH2_ERROR_EAGAIN)) {
+                    NMSSHLogError(@"Error fetching response from command");
+                    [command setError:[NSError errorWithDomain:@"NMSSH"
+                                                          code:NMSSHChannelExecutionResponseError
+                                                      userInfo:@{ NSLocalizedDescriptionKey : [[self.session lastError] localizedDescription],
+                                                                  @"command"                : commandLine }]];
+                    [command setState:NMSSHBatchCommandFreeing];
+                    break;
+                }
+
+                if (libssh2_channel_eof(command.channel) != 1) {
+                    return LIBSSH2_ERROR_EAGAIN;
+                }
+
+                [command setState:NMSSHBatchCommandClosing];
+                break;
+            }
+
+            case NMSSHBatchCommandClosing:
+                if (!command.closing) {
+                    rc = libssh2_channel_close(command.channel);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) {
+                        return rc;
+                    }
+
+                    [command setClosing:YES];
+                }
+
+                rc = libssh2_channel_wait_closed(command.channel);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
+                }
+
+                [command setResult:[[NMSSHCommandResult alloc] init]];
+                [command.result setCommand:commandLine];
+                [command.result setStandardOutput:[command.standardOutput copy]];
+                [command.result setStandardError:[command.standardError copy]];
+                [command.result setExitStatus:libssh2_channel_get_exit_status(command.channel)];
+                [command setState:NMSSHBatchCommandFreeing];
+                break;
+
+            case NMSSHBatchCommandFreeing:
+                rc = libssh2_channel_free(command.channel);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return rc;
+                }
+
+                [command setChannel:NULL];
+                [command setState:NMSSHBatchCommandFinished];
+                break;
+
+            case NMSSHBatchCommandFinished:
+                return kNMSSHStepDone;
+        }
+    }
+}
+
+- (NSString *)exitSignalOfChannel:(LIBSSH2_CHANNEL *)channel {
+    char *signal = NULL;
+    size_t signalLength = 0;
+
+    // The signal name is allocated by libssh2, e.g. "KILL" for a killed command
+    if (libssh2_channel_get_exit_signal(channel, &signal, &signalLength, NULL, NULL, NULL, NULL) != 0 || !signal) {
+        return nil;
+    }
+
+    NSString *name = [[NSString alloc] initWithBytes:signal length:signalLength encoding:NSUTF8StringEncoding];
+    libssh2_free(self.session.rawSession, signal);
+
+    return name;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - REMOTE SHELL SESSION
+// -----------------------------------------------------------------------------
+
+- (BOOL)startShell:(NSError *__autoreleasing *)error  {
+    __block NSError *shellError = nil;
+    BOOL success = [self.session performBoolBlockAndWait:^BOOL{
+        NSError *blockError = nil;
+        [self setSubsystemName:nil];
+        BOOL started = [self openShell:&blockError];
+        shellError = blockError;
+
+        return started;
+    }];
+
+    if (error && shellError) {
+        *error = shellError;
+    }
+
+    return success;
+}
+
+- (BOOL)startSubsystem:(NSString *)name error:(NSError *__autoreleasing *)error {
+    __block NSError *subsystemError = nil;
+    BOOL success = [self.session performBoolBlockAndWait:^BOOL{
+        NSError *blockError = nil;
+        [self setSubsystemName:name];
+        BOOL started = [self openShell:&blockError];
+        subsystemError = blockError;
+
+        return started;
+    }];
+
+    if (error && subsystemError) {
+        *error = subsystemError;
+    }
+
+    return success;
+}
+
+/// Shells and subsystems stream their output through readShell
+- (BOOL)hasStream {
+    return self.type == NMSSHChannelTypeShell || self.type == NMSSHChannelTypeSubsystem;
+}
+
+- (BOOL)openShell:(NSError *__autoreleasing *)error {
+    if (self.subsystemName) {
+        NMSSHLogInfo(@"Starting subsystem %@", self.subsystemName);
+    }
+    else {
+        NMSSHLogInfo(@"Starting shell");
+    }
+
+    if (![self openChannel:error]) {
+        return NO;
+    }
+
+    // Set non-blocking mode
+    libssh2_session_set_blocking(self.session.rawSession, 0);
+
+    [self setLastResponse:nil];
+    [self setOutputDecoder:[[NMSSHUTF8Decoder alloc] init]];
+    [self setErrorDecoder:[[NMSSHUTF8Decoder alloc] init]];
+
+    [self setPendingOutput:[NSMutableData data]];
+    [self setPendingError:[NSMutableData data]];
+    [self setDeliveringBytes:0];
+    [self setReadSuspended:NO];
+    [self setFramingFailed:NO];
+    [self.expectBacklog setLength:0];
+    [self.messageFramer reset];
+
+    // Fetch response from output buffer, the session reads every stream
+    // from a single source on its socket
+    [self setPumped:YES];
+    [self.session addPumpedChannel:self];
+
+    int rc = 0;
+
+    // Try opening the shell, or the subsystem
+    const char *subsystem = [self.subsystemName UTF8String];
+    const char *shellCommand = [self.shellCommand UTF8String];
+    while ((rc = subsystem ? libssh2_channel_subsystem(self.channel, subsystem) :
+                 shellCommand ? libssh2_channel_exec(self.channel, shellCommand) :
+                 libssh2_channel_shell(self.channel)) == LIBSSH2_ERROR_EAGAIN) {
+        waitsocket(CFSocketGetNative([self.session socket]), [self.session rawSession]);
+    }
+
+    if (rc != 0) {
+        NMSSHLogError(@"Shell request error");
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelRequestShellError
+                                     userInfo:@{ NSLocalizedDescriptionKey : [[self.session lastError] localizedDescription] }];
+        }
+
+        [self closeShell];
+        return NO;
+    }
+
+    NMSSHLogVerbose(@"Shell allocated");
+    [self setType:self.subsystemName ? NMSSHChannelTypeSubsystem : NMSSHChannelTypeShell];
+
+    return YES;
+}
+
+- (BOOL)canPumpReads {
+    return self.channel != NULL && [self hasStream] && !self.readSuspended;
+}
+
+- (BOOL)hasBufferedInput {
+    return libssh2_poll_channel_read(self.channel, 0) ||
+           libssh2_poll_channel_read(self.channel, 1) ||
+           libssh2_channel_eof(self.channel) == 1;
+}
+
+- (void)readShell {
+    NMSSHLogVerbose(@"Data available on the socket!");
+    if (self.channel == NULL || self.readSuspended) {
+        return;
+    }
+
+    // The session may have been used by a blocking operation meanwhile
+    libssh2_session_set_blocking(self.session.rawSession, 0);
+
+    ssize_t rc, erc=0;
+    NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:self.bufferSize];
+
+    while (self.channel != NULL && !self.readSuspended) {
+        rc = libssh2_channel_read(self.channel, [buffer mutableBytes], [buffer length]);
+        if (rc > 0) {
+            [self receiveShellBytes:[buffer bytes] length:rc standardError:NO];
+        }
+
+        erc = libssh2_channel_read_stderr(self.channel, [buffer mutableBytes], [buffer length]);
+        if (erc > 0) {
+            [self receiveShellBytes:[buffer bytes] length:erc standardError:YES];
+        }
+
+        if (!(rc >=0 || erc >= 0)) {
+            NMSSHLogVerbose(@"Return code of response %ld, error %ld", (long)rc, (long)erc);
+
+            if (rc == LIBSSH2_ERROR_SOCKET_RECV || erc == LIBSSH2_ERROR_SOCKET_RECV) {
+                NMSSHLogVerbose(@"Error received, closing channel...");
+                [self closeShell];
+                return;
+            }
+            break;
+        }
+        else if (rc == 0 && erc <= 0 && libssh2_channel_eof(self.channel) == 1) {
+            NMSSHLogVerbose(@"Host EOF received, closing channel...");
+            [self closeShell];
+            return;
+        }
+    }
+
+    [self scheduleShellFlush];
+}
+
+- (void)receiveShellBytes:(const void *)bytes length:(NSUInteger)length standardError:(BOOL)standardError {
+    [self.scrollbackBuffer appendBytes:bytes length:length];
+    [self.recorder recordOutput:bytes length:length];
+
+    if (!standardError) {
+        [self receiveExpectBytes:bytes length:length];
+    }
+
+    if (!standardError && self.messageFramer) {
+        [self receiveMessageBytes:bytes length:length];
+        return;
+    }
+
+    [(standardError ? self.pendingError : self.pendingOutput) appendBytes:bytes length:length];
+
+    // Immediate reads go through the same path, one read per delivery
+    if (self.deliveryMode != NMSSHChannelDeliveryCoalesced ||
+        [self.pendingOutput length] + [self.pendingError length] >= self.coalescingSize) {
+        [self flushShellOutput];
+    }
+}
+
+- (dispatch_queue_t)shellDeliveryQueue {
+    if (self.deliveryQueue) {
+        return self.deliveryQueue;
+    }
+
+    return self.deliveryMode == NMSSHChannelDeliveryCoalesced ? self.session.callbackQueue : self.immediateQueue;
+}
+
+/// Decode on the session queue, where the reads are in order
+- (NSString *)decodeShellData:(NSData *)data standardError:(BOOL)standardError {
+    return [(standardError ? self.errorDecoder : self.outputDecoder) decodeData:data];
+}
+
+- (void)deliverShellData:(NSData *)data text:(NSString *)response standardError:(BOOL)standardError {
+    // An empty text is the start of a character completed by the next read
+    if (!standardError) {
+        if ([response length] && self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadData:)]) {
+            [self.delegate channel:self didReadData:response];
+        }
+
+        if (self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadRawData:)]) {
+            [self.delegate channel:self didReadRawData:data];
+        }
+    }
+    else {
+        if ([response length] && self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadError:)]) {
+            [self.delegate channel:self didReadError:response];
+        }
+
+        if (self.delegate && [self.delegate respondsToSelector:@selector(channel:didReadRawError:)]) {
+            [self.delegate channel:self didReadRawError:data];
+        }
+    }
+}
+
+- (void)scheduleShellFlush {
+    if (self.flushScheduled || [self.pendingOutput length] + [self.pendingError length] == 0) {
+        return;
+    }
+
+    if (self.coalescingInterval <= 0) {
+        [self flushShellOutput];
+        return;
+    }
+
+    [self setFlushScheduled:YES];
+
+    __weak NMSSHChannel *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.coalescingInterval * NSEC_PER_SEC)), self.session.queue, ^{
+        [weakSelf setFlushScheduled:NO];
+        [weakSelf flushShellOutput];
+    });
+}
+
+- (void)flushShellOutput {
+    NSData *output = self.pendingOutput;
+    NSData *errorOutput = self.pendingError;
+    NSUInteger length = [output length] + [errorOutput length];
+    if (length == 0) {
+        return;
+    }
+
+    [self setPendingOutput:[NSMutableData data]];
+    [self setPendingError:[NSMutableData data]];
+    [self setDeliveringBytes:self.deliveringBytes + length];
+
+    NSString *text = [output length] ? [self decodeShellData:output standardError:NO] : nil;
+    NSString *errorText = [errorOutput length] ? [self decodeShellData:errorOutput standardError:YES] : nil;
+
+    // Set on the session queue, where the synchronous readers look for it
+    if ([output length]) {
+        [self setLastResponse:text];
+    }
+
+    dispatch_queue_t sessionQueue = self.session.queue;
+    dispatch_async([self shellDeliveryQueue], ^{
+        if ([output length]) {
+            [self deliverShellData:output text:text standardError:NO];
+        }
+
+        if ([errorOutput length]) {
+            [self deliverShellData:errorOutput text:errorText standardError:YES];
+        }
+
+        dispatch_async(sessionQueue, ^{
+            [self setDeliveringBytes:self.deliveringBytes - length];
+            [self resumeShellReads];
+        });
+    });
+
+    [self suspendShellReadsIfNeeded];
+}
+
+- (void)suspendShellReadsIfNeeded {
+    // The consumer fell behind, leave the data on the server until it catches up
+    if (self.deliveringBytes > self.maximumPendingBytes && self.pumped && !self.readSuspended) {
+        NMSSHLogVerbose(@"Shell delivery backlog of %lu bytes, suspending reads", (unsigned long)self.deliveringBytes);
+        [self setReadSuspended:YES];
+    }
+}
+
+- (void)receiveMessageBytes:(const void *)bytes length:(NSUInteger)length {
+    if (self.framingFailed) {
+        return;
+    }
+
+    NSData *data = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+    NSArray *messages = [self.messageFramer messagesFromData:data error:nil];
+
+    // Nothing after a framing error can be trusted, the reads in progress
+    // still need the channel
+    if (!messages) {
+        LIBSSH2_CHANNEL *failedChannel = self.channel;
+        [self setFramingFailed:YES];
+        dispatch_async(self.session.queue, ^{
+            if (self.channel == failedChannel) {
+                [self closeShell];
+            }
+        });
+        return;
+    }
+
+    if ([messages count] == 0 || ![self.delegate respondsToSelector:@selector(channel:didReadMessage:)]) {
+        return;
+    }
+
+    NSUInteger delivering = [[messages valueForKeyPath:@"@sum.length"] unsignedIntegerValue];
+    [self setDeliveringBytes:self.deliveringBytes + delivering];
+
+    dispatch_queue_t sessionQueue = self.session.queue;
+    dispatch_async([self shellDeliveryQueue], ^{
+        for (NSData *message in messages) {
+            [self.delegate channel:self didReadMessage:message];
+        }
+
+        dispatch_async(sessionQueue, ^{
+            [self setDeliveringBytes:self.deliveringBytes - delivering];
+            [self resumeShellReads];
+        });
+    });
+
+    [self suspendShellReadsIfNeeded];
+}
+
+- (void)resumeShellReads {
+    if (!self.readSuspended || self.deliveringBytes > self.maximumPendingBytes / 2) {
+        return;
+    }
+
+    [self setReadSuspended:NO];
+
+    // Data already buffered by libssh2 does not make the socket readable again
+    [self.session schedulePump];
+}
+
+- (void)closeShell {
+    [self.session performBlockAndWait:^{
+        [self flushShellOutput];
+
+        if (self.expectMatcher) {
+            [self finishExpectationWithMatch:nil error:[NSError errorWithDomain:@"NMSSH"
+                                                                           code:NMSSHChannelReadError
+                                                                       userInfo:@{ NSLocalizedDescriptionKey : @"The shell was closed" }]];
+        }
+
+        if (self.pumped) {
+            [self setPumped:NO];
+            [self setReadSuspended:NO];
+            [self.session removePumpedChannel:self];
+            [self notifyShellClosed];
+        }
+
+        if ([self hasStream]) {
+            // Set blocking mode
+            libssh2_session_set_blocking(self.session.rawSession, 1);
+
+            [self sendEOF];
+        }
+
+        [self closeChannel];
+        [self.recorder close];
+    }];
+}
+
+- (void)notifyShellClosed {
+    NMSSHLogVerbose(@"Shell reads stopped");
+
+    if (!self.delegate || ![self.delegate respondsToSelector:@selector(channelShellDidClose:)]) {
+        return;
+    }
+
+    // Output is still on its way, the close comes after it
+    dispatch_async([self shellDeliveryQueue], ^{
+        [self.delegate channelShellDidClose:self];
+    });
+}
+
+- (BOOL)write:(NSString *)command error:(NSError *__autoreleasing *)error {
+    return [self write:command error:error timeout:@0];
+}
+
+- (BOOL)write:(NSString *)command error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    return [self writeData:[command dataUsingEncoding:NSUTF8StringEncoding] error:error timeout:timeout];
+}
+
+- (BOOL)writeData:(NSData *)data error:(NSError *__autoreleasing *)error {
+    return [self writeData:data error:error timeout:@0];
+}
+
+- (BOOL)writeData:(NSData *)data error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    __block NSError *writeError = nil;
+    BOOL success = [self.session performBoolBlockAndWait:^BOOL{
+        NSError *blockError = nil;
+        BOOL written = [self writeShellData:data error:&blockError timeout:timeout];
+        writeError = blockError;
+
+        return written;
+    }];
+
+    if (error && writeError) {
+        *error = writeError;
+    }
+
+    return success;
+}
+
+- (BOOL)writeShellData:(NSData *)data error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    if (![self hasStream]) {
+        NMSSHLogError(@"Shell required");
+        return NO;
+    }
+
+    // Set non-blocking mode
+    libssh2_session_set_blocking(self.session.rawSession, 0);
+
+    ssize_t rc;
+
+    // The timeout can only shorten the deadline of the session
+    NMSSHDeadline *deadline = [self.session deadlineWithTimeout:timeout];
+
+    // Try writing on shell
+    while ((rc = libssh2_channel_write(self.channel, [data bytes], [data length])) == LIBSSH2_ERROR_EAGAIN) {
+        // Check if the connection timed out
+        if (deadline.isExpired) {
+            if (error) {
+                NSString *description = @"Connection timed out";
+
+                *error = [NSError errorWithDomain:@"NMSSH"
+                                             code:NMSSHChannelExecutionTimeout
+                                         userInfo:@{ NSLocalizedDescriptionKey : description }];
+            }
+
+            return NO;
+        }
+
+        waitsocket(CFSocketGetNative([self.session socket]), self.session.rawSession);
+    }
+
+    if (rc > 0) {
+        [self.recorder recordInput:[data bytes] length:rc];
+    }
+
+    if (rc < 0) {
+        NMSSHLogError(@"Error writing on the shell");
+        if (error) {
+            NSString *command = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelWriteError
+                                     userInfo:@{ NSLocalizedDescriptionKey : [[self.session lastError] localizedDescription],
+                                                 @"command"                : command }];
+        }
+    }
+
+    return YES;
+}
+
+- (BOOL)requestSizeWidth:(NSUInteger)width height:(NSUInteger)height {
+    return [self.session performBoolBlockAndWait:^BOOL{
+        int rc = libssh2_channel_request_pty_size(self.channel, (int)width, (int)height);
+        if (rc) {
+            NMSSHLogError(@"Request size failed with error %i", rc);
+        }
+        else {
+            [self.recorder recordResizeWidth:width height:height];
+        }
+
+        return rc == 0;
+    }];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - ASYNCHRONOUS SHELL INPUT
+// -----------------------------------------------------------------------------
+
+- (void)writeData:(NSData *)data completionHandler:(void (^)(NSError *))completionHandler {
+    NSData *copiedData = [data copy];
+    void (^handler)(NSError *) = [completionHandler copy];
+
+    dispatch_async(self.session.queue, ^{
+        [self.pendingInput appendData:copiedData];
+        if (handler) {
+            [self.pendingInputHandlers addObject:handler];
+        }
+
+        // A full buffer is worth a packet on its own
+        if ([self.pendingInput length] >= self.bufferSize || self.writeCoalescingInterval <= 0) {
+            [self flushShellInput];
+            return;
+        }
+
+        if (self.writeScheduled) {
+            return;
+        }
+
+        [self setWriteScheduled:YES];
+
+        __weak NMSSHChannel *weakSelf = self;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.writeCoalescingInterval * NSEC_PER_SEC)), self.session.queue, ^{
+            [weakSelf setWriteScheduled:NO];
+            [weakSelf flushShellInput];
+        });
+    });
+}
+
+- (void)writeMessage:(NSData *)message completionHandler:(void (^)(NSError *))completionHandler {
+    NSData *frame = self.messageFramer ? [self.messageFramer frameMessage:message] : message;
+    [self writeData:frame completionHandler:completionHandler];
+}
+
+- (void)flushShellInput {
+    // Input queued while a batch is being sent joins the next batch
+    if (self.writeInFlight || [self.pendingInput length] == 0) {
+        return;
+    }
+
+    NSData *batch = self.pendingInput;
+    NSArray *handlers = self.pendingInputHandlers;
+    [self setPendingInput:[NSMutableData data]];
+    [self setPendingInputHandlers:[NSMutableArray array]];
+    [self setWriteInFlight:YES];
+
+    __block NSUInteger offset = 0;
+    NMSSHOperationStep writeStep = ^int(NMSSHOperation *operation) {
+        if (self.channel == NULL || ![self hasStream]) {
+            [operation setError:[NSError errorWithDomain:@"NMSSH"
+                                                    code:NMSSHChannelWriteError
+                                                userInfo:@{ NSLocalizedDescriptionKey : @"The shell is not running" }]];
+            return kNMSSHStepFailed;
+        }
+
+        // libssh2 accepts no more than the channel window, the rest waits for the server
+        while (offset < [batch length]) {
+            ssize_t rc = libssh2_channel_write(self.channel, (const char *)[batch bytes] + offset, [batch length] - offset);
+            if (rc < 0) {
+                return (int)rc;
+            }
+
+            [self.recorder recordInput:(const char *)[batch bytes] + offset length:rc];
+            offset += rc;
+        }
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[writeStep]
+                                                              cleanup:nil
+                                                           completion:^(NSError *error) {
+        for (void (^handler)(NSError *) in handlers) {
+            handler(error);
+        }
+
+        dispatch_async(self.session.queue, ^{
+            [self setWriteInFlight:NO];
+            [self flushShellInput];
+        });
+    }];
+
+    [operation setPriority:self.priority];
+    [self.session enqueueOperation:operation];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - EXPECT
+// -----------------------------------------------------------------------------
+
+- (NMSSHExpectMatch *)expect:(NSArray *)patterns error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    // The output is read on the session queue, waiting there would never end
+    if ([self.session isOnQueue]) {
+        NMSSHLogError(@"Expectations can't be awaited on the session queue");
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelReadError
+                                     userInfo:@{ NSLocalizedDescriptionKey : @"Expectations can't be awaited on the session queue" }];
+        }
+
+        return nil;
+    }
+
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    __block NMSSHExpectMatch *result = nil;
+    __block NSError *expectError = nil;
+
+    // The handler runs on the session queue, the callback queue may be the calling one
+    [self expect:patterns timeout:timeout queue:NULL completionHandler:^(NMSSHExpectMatch *match, NSError *blockError) {
+        result = match;
+        expectError = blockError;
+        dispatch_semaphore_signal(done);
+    }];
+
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(done);
+#endif
+
+    if (error && expectError) {
+        *error = expectError;
+    }
+
+    return result;
+}
+
+- (void)expect:(NSArray *)patterns timeout:(NSNumber *)timeout completionHandler:(void (^)(NMSSHExpectMatch *, NSError *))completionHandler {
+    [self expect:patterns timeout:timeout queue:self.session.callbackQueue completionHandler:completionHandler];
+}
+
+- (void)expect:(NSArray *)patterns
+       timeout:(NSNumber *)timeout
+         queue:(dispatch_queue_t)queue
+completionHandler:(void (^)(NMSSHExpectMatch *, NSError *))completionHandler {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:patterns];
+    void (^handler)(NMSSHExpectMatch *, NSError *) = ^(NMSSHExpectMatch *match, NSError *error) {
+        if (!completionHandler) {
+            return;
+        }
+
+        if (queue) {
+            dispatch_async(queue, ^{
+                completionHandler(match, error);
+            });
+        }
+        else {
+            completionHandler(match, error);
+        }
+    };
+
+    dispatch_async(self.session.queue, ^{
+        NSString *failure = nil;
+        if (![self hasStream]) {
+            failure = @"The shell is not started";
+        }
+        else if (self.expectMatcher) {
+            failure = @"Another expectation is awaited";
+        }
+
+        if (failure) {
+            NMSSHLogError(@"%@", failure);
+            handler(nil, [NSError errorWithDomain:@"NMSSH"
+                                             code:NMSSHChannelReadError
+                                         userInfo:@{ NSLocalizedDescriptionKey : failure }]);
+            return;
+        }
+
+        [self setExpectMatcher:matcher];
+        [self setExpectHandler:handler];
+        [self setExpectBase:0];
+        [self setExpectGeneration:self.expectGeneration + 1];
+
+        NSUInteger generation = self.expectGeneration;
+        __weak NMSSHChannel *weakSelf = self;
+        [patterns enumerateObjectsUsingBlock:^(NMSSHExpectPattern *pattern, NSUInteger index, BOOL *stop) {
+            NSTimeInterval patternTimeout = pattern.timeout > 0 ? pattern.timeout : [timeout doubleValue];
+            if (patternTimeout <= 0) {
+                return;
+            }
+
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(patternTimeout * NSEC_PER_SEC)), self.session.queue, ^{
+                [weakSelf expirePatternAtIndex:index generation:generation];
+            });
+        }];
+
+        // Output received before the call is searched first
+        [self scanExpectBacklogFrom:0];
+    });
+}
+
+- (void)expirePatternAtIndex:(NSUInteger)index generation:(NSUInteger)generation {
+    // The timer may outlive its expectation
+    if (self.expectGeneration != generation || !self.expectMatcher) {
+        return;
+    }
+
+    [self.expectMatcher disablePatternAtIndex:index];
+
+    if (!self.expectMatcher.hasEnabledPatterns) {
+        NMSSHLogVerbose(@"No pattern matched before the timeout");
+        [self finishExpectationWithMatch:nil error:[NSError errorWithDomain:@"NMSSH"
+                                                                       code:NMSSHChannelExpectTimeout
+                                                                   userInfo:@{ NSLocalizedDescriptionKey : @"No pattern matched before the timeout" }]];
+    }
+}
+
+- (void)receiveExpectBytes:(const void *)bytes length:(NSUInteger)length {
+    NSUInteger offset = [self.expectBacklog length];
+    [self.expectBacklog appendBytes:bytes length:length];
+
+    if (self.expectMatcher) {
+        [self scanExpectBacklogFrom:offset];
+    }
+
+    // Dropping half of the backlog at once keeps the cost linear
+    if ([self.expectBacklog length] > 2 * self.expectBufferSize) {
+        NSUInteger dropped = [self.expectBacklog length] - self.expectBufferSize;
+        [self.expectBacklog replaceBytesInRange:NSMakeRange(0, dropped) withBytes:NULL length:0];
+        [self setExpectBase:self.expectBase - (NSInteger)dropped];
+    }
+}
+
+- (void)scanExpectBacklogFrom:(NSUInteger)offset {
+    NSMutableData *backlog = self.expectBacklog;
+    if (offset >= [backlog length]) {
+        return;
+    }
+
+    NMSSHExpectMatch *match = [self.expectMatcher scanBytes:(const char *)[backlog bytes] + offset length:[backlog length] - offset];
+    if (!match) {
+        return;
+    }
+
+    // The matcher counts from the start of the expectation, the bytes dropped
+    // from the backlog meanwhile are gone
+    NSUInteger start = (NSUInteger)MAX(self.expectBase + (NSInteger)match.range.location, 0);
+    NSUInteger end = (NSUInteger)MAX(self.expectBase + (NSInteger)NSMaxRange(match.range), 0);
+
+    [match setPrecedingData:[backlog subdataWithRange:NSMakeRange(0, start)]];
+    [backlog replaceBytesInRange:NSMakeRange(0, end) withBytes:NULL length:0];
+
+    [self finishExpectationWithMatch:match error:nil];
+}
+
+- (void)finishExpectationWithMatch:(NMSSHExpectMatch *)match error:(NSError *)error {
+    void (^handler)(NMSSHExpectMatch *, NSError *) = self.expectHandler;
+
+    [self setExpectMatcher:nil];
+    [self setExpectHandler:nil];
+    [self setExpectGeneration:self.expectGeneration + 1];
+
+    if (handler) {
+        handler(match, error);
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SCP FILE TRANSFER
+// -----------------------------------------------------------------------------
+
+- (BOOL)uploadFile:(NSString *)localPath to:(NSString *)remotePath {
+    return [self uploadFile:localPath to:remotePath progress:NULL];
+}
+
+- (BOOL)uploadFile:(NSString *)localPath to:(NSString *)remotePath progress:(BOOL (^)(NSUInteger))progress {
+    NSString *sourcePath = [localPath stringByExpandingTildeInPath];
+    NSString *targetPath = remotePath;
+
+    // Inherit file name if to: contains a directory
+    if ([targetPath hasSuffix:@"/"]) {
+        targetPath = [targetPath stringByAppendingString:
+                      [[sourcePath componentsSeparatedByString:@"/"] lastObject]];
+    }
+
+    return [self.session performBoolBlockAndWait:^BOOL{
+        if (self.channel != NULL) {
+            NMSSHLogWarn(@"The channel will be closed before continue");
+
+            if ([self hasStream]) {
+                [self closeShell];
+            }
+            else {
+                [self closeChannel];
+            }
+        }
+
+        // Read local file
+        int local = open([sourcePath UTF8String], O_RDONLY);
+        if (local < 0) {
+            NMSSHLogError(@"Can't read local file");
+            return NO;
+        }
+
+        // Set blocking mode
+        libssh2_session_set_blocking(self.session.rawSession, 1);
+
+        // Try to send a file via SCP.
+        struct stat fileinfo;
+        fstat(local, &fileinfo);
+        LIBSSH2_CHANNEL *channel = libssh2_scp_send64(self.session.rawSession, [targetPath UTF8String], fileinfo.st_mode & 0644,
+                                                      (libssh2_int64_t)fileinfo.st_size, 0, 0);
+
+        if (channel == NULL) {
+            NMSSHLogError(@"Unable to open SCP session");
+            close(local);
+
+            return NO;
+        }
+
+        [self setChannel:channel];
+        [self setType:NMSSHChannelTypeSCP];
+
+        // Wait for file transfer to finish
+        BOOL abort = NO;
+        BOOL sent = [self sendFile:local length:(uint64_t)fileinfo.st_size progress:progress aborted:&abort];
+        close(local);
+
+        if (!sent) {
+            [self closeChannel];
+            return NO;
+        }
+
+        if ([self sendEOF]) {
+            [self waitEOF];
+        }
+        [self closeChannel];
+
+        return !abort;
+    }];
+}
+
+- (BOOL)sendFile:(int)file length:(uint64_t)length progress:(BOOL (^)(NSUInteger))progress aborted:(BOOL *)aborted {
+    // The disk queue reads the next stage while the current one is sent. A file
+    // truncated meanwhile fails the read, where a mapping would fault
+    dispatch_queue_t diskQueue = dispatch_queue_create("com.nmssh.upload", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t freeStages = dispatch_semaphore_create(kNMSSHUploadStages);
+    dispatch_semaphore_t filledStages = dispatch_semaphore_create(0);
+    NSMutableArray *stages = [NSMutableArray array];
+    __block volatile BOOL stopped = NO;
+
+    size_t stageSize = MAX(self.bufferSize, (NSUInteger)kNMSSHUploadStageSize);
+    dispatch_async(diskQueue, ^{
+        uint64_t position = 0;
+
+        while (position < length) {
+            dispatch_semaphore_wait(freeStages, DISPATCH_TIME_FOREVER);
+            if (stopped) {
+                break;
+            }
+
+            NMSSHBuffer *stage = [[NMSSHBufferPool sharedPool] newBufferWithLength:stageSize];
+            size_t wanted = (size_t)MIN((uint64_t)stageSize, length - position);
+            size_t filled = 0;
+
+            while (filled < wanted) {
+                ssize_t nread = pread(file, (char *)[stage mutableBytes] + filled, wanted - filled, (off_t)(position + filled));
+                if (nread < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (nread <= 0) {
+                    break;
+                }
+
+                filled += nread;
+            }
+
+            // A short stage ends the upload, the file is not as long as announced
+            @synchronized (stages) {
+                [stages addObject:filled == wanted ? @[stage, @(filled)] : [NSNull null]];
+            }
+            dispatch_semaphore_signal(filledStages);
+
+            if (filled < wanted) {
+                break;
+            }
+
+            position += filled;
+        }
+    });
+
+    uint64_t total = 0;
+    NMSSHDeadline *nextProgress = nil;
+    BOOL success = YES;
+
+    while (total < length && !*aborted) {
+        dispatch_semaphore_wait(filledStages, DISPATCH_TIME_FOREVER);
+
+        id entry = nil;
+        @synchronized (stages) {
+            entry = stages[0];
+            [stages removeObjectAtIndex:0];
+        }
+
+        if (entry == [NSNull null]) {
+            dispatch_semaphore_signal(freeStages);
+            NMSSHLogError(@"Failed reading file");
+            success = NO;
+            break;
+        }
+
+        const char *bytes = [entry[0] bytes];
+        size_t size = [entry[1] unsignedLongValue];
+        size_t offset = 0;
+
+        while (offset < size && !*aborted) {
+            ssize_t rc = libssh2_channel_write(self.channel, bytes + offset, size - offset);
+            if (rc < 0) {
+                break;
+            }
+
+            offset += rc;
+
+            // Progress is reported at most every kNMSSHProgressInterval, and once done
+            if (progress && (!nextProgress || nextProgress.isExpired || total + offset == length)) {
+                nextProgress = [NMSSHDeadline deadlineWithTimeout:kNMSSHProgressInterval];
+                *aborted = !progress((NSUInteger)(total + offset));
+            }
+        }
+
+        dispatch_semaphore_signal(freeStages);
+
+        if (offset < size && !*aborted) {
+            NMSSHLogError(@"Failed writing file");
+            success = NO;
+            break;
+        }
+
+        total += offset;
+    }
+
+    // Wake up the reader if it waits for a stage, then give back every stage
+    // before the semaphore goes away
+    stopped = YES;
+    dispatch_semaphore_signal(freeStages);
+    dispatch_sync(diskQueue, ^{});
+    for (NSUInteger i = 0; i < [stages count]; i++) {
+        dispatch_semaphore_signal(freeStages);
+    }
+
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(diskQueue);
+    dispatch_release(freeStages);
+    dispatch_release(filledStages);
+#endif
+
+    return success;
+}
+
+- (BOOL)downloadFile:(NSString *)remotePath to:(NSString *)localPath {
+    return [self downloadFile:remotePath to:localPath progress:NULL];
+}
+
+- (BOOL)downloadFile:(NSString *)remotePath to:(NSString *)localPath progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
+    NSString *targetPath = [localPath stringByExpandingTildeInPath];
+
+    // Inherit file name if to: contains a directory
+    if ([targetPath hasSuffix:@"/"]) {
+        targetPath = [targetPath stringByAppendingString:[[remotePath componentsSeparatedByString:@"/"] lastObject]];
+    }
+
+    return [self.session performBoolBlockAndWait:^BOOL{
+        if (self.channel != NULL) {
+            NMSSHLogWarn(@"The channel will be closed before continue");
+
+            if ([self hasStream]) {
+                [self closeShell];
+            }
+            else {
+                [self closeChannel];
+            }
+        }
+
+        // Set blocking mode
+        libssh2_session_set_blocking(self.session.rawSession, 1);
+
+        // Request a file via SCP
+        struct stat fileinfo;
+        LIBSSH2_CHANNEL *channel = libssh2_scp_recv(self.session.rawSession, [remotePath UTF8String], &fileinfo);
+
+        if (channel == NULL) {
+            NMSSHLogError(@"Unable to open SCP session");
+            return NO;
+        }
+
+        [self setChannel:channel];
+        [self setType:NMSSHChannelTypeSCP];
+
+        if ([[NSFileManager defaultManager] fileExistsAtPath:targetPath]) {
+            NMSSHLogInfo(@"A file already exists at %@, it will be overwritten", targetPath);
+            [[NSFileManager defaultManager] removeItemAtPath:targetPath error:nil];
+        }
+
+        // Open local file in order to write to it
+        int localFile = open([targetPath UTF8String], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (localFile < 0) {
+            NMSSHLogError(@"Can't create local file");
+            [self closeChannel];
+            return NO;
+        }
+
+        [self preallocateFile:localFile length:fileinfo.st_size];
+
+        // Save data to local file
+        BOOL received = [self receiveFile:localFile length:(uint64_t)fileinfo.st_size progress:progress];
+
+        if (received && self.synchronizesDownloads && fcntl(localFile, F_FULLFSYNC) != 0 && fsync(localFile) != 0) {
+            NMSSHLogError(@"Failed to synchronize local file");
+            received = NO;
+        }
+
+        if (close(localFile) != 0) {
+            received = NO;
+        }
+
+        [self closeChannel];
+
+        return received;
+    }];
+}
+
+- (void)preallocateFile:(int)file length:(off_t)length {
+    if (length <= 0) {
+        return;
+    }
+
+    // Contiguous space if possible, any space otherwise, the download may go
+    // on without it
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, length, 0 };
+    if (fcntl(file, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(file, F_PREALLOCATE, &store) == -1) {
+            NMSSHLogVerbose(@"Unable to preallocate %lld bytes", (long long)length);
+        }
+    }
+}
+
+- (BOOL)receiveFile:(int)file length:(uint64_t)length progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
+    // The network fills a stage while the disk queue writes the previous ones
+    dispatch_queue_t diskQueue = dispatch_queue_create("com.nmssh.download", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t freeStages = dispatch_semaphore_create(kNMSSHDownloadStages);
+    __block volatile BOOL diskFailed = NO;
+
+    size_t stageSize = MAX(self.bufferSize, (NSUInteger)kNMSSHDownloadStageSize);
+    unsigned long windowTarget = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+    NMSSHDeadline *nextProgress = nil;
+    uint64_t got = 0;
+    BOOL success = YES;
+
+    while (got < length) {
+        dispatch_semaphore_wait(freeStages, DISPATCH_TIME_FOREVER);
+
+        NMSSHBuffer *stage = [[NMSSHBufferPool sharedPool] newBufferWithLength:stageSize];
+        size_t wanted = (size_t)MIN((uint64_t)stageSize, length - got);
+        size_t filled = 0;
+
+        while (success && !diskFailed && filled < wanted) {
+            ssize_t rc = libssh2_channel_read(self.channel, (char *)[stage mutableBytes] + filled, wanted - filled);
+
+            if (rc < 0 || (rc == 0 && libssh2_channel_eof(self.channel))) {
+                NMSSHLogError(@"Failed to read SCP data");
+                success = NO;
+                break;
+            }
+
+            filled += rc;
+            [self growReceiveWindowOfChannel:self.channel target:&windowTarget];
+
+            if (progress && (!nextProgress || nextProgress.isExpired || got + filled == length)) {
+                nextProgress = [NMSSHDeadline deadlineWithTimeout:kNMSSHProgressInterval];
+                success = progress((NSUInteger)(got + filled), (NSUInteger)length);
+            }
+        }
+
+        if (!success || diskFailed) {
+            // Every stage must be given back before the semaphore goes away
+            dispatch_semaphore_signal(freeStages);
+            break;
+        }
+
+        off_t offset = (off_t)got;
+        dispatch_async(diskQueue, ^{
+            const char *bytes = [stage bytes];
+            size_t remaining = filled;
+            off_t position = offset;
 
-- (void)closeShell {
-    if (self.source) {
-        dispatch_source_cancel(self.source);
-#if !(OS_OBJECT_USE_OBJC)
-        dispatch_release(self.source);
-#endif
-        [self setSource: nil];
+            while (remaining > 0 && !diskFailed) {
+                ssize_t written = pwrite(file, bytes, remaining, position);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (written <= 0) {
+                    diskFailed = YES;
+                    break;
+                }
+
+                bytes += written;
+                remaining -= written;
+                position += written;
+            }
+
+            dispatch_semaphore_signal(freeStages);
+        });
+
+        got += filled;
     }
 
-    if (self.type == NMSSHChannelTypeShell) {
-        // Set blocking mode
-        libssh2_session_set_blocking(self.session.rawSession, 1);
+    // Wait for the stages still being written
+    dispatch_sync(diskQueue, ^{});
 
-        [self sendEOF];
+    if (diskFailed) {
+        NMSSHLogError(@"Failed to write to local file");
+        success = NO;
     }
 
-    [self closeChannel];
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(diskQueue);
+    dispatch_release(freeStages);
+#endif
+
+    return success;
 }
 
-- (BOOL)write:(NSString *)command error:(NSError *__autoreleasing *)error {
-    return [self write:command error:error timeout:@0];
+// -----------------------------------------------------------------------------
+#pragma mark - RECURSIVE SCP FILE TRANSFER
+// -----------------------------------------------------------------------------
+
+- (BOOL)uploadDirectory:(NSString *)localPath to:(NSString *)remotePath progress:(BOOL (^)(NSUInteger))progress {
+    return [self.session performBoolBlockAndWait:^BOOL{
+        NSString *path = [[localPath stringByExpandingTildeInPath] stringByStandardizingPath];
+        NSString *command = [NSString stringWithFormat:@"scp -r -p -t %@", [self quotedShellArgument:remotePath]];
+
+        if (![self openSCPChannelWithCommand:command]) {
+            return NO;
+        }
+
+        BOOL success = [self readSCPAcknowledgement] && [self sendTree:path progress:progress];
+
+        if ([self sendEOF]) {
+            [self waitEOF];
+        }
+        [self closeChannel];
+
+        return success;
+    }];
 }
 
-- (BOOL)write:(NSString *)command error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
-    return [self writeData:[command dataUsingEncoding:NSUTF8StringEncoding] error:error timeout:timeout];
+- (BOOL)downloadDirectory:(NSString *)remotePath to:(NSString *)localPath progress:(BOOL (^)(NSUInteger))progress {
+    return [self.session performBoolBlockAndWait:^BOOL{
+        NSString *path = [[localPath stringByExpandingTildeInPath] stringByStandardizingPath];
+        NSString *command = [NSString stringWithFormat:@"scp -r -p -f %@", [self quotedShellArgument:remotePath]];
+
+        if (![self openSCPChannelWithCommand:command]) {
+            return NO;
+        }
+
+        BOOL success = [self receiveTreeAtPath:path progress:progress];
+        [self closeChannel];
+
+        return success;
+    }];
 }
 
-- (BOOL)writeData:(NSData *)data error:(NSError *__autoreleasing *)error {
-    return [self writeData:data error:error timeout:@0];
+- (NSString *)quotedShellArgument:(NSString *)argument {
+    return [NSString stringWithFormat:@"'%@'", [argument stringByReplacingOccurrencesOfString:@"'" withString:@"'\\''"]];
 }
 
-- (BOOL)writeData:(NSData *)data error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
-    if (self.type != NMSSHChannelTypeShell) {
-        NMSSHLogError(@"Shell required");
-        return NO;
+- (BOOL)openSCPChannelWithCommand:(NSString *)command {
+    if (self.channel != NULL) {
+        NMSSHLogWarn(@"The channel will be closed before continue");
+
+        if ([self hasStream]) {
+            [self closeShell];
+        }
+        else {
+            [self closeChannel];
+        }
     }
 
-    ssize_t rc;
+    // Set blocking mode
+    libssh2_session_set_blocking(self.session.rawSession, 1);
 
-    // Set the timeout
-    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent() + [timeout doubleValue];
+    // No pseudo terminal, it would mangle the binary stream
+    LIBSSH2_CHANNEL *channel = libssh2_channel_open_ex(self.session.rawSession, "session", sizeof("session") - 1,
+                                                       (unsigned int)self.windowSize, (unsigned int)self.packetSize, NULL, 0);
+    if (channel == NULL) {
+        NMSSHLogError(@"Unable to open SCP session");
+        return NO;
+    }
 
-    // Try writing on shell
-    while ((rc = libssh2_channel_write(self.channel, [data bytes], [data length])) == LIBSSH2_ERROR_EAGAIN) {
-        // Check if the connection timed out
-        if ([timeout longValue] > 0 && time < CFAbsoluteTimeGetCurrent()) {
-            if (error) {
-                NSString *description = @"Connection timed out";
+    [self setChannel:channel];
+    [self setType:NMSSHChannelTypeSCP];
 
-                *error = [NSError errorWithDomain:@"NMSSH"
-                                             code:NMSSHChannelExecutionTimeout
-                                         userInfo:@{ NSLocalizedDescriptionKey : description }];
-            }
+    if (libssh2_channel_exec(self.channel, [command UTF8String]) != 0) {
+        NMSSHLogError(@"Unable to start %@", command);
+        [self closeChannel];
+        return NO;
+    }
 
+    return YES;
+}
+
+- (BOOL)writeSCPData:(const void *)bytes length:(size_t)length {
+    size_t offset = 0;
+    while (offset < length) {
+        ssize_t rc = libssh2_channel_write(self.channel, (const char *)bytes + offset, length - offset);
+        if (rc < 0) {
+            NMSSHLogError(@"Failed writing SCP data");
             return NO;
         }
 
-        waitsocket(CFSocketGetNative([self.session socket]), self.session.rawSession);
+        offset += rc;
     }
 
-    if (rc < 0) {
-        NMSSHLogError(@"Error writing on the shell");
-        if (error) {
-            NSString *command = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-            *error = [NSError errorWithDomain:@"NMSSH"
-                                         code:NMSSHChannelWriteError
-                                     userInfo:@{ NSLocalizedDescriptionKey : [[self.session lastError] localizedDescription],
-                                                 @"command"                : command }];
+    return YES;
+}
+
+- (BOOL)writeSCPMessage:(NSString *)message {
+    NSData *data = [message dataUsingEncoding:NSUTF8StringEncoding];
+    return [self writeSCPData:[data bytes] length:[data length]] && [self readSCPAcknowledgement];
+}
+
+/// Read a protocol line without its newline, `nil` at the end of the stream
+- (NSString *)readSCPLine {
+    NSMutableData *line = [NSMutableData data];
+    char byte;
+
+    // Lines are short and already buffered by libssh2, reading them byte by
+    // byte costs no system call
+    for (;;) {
+        ssize_t rc = libssh2_channel_read(self.channel, &byte, 1);
+        if (rc < 0 || (rc == 0 && libssh2_channel_eof(self.channel))) {
+            return nil;
+        }
+
+        if (rc == 1) {
+            if (byte == '\n') {
+                break;
+            }
+
+            [line appendBytes:&byte length:1];
         }
     }
 
-    return YES;
+    return [[NSString alloc] initWithData:line encoding:NSUTF8StringEncoding] ?: @"";
 }
 
-- (BOOL)requestSizeWidth:(NSUInteger)width height:(NSUInteger)height {
-    int rc = libssh2_channel_request_pty_size(self.channel, (int)width, (int)height);
-    if (rc) {
-        NMSSHLogError(@"Request size failed with error %i", rc);
+- (BOOL)readSCPAcknowledgement {
+    char status;
+    ssize_t rc;
+    while ((rc = libssh2_channel_read(self.channel, &status, 1)) == 0 && !libssh2_channel_eof(self.channel));
+
+    if (rc != 1) {
+        NMSSHLogError(@"SCP peer closed the connection");
+        return NO;
     }
 
-    return rc == 0;
-}
+    if (status == 0) {
+        return YES;
+    }
 
-// -----------------------------------------------------------------------------
-#pragma mark - SCP FILE TRANSFER
-// -----------------------------------------------------------------------------
+    // 1 is a warning and 2 a fatal error, both followed by a message
+    NSString *message = [self readSCPLine];
+    NMSSHLogError(@"SCP error: %@", message);
 
-- (BOOL)uploadFile:(NSString *)localPath to:(NSString *)remotePath {
-    return [self uploadFile:localPath to:remotePath progress:NULL];
+    return NO;
 }
 
-- (BOOL)uploadFile:(NSString *)localPath to:(NSString *)remotePath progress:(BOOL (^)(NSUInteger))progress {
-    if (self.channel != NULL) {
-        NMSSHLogWarn(@"The channel will be closed before continue");
+- (BOOL)writeSCPTimesOfEntry:(NMSSHSCPEntry *)entry {
+    return [self writeSCPMessage:[NSString stringWithFormat:@"T%lld 0 %lld 0\n", (long long)entry.modificationTime, (long long)entry.accessTime]];
+}
 
-        if (self.type == NMSSHChannelTypeShell) {
-            [self closeShell];
+- (BOOL)sendTree:(NSString *)path progress:(BOOL (^)(NSUInteger))progress {
+    NMSSHSCPWalker *walker = [[NMSSHSCPWalker alloc] initWithPath:path];
+    __block uint64_t total = 0;
+    BOOL aborted = NO;
+    BOOL success = YES;
+    NMSSHSCPEntry *entry;
+
+    while (success && !aborted && (entry = [walker nextEntry]) != nil) {
+        if (entry.type == NMSSHSCPEntryEndOfDirectory) {
+            success = [self writeSCPMessage:@"E\n"];
+            continue;
         }
-        else {
-            [self closeChannel];
+
+        if (entry.type == NMSSHSCPEntryDirectory) {
+            success = [self writeSCPTimesOfEntry:entry] &&
+                      [self writeSCPMessage:[NSString stringWithFormat:@"D%04o 0 %@\n", entry.mode, entry.name]];
+            continue;
         }
-    }
 
-    localPath = [localPath stringByExpandingTildeInPath];
+        int file = open([entry.path fileSystemRepresentation], O_RDONLY);
+        if (file < 0) {
+            NMSSHLogError(@"Can't read local file %@", entry.path);
+            success = NO;
+            break;
+        }
 
-    // Inherit file name if to: contains a directory
-    if ([remotePath hasSuffix:@"/"]) {
-        remotePath = [remotePath stringByAppendingString:
-                      [[localPath componentsSeparatedByString:@"/"] lastObject]];
+        uint64_t base = total;
+        success = [self writeSCPTimesOfEntry:entry] &&
+                  [self writeSCPMessage:[NSString stringWithFormat:@"C%04o %llu %@\n", entry.mode, entry.size, entry.name]] &&
+                  [self sendFile:file length:entry.size progress:^BOOL(NSUInteger sent) {
+                      total = base + sent;
+                      return progress ? progress((NSUInteger)total) : YES;
+                  } aborted:&aborted];
+        close(file);
+
+        // Every file ends with a null byte, acknowledged by the peer
+        if (success && !aborted) {
+            success = [self writeSCPData:"" length:1] && [self readSCPAcknowledgement];
+        }
     }
 
-    // Read local file
-    FILE *local = fopen([localPath UTF8String], "rb");
-    if (!local) {
-        NMSSHLogError(@"Can't read local file");
-        return NO;
-    }
+    [walker cancel];
 
-    // Set blocking mode
-    libssh2_session_set_blocking(self.session.rawSession, 1);
+    return success && !aborted && !walker.failed;
+}
 
-    // Try to send a file via SCP.
-    struct stat fileinfo;
-    stat([localPath UTF8String], &fileinfo);
-    LIBSSH2_CHANNEL *channel = libssh2_scp_send64(self.session.rawSession, [remotePath UTF8String], fileinfo.st_mode & 0644,
-                                                  (unsigned long)fileinfo.st_size, 0, 0);;
+- (BOOL)isValidSCPName:(NSString *)name {
+    return [name length] > 0 && ![name isEqualToString:@"."] && ![name isEqualToString:@".."] &&
+           [name rangeOfString:@"/"].location == NSNotFound;
+}
 
-    if (channel == NULL) {
-        NMSSHLogError(@"Unable to open SCP session");
-        fclose(local);
+- (BOOL)receiveTreeAtPath:(NSString *)path progress:(BOOL (^)(NSUInteger))progress {
+    // Directories being received, their mode and times are applied once complete
+    NSMutableArray *directories = [NSMutableArray array];
+    __block uint64_t total = 0;
+    struct timeval times[2];
+    BOOL hasTimes = NO;
+    BOOL isDirectory = NO;
+    BOOL targetIsDirectory = [[NSFileManager defaultManager] fileExistsAtPath:path isDirectory:&isDirectory] && isDirectory;
 
+    if (![self writeSCPData:"" length:1]) {
         return NO;
     }
 
-    [self setChannel:channel];
-    [self setType:NMSSHChannelTypeSCP];
+    NSString *line;
+    while ((line = [self readSCPLine]) != nil) {
+        unichar type = [line length] ? [line characterAtIndex:0] : 0;
+        NSScanner *scanner = [NSScanner scannerWithString:[line length] ? [line substringFromIndex:1] : @""];
+        [scanner setCharactersToBeSkipped:nil];
+
+        if (type == 1 || type == 2) {
+            NMSSHLogError(@"SCP error: %@", [line substringFromIndex:1]);
+            if (type == 2) {
+                return NO;
+            }
+            continue;
+        }
+
+        if (type == 'T') {
+            long long modificationTime, accessTime;
+            if (![scanner scanLongLong:&modificationTime] || ![scanner scanString:@" 0 " intoString:NULL] ||
+                ![scanner scanLongLong:&accessTime]) {
+                NMSSHLogError(@"Malformed SCP times: %@", line);
+                return NO;
+            }
 
-    // Wait for file transfer to finish
-    char mem[self.bufferSize];
-    size_t nread;
-    char *ptr;
-    long rc;
-    NSUInteger total = 0;
-    BOOL abort = NO;
-    while (!abort && (nread = fread(mem, 1, sizeof(mem), local)) > 0) {
-        ptr = mem;
+            times[0].tv_sec = (time_t)accessTime;
+            times[0].tv_usec = 0;
+            times[1].tv_sec = (time_t)modificationTime;
+            times[1].tv_usec = 0;
+            hasTimes = YES;
+        }
+        else if (type == 'E') {
+            NSDictionary *directory = [directories lastObject];
+            if (!directory) {
+                NMSSHLogError(@"Unbalanced SCP directory end");
+                return NO;
+            }
 
-        do {
-            // Write the same data over and over, until error or completion
-            rc = libssh2_channel_write(self.channel, ptr, nread);
+            const char *directoryPath = [directory[@"path"] fileSystemRepresentation];
+            chmod(directoryPath, (mode_t)[directory[@"mode"] unsignedShortValue]);
+            if (directory[@"times"]) {
+                utimes(directoryPath, [directory[@"times"] bytes]);
+            }
 
-            if (rc < 0) {
-                NMSSHLogError(@"Failed writing file");
-                [self closeChannel];
+            [directories removeLastObject];
+        }
+        else if (type == 'C' || type == 'D') {
+            unsigned int mode;
+            unsigned long long size;
+            NSString *name = nil;
+
+            // The mode is octal, NSScanner has no octal scanning
+            NSString *modeString = nil;
+            if (![scanner scanUpToString:@" " intoString:&modeString] || sscanf([modeString UTF8String], "%o", &mode) != 1 ||
+                ![scanner scanString:@" " intoString:NULL] || ![scanner scanUnsignedLongLong:&size] ||
+                ![scanner scanString:@" " intoString:NULL] || ![scanner scanUpToString:@"\n" intoString:&name] ||
+                ![self isValidSCPName:name]) {
+                NMSSHLogError(@"Malformed SCP header: %@", line);
                 return NO;
             }
+
+            // The top entry replaces the target unless the target is a directory
+            NSString *parent = [[directories lastObject] objectForKey:@"path"];
+            NSString *target = parent ? [parent stringByAppendingPathComponent:name] :
+                               (targetIsDirectory ? [path stringByAppendingPathComponent:name] : path);
+
+            if (type == 'D') {
+                if (mkdir([target fileSystemRepresentation], 0700) != 0 && errno != EEXIST) {
+                    NMSSHLogError(@"Can't create local directory %@", target);
+                    return NO;
+                }
+
+                NSMutableDictionary *directory = [@{ @"path" : target, @"mode" : @(mode & 07777) } mutableCopy];
+                if (hasTimes) {
+                    directory[@"times"] = [NSData dataWithBytes:times length:sizeof(times)];
+                }
+                [directories addObject:directory];
+            }
             else {
-                // rc indicates how many bytes were written this time
-                total += rc;
-                if (progress && !progress(total)) {
-                    abort = YES;
-                    break;
+                int file = open([target fileSystemRepresentation], O_WRONLY|O_CREAT|O_TRUNC, 0600);
+                if (file < 0) {
+                    NMSSHLogError(@"Can't create local file %@", target);
+                    return NO;
+                }
+
+                [self preallocateFile:file length:(off_t)size];
+
+                uint64_t base = total;
+                BOOL received = [self writeSCPData:"" length:1] &&
+                                [self receiveFile:file length:size progress:^BOOL(NSUInteger got, NSUInteger length) {
+                                    total = base + got;
+                                    return progress ? progress((NSUInteger)total) : YES;
+                                }] &&
+                                [self readSCPAcknowledgement];
+
+                fchmod(file, (mode_t)(mode & 07777));
+                if (hasTimes) {
+                    futimes(file, times);
+                }
+
+                if (close(file) != 0 || !received) {
+                    return NO;
                 }
-                ptr += rc;
-                nread -= rc;
             }
-        } while (nread);
-    };
 
-    fclose(local);
+            hasTimes = NO;
+        }
+        else {
+            NMSSHLogError(@"Unexpected SCP message: %@", line);
+            return NO;
+        }
 
-    if ([self sendEOF]) {
-        [self waitEOF];
+        if (![self writeSCPData:"" length:1]) {
+            return NO;
+        }
     }
-    [self closeChannel];
 
-    return !abort;
+    return [directories count] == 0;
 }
 
-- (BOOL)downloadFile:(NSString *)remotePath to:(NSString *)localPath {
-    return [self downloadFile:remotePath to:localPath progress:NULL];
-}
+// -----------------------------------------------------------------------------
+#pragma mark - TAR STREAM TRANSFER
+// -----------------------------------------------------------------------------
 
-- (BOOL)downloadFile:(NSString *)remotePath to:(NSString *)localPath progress:(BOOL (^)(NSUInteger, NSUInteger))progress {
-    if (self.channel != NULL) {
-        NMSSHLogWarn(@"The channel will be closed before continue");
+- (BOOL)uploadDirectoryWithTar:(NSString *)localPath
+                            to:(NSString *)remotePath
+                   compression:(NMSSHChannelCompression)compression
+                      progress:(BOOL (^)(NSUInteger))progress {
+    return [self.session performBoolBlockAndWait:^BOOL{
+        NSString *path = [[localPath stringByExpandingTildeInPath] stringByStandardizingPath];
+        NSString *destination = [self quotedShellArgument:remotePath];
 
-        if (self.type == NMSSHChannelTypeShell) {
-            [self closeShell];
+        // The beginning of the archive is held back until compression is decided
+        __block NSMutableData *sample = compression == NMSSHChannelCompressionAutomatic ? [NSMutableData data] : nil;
+        __block NMSSHGzipStream *compressor = nil;
+
+        BOOL (^send)(const void *, size_t) = ^BOOL(const void *bytes, size_t length) {
+            return compressor ? [compressor processBytes:bytes length:length] : [self writeSCPData:bytes length:length];
+        };
+
+        BOOL (^start)(void) = ^BOOL{
+            BOOL gzip = compression == NMSSHChannelCompressionGzip ||
+                        (sample && [NMSSHGzipStream compressionRatioOfData:sample] <= kNMSSHTarCompressionThreshold);
+            NSString *command = [NSString stringWithFormat:@"mkdir -p %@ && tar x%@f - -C %@", destination, gzip ? @"z" : @"", destination];
+
+            if (![self openSCPChannelWithCommand:command]) {
+                return NO;
+            }
+
+            // Report the exit status of tar on close
+            [self setType:NMSSHChannelTypeExec];
+
+            if (gzip) {
+                compressor = [[NMSSHGzipStream alloc] initCompressorWithLevel:kNMSSHTarCompressionLevel sink:^BOOL(const void *bytes, size_t length) {
+                    return [self writeSCPData:bytes length:length];
+                }];
+            }
+
+            NSData *buffered = sample;
+            sample = nil;
+
+            return !buffered || send([buffered bytes], [buffered length]);
+        };
+
+        NMSSHTarWriter *writer = [[NMSSHTarWriter alloc] initWithSink:^BOOL(const void *bytes, size_t length) {
+            if (!sample) {
+                return send(bytes, length);
+            }
+
+            [sample appendBytes:bytes length:length];
+            return [sample length] < kNMSSHTarSampleSize || start();
+        }];
+
+        BOOL success = sample || start();
+        if (success) {
+            success = [self writeTree:path toArchive:writer progress:progress] && [writer finish] && (!sample || start());
         }
-        else {
+
+        if (success && compressor) {
+            success = [compressor finish];
+        }
+
+        if (self.channel) {
+            if ([self sendEOF]) {
+                [self waitEOF];
+            }
             [self closeChannel];
+
+            if (success && self.lastExitStatus != 0) {
+                NMSSHLogError(@"Remote tar failed with exit status %i", self.lastExitStatus);
+                success = NO;
+            }
         }
-    }
 
-    localPath = [localPath stringByExpandingTildeInPath];
+        return success;
+    }];
+}
 
-    // Inherit file name if to: contains a directory
-    if ([localPath hasSuffix:@"/"]) {
-        localPath = [localPath stringByAppendingString:[[remotePath componentsSeparatedByString:@"/"] lastObject]];
-    }
+- (BOOL)writeTree:(NSString *)path toArchive:(NMSSHTarWriter *)writer progress:(BOOL (^)(NSUInteger))progress {
+    NMSSHSCPWalker *walker = [[NMSSHSCPWalker alloc] initWithPath:path];
+    NSMutableArray *directories = [NSMutableArray array];
+    __block NMSSHDeadline *nextProgress = nil;
+    __block BOOL aborted = NO;
+    BOOL success = YES;
+    NMSSHSCPEntry *entry;
+
+    BOOL (^report)(void) = ^BOOL{
+        // Progress is reported at most every kNMSSHProgressInterval
+        if (progress && (!nextProgress || nextProgress.isExpired)) {
+            nextProgress = [NMSSHDeadline deadlineWithTimeout:kNMSSHProgressInterval];
+            aborted = !progress((NSUInteger)writer.length);
+        }
 
-    // Set blocking mode
-    libssh2_session_set_blocking(self.session.rawSession, 1);
+        return !aborted;
+    };
 
-    // Request a file via SCP
-    struct stat fileinfo;
-    LIBSSH2_CHANNEL *channel = libssh2_scp_recv(self.session.rawSession, [remotePath UTF8String], &fileinfo);
+    while (success && (entry = [walker nextEntry]) != nil) {
+        if (entry.type == NMSSHSCPEntryEndOfDirectory) {
+            [directories removeLastObject];
+            continue;
+        }
 
-    if (channel == NULL) {
-        NMSSHLogError(@"Unable to open SCP session");
-        return NO;
+        NSString *name = [[directories arrayByAddingObject:entry.name] componentsJoinedByString:@"/"];
+
+        if (entry.type == NMSSHSCPEntryDirectory) {
+            [directories addObject:entry.name];
+            success = [writer appendDirectory:name mode:entry.mode modificationTime:entry.modificationTime];
+            continue;
+        }
+
+        int file = open([entry.path fileSystemRepresentation], O_RDONLY);
+        if (file < 0) {
+            NMSSHLogError(@"Can't read local file %@", entry.path);
+            success = NO;
+            break;
+        }
+
+        success = [writer appendFile:name descriptor:file size:entry.size mode:entry.mode modificationTime:entry.modificationTime progress:^BOOL(uint64_t written) {
+            return report();
+        }];
+        close(file);
+
+        success = success && report();
     }
 
-    [self setChannel:channel];
-    [self setType:NMSSHChannelTypeSCP];
+    [walker cancel];
 
-    if ([[NSFileManager defaultManager] fileExistsAtPath:localPath]) {
-        NMSSHLogInfo(@"A file already exists at %@, it will be overwritten", localPath);
-        [[NSFileManager defaultManager] removeItemAtPath:localPath error:nil];
+    if (success && progress) {
+        success = progress((NSUInteger)writer.length);
     }
 
-    // Open local file in order to write to it
-    int localFile = open([localPath UTF8String], O_WRONLY|O_CREAT, 0644);
+    return success && !walker.failed;
+}
 
-    // Save data to local file
-    off_t got = 0;
-    while (got < fileinfo.st_size) {
-        char mem[self.bufferSize];
-        size_t amount = sizeof(mem);
+- (BOOL)downloadDirectoryWithTar:(NSString *)remotePath
+                              to:(NSString *)localPath
+                     compression:(NMSSHChannelCompression)compression
+                        progress:(BOOL (^)(NSUInteger))progress {
+    return [self.session performBoolBlockAndWait:^BOOL{
+        NSString *path = [[localPath stringByExpandingTildeInPath] stringByStandardizingPath];
+        NSString *parent = [remotePath stringByDeletingLastPathComponent];
+        NSString *operands = [NSString stringWithFormat:@"-C %@ %@",
+                              [self quotedShellArgument:[parent length] > 0 ? parent : @"."],
+                              [self quotedShellArgument:[remotePath lastPathComponent]]];
+
+        // There is no local sample before the stream starts, compression of
+        // downloads is only used when asked for
+        BOOL gzip = compression == NMSSHChannelCompressionGzip;
+        NSString *archive = [NSString stringWithFormat:@"tar c%@f - %@", gzip ? @"z" : @"", operands];
+
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:nil]) {
+            NMSSHLogError(@"Can't create local directory %@", path);
+            return NO;
+        }
 
-        if ((fileinfo.st_size - got) < amount) {
-            amount = (size_t)(fileinfo.st_size - got);
+        if (![self openSCPChannelWithCommand:archive]) {
+            return NO;
         }
 
-        ssize_t rc = libssh2_channel_read(self.channel, mem, amount);
+        // Report the exit status of tar on close
+        [self setType:NMSSHChannelTypeExec];
 
-        if (rc > 0) {
-            size_t n = write(localFile, mem, rc);
-            if (n < rc) {
-                NMSSHLogError(@"Failed to write to local file");
-                close(localFile);
-                [self closeChannel];
-                return NO;
+        NMSSHTarReader *reader = [[NMSSHTarReader alloc] initWithDestination:path];
+        NMSSHGzipStream *decompressor = nil;
+        if (gzip) {
+            decompressor = [[NMSSHGzipStream alloc] initDecompressorWithSink:^BOOL(const void *bytes, size_t length) {
+                return [reader consumeBytes:bytes length:length];
+            }];
+        }
+
+        NMSSHBuffer *buffer = [[NMSSHBufferPool sharedPool] newBufferWithLength:kNMSSHDownloadStageSize];
+        NSMutableData *errorOutput = [NSMutableData data];
+        unsigned long window = self.windowSize;
+        NMSSHDeadline *nextProgress = nil;
+        BOOL success = YES;
+
+        // Standard error shares the window of the channel, it is drained along
+        // the archive so diagnostics of tar can't stall the stream
+        libssh2_session_set_blocking(self.session.rawSession, 0);
+
+        for (;;) {
+            ssize_t rc = libssh2_channel_read(self.channel, [buffer mutableBytes], [buffer length]);
+            if (rc > 0) {
+                success = decompressor ? [decompressor processBytes:[buffer bytes] length:rc] : [reader consumeBytes:[buffer bytes] length:rc];
+                if (!success) {
+                    break;
+                }
+
+                [self growReceiveWindowOfChannel:self.channel target:&window];
             }
-            got += rc;
-            if (progress && !progress((NSUInteger)got, (NSUInteger)fileinfo.st_size)) {
-                close(localFile);
-                [self closeChannel];
-                return NO;
+
+            // Keep the diagnostics of tar for the log
+            ssize_t erc = libssh2_channel_read_stderr(self.channel, [buffer mutableBytes], [buffer length]);
+            if (erc > 0) {
+                [errorOutput appendBytes:[buffer bytes] length:erc];
             }
-        }
-        else if (rc < 0) {
-            NMSSHLogError(@"Failed to read SCP data");
-            close(localFile);
-            [self closeChannel];
 
-            return NO;
+            if ((rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) || (erc < 0 && erc != LIBSSH2_ERROR_EAGAIN)) {
+                NMSSHLogError(@"Failed reading tar stream");
+                success = NO;
+                break;
+            }
+
+            // Progress is reported at most every kNMSSHProgressInterval
+            if (rc > 0 && progress && (!nextProgress || nextProgress.isExpired)) {
+                nextProgress = [NMSSHDeadline deadlineWithTimeout:kNMSSHProgressInterval];
+                if (!progress((NSUInteger)reader.length)) {
+                    success = NO;
+                    break;
+                }
+            }
+
+            if (rc > 0 || erc > 0) {
+                continue;
+            }
+
+            if (libssh2_channel_eof(self.channel) == 1) {
+                break;
+            }
+
+            waitsocket(CFSocketGetNative([self.session socket]), self.session.rawSession);
         }
 
-        memset(mem, 0x0, sizeof(mem));
-    }
+        success = success && (!decompressor || [decompressor finish]);
+        success = [reader finish] && success;
 
-    close(localFile);
-    [self closeChannel];
+        [self closeChannel];
 
-    return YES;
+        if (success && self.lastExitStatus != 0) {
+            NMSSHLogError(@"Remote tar failed with exit status %i: %@", self.lastExitStatus,
+                          [[NSString alloc] initWithData:errorOutput encoding:NSUTF8StringEncoding]);
+            success = NO;
+        }
+
+        if (success && progress) {
+            success = progress((NSUInteger)reader.length);
+        }
+
+        return success;
+    }];
 }
 
 @end
@@ -0,0 +1,113 @@
+#import "NMSSH.h"
+
+@class NMSSHSession;
+@class NMSSHChannel;
+
+/**
+ NMSSHCommandResult holds the outcome of a command run by a NMSSHCommandServer.
+ */
+@interface NMSSHCommandResult : NSObject
+
+/** The command (read-only). */
+@property (nonatomic, nonnull, readonly) NSString *command;
+
+/** Standard output of the command (read-only). */
+@property (nonatomic, nonnull, readonly) NSData *standardOutput;
+
+/** Standard error output of the command (read-only). */
+@property (nonatomic, nonnull, readonly) NSData *standardError;
+
+/** Exit status of the command (read-only). */
+@property (nonatomic, readonly) int exitStatus;
+
+/** Standard output decoded as UTF-8, `nil` if it is not valid UTF-8 (read-only). */
+@property (nonatomic, nullable, readonly) NSString *output;
+
+@end
+
+/**
+ NMSSHCommandServer runs many short commands over a single long-lived channel.
+
+ Every -[NMSSHChannel execute:error:] opens a channel, starts the command and
+ waits for the channel to close, several round trips per command. The command
+ server instead starts `/bin/sh` once and writes the commands to it, each one
+ followed by a unique sentinel printed on both outputs along with the exit
+ status. Commands are pipelined: they are sent without waiting for the previous
+ results, which come back in order.
+
+    NMSSHCommandServer *server = [[NMSSHCommandServer alloc] initWithSession:session];
+    [server start:nil];
+
+    for (NSString *host in hosts) {
+        [server execute:[@"ping -c 1 " stringByAppendingString:host]
+      completionHandler:^(NMSSHCommandResult *result, NSError *error) {
+            NSLog(@"%@: %d", host, result.exitStatus);
+        }];
+    }
+
+ Each command runs in a subshell with its standard input redirected from
+ `/dev/null`: `cd`, variables and `exit` do not leak into the next commands,
+ and a command cannot consume the following ones. Commands that never exit
+ hold the commands queued after them.
+ */
+@interface NMSSHCommandServer : NSObject
+
+/** The session the server runs on (read-only). */
+@property (nonatomic, nonnull, readonly) NMSSHSession *session;
+
+/** The channel running the shell (read-only). */
+@property (nonatomic, nonnull, readonly) NMSSHChannel *channel;
+
+/** A Boolean value indicating whether the shell is running (read-only). */
+@property (nonatomic, readonly, getter = isRunning) BOOL running;
+
+/** The number of commands sent whose result did not arrive yet (read-only). */
+@property (nonatomic, readonly) NSUInteger pendingCommands;
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ Create a new command server.
+
+ @param session An authorized session
+ @returns Stopped command server
+ */
+- (nonnull instancetype)initWithSession:(nonnull NMSSHSession *)session;
+
+/**
+ Start the shell.
+
+ @param error Error handler
+ @returns Start success
+ */
+- (BOOL)start:(NSError * _Nullable * _Nullable)error;
+
+/** Stop the shell, the pending commands fail. */
+- (void)stop;
+
+/**
+ Queue a command, without waiting.
+
+ @param command Any shell script that is available on the server
+ @param completionHandler Called on the `callbackQueue` of the session with
+     the result of the command, or the reason of the failure
+ */
+- (void)execute:(nonnull NSString *)command
+completionHandler:(nullable void (^)(NMSSHCommandResult * _Nullable result, NSError * _Nullable error))completionHandler;
+
+/**
+ Run a command and wait for its result.
+
+ A non-zero exit status is not an error. The command keeps running on the
+ server after a timeout. This method can't be called from the session queue.
+
+ @param command Any shell script that is available on the server
+ @param error Error handler
+ @param timeout The time to wait (in seconds) for the result, 0 to wait forever
+ @returns The result of the command
+ */
+- (nullable NMSSHCommandResult *)execute:(nonnull NSString *)command
+                                   error:(NSError * _Nullable * _Nullable)error
+                                 timeout:(nonnull NSNumber *)timeout;
+
+@end
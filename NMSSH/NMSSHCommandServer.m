@@ -0,0 +1,327 @@
+#import "NMSSHCommandServer.h"
+#import "NMSSH+Protected.h"
+
+// Sentinels start with a control character commands hardly ever print
+#define kNMSSHCommandSentinel "\036"
+
+@implementation NMSSHCommandResult
+
+- (NSString *)output {
+    return [[NSString alloc] initWithData:self.standardOutput encoding:NSUTF8StringEncoding];
+}
+
+@end
+
+// A command written to the shell, waiting for its sentinels
+@interface NMSSHCommandRequest : NSObject
+@property (nonatomic, strong) NMSSHCommandResult *result;
+@property (nonatomic, strong) NSData *outputSentinel;
+@property (nonatomic, strong) NSData *errorSentinel;
+@property (nonatomic, assign) BOOL outputReceived;
+@property (nonatomic, assign) BOOL errorReceived;
+@property (nonatomic, copy) void (^handler)(NMSSHCommandResult *, NSError *);
+@end
+
+@implementation NMSSHCommandRequest
+@end
+
+@interface NMSSHCommandServer () <NMSSHChannelDelegate> {
+    // Where the next sentinel searches may start, earlier bytes were searched
+    NSUInteger _outputSearchOffset;
+    NSUInteger _errorSearchOffset;
+}
+@property (nonatomic, strong) NMSSHSession *session;
+@property (nonatomic, strong) NMSSHChannel *channel;
+@property (nonatomic, strong) NSString *token;
+@property (atomic, assign) BOOL running;
+
+// Only touched on the session queue
+@property (nonatomic, assign) NSUInteger sequence;
+@property (nonatomic, strong) NSMutableArray *requests;
+@property (nonatomic, strong) NSMutableData *output;
+@property (nonatomic, strong) NSMutableData *errorOutput;
+@end
+
+@implementation NMSSHCommandServer
+
+// -----------------------------------------------------------------------------
+#pragma mark - INITIALIZER
+// -----------------------------------------------------------------------------
+
+- (instancetype)initWithSession:(NMSSHSession *)session {
+    if ((self = [super init])) {
+        [self setSession:session];
+        [self setChannel:[[NMSSHChannel alloc] initWithSession:session]];
+        [self setToken:[NSString stringWithFormat:@"NMSSH-%@", [[NSUUID UUID] UUIDString]]];
+        [self setRequests:[NSMutableArray array]];
+        [self setOutput:[NSMutableData data]];
+        [self setErrorOutput:[NSMutableData data]];
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    if (self.running) {
+        [self.channel closeShell];
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SHELL
+// -----------------------------------------------------------------------------
+
+- (BOOL)start:(NSError *__autoreleasing *)error {
+    // sh whatever the login shell is, without a terminal mangling the output
+    [self.channel setShellCommand:@"/bin/sh"];
+    [self.channel setRequestPty:NO];
+    [self.channel setDeliveryMode:NMSSHChannelDeliveryImmediate];
+    [self.channel setDeliveryQueue:self.session.queue];
+    [self.channel setDelegate:self];
+
+    if (![self.channel startShell:error]) {
+        return NO;
+    }
+
+    [self setRunning:YES];
+
+    // Anything printed by the startup files of the login shell goes to a
+    // first empty command
+    [self enqueueCommand:@":" handler:nil];
+
+    return YES;
+}
+
+- (void)stop {
+    [self.channel closeShell];
+
+    [self.session performBlockAndWait:^{
+        [self failRequestsWithDescription:@"The command server was stopped"];
+    }];
+}
+
+- (NSUInteger)pendingCommands {
+    __block NSUInteger count = 0;
+    [self.session performBlockAndWait:^{
+        count = [self.requests count];
+    }];
+
+    return count;
+}
+
+- (void)failRequestsWithDescription:(NSString *)description {
+    [self setRunning:NO];
+
+    NSArray *requests = [self.requests copy];
+    [self.requests removeAllObjects];
+    [self.output setLength:0];
+    [self.errorOutput setLength:0];
+    _outputSearchOffset = 0;
+    _errorSearchOffset = 0;
+
+    NSError *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelReadError
+                                     userInfo:@{ NSLocalizedDescriptionKey : description }];
+    for (NMSSHCommandRequest *request in requests) {
+        if (request.handler) {
+            request.handler(nil, error);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - COMMANDS
+// -----------------------------------------------------------------------------
+
+- (void)execute:(NSString *)command completionHandler:(void (^)(NMSSHCommandResult *, NSError *))completionHandler {
+    dispatch_queue_t callbackQueue = self.session.callbackQueue;
+
+    [self enqueueCommand:command handler:^(NMSSHCommandResult *result, NSError *error) {
+        if (completionHandler) {
+            dispatch_async(callbackQueue, ^{
+                completionHandler(result, error);
+            });
+        }
+    }];
+}
+
+- (NMSSHCommandResult *)execute:(NSString *)command error:(NSError *__autoreleasing *)error timeout:(NSNumber *)timeout {
+    // The output is read on the session queue, waiting there would never end
+    if ([self.session isOnQueue]) {
+        NMSSHLogError(@"Commands can't be awaited on the session queue");
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelExecutionError
+                                     userInfo:@{ NSLocalizedDescriptionKey : @"Commands can't be awaited on the session queue" }];
+        }
+
+        return nil;
+    }
+
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    __block NMSSHCommandResult *result = nil;
+    __block NSError *executionError = nil;
+
+    // The handler runs on the session queue, the callback queue may be the calling one
+    NMSSHCommandRequest *request = [self enqueueCommand:command handler:^(NMSSHCommandResult *blockResult, NSError *blockError) {
+        result = blockResult;
+        executionError = blockError;
+        dispatch_semaphore_signal(done);
+    }];
+
+    dispatch_time_t deadline = [timeout doubleValue] > 0 ? dispatch_time(DISPATCH_TIME_NOW, (int64_t)([timeout doubleValue] * NSEC_PER_SEC)) : DISPATCH_TIME_FOREVER;
+    long timedOut = dispatch_semaphore_wait(done, deadline);
+
+    if (timedOut) {
+        // The command still runs and its output still has to be consumed,
+        // only its handler is dropped. It may have completed meanwhile.
+        [self.session performBlockAndWait:^{
+            [request setHandler:nil];
+        }];
+        timedOut = dispatch_semaphore_wait(done, DISPATCH_TIME_NOW);
+    }
+
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(done);
+#endif
+
+    if (timedOut) {
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHChannelExecutionTimeout
+                                     userInfo:@{ @"command" : command, NSLocalizedDescriptionKey : @"The command timed out" }];
+        }
+
+        return nil;
+    }
+
+    if (error && executionError) {
+        *error = executionError;
+    }
+
+    return result;
+}
+
+- (NMSSHCommandRequest *)enqueueCommand:(NSString *)command handler:(void (^)(NMSSHCommandResult *, NSError *))handler {
+    // Returned right away, its handler is only called and changed on the session queue
+    NMSSHCommandRequest *request = [[NMSSHCommandRequest alloc] init];
+    [request setHandler:handler];
+
+    dispatch_async(self.session.queue, ^{
+        if (!self.running) {
+            if (request.handler) {
+                request.handler(nil, [NSError errorWithDomain:@"NMSSH"
+                                                         code:NMSSHChannelExecutionError
+                                                     userInfo:@{ NSLocalizedDescriptionKey : @"The command server is not running" }]);
+            }
+            return;
+        }
+
+        [self setSequence:self.sequence + 1];
+        NSString *sentinel = [NSString stringWithFormat:@"%@:%lu", self.token, (unsigned long)self.sequence];
+
+        NMSSHCommandResult *result = [[NMSSHCommandResult alloc] init];
+        [result setCommand:command];
+
+        [request setResult:result];
+        [request setOutputSentinel:[[NSString stringWithFormat:@kNMSSHCommandSentinel "%@:", sentinel] dataUsingEncoding:NSUTF8StringEncoding]];
+        [request setErrorSentinel:[[NSString stringWithFormat:@kNMSSHCommandSentinel "%@\n", sentinel] dataUsingEncoding:NSUTF8StringEncoding]];
+        [self.requests addObject:request];
+
+        // The command runs in a subshell reading /dev/null, eval turns its
+        // syntax errors into an exit status. Both outputs end with a sentinel,
+        // the one of the standard output carries the exit status.
+        NSString *quotedCommand = [NSString stringWithFormat:@"'%@'", [command stringByReplacingOccurrencesOfString:@"'" withString:@"'\\''"]];
+        NSString *line = [NSString stringWithFormat:@"(eval %@) </dev/null; printf '\\036%%s:%%s\\n' '%@' \"$?\"; printf '\\036%%s\\n' '%@' >&2\n",
+                          quotedCommand, sentinel, sentinel];
+
+        [self.channel writeData:[line dataUsingEncoding:NSUTF8StringEncoding] completionHandler:^(NSError *error) {
+            if (error) {
+                dispatch_async(self.session.queue, ^{
+                    [self failRequestsWithDescription:[error localizedDescription]];
+                });
+            }
+        }];
+    });
+
+    return request;
+}
+
+/// Search a sentinel, bytes that cannot start it are not searched twice
+- (NSRange)findSentinel:(NSData *)sentinel inData:(NSData *)data offset:(NSUInteger *)offset {
+    if ([data length] < *offset + [sentinel length]) {
+        return NSMakeRange(NSNotFound, 0);
+    }
+
+    NSRange range = [data rangeOfData:sentinel options:0 range:NSMakeRange(*offset, [data length] - *offset)];
+    *offset = range.location != NSNotFound ? range.location : [data length] - [sentinel length] + 1;
+
+    return range;
+}
+
+- (void)processOutputs {
+    while ([self.requests count] > 0) {
+        NMSSHCommandRequest *request = self.requests[0];
+
+        if (!request.outputReceived) {
+            NSRange sentinel = [self findSentinel:request.outputSentinel inData:self.output offset:&_outputSearchOffset];
+            NSRange newline = NSMakeRange(NSNotFound, 0);
+            if (sentinel.location != NSNotFound) {
+                newline = [self.output rangeOfData:[NSData dataWithBytes:"\n" length:1]
+                                           options:0
+                                             range:NSMakeRange(NSMaxRange(sentinel), [self.output length] - NSMaxRange(sentinel))];
+            }
+
+            if (newline.location != NSNotFound) {
+                NSData *status = [self.output subdataWithRange:NSMakeRange(NSMaxRange(sentinel), newline.location - NSMaxRange(sentinel))];
+                [request.result setExitStatus:[[[NSString alloc] initWithData:status encoding:NSUTF8StringEncoding] intValue]];
+                [request.result setStandardOutput:[self.output subdataWithRange:NSMakeRange(0, sentinel.location)]];
+                [request setOutputReceived:YES];
+
+                [self.output replaceBytesInRange:NSMakeRange(0, NSMaxRange(newline)) withBytes:NULL length:0];
+                _outputSearchOffset = 0;
+            }
+        }
+
+        if (!request.errorReceived) {
+            NSRange sentinel = [self findSentinel:request.errorSentinel inData:self.errorOutput offset:&_errorSearchOffset];
+            if (sentinel.location != NSNotFound) {
+                [request.result setStandardError:[self.errorOutput subdataWithRange:NSMakeRange(0, sentinel.location)]];
+                [request setErrorReceived:YES];
+
+                [self.errorOutput replaceBytesInRange:NSMakeRange(0, NSMaxRange(sentinel)) withBytes:NULL length:0];
+                _errorSearchOffset = 0;
+            }
+        }
+
+        // Results arrive in order, the next command has to wait for this one
+        if (!request.outputReceived || !request.errorReceived) {
+            break;
+        }
+
+        [self.requests removeObjectAtIndex:0];
+        if (request.handler) {
+            request.handler(request.result, nil);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - CHANNEL DELEGATE
+// -----------------------------------------------------------------------------
+
+- (void)channel:(NMSSHChannel *)channel didReadRawData:(NSData *)data {
+    [self.output appendData:data];
+    [self processOutputs];
+}
+
+- (void)channel:(NMSSHChannel *)channel didReadRawError:(NSData *)error {
+    [self.errorOutput appendData:error];
+    [self processOutputs];
+}
+
+- (void)channelShellDidClose:(NMSSHChannel *)channel {
+    [self failRequestsWithDescription:@"The shell was closed"];
+}
+
+@end
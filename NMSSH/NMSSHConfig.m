@@ -81,6 +81,20 @@ typedef enum {
 
     // Get the string value of the first token.
     NSString *keyword = [line substringWithRange:range];
+
+    // Keywords and arguments may also be separated by "=" and optional blanks
+    NSRange equalsRange = [keyword rangeOfString:@"="];
+    if (equalsRange.location != NSNotFound) {
+        arguments = [[keyword substringFromIndex:NSMaxRange(equalsRange)] stringByAppendingString:arguments];
+        keyword = [keyword substringToIndex:equalsRange.location];
+    }
+    else {
+        NSString *trimmedArguments = [arguments stringByTrimmingCharactersInSet:[self blanksCharacterSet]];
+        if ([trimmedArguments hasPrefix:@"="]) {
+            arguments = [trimmedArguments substringFromIndex:1];
+        }
+    }
+
     if ([keyword hasPrefix:@"#"] ||
         [keyword length] == 0) {
         return;
@@ -102,6 +116,9 @@ typedef enum {
     else if ([keyword localizedCaseInsensitiveCompare:@"identityfile"] == NSOrderedSame) {
         [self parseIdentityFileWithArguments:arguments intoArray:array];
     }
+    else if ([keyword localizedCaseInsensitiveCompare:@"proxycommand"] == NSOrderedSame) {
+        [self parseProxyCommandWithArguments:arguments intoArray:array];
+    }
 }
 
 - (void)parseHostWithArguments:(NSString *)arguments intoArray:(NSMutableArray *)array {
@@ -187,6 +204,21 @@ typedef enum {
     }
 }
 
+- (void)parseProxyCommandWithArguments:(NSString *)arguments
+                             intoArray:(NSMutableArray *)array {
+    if ([array count] == 0) {
+        return;
+    }
+    NMSSHHostConfig *config = [array lastObject];
+
+    // The command is the rest of the line, it is passed verbatim to the shell
+    NSString *command = [arguments stringByTrimmingCharactersInSet:[self blanksCharacterSet]];
+
+    if ([command length] > 0) {
+        [config setProxyCommand:command];
+    }
+}
+
 - (NSCharacterSet *)blanksCharacterSet {
     NSMutableCharacterSet *blanksCharacterSet = [[NSMutableCharacterSet alloc] init];
     [blanksCharacterSet addCharactersInRange:NSMakeRange(' ', 1)];
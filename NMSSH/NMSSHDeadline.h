@@ -0,0 +1,65 @@
+#import "NMSSH.h"
+
+/**
+ NMSSHDeadline is a point in time after which an operation gives up.
+
+ Deadlines are measured on a monotonic clock, they are not affected by changes
+ of the system clock. A deadline is applied to everything run on a session
+ with -[NMSSHSession performWithDeadline:block:]:
+
+    NMSSHDeadline *deadline = [NMSSHDeadline deadlineWithTimeout:30];
+    [session performWithDeadline:deadline block:^{
+        [session connect];
+        [session authenticateByPassword:@"pass"];
+        [session.sftp contentsAtPath:@"/var/log/system.log"];
+    }];
+
+ The budget is shared by the name resolution, the connection, the handshake,
+ the authentication and every later call. Once it is spent, the libssh2 call in
+ progress is aborted and fails with a timeout.
+ */
+@interface NMSSHDeadline : NSObject
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ Create a deadline expiring after the given time.
+
+ @param timeout Time interval from now, in seconds
+ @returns New deadline
+ */
++ (nonnull instancetype)deadlineWithTimeout:(NSTimeInterval)timeout;
+
+/**
+ A deadline that never expires.
+
+ @returns Shared distant deadline
+ */
++ (nonnull instancetype)distantDeadline;
+
+/** Time left before the deadline, in seconds, 0 once expired (read-only). */
+@property (nonatomic, readonly) NSTimeInterval remainingTime;
+
+/** A Boolean value indicating whether the deadline passed (read-only). */
+@property (nonatomic, readonly, getter = isExpired) BOOL expired;
+
+/** A Boolean value indicating whether the deadline never expires (read-only). */
+@property (nonatomic, readonly, getter = isDistant) BOOL distant;
+
+/**
+ The earliest of the receiver and a deadline expiring after the given time.
+
+ @param timeout Time interval from now, in seconds, ignored when not positive
+ @returns Combined deadline
+ */
+- (nonnull NMSSHDeadline *)deadlineWithTimeout:(NSTimeInterval)timeout;
+
+/**
+ The earliest of the receiver and another deadline.
+
+ @param deadline Another deadline, may be `nil`
+ @returns Combined deadline
+ */
+- (nonnull NMSSHDeadline *)earliestDeadline:(nullable NMSSHDeadline *)deadline;
+
+@end
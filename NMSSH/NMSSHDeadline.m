@@ -0,0 +1,118 @@
+#import "NMSSHDeadline.h"
+#import "NMSSH+Protected.h"
+
+#import <mach/mach_time.h>
+
+@interface NMSSHDeadline ()
+@property (nonatomic, assign) uint64_t expiration;
+@end
+
+@implementation NMSSHDeadline
+
+// -----------------------------------------------------------------------------
+#pragma mark - MONOTONIC CLOCK
+// -----------------------------------------------------------------------------
+
+static uint64_t NMSSHDeadlineNow(void) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&timebase);
+    });
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - INITIALIZER
+// -----------------------------------------------------------------------------
+
+- (instancetype)initWithExpiration:(uint64_t)expiration {
+    if ((self = [super init])) {
+        [self setExpiration:expiration];
+    }
+
+    return self;
+}
+
++ (instancetype)deadlineWithTimeout:(NSTimeInterval)timeout {
+    return [[self alloc] initWithExpiration:NMSSHDeadlineNow() + (uint64_t)(MAX(timeout, 0) * NSEC_PER_SEC)];
+}
+
++ (instancetype)distantDeadline {
+    static NMSSHDeadline *deadline;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        deadline = [[self alloc] initWithExpiration:UINT64_MAX];
+    });
+
+    return deadline;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - REMAINING TIME
+// -----------------------------------------------------------------------------
+
+- (BOOL)isDistant {
+    return self.expiration == UINT64_MAX;
+}
+
+- (BOOL)isExpired {
+    return !self.isDistant && NMSSHDeadlineNow() >= self.expiration;
+}
+
+- (NSTimeInterval)remainingTime {
+    if (self.isDistant) {
+        return DBL_MAX;
+    }
+
+    uint64_t now = NMSSHDeadlineNow();
+    return now < self.expiration ? (NSTimeInterval)(self.expiration - now) / NSEC_PER_SEC : 0;
+}
+
+- (long)remainingMilliseconds {
+    if (self.isDistant) {
+        return 0;
+    }
+
+    // libssh2 reads a zero timeout as no timeout at all
+    return MAX((long)ceil(self.remainingTime * 1000), 1);
+}
+
+- (dispatch_time_t)dispatchTime {
+    if (self.isDistant) {
+        return DISPATCH_TIME_FOREVER;
+    }
+
+    return dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.remainingTime * NSEC_PER_SEC));
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - COMBINING DEADLINES
+// -----------------------------------------------------------------------------
+
+- (NMSSHDeadline *)deadlineWithTimeout:(NSTimeInterval)timeout {
+    if (timeout <= 0) {
+        return self;
+    }
+
+    return [self earliestDeadline:[NMSSHDeadline deadlineWithTimeout:timeout]];
+}
+
+- (NMSSHDeadline *)earliestDeadline:(NMSSHDeadline *)deadline {
+    if (!deadline || self.expiration <= deadline.expiration) {
+        return self;
+    }
+
+    return deadline;
+}
+
+- (NSString *)description {
+    if (self.isDistant) {
+        return [NSString stringWithFormat:@"<%@: %p, distant>", NSStringFromClass([self class]), self];
+    }
+
+    return [NSString stringWithFormat:@"<%@: %p, %.3fs remaining>", NSStringFromClass([self class]), self, self.remainingTime];
+}
+
+@end
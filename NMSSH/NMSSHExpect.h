@@ -0,0 +1,144 @@
+#import "NMSSH.h"
+
+typedef NS_ENUM(NSInteger, NMSSHExpectPatternType) {
+    NMSSHExpectPatternLiteral,
+    NMSSHExpectPatternRegularExpression
+};
+
+/**
+ NMSSHExpectPattern is a string awaited in the output of a shell, see
+ -[NMSSHChannel expect:error:timeout:].
+ */
+@interface NMSSHExpectPattern : NSObject
+
+/**
+ A pattern matching the exact bytes of a string.
+
+ @param string The awaited string, e.g. a prompt
+ @returns Literal pattern, `nil` for an empty string
+ */
++ (nullable instancetype)patternWithString:(nonnull NSString *)string;
+
+/**
+ A pattern matching a regular expression.
+
+ Regular expressions are applied to one line at a time, they cannot match
+ across a line feed.
+
+ @param pattern ICU regular expression
+ @param options Options of the regular expression
+ @param error Error handler, for invalid expressions
+ @returns Regular expression pattern
+ */
++ (nullable instancetype)patternWithRegularExpression:(nonnull NSString *)pattern
+                                              options:(NSRegularExpressionOptions)options
+                                                error:(NSError * _Nullable * _Nullable)error;
+
+/** Kind of the pattern (read-only). */
+@property (nonatomic, readonly) NMSSHExpectPatternType type;
+
+/** The literal string or the source of the regular expression (read-only). */
+@property (nonatomic, nonnull, readonly) NSString *string;
+
+/** The compiled regular expression, `nil` for literals (read-only). */
+@property (nonatomic, nullable, readonly) NSRegularExpression *regularExpression;
+
+/**
+ Seconds after which the pattern stops being awaited, defaults to 0 for the
+ timeout of the whole expectation.
+ */
+@property (nonatomic, assign) NSTimeInterval timeout;
+
+@end
+
+/**
+ NMSSHExpectMatch describes the pattern found by an expectation.
+ */
+@interface NMSSHExpectMatch : NSObject
+
+/** Index of the matching pattern in the awaited patterns (read-only). */
+@property (nonatomic, readonly) NSUInteger patternIndex;
+
+/** The matching pattern (read-only). */
+@property (nonatomic, nonnull, readonly) NMSSHExpectPattern *pattern;
+
+/** Position of the match in the bytes scanned by the expectation (read-only). */
+@property (nonatomic, readonly) NSRange range;
+
+/** The matched bytes (read-only). */
+@property (nonatomic, nonnull, readonly) NSData *matchedData;
+
+/**
+ The matched string followed by the capture groups of a regular expression,
+ `@""` for groups that did not participate (read-only).
+ */
+@property (nonatomic, nonnull, readonly) NSArray<NSString *> *captures;
+
+/**
+ The output received before the match, up to -[NMSSHChannel expectBufferSize]
+ bytes. `nil` when the match comes from NMSSHExpect directly (read-only).
+ */
+@property (nonatomic, nullable, readonly) NSData *precedingData;
+
+@end
+
+/**
+ NMSSHExpect finds the first of several patterns in a byte stream fed chunk by
+ chunk.
+
+ Literal patterns are compiled into a single Aho-Corasick automaton: every byte
+ costs one table lookup whatever the number of patterns, and a literal split
+ over several chunks is found as soon as its last byte arrives. Regular
+ expressions are evaluated against the current line when it ends, when a
+ literal matches and at the end of every chunk; the match ending first wins.
+ Lines are capped to `maximumLineLength` bytes, so the memory used does not
+ depend on the length of the stream.
+
+ Regular expressions are not linear: every evaluation decodes and searches the
+ whole current line again, so a long line received in many small chunks costs
+ up to `maximumLineLength` bytes per chunk. Prefer literals for the patterns
+ awaited in bulk output, and keep `maximumLineLength` to the longest line a
+ regular expression has to see.
+ */
+@interface NMSSHExpect : NSObject
+
+/**
+ Create a matcher.
+
+ @param patterns Patterns to look for, earlier patterns win ties
+ @returns Matcher in its initial state
+ */
+- (nonnull instancetype)initWithPatterns:(nonnull NSArray<NMSSHExpectPattern *> *)patterns;
+
+/** The awaited patterns (read-only). */
+@property (nonatomic, nonnull, readonly) NSArray<NMSSHExpectPattern *> *patterns;
+
+/** Bytes of a line kept for the regular expressions, defaults to 4096 */
+@property (nonatomic, assign) NSUInteger maximumLineLength;
+
+/** A Boolean value indicating whether some pattern can still match (read-only). */
+@property (nonatomic, readonly) BOOL hasEnabledPatterns;
+
+/**
+ Scan the next chunk of the stream.
+
+ Once a pattern matched, the bytes following it are not scanned and the
+ matcher has to be reset before scanning again.
+
+ @param bytes Chunk of the stream
+ @param length Length of the chunk
+ @returns The first match, or `nil`
+ */
+- (nullable NMSSHExpectMatch *)scanBytes:(nonnull const void *)bytes length:(NSUInteger)length;
+
+/**
+ Stop looking for a pattern, e.g. once its timeout expired.
+
+ @param index Index of the pattern
+ */
+- (void)disablePatternAtIndex:(NSUInteger)index;
+
+/** Forget the stream scanned so far and enable all the patterns again. */
+- (void)reset;
+
+@end
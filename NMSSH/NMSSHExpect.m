@@ -0,0 +1,405 @@
+#import "NMSSHExpect.h"
+#import "NMSSH+Protected.h"
+
+#define kNMSSHExpectDefaultLineLength (4096)
+
+// -----------------------------------------------------------------------------
+#pragma mark - PATTERN
+// -----------------------------------------------------------------------------
+
+@interface NMSSHExpectPattern ()
+@property (nonatomic, readwrite) NMSSHExpectPatternType type;
+@property (nonatomic, strong) NSString *string;
+@property (nonatomic, strong) NSRegularExpression *regularExpression;
+@end
+
+@implementation NMSSHExpectPattern
+
++ (instancetype)patternWithString:(NSString *)string {
+    // An empty literal would match before any output
+    if ([string length] == 0) {
+        NMSSHLogError(@"An expect pattern can't be an empty string");
+        return nil;
+    }
+
+    NMSSHExpectPattern *pattern = [[self alloc] init];
+    [pattern setType:NMSSHExpectPatternLiteral];
+    [pattern setString:[string copy]];
+
+    return pattern;
+}
+
++ (instancetype)patternWithRegularExpression:(NSString *)source
+                                     options:(NSRegularExpressionOptions)options
+                                       error:(NSError *__autoreleasing *)error {
+    NSRegularExpression *expression = [NSRegularExpression regularExpressionWithPattern:source options:options error:error];
+    if (!expression) {
+        return nil;
+    }
+
+    NMSSHExpectPattern *pattern = [[self alloc] init];
+    [pattern setType:NMSSHExpectPatternRegularExpression];
+    [pattern setString:[source copy]];
+    [pattern setRegularExpression:expression];
+
+    return pattern;
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"<%@: %@%@>", NSStringFromClass([self class]),
+            self.type == NMSSHExpectPatternLiteral ? @"" : @"/", self.string];
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - MATCH
+// -----------------------------------------------------------------------------
+
+@implementation NMSSHExpectMatch
+
+- (instancetype)initWithPattern:(NMSSHExpectPattern *)pattern
+                        atIndex:(NSUInteger)index
+                          range:(NSRange)range
+                    matchedData:(NSData *)matchedData
+                       captures:(NSArray *)captures {
+    if ((self = [super init])) {
+        _pattern = pattern;
+        _patternIndex = index;
+        _range = range;
+        _matchedData = matchedData;
+        _captures = captures;
+    }
+
+    return self;
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - MATCHER
+// -----------------------------------------------------------------------------
+
+@interface NMSSHExpect () {
+    // Aho-Corasick automaton of the literals, with a transition for every byte
+    int32_t *_transitions;
+    // Lowest index of the literals ending exactly in a state, or -1
+    int32_t *_literalAtState;
+    // Nearest state reached through failure links ending a literal, or -1
+    int32_t *_outputLink;
+    // Next literal identical to a literal, or -1
+    int32_t *_nextDuplicate;
+    int32_t _state;
+
+    BOOL *_disabled;
+    NSUInteger _position;
+    NSUInteger _lineStart;
+    BOOL _matched;
+}
+@property (nonatomic, strong) NSArray *patterns;
+@property (nonatomic, strong) NSArray *literals;
+@property (nonatomic, strong) NSMutableData *line;
+@property (nonatomic, assign) NSUInteger regularExpressionCount;
+@end
+
+@implementation NMSSHExpect
+
+- (instancetype)initWithPatterns:(NSArray *)patterns {
+    if ((self = [super init])) {
+        [self setPatterns:[patterns copy]];
+        [self setMaximumLineLength:kNMSSHExpectDefaultLineLength];
+        [self setLine:[NSMutableData data]];
+
+        NSMutableArray *literals = [NSMutableArray arrayWithCapacity:[patterns count]];
+        for (NMSSHExpectPattern *pattern in patterns) {
+            if (pattern.type == NMSSHExpectPatternLiteral) {
+                [literals addObject:[pattern.string dataUsingEncoding:NSUTF8StringEncoding]];
+            }
+            else {
+                [literals addObject:[NSNull null]];
+                [self setRegularExpressionCount:self.regularExpressionCount + 1];
+            }
+        }
+
+        [self setLiterals:literals];
+        _disabled = calloc(MAX([patterns count], 1), sizeof(BOOL));
+        [self buildAutomaton];
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    free(_transitions);
+    free(_literalAtState);
+    free(_outputLink);
+    free(_nextDuplicate);
+    free(_disabled);
+}
+
+- (void)buildAutomaton {
+    NSUInteger capacity = 1;
+    for (id literal in self.literals) {
+        if (literal != [NSNull null]) {
+            capacity += [literal length];
+        }
+    }
+
+    _transitions = malloc(capacity * 256 * sizeof(int32_t));
+    _literalAtState = malloc(capacity * sizeof(int32_t));
+    _outputLink = malloc(capacity * sizeof(int32_t));
+    _nextDuplicate = malloc(MAX([self.literals count], 1) * sizeof(int32_t));
+    int32_t *failure = malloc(capacity * sizeof(int32_t));
+    int32_t *queue = malloc(capacity * sizeof(int32_t));
+
+    memset(_transitions, 0xFF, capacity * 256 * sizeof(int32_t));
+    memset(_literalAtState, 0xFF, capacity * sizeof(int32_t));
+    memset(_outputLink, 0xFF, capacity * sizeof(int32_t));
+    memset(_nextDuplicate, 0xFF, MAX([self.literals count], 1) * sizeof(int32_t));
+
+    // Trie of the literals
+    __block int32_t states = 1;
+    [self.literals enumerateObjectsUsingBlock:^(id literal, NSUInteger index, BOOL *stop) {
+        if (literal == [NSNull null]) {
+            return;
+        }
+
+        const unsigned char *bytes = [literal bytes];
+        int32_t state = 0;
+        for (NSUInteger i = 0; i < [literal length]; i++) {
+            int32_t *next = &_transitions[state * 256 + bytes[i]];
+            if (*next < 0) {
+                *next = states++;
+            }
+            state = *next;
+        }
+
+        if (_literalAtState[state] < 0) {
+            _literalAtState[state] = (int32_t)index;
+            return;
+        }
+
+        int32_t last = _literalAtState[state];
+        while (_nextDuplicate[last] >= 0) {
+            last = _nextDuplicate[last];
+        }
+        _nextDuplicate[last] = (int32_t)index;
+    }];
+
+    // Breadth-first, the failure link of a state is known before its children
+    // are visited, missing transitions are completed from it
+    NSUInteger head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int32_t child = _transitions[c];
+        if (child < 0) {
+            _transitions[c] = 0;
+        }
+        else {
+            failure[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+
+    while (head < tail) {
+        int32_t state = queue[head++];
+
+        for (int c = 0; c < 256; c++) {
+            int32_t child = _transitions[state * 256 + c];
+            int32_t fallback = _transitions[failure[state] * 256 + c];
+
+            if (child < 0) {
+                _transitions[state * 256 + c] = fallback;
+                continue;
+            }
+
+            failure[child] = fallback;
+            _outputLink[child] = _literalAtState[fallback] >= 0 ? fallback : _outputLink[fallback];
+            queue[tail++] = child;
+        }
+    }
+
+    free(failure);
+    free(queue);
+}
+
+- (BOOL)hasEnabledPatterns {
+    for (NSUInteger i = 0; i < [self.patterns count]; i++) {
+        if (!_disabled[i]) {
+            return YES;
+        }
+    }
+
+    return NO;
+}
+
+- (void)disablePatternAtIndex:(NSUInteger)index {
+    if (index < [self.patterns count]) {
+        _disabled[index] = YES;
+    }
+}
+
+- (void)reset {
+    _state = 0;
+    _position = 0;
+    _lineStart = 0;
+    _matched = NO;
+    memset(_disabled, 0, MAX([self.patterns count], 1) * sizeof(BOOL));
+    [self.line setLength:0];
+}
+
+- (NMSSHExpectMatch *)literalMatchInState:(int32_t)state {
+    int32_t best = -1;
+
+    // Every literal ending here is a suffix of the longest one, the earliest
+    // pattern wins
+    for (int32_t s = _literalAtState[state] >= 0 ? state : _outputLink[state]; s >= 0; s = _outputLink[s]) {
+        // Identical literals share their state, chained by increasing index
+        for (int32_t index = _literalAtState[s]; index >= 0; index = _nextDuplicate[index]) {
+            if (!_disabled[index]) {
+                if (best < 0 || index < best) {
+                    best = index;
+                }
+                break;
+            }
+        }
+    }
+
+    if (best < 0) {
+        return nil;
+    }
+
+    NSData *literal = self.literals[best];
+    return [[NMSSHExpectMatch alloc] initWithPattern:self.patterns[best]
+                                             atIndex:best
+                                               range:NSMakeRange(_position - [literal length], [literal length])
+                                         matchedData:literal
+                                            captures:@[self.patterns[best] string]];
+}
+
+- (NMSSHExpectMatch *)regularExpressionMatchInLine {
+    if (self.regularExpressionCount == 0 || [self.line length] == 0) {
+        return nil;
+    }
+
+    // A character may be split at the end of the chunk
+    NSStringEncoding encoding = NSUTF8StringEncoding;
+    NSUInteger length = [self.line length];
+    NSString *line = nil;
+    for (NSUInteger trimmed = 0; !line && trimmed < 4 && trimmed < length; trimmed++) {
+        line = [[NSString alloc] initWithBytes:[self.line bytes] length:length - trimmed encoding:NSUTF8StringEncoding];
+    }
+
+    // Binary noise is matched byte for byte
+    if (!line) {
+        encoding = NSISOLatin1StringEncoding;
+        line = [[NSString alloc] initWithBytes:[self.line bytes] length:length encoding:encoding];
+    }
+
+    NMSSHExpectMatch *best = nil;
+    for (NSUInteger index = 0; index < [self.patterns count]; index++) {
+        NMSSHExpectPattern *pattern = self.patterns[index];
+        if (pattern.type != NMSSHExpectPatternRegularExpression || _disabled[index]) {
+            continue;
+        }
+
+        NSTextCheckingResult *result = [pattern.regularExpression firstMatchInString:line options:0 range:NSMakeRange(0, [line length])];
+        if (!result) {
+            continue;
+        }
+
+        NSUInteger start = [[line substringToIndex:result.range.location] lengthOfBytesUsingEncoding:encoding];
+        NSUInteger matchLength = [[line substringWithRange:result.range] lengthOfBytesUsingEncoding:encoding];
+
+        // The match ending first wins
+        if (best && NSMaxRange(best.range) <= _lineStart + start + matchLength) {
+            continue;
+        }
+
+        NSMutableArray *captures = [NSMutableArray arrayWithCapacity:result.numberOfRanges];
+        for (NSUInteger i = 0; i < result.numberOfRanges; i++) {
+            NSRange range = [result rangeAtIndex:i];
+            [captures addObject:range.location == NSNotFound ? @"" : [line substringWithRange:range]];
+        }
+
+        best = [[NMSSHExpectMatch alloc] initWithPattern:pattern
+                                                 atIndex:index
+                                                   range:NSMakeRange(_lineStart + start, matchLength)
+                                             matchedData:[self.line subdataWithRange:NSMakeRange(start, matchLength)]
+                                                captures:captures];
+    }
+
+    return best;
+}
+
+- (void)appendLineBytes:(const unsigned char *)bytes length:(NSUInteger)length {
+    [self.line appendBytes:bytes length:length];
+
+    // Keep the end of overlong lines, dropping half at once keeps the cost linear
+    if ([self.line length] >= 2 * MAX(self.maximumLineLength, 1)) {
+        NSUInteger dropped = [self.line length] - self.maximumLineLength;
+        [self.line replaceBytesInRange:NSMakeRange(0, dropped) withBytes:NULL length:0];
+        _lineStart += dropped;
+    }
+}
+
+- (NMSSHExpectMatch *)scanBytes:(const void *)bytes length:(NSUInteger)length {
+    if (_matched) {
+        return nil;
+    }
+
+    const unsigned char *cursor = bytes;
+    const unsigned char *end = cursor + length;
+    NMSSHExpectMatch *match = nil;
+
+    // Lines are only kept for regular expressions, copied a run at a time
+    BOOL keepsLines = (self.regularExpressionCount > 0);
+    const unsigned char *run = cursor;
+
+    while (cursor < end && !match) {
+        unsigned char byte = *cursor++;
+        _state = _transitions[_state * 256 + byte];
+        _position++;
+
+        if (_literalAtState[_state] >= 0 || _outputLink[_state] >= 0) {
+            match = [self literalMatchInState:_state];
+        }
+
+        // A regular expression may match the line so far and end before the
+        // literal, or with it as an earlier pattern
+        if (match && keepsLines) {
+            [self appendLineBytes:run length:cursor - run];
+            run = cursor;
+
+            NMSSHExpectMatch *lineMatch = [self regularExpressionMatchInLine];
+            if (lineMatch && (NSMaxRange(lineMatch.range) < NSMaxRange(match.range) ||
+                              (NSMaxRange(lineMatch.range) == NSMaxRange(match.range) && lineMatch.patternIndex < match.patternIndex))) {
+                match = lineMatch;
+            }
+
+            break;
+        }
+
+        if (!match && byte == '\n' && keepsLines) {
+            [self appendLineBytes:run length:cursor - run];
+            run = cursor;
+
+            match = [self regularExpressionMatchInLine];
+            [self.line setLength:0];
+            _lineStart = _position;
+        }
+    }
+
+    if (keepsLines) {
+        [self appendLineBytes:run length:cursor - run];
+    }
+
+    if (!match) {
+        match = [self regularExpressionMatchInLine];
+    }
+
+    _matched = (match != nil);
+
+    return match;
+}
+
+@end
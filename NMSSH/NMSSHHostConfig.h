@@ -42,6 +42,19 @@
  */
 @property(nonatomic, strong) NSArray *identityFiles;
 
+/**
+ Specifies the command to use to connect to the server. The command is
+ executed using the user's shell, it should read from its standard input and
+ write to its standard output, e.g. `nc %h %p` or `ssh -W %h:%p bastion`.
+ The client should perform the following substitutions on the command:
+   "%h" should be replaced with the remote host name
+   "%p" should be replaced with the remote port
+   "%r" should be replaced with the remote user name
+   "%%" should be replaced with a literal "%"
+ The value "none" disables the proxy command.
+ */
+@property(nonatomic, strong) NSString *proxyCommand;
+
 /**
  Values for {other} are copied to {self} if not already set. Arrays are
  appended from {other} without adding duplicates.
@@ -39,6 +39,9 @@
     }
     [self setIdentityFiles:[self mergedArray:self.identityFiles
                                    withArray:other.identityFiles]];
+    if (!self.proxyCommand) {
+        [self setProxyCommand:other.proxyCommand];
+    }
 }
 
 @end
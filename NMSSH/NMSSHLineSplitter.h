@@ -0,0 +1,49 @@
+#import "NMSSH.h"
+
+/** Called with a line, without its line feed. The bytes are only valid during the call. */
+typedef void (^NMSSHLineHandler)(const char * _Nonnull line, NSUInteger length);
+
+/**
+ NMSSHLineSplitter splits a byte stream into lines as it arrives.
+
+ Line feeds are searched 16 bytes at a time with SSE2 or NEON where available.
+ Lines are handed out as slices of the bytes consumed, without any copy or
+ allocation. Only a line split between two chunks is kept, until the chunk
+ that completes it:
+
+    NMSSHLineSplitter *splitter = [[NMSSHLineSplitter alloc] init];
+
+    [splitter splitBytes:bytes length:length handler:^(const char *line, NSUInteger length) {
+        ...
+    }];
+
+ A handler that keeps a line has to copy it.
+ */
+@interface NMSSHLineSplitter : NSObject
+
+/** Whether a carriage return ending a line is dropped, as printed on a pty. Defaults to YES. */
+@property (nonatomic, assign) BOOL stripsCarriageReturns;
+
+/** Bytes of the incomplete line kept (read-only). */
+@property (nonatomic, readonly) NSUInteger bufferedLength;
+
+/**
+ Consume the next chunk of the stream.
+
+ @param bytes Bytes of the chunk
+ @param length Length of the chunk
+ @param handler Called with every line the chunk completes, in order
+ */
+- (void)splitBytes:(nonnull const void *)bytes length:(NSUInteger)length handler:(nonnull NMSSHLineHandler)handler;
+
+/**
+ End the stream.
+
+ @param handler Called with the last line if the stream does not end with a line feed
+ */
+- (void)finishWithHandler:(nonnull NMSSHLineHandler)handler;
+
+/** Drop the incomplete line kept, if any. */
+- (void)reset;
+
+@end
@@ -0,0 +1,118 @@
+#import "NMSSHLineSplitter.h"
+#import "NMSSH+Protected.h"
+
+// Newline masks have kNMSSHNewlineStride bits per byte of a block, the highest
+// of them set for a line feed
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#define kNMSSHNewlineBlock (16)
+#define kNMSSHNewlineStride (1)
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#define kNMSSHNewlineBlock (16)
+#define kNMSSHNewlineStride (4)
+#else
+#define kNMSSHNewlineBlock (8)
+#define kNMSSHNewlineStride (8)
+#endif
+
+/// Mask of the line feeds in a block, the lowest bits are the first bytes
+static inline uint64_t NMSSHNewlineMask(const uint8_t *bytes) {
+#if defined(__SSE2__)
+    __m128i block = _mm_loadu_si128((const __m128i *)bytes);
+    return (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // NEON has no movemask, narrowing the comparison leaves a nibble per byte
+    uint8x16_t matches = vceqq_u8(vld1q_u8(bytes), vdupq_n_u8('\n'));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ULL;
+#else
+    // The high bit of a byte is set if it is zero, without borrows across bytes
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    word ^= 0x0A0A0A0A0A0A0A0AULL;
+    uint64_t low = (word & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL;
+    return ~(low | word | 0x7F7F7F7F7F7F7F7FULL);
+#endif
+}
+
+@interface NMSSHLineSplitter ()
+// Start of a line that did not end in the previous chunks
+@property (nonatomic, strong) NSMutableData *partialLine;
+@end
+
+@implementation NMSSHLineSplitter
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        [self setStripsCarriageReturns:YES];
+        [self setPartialLine:[NSMutableData data]];
+    }
+
+    return self;
+}
+
+- (NSUInteger)bufferedLength {
+    return [self.partialLine length];
+}
+
+- (void)reset {
+    [self.partialLine setLength:0];
+}
+
+- (void)deliverLine:(const char *)line length:(NSUInteger)length handler:(NMSSHLineHandler)handler {
+    if (self.stripsCarriageReturns && length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+
+    handler(line, length);
+}
+
+- (void)deliverBytes:(const uint8_t *)bytes length:(NSUInteger)length handler:(NMSSHLineHandler)handler {
+    // Only the first line of a chunk may have started earlier
+    if ([self.partialLine length] > 0) {
+        [self.partialLine appendBytes:bytes length:length];
+        [self deliverLine:[self.partialLine bytes] length:[self.partialLine length] handler:handler];
+        [self.partialLine setLength:0];
+        return;
+    }
+
+    [self deliverLine:(const char *)bytes length:length handler:handler];
+}
+
+- (void)splitBytes:(const void *)bytes length:(NSUInteger)length handler:(NMSSHLineHandler)handler {
+    const uint8_t *input = bytes;
+    NSUInteger lineStart = 0;
+    NSUInteger i = 0;
+
+    for (; i + kNMSSHNewlineBlock <= length; i += kNMSSHNewlineBlock) {
+        uint64_t mask = NMSSHNewlineMask(input + i);
+
+        while (mask) {
+            NSUInteger newline = i + __builtin_ctzll(mask) / kNMSSHNewlineStride;
+            [self deliverBytes:input + lineStart length:newline - lineStart handler:handler];
+            lineStart = newline + 1;
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < length; i++) {
+        if (input[i] == '\n') {
+            [self deliverBytes:input + lineStart length:i - lineStart handler:handler];
+            lineStart = i + 1;
+        }
+    }
+
+    if (lineStart < length) {
+        [self.partialLine appendBytes:input + lineStart length:length - lineStart];
+    }
+}
+
+- (void)finishWithHandler:(NMSSHLineHandler)handler {
+    if ([self.partialLine length] > 0) {
+        [self deliverLine:[self.partialLine bytes] length:[self.partialLine length] handler:handler];
+        [self.partialLine setLength:0];
+    }
+}
+
+@end
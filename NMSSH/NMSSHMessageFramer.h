@@ -0,0 +1,75 @@
+#import "NMSSH.h"
+
+typedef NS_ENUM(NSInteger, NMSSHMessageFramerError) {
+    NMSSHMessageFramerInvalidFrame,
+    NMSSHMessageFramerMessageTooLong
+};
+
+typedef NS_ENUM(NSInteger, NMSSHMessageFraming) {
+    NMSSHMessageFramingDelimiter,     // Every message ends with the delimiter, `]]>]]>` for NETCONF 1.0
+    NMSSHMessageFramingChunked,       // Chunked framing of NETCONF 1.1 (RFC 6242)
+    NMSSHMessageFramingLengthPrefixed // A 32-bit big-endian length precedes every message, as in SFTP
+};
+
+/**
+ NMSSHMessageFramer splits a byte stream into messages and frames outgoing
+ messages, for the protocols spoken over subsystems.
+
+ Incoming bytes are consumed as they arrive, a message split between reads is
+ kept until it is complete:
+
+    NMSSHMessageFramer *framer = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingLengthPrefixed];
+
+    for (NSData *message in [framer messagesFromData:data error:&error]) {
+        ...
+    }
+
+ The framing may be changed between two messages, e.g. from the delimiter to
+ the chunked framing once NETCONF peers exchanged their hello messages.
+ */
+@interface NMSSHMessageFramer : NSObject
+
+/** The framing of the stream. Change it between two messages only. */
+@property (nonatomic, assign) NMSSHMessageFraming framing;
+
+/** The delimiter of NMSSHMessageFramingDelimiter, defaults to `]]>]]>`. */
+@property (nonatomic, nonnull, copy) NSData *delimiter;
+
+/** Longest message accepted, defaults to 16 MiB. */
+@property (nonatomic, assign) NSUInteger maximumMessageLength;
+
+/** Bytes received that are not part of a complete message yet (read-only). */
+@property (nonatomic, readonly) NSUInteger bufferedLength;
+
+/**
+ Create a framer.
+
+ @param framing Framing of the stream
+ @returns Framer with an empty buffer
+ */
++ (nonnull instancetype)framerWithFraming:(NMSSHMessageFraming)framing;
+
+/**
+ Frame a message to be written to the stream.
+
+ @param message Message
+ @returns Framed message
+ */
+- (nonnull NSData *)frameMessage:(nonnull NSData *)message;
+
+/**
+ Consume received bytes.
+
+ After an error, the stream can't be trusted anymore: the buffer is emptied
+ and the framer should be reset before it is used again.
+
+ @param data Received bytes
+ @param error Error handler
+ @returns The messages completed by the bytes, `nil` if the stream is not valid
+ */
+- (nullable NSArray<NSData *> *)messagesFromData:(nonnull NSData *)data error:(NSError * _Nullable * _Nullable)error;
+
+/** Drop the buffered bytes. */
+- (void)reset;
+
+@end
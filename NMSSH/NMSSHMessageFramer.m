@@ -0,0 +1,283 @@
+#import "NMSSHMessageFramer.h"
+#import "NMSSH+Protected.h"
+
+#define kNMSSHMessageFramerDefaultMaximum (16 * 1024 * 1024)
+
+// Chunk sizes of RFC 6242 are at most 4294967295, 10 digits
+#define kNMSSHMessageFramerChunkDigits (10)
+
+@interface NMSSHMessageFramer () {
+    // Bytes before _offset were consumed, they are dropped in bulk
+    NSUInteger _offset;
+    // Where the next delimiter search starts
+    NSUInteger _searchOffset;
+}
+@property (nonatomic, strong) NSMutableData *buffer;
+// Chunks of the NETCONF 1.1 message being received
+@property (nonatomic, strong) NSMutableData *chunks;
+@end
+
+@implementation NMSSHMessageFramer
+
++ (instancetype)framerWithFraming:(NMSSHMessageFraming)framing {
+    NMSSHMessageFramer *framer = [[self alloc] init];
+    [framer setFraming:framing];
+
+    return framer;
+}
+
+- (instancetype)init {
+    if ((self = [super init])) {
+        [self setDelimiter:[NSData dataWithBytes:"]]>]]>" length:6]];
+        [self setMaximumMessageLength:kNMSSHMessageFramerDefaultMaximum];
+        [self setBuffer:[NSMutableData data]];
+        [self setChunks:[NSMutableData data]];
+    }
+
+    return self;
+}
+
+- (NSUInteger)bufferedLength {
+    return [self.buffer length] - _offset + [self.chunks length];
+}
+
+- (void)reset {
+    [self.buffer setLength:0];
+    [self.chunks setLength:0];
+    _offset = 0;
+    _searchOffset = 0;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - OUTGOING MESSAGES
+// -----------------------------------------------------------------------------
+
+- (NSData *)frameMessage:(NSData *)message {
+    NSMutableData *frame = nil;
+
+    switch (self.framing) {
+        case NMSSHMessageFramingDelimiter:
+            frame = [NSMutableData dataWithCapacity:[message length] + [self.delimiter length]];
+            [frame appendData:message];
+            [frame appendData:self.delimiter];
+            break;
+
+        case NMSSHMessageFramingChunked: {
+            frame = [NSMutableData dataWithCapacity:[message length] + 32];
+            if ([message length] > 0) {
+                char header[kNMSSHMessageFramerChunkDigits + 4];
+                int length = snprintf(header, sizeof(header), "\n#%lu\n", (unsigned long)[message length]);
+                [frame appendBytes:header length:length];
+                [frame appendData:message];
+            }
+            [frame appendBytes:"\n##\n" length:4];
+            break;
+        }
+
+        case NMSSHMessageFramingLengthPrefixed: {
+            uint32_t length = htonl((uint32_t)[message length]);
+            frame = [NSMutableData dataWithCapacity:[message length] + sizeof(length)];
+            [frame appendBytes:&length length:sizeof(length)];
+            [frame appendData:message];
+            break;
+        }
+    }
+
+    return frame;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - INCOMING MESSAGES
+// -----------------------------------------------------------------------------
+
+- (NSArray *)messagesFromData:(NSData *)data error:(NSError *__autoreleasing *)error {
+    [self.buffer appendData:data];
+
+    NSMutableArray *messages = [NSMutableArray array];
+    NSError *framingError = nil;
+
+    while (YES) {
+        NSData *message = nil;
+
+        switch (self.framing) {
+            case NMSSHMessageFramingDelimiter:
+                message = [self nextDelimitedMessage:&framingError];
+                break;
+
+            case NMSSHMessageFramingChunked:
+                message = [self nextChunkedMessage:&framingError];
+                break;
+
+            case NMSSHMessageFramingLengthPrefixed:
+                message = [self nextLengthPrefixedMessage:&framingError];
+                break;
+        }
+
+        if (!message) {
+            break;
+        }
+
+        [messages addObject:message];
+    }
+
+    if (framingError) {
+        NMSSHLogError(@"%@", [framingError localizedDescription]);
+        [self reset];
+
+        if (error) {
+            *error = framingError;
+        }
+
+        return nil;
+    }
+
+    // Consumed bytes are dropped once they outweigh the rest
+    if (_offset > 0 && _offset >= [self.buffer length] - _offset) {
+        [self.buffer replaceBytesInRange:NSMakeRange(0, _offset) withBytes:NULL length:0];
+        _searchOffset -= MIN(_searchOffset, _offset);
+        _offset = 0;
+    }
+
+    return messages;
+}
+
+- (NSError *)errorWithCode:(NMSSHMessageFramerError)code description:(NSString *)description {
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:code
+                           userInfo:@{ NSLocalizedDescriptionKey : description }];
+}
+
+- (NSData *)nextDelimitedMessage:(NSError *__autoreleasing *)error {
+    const char *bytes = [self.buffer bytes];
+    NSUInteger length = [self.buffer length];
+    NSUInteger delimiterLength = [self.delimiter length];
+    const char *delimiter = [self.delimiter bytes];
+
+    if (delimiterLength == 0) {
+        *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"The message delimiter is empty"];
+        return nil;
+    }
+
+    NSUInteger position = MAX(_searchOffset, _offset);
+    while (position + delimiterLength <= length) {
+        const char *candidate = memchr(bytes + position, delimiter[0], length - delimiterLength + 1 - position);
+        if (!candidate) {
+            break;
+        }
+
+        position = candidate - bytes;
+        if (memcmp(candidate, delimiter, delimiterLength) == 0) {
+            NSData *message = [self.buffer subdataWithRange:NSMakeRange(_offset, position - _offset)];
+            _offset = position + delimiterLength;
+            _searchOffset = _offset;
+
+            return message;
+        }
+
+        position++;
+    }
+
+    // The end may be the start of a delimiter
+    _searchOffset = length >= delimiterLength ? MAX(length - delimiterLength + 1, _offset) : _offset;
+
+    if (length - _offset > self.maximumMessageLength + delimiterLength) {
+        *error = [self errorWithCode:NMSSHMessageFramerMessageTooLong description:@"The message is too long"];
+    }
+
+    return nil;
+}
+
+- (NSData *)nextLengthPrefixedMessage:(NSError *__autoreleasing *)error {
+    uint32_t prefix;
+    if ([self.buffer length] - _offset < sizeof(prefix)) {
+        return nil;
+    }
+
+    memcpy(&prefix, (const char *)[self.buffer bytes] + _offset, sizeof(prefix));
+    NSUInteger length = ntohl(prefix);
+
+    if (length > self.maximumMessageLength) {
+        *error = [self errorWithCode:NMSSHMessageFramerMessageTooLong description:@"The message is too long"];
+        return nil;
+    }
+
+    if ([self.buffer length] - _offset - sizeof(prefix) < length) {
+        return nil;
+    }
+
+    NSData *message = [self.buffer subdataWithRange:NSMakeRange(_offset + sizeof(prefix), length)];
+    _offset += sizeof(prefix) + length;
+
+    return message;
+}
+
+/// chunk = LF HASH chunk-size LF chunk-data, end-of-chunks = LF HASH HASH LF
+- (NSData *)nextChunkedMessage:(NSError *__autoreleasing *)error {
+    const unsigned char *bytes = [self.buffer bytes];
+    NSUInteger length = [self.buffer length];
+
+    while (YES) {
+        NSUInteger available = length - _offset;
+        const unsigned char *header = bytes + _offset;
+
+        if (available < 4) {
+            if ((available > 0 && header[0] != '\n') || (available > 1 && header[1] != '#')) {
+                *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"Invalid chunk header"];
+            }
+            return nil;
+        }
+
+        if (header[0] != '\n' || header[1] != '#') {
+            *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"Invalid chunk header"];
+            return nil;
+        }
+
+        if (header[2] == '#') {
+            if (header[3] != '\n' || [self.chunks length] == 0) {
+                *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"Invalid end of chunks"];
+                return nil;
+            }
+
+            _offset += 4;
+            NSData *message = [self.chunks copy];
+            [self.chunks setLength:0];
+
+            return message;
+        }
+
+        // The size has no leading zero, the line feed ends it
+        uint64_t size = 0;
+        NSUInteger i = 2;
+        for (; i < available && i < 2 + kNMSSHMessageFramerChunkDigits + 1 && header[i] != '\n'; i++) {
+            if (header[i] < '0' || header[i] > '9' || (i == 2 && header[i] == '0')) {
+                *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"Invalid chunk size"];
+                return nil;
+            }
+
+            size = size * 10 + (header[i] - '0');
+        }
+
+        if (i == available) {
+            return nil;
+        }
+
+        if (header[i] != '\n' || i == 2 || size > UINT32_MAX) {
+            *error = [self errorWithCode:NMSSHMessageFramerInvalidFrame description:@"Invalid chunk size"];
+            return nil;
+        }
+
+        if ([self.chunks length] + size > self.maximumMessageLength) {
+            *error = [self errorWithCode:NMSSHMessageFramerMessageTooLong description:@"The message is too long"];
+            return nil;
+        }
+
+        if (available - i - 1 < size) {
+            return nil;
+        }
+
+        [self.chunks appendBytes:header + i + 1 length:(NSUInteger)size];
+        _offset += i + 1 + (NSUInteger)size;
+    }
+}
+
+@end
@@ -0,0 +1,66 @@
+#import "NMSSH.h"
+
+typedef NS_ENUM(NSInteger, NMSSHOperationPriority) {
+    NMSSHOperationPriorityBulk = -1,       // Large transfers, they get the bandwidth left by the other classes
+    NMSSHOperationPriorityDefault = 0,
+    NMSSHOperationPriorityInteractive = 1  // Keystrokes and short requests, run ahead of the other classes
+};
+
+/**
+ NMSSHOperation represents an asynchronous call made on a NMSSHSession, one of
+ its channels or its SFTP instance.
+
+ Asynchronous methods return immediately and call their completion handler on
+ the `callbackQueue` of the session once done:
+
+    [session authenticateByPassword:@"pass" completionHandler:^(NSError *error) {
+        if (!error) {
+            NSLog(@"Successfully authorized");
+        }
+    }];
+
+ The operations of a session are run in submission order, one at a time, on
+ the session queue. They only use non-blocking libssh2 calls, resumed when the
+ session socket is ready, so no thread is ever blocked waiting for the server
+ and any number of operations can be in flight at once.
+
+ Operations of the same priority class run in submission order. The classes
+ share the session by weight: an interactive operation waits for no more than
+ the libssh2 call in progress, while bulk transfers still get a share of the
+ bandwidth when the other classes are busy. Set the `priority` of a channel or
+ of a SFTP instance to pick the class of its operations.
+ */
+@interface NMSSHOperation : NSObject
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/** A Boolean value indicating whether the operation has been cancelled (read-only). */
+@property (atomic, readonly, getter = isCancelled) BOOL cancelled;
+
+/** A Boolean value indicating whether the operation has finished (read-only). */
+@property (atomic, readonly, getter = isFinished) BOOL finished;
+
+/**
+ The deadline of the operation, `nil` if it may run forever (read-only).
+
+ Operations started from -[NMSSHSession performWithDeadline:block:] get its
+ deadline. An expired operation fails with a `NMSSHSessionTimeoutError` error.
+ */
+@property (atomic, nullable, readonly) NMSSHDeadline *deadline;
+
+/** The priority class of the operation (read-only). */
+@property (atomic, readonly) NMSSHOperationPriority priority;
+
+/**
+ Cancel the operation.
+
+ An operation waiting in the queue is removed right away. A running operation
+ stops as soon as the libssh2 call in progress completes and releases the
+ remote resources it holds (channels, SFTP handles).
+
+ The completion handler is called with a `NSUserCancelledError` error unless
+ the operation already finished.
+ */
+- (void)cancel;
+
+@end
@@ -0,0 +1,228 @@
+#import "NMSSHOperation.h"
+#import "NMSSH+Protected.h"
+
+// Consecutive kNMSSHStepContinue results before the session queue is yielded
+#define kNMSSHOperationBatch 16
+
+@interface NMSSHOperation ()
+@property (atomic, readwrite, getter = isCancelled) BOOL cancelled;
+@property (atomic, readwrite, getter = isFinished) BOOL finished;
+@property (nonatomic, readwrite, getter = isWaiting) BOOL waiting;
+@property (nonatomic, readwrite, getter = isStarted) BOOL started;
+
+@property (nonatomic, strong) NSArray<NMSSHOperationStep> *steps;
+@property (nonatomic, copy) NMSSHOperationStep cleanup;
+@property (nonatomic, copy) void (^completion)(NSError *error);
+@property (nonatomic, assign) NSUInteger index;
+@property (nonatomic, assign) BOOL cleanedUp;
+@end
+
+@implementation NMSSHOperation
+
+// -----------------------------------------------------------------------------
+#pragma mark - INITIALIZER
+// -----------------------------------------------------------------------------
+
+- (instancetype)initWithSteps:(NSArray<NMSSHOperationStep> *)steps
+                      cleanup:(NMSSHOperationStep)cleanup
+                   completion:(void (^)(NSError *))completion {
+    if ((self = [super init])) {
+        NSMutableArray *copiedSteps = [NSMutableArray arrayWithCapacity:[steps count]];
+        for (NMSSHOperationStep step in steps) {
+            [copiedSteps addObject:[step copy]];
+        }
+
+        [self setSteps:copiedSteps];
+        [self setCleanup:cleanup];
+        [self setCompletion:completion];
+        [self setRequiresSession:YES];
+    }
+
+    return self;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - CANCELLATION
+// -----------------------------------------------------------------------------
+
+- (void)cancel {
+    if (self.isFinished || self.isCancelled) {
+        return;
+    }
+
+    [self setCancelled:YES];
+
+    // Wake the session up, the operation may be waiting for the socket
+    [self.session resumeOperations];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - STEPS
+// -----------------------------------------------------------------------------
+
+- (NSError *)cancellationError {
+    return [NSError errorWithDomain:NSCocoaErrorDomain
+                               code:NSUserCancelledError
+                           userInfo:@{ NSLocalizedDescriptionKey : @"Operation cancelled" }];
+}
+
+- (NSError *)timeoutError {
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:NMSSHSessionTimeoutError
+                           userInfo:@{ NSLocalizedDescriptionKey : @"Operation timed out" }];
+}
+
+- (NSError *)disconnectionError {
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:NMSSHSessionDisconnectedError
+                           userInfo:@{ NSLocalizedDescriptionKey : @"Session disconnected" }];
+}
+
+- (NMSSHOperationStep)currentStep {
+    BOOL disconnected = self.requiresSession && !self.session.rawSession;
+
+    // Cancellation is only honored between libssh2 calls, abandoning a call
+    // in progress would corrupt the state of the session. An expired deadline
+    // aborts the call anyway, like a libssh2 blocking timeout does.
+    if (self.index < [self.steps count]) {
+        if (self.deadline.isExpired) {
+            [self failWithError:[self timeoutError]];
+        }
+        else if (self.isCancelled && !self.isWaiting) {
+            [self failWithError:[self cancellationError]];
+        }
+        else if (disconnected && !self.isWaiting) {
+            [self failWithError:[self disconnectionError]];
+        }
+    }
+
+    if (self.index < [self.steps count]) {
+        return self.steps[self.index];
+    }
+
+    if (self.cleanup && !self.cleanedUp && !disconnected) {
+        return self.cleanup;
+    }
+
+    return nil;
+}
+
+- (void)failWithError:(NSError *)error {
+    if (!self.error) {
+        [self setError:error];
+    }
+
+    [self setIndex:[self.steps count]];
+}
+
+- (void)completeStep:(int)rc {
+    if (self.index >= [self.steps count]) {
+        // Errors while releasing resources are not reported
+        if (rc != kNMSSHStepContinue) {
+            [self setCleanedUp:YES];
+        }
+
+        return;
+    }
+
+    if (rc < 0) {
+        [self failWithError:self.error ?: [self.session lastError]];
+    }
+    else if (rc == kNMSSHStepDone) {
+        [self setIndex:self.index + 1];
+    }
+}
+
+- (int)run {
+    NSUInteger iterations = 0;
+    [self setStarted:YES];
+
+    for (;;) {
+        NMSSHOperationStep step = [self currentStep];
+        if (!step) {
+            return kNMSSHStepDone;
+        }
+
+        int rc = step(self);
+        [self setWaiting:(rc == LIBSSH2_ERROR_EAGAIN)];
+
+        // Releasing resources on a server past the deadline could hang as
+        // well, they are freed along with the session instead
+        if (rc == LIBSSH2_ERROR_EAGAIN && self.index >= [self.steps count] && self.deadline.isExpired) {
+            [self setWaiting:NO];
+            [self setCleanedUp:YES];
+            continue;
+        }
+
+        if (rc == LIBSSH2_ERROR_EAGAIN || rc == kNMSSHStepSuspend) {
+            return rc;
+        }
+
+        [self completeStep:rc];
+
+        // Long transfers let the other users of the session in regularly,
+        // right away when more urgent operations are queued
+        if (rc == kNMSSHStepContinue &&
+            (++iterations == kNMSSHOperationBatch || [self.session hasOperationsAbovePriority:self.priority])) {
+            return kNMSSHStepContinue;
+        }
+    }
+}
+
+- (void)settle {
+    if (!self.isWaiting) {
+        return;
+    }
+
+    NMSSHOperationStep step = self.index < [self.steps count] ? self.steps[self.index] : self.cleanup;
+    int rc = step(self);
+    [self setWaiting:(rc == LIBSSH2_ERROR_EAGAIN)];
+
+    if (rc != LIBSSH2_ERROR_EAGAIN && rc != kNMSSHStepSuspend) {
+        [self completeStep:rc];
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - COMPLETION
+// -----------------------------------------------------------------------------
+
+- (BOOL)finishIfAbandoned {
+    if (self.isCancelled) {
+        [self finishWithError:[self cancellationError]];
+    }
+    else if (self.deadline.isExpired) {
+        [self finishWithError:[self timeoutError]];
+    }
+    else {
+        return NO;
+    }
+
+    return YES;
+}
+
+- (void)finishWithError:(NSError *)error {
+    [self failWithError:error ?: [self cancellationError]];
+    [self setCleanedUp:YES];
+    [self finish];
+}
+
+- (void)finish {
+    if (self.isFinished) {
+        return;
+    }
+
+    [self setFinished:YES];
+
+    void (^completion)(NSError *) = self.completion;
+    NSError *error = self.error;
+    [self setCompletion:nil];
+
+    if (completion) {
+        dispatch_async(self.callbackQueue ?: dispatch_get_main_queue(), ^{
+            completion(error);
+        });
+    }
+}
+
+@end
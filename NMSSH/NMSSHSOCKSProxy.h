@@ -0,0 +1,106 @@
+#import "NMSSH.h"
+
+@class NMSSHSession;
+
+typedef NS_ENUM(NSInteger, NMSSHSOCKSProxyError) {
+    NMSSHSOCKSProxySocketError,
+    NMSSHSOCKSProxyBindError,
+    NMSSHSOCKSProxySessionError
+};
+
+/**
+ NMSSHSOCKSProxy provides a local SOCKS5 server (dynamic port forwarding, like
+ `ssh -D`) on top of one or more authorized NMSSHSession instances.
+
+ Every SOCKS `CONNECT` request is turned into a `direct-tcpip` channel opened on
+ the least loaded session of the pool, so any number of clients can tunnel
+ through a handful of authenticated SSH connections:
+
+    NMSSHSOCKSProxy *proxy = [[NMSSHSOCKSProxy alloc] initWithSession:session];
+
+    NSError *error = nil;
+    if ([proxy startOnPort:1080 error:&error]) {
+        NSLog(@"SOCKS5 proxy listening on 127.0.0.1:%u", proxy.port);
+    }
+
+ The clients of a session and its channels are serviced without blocking on
+ the session queue, so the sessions can keep being used for anything else
+ while the proxy is running. Data is never buffered beyond `bufferSize` per
+ direction and per client: a client is not read while the remote window of its
+ channel is exhausted, and a channel is not read while its client is not
+ accepting data, so the SSH flow control is propagated end to end.
+ */
+@interface NMSSHSOCKSProxy : NSObject
+
+/** The sessions used to open the forwarding channels (read-only). */
+@property (nonatomic, nonnull, readonly) NSArray<NMSSHSession *> *sessions;
+
+/** Size of the per-direction buffer of every client, defaults to 0x4000 */
+@property (nonatomic, assign) NSUInteger bufferSize;
+
+/** Maximum number of concurrent clients, 0 means unlimited (default). */
+@property (nonatomic, assign) NSUInteger maximumConnections;
+
+/** The port the proxy is listening on, 0 if the proxy is not running (read-only). */
+@property (nonatomic, readonly) uint16_t port;
+
+/** A Boolean value indicating whether the proxy is accepting clients (read-only). */
+@property (nonatomic, readonly, getter = isRunning) BOOL running;
+
+/** The number of clients currently connected (read-only). */
+@property (nonatomic, readonly) NSUInteger activeConnections;
+
+/// ----------------------------------------------------------------------------
+/// @name Initializer
+/// ----------------------------------------------------------------------------
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ Create a new NMSSHSOCKSProxy instance using a single session.
+
+ @param session A valid, connected and authorized, NMSSHSession instance
+ @returns New NMSSHSOCKSProxy instance
+ */
+- (nonnull instancetype)initWithSession:(nonnull NMSSHSession *)session;
+
+/**
+ Create a new NMSSHSOCKSProxy instance using a pool of sessions.
+
+ Each new client is assigned to the authorized session with the fewest active
+ clients.
+
+ @param sessions An array of connected and authorized NMSSHSession instances
+ @returns New NMSSHSOCKSProxy instance
+ */
+- (nonnull instancetype)initWithSessions:(nonnull NSArray<NMSSHSession *> *)sessions NS_DESIGNATED_INITIALIZER;
+
+/// ----------------------------------------------------------------------------
+/// @name Start/Stop the proxy
+/// ----------------------------------------------------------------------------
+
+/**
+ Start listening on the loopback interface.
+
+ @param port The port to listen on, use 0 to let the system pick a free port
+ @param error Error handler
+ @returns Start success
+ */
+- (BOOL)startOnPort:(uint16_t)port error:(NSError * _Nullable * _Nullable)error;
+
+/**
+ Start listening on a given IPv4 address.
+
+ @param address The IPv4 address to bind, e.g. `@"127.0.0.1"` or `@"0.0.0.0"`
+ @param port The port to listen on, use 0 to let the system pick a free port
+ @param error Error handler
+ @returns Start success
+ */
+- (BOOL)startOnAddress:(nonnull NSString *)address port:(uint16_t)port error:(NSError * _Nullable * _Nullable)error;
+
+/**
+ Stop accepting clients and close every open tunnel.
+ */
+- (void)stop;
+
+@end
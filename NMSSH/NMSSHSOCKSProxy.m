@@ -0,0 +1,1027 @@
+#import "NMSSHSOCKSProxy.h"
+#import "NMSSH+Protected.h"
+#import <fcntl.h>
+#import <netinet/tcp.h>
+
+#define kNMSSHSOCKSVersion         0x05
+#define kNMSSHSOCKSMethodNone      0x00
+#define kNMSSHSOCKSMethodRejected  0xFF
+#define kNMSSHSOCKSCommandConnect  0x01
+#define kNMSSHSOCKSAddressIPv4     0x01
+#define kNMSSHSOCKSAddressDomain   0x03
+#define kNMSSHSOCKSAddressIPv6     0x04
+
+typedef NS_ENUM(uint8_t, NMSSHSOCKSReply) {
+    NMSSHSOCKSReplySucceeded           = 0x00,
+    NMSSHSOCKSReplyGeneralFailure      = 0x01,
+    NMSSHSOCKSReplyConnectionRefused   = 0x05,
+    NMSSHSOCKSReplyCommandNotSupported = 0x07,
+    NMSSHSOCKSReplyAddressNotSupported = 0x08
+};
+
+typedef NS_ENUM(NSInteger, NMSSHSOCKSState) {
+    NMSSHSOCKSStateGreeting,
+    NMSSHSOCKSStateRequest,
+    NMSSHSOCKSStateConnecting,
+    NMSSHSOCKSStateStreaming,
+    NMSSHSOCKSStateClosing
+};
+
+// -----------------------------------------------------------------------------
+#pragma mark - CLIENT CONNECTION
+// -----------------------------------------------------------------------------
+
+@class NMSSHSOCKSSessionPump;
+
+@interface NMSSHSOCKSConnection : NSObject
+@property (nonatomic, assign) int fd;
+@property (nonatomic, assign) uint16_t clientPort;
+@property (nonatomic, assign) NMSSHSOCKSState state;
+@property (nonatomic, weak) NMSSHSOCKSSessionPump *pump;
+@property (nonatomic, assign) LIBSSH2_CHANNEL *channel;
+
+@property (nonatomic, strong) NSMutableData *handshake;
+@property (nonatomic, assign) BOOL openInFlight;
+@property (nonatomic, strong) NSString *targetHost;
+@property (nonatomic, assign) uint16_t targetPort;
+
+// Client -> channel and channel -> client pending bytes
+@property (nonatomic, strong) NSMutableData *inbound;
+@property (nonatomic, assign) NSUInteger inboundOffset;
+@property (nonatomic, strong) NSMutableData *outbound;
+@property (nonatomic, assign) NSUInteger outboundOffset;
+
+@property (nonatomic, assign) BOOL clientEOF;
+@property (nonatomic, assign) BOOL sentEOF;
+@property (nonatomic, assign) BOOL channelEOF;
+@property (nonatomic, assign) BOOL clientShutdown;
+
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_source_t readSource;
+@property (nonatomic, strong) dispatch_source_t writeSource;
+#else
+@property (nonatomic, assign) dispatch_source_t readSource;
+@property (nonatomic, assign) dispatch_source_t writeSource;
+#endif
+@property (nonatomic, assign) BOOL readSuspended;
+@property (nonatomic, assign) BOOL writeSuspended;
+@end
+
+@implementation NMSSHSOCKSConnection
+
+- (void)suspendRead {
+    if (!self.readSuspended && self.readSource) {
+        dispatch_suspend(self.readSource);
+        [self setReadSuspended:YES];
+    }
+}
+
+- (void)resumeRead {
+    if (self.readSuspended && self.readSource) {
+        dispatch_resume(self.readSource);
+        [self setReadSuspended:NO];
+    }
+}
+
+- (void)suspendWrite {
+    if (!self.writeSuspended && self.writeSource) {
+        dispatch_suspend(self.writeSource);
+        [self setWriteSuspended:YES];
+    }
+}
+
+- (void)resumeWrite {
+    if (self.writeSuspended && self.writeSource) {
+        dispatch_resume(self.writeSource);
+        [self setWriteSuspended:NO];
+    }
+}
+
+- (BOOL)hasPendingInbound {
+    return self.inboundOffset < [self.inbound length];
+}
+
+- (BOOL)hasPendingOutbound {
+    return self.outboundOffset < [self.outbound length];
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - SESSION PUMP
+// -----------------------------------------------------------------------------
+
+@interface NMSSHSOCKSSessionPump : NSObject
+@property (nonatomic, strong) NMSSHSession *session;
+@property (nonatomic, strong) NSMutableArray<NMSSHSOCKSConnection *> *connections;
+@property (nonatomic, strong) NSMutableArray<NMSSHSOCKSConnection *> *pendingOpens;
+
+// Only accessed on the proxy queue, connections live on the session queue
+@property (nonatomic, assign) NSUInteger connectionCount;
+
+// Set on the proxy queue once the session queue found the session gone
+@property (nonatomic, assign, getter = isUnavailable) BOOL unavailable;
+
+// Registration with the read pump of the session, nil once stopped
+@property (nonatomic, strong) id pumpHandler;
+@end
+
+@implementation NMSSHSOCKSSessionPump
+@end
+
+// -----------------------------------------------------------------------------
+#pragma mark - PROXY
+// -----------------------------------------------------------------------------
+
+@interface NMSSHSOCKSProxy ()
+@property (nonatomic, strong) NSArray<NMSSHSession *> *sessions;
+@property (nonatomic, strong) NSArray<NMSSHSOCKSSessionPump *> *pumps;
+@property (nonatomic, readwrite) uint16_t port;
+@property (nonatomic, readwrite, getter = isRunning) BOOL running;
+@property (nonatomic, assign) int listenSocket;
+
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_queue_t queue;
+@property (nonatomic, strong) dispatch_source_t acceptSource;
+#else
+@property (nonatomic, assign) dispatch_queue_t queue;
+@property (nonatomic, assign) dispatch_source_t acceptSource;
+#endif
+@end
+
+@implementation NMSSHSOCKSProxy
+
+// -----------------------------------------------------------------------------
+#pragma mark - INITIALIZER
+// -----------------------------------------------------------------------------
+
+- (instancetype)initWithSession:(NMSSHSession *)session {
+    return [self initWithSessions:@[session]];
+}
+
+- (instancetype)initWithSessions:(NSArray<NMSSHSession *> *)sessions {
+    if ((self = [super init])) {
+        [self setSessions:[sessions copy]];
+        [self setBufferSize:kNMSSHBufferSize];
+        [self setMaximumConnections:0];
+        [self setListenSocket:-1];
+        [self setQueue:dispatch_queue_create("NMSSH.SOCKSProxy", DISPATCH_QUEUE_SERIAL)];
+
+        // Make sure we were provided valid sessions
+        for (NMSSHSession *session in sessions) {
+            if (![session isKindOfClass:[NMSSHSession class]]) {
+                @throw @"You have to provide a valid NMSSHSession!";
+            }
+        }
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(self.queue);
+#endif
+}
+
+- (NSUInteger)activeConnections {
+    __block NSUInteger count = 0;
+    dispatch_sync(self.queue, ^{
+        for (NMSSHSOCKSSessionPump *pump in self.pumps) {
+            count += pump.connectionCount;
+        }
+    });
+
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - START/STOP THE PROXY
+// -----------------------------------------------------------------------------
+
+- (BOOL)startOnPort:(uint16_t)port error:(NSError *__autoreleasing *)error {
+    return [self startOnAddress:@"127.0.0.1" port:port error:error];
+}
+
+- (BOOL)startOnAddress:(NSString *)address port:(uint16_t)port error:(NSError *__autoreleasing *)error {
+    if (self.isRunning) {
+        NMSSHLogWarn(@"The SOCKS proxy is already running");
+        return YES;
+    }
+
+    NSMutableArray *pumps = [NSMutableArray array];
+    for (NMSSHSession *session in self.sessions) {
+        if (session.isConnected && session.isAuthorized) {
+            NMSSHSOCKSSessionPump *pump = [[NMSSHSOCKSSessionPump alloc] init];
+            [pump setSession:session];
+            [pump setConnections:[NSMutableArray array]];
+            [pump setPendingOpens:[NSMutableArray array]];
+            [pumps addObject:pump];
+        }
+        else {
+            NMSSHLogWarn(@"Skipping session %@@%@, it is not authorized", session.username, session.host);
+        }
+    }
+
+    if ([pumps count] == 0) {
+        NMSSHLogError(@"The SOCKS proxy requires at least one authorized session");
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHSOCKSProxySessionError
+                                     userInfo:@{ NSLocalizedDescriptionKey : @"No authorized session available" }];
+        }
+
+        return NO;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        NMSSHLogError(@"Error creating the SOCKS listening socket");
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHSOCKSProxySocketError
+                                     userInfo:@{ NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(errno)] }];
+        }
+
+        return NO;
+    }
+
+    int set = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&set, sizeof(set));
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_len = sizeof(sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, [address UTF8String], &sin.sin_addr) != 1 ||
+        bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        NMSSHLogError(@"Unable to listen on %@:%u", address, port);
+        if (error) {
+            *error = [NSError errorWithDomain:@"NMSSH"
+                                         code:NMSSHSOCKSProxyBindError
+                                     userInfo:@{ NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(errno)] }];
+        }
+
+        close(fd);
+        return NO;
+    }
+
+    socklen_t length = sizeof(sin);
+    getsockname(fd, (struct sockaddr *)&sin, &length);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    [self setListenSocket:fd];
+    [self setPort:ntohs(sin.sin_port)];
+    [self setPumps:[pumps copy]];
+
+    for (NMSSHSOCKSSessionPump *pump in self.pumps) {
+        [pump.session performBlockAndWait:^{
+            [self startPump:pump];
+        }];
+    }
+
+    __weak NMSSHSOCKSProxy *weakSelf = self;
+    [self setAcceptSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, self.queue)];
+    dispatch_source_set_event_handler(self.acceptSource, ^{
+        [weakSelf acceptClients];
+    });
+    dispatch_source_set_cancel_handler(self.acceptSource, ^{
+        close(fd);
+    });
+    dispatch_resume(self.acceptSource);
+
+    [self setRunning:YES];
+    NMSSHLogInfo(@"SOCKS proxy listening on %@:%u", address, self.port);
+
+    return YES;
+}
+
+- (void)stop {
+    if (!self.isRunning) {
+        return;
+    }
+
+    dispatch_sync(self.queue, ^{
+        dispatch_source_cancel(self.acceptSource);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(self.acceptSource);
+#endif
+        [self setAcceptSource:nil];
+
+        for (NMSSHSOCKSSessionPump *pump in self.pumps) {
+            [pump.session performBlockAndWait:^{
+                [self stopPump:pump];
+            }];
+        }
+
+        [self setPumps:nil];
+    });
+
+    [self setListenSocket:-1];
+    [self setPort:0];
+    [self setRunning:NO];
+    NMSSHLogInfo(@"SOCKS proxy stopped");
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SESSION PUMPS
+// -----------------------------------------------------------------------------
+
+- (void)startPump:(NMSSHSOCKSSessionPump *)pump {
+    __weak NMSSHSOCKSProxy *weakSelf = self;
+    __weak NMSSHSOCKSSessionPump *weakPump = pump;
+
+    // The channels are serviced without blocking by the read pump of the
+    // session, along with its other streaming channels
+    [pump setPumpHandler:[pump.session addPumpHandler:^BOOL{
+        if (![weakSelf preparePump:weakPump]) {
+            return NO;
+        }
+
+        [weakSelf servicePump:weakPump];
+
+        return [weakSelf pumpWaitsForChannels:weakPump];
+    }]];
+}
+
+- (void)stopPump:(NMSSHSOCKSSessionPump *)pump {
+    [pump.session removePumpHandler:pump.pumpHandler];
+    [pump setPumpHandler:nil];
+
+    // Tear down the remaining tunnels synchronously, an open still in flight
+    // is completed first so libssh2 can't resume it for another channel
+    LIBSSH2_SESSION *session = pump.session.rawSession;
+    if (session) {
+        libssh2_session_set_blocking(session, 1);
+    }
+
+    for (NMSSHSOCKSConnection *connection in [pump.connections copy]) {
+        if (!session) {
+            // The channels went away along with the session
+            [connection setOpenInFlight:NO];
+            [connection setChannel:NULL];
+        }
+
+        [self closeConnection:connection];
+
+        if (connection.openInFlight) {
+            [self openChannelForConnection:connection];
+        }
+    }
+
+    [pump.connections removeAllObjects];
+    [pump.pendingOpens removeAllObjects];
+    [pump setConnectionCount:0];
+}
+
+- (BOOL)preparePump:(NMSSHSOCKSSessionPump *)pump {
+    if (!pump || !pump.session.rawSession) {
+        return NO;
+    }
+
+    // The session may be shared, any other operation leaves it blocking
+    libssh2_session_set_blocking(pump.session.rawSession, 0);
+
+    return YES;
+}
+
+- (void)removeConnection:(NMSSHSOCKSConnection *)connection {
+    NMSSHSOCKSSessionPump *pump = connection.pump;
+    if (![pump.connections containsObject:connection]) {
+        return;
+    }
+
+    [pump.connections removeObject:connection];
+    dispatch_async(self.queue, ^{
+        if (pump.connectionCount > 0) {
+            [pump setConnectionCount:pump.connectionCount - 1];
+        }
+    });
+}
+
+- (NMSSHSOCKSSessionPump *)leastLoadedPump {
+    NMSSHSOCKSSessionPump *best = nil;
+    for (NMSSHSOCKSSessionPump *pump in self.pumps) {
+        if (pump.isUnavailable) {
+            continue;
+        }
+
+        if (!best || pump.connectionCount < best.connectionCount) {
+            best = pump;
+        }
+    }
+
+    return best;
+}
+
+- (void)servicePump:(NMSSHSOCKSSessionPump *)pump {
+    if (!pump || !pump.session.rawSession) {
+        return;
+    }
+
+    // Channel opens can't overlap in libssh2, only the head of the queue is
+    // in flight at any time
+    while ([pump.pendingOpens count] > 0) {
+        NMSSHSOCKSConnection *connection = pump.pendingOpens[0];
+        if (![self openChannelForConnection:connection]) {
+            break;
+        }
+
+        [pump.pendingOpens removeObjectAtIndex:0];
+    }
+
+    // Reading a packet for one channel may have queued data for any other
+    // channel of the session, so all of them are serviced on every wakeup
+    for (NMSSHSOCKSConnection *connection in [pump.connections copy]) {
+        [self serviceConnection:connection];
+    }
+}
+
+// Whether a channel open is in flight or a tunnel reads its channel, the
+// socket is left alone while every client is busy draining its data
+- (BOOL)pumpWaitsForChannels:(NMSSHSOCKSSessionPump *)pump {
+    if (!pump) {
+        return NO;
+    }
+
+    if ([pump.pendingOpens count] > 0) {
+        return YES;
+    }
+
+    for (NMSSHSOCKSConnection *connection in pump.connections) {
+        if (connection.state == NMSSHSOCKSStateClosing ||
+            (connection.state == NMSSHSOCKSStateStreaming && ![connection hasPendingOutbound] && !connection.channelEOF)) {
+            return YES;
+        }
+    }
+
+    return NO;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - CLIENTS
+// -----------------------------------------------------------------------------
+
+- (void)acceptClients {
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int fd = accept(self.listenSocket, (struct sockaddr *)&address, &length);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                NMSSHLogError(@"SOCKS accept failed: %s", strerror(errno));
+            }
+
+            return;
+        }
+
+        NSUInteger active = 0;
+        for (NMSSHSOCKSSessionPump *pump in self.pumps) {
+            active += pump.connectionCount;
+        }
+
+        if (self.maximumConnections > 0 && active >= self.maximumConnections) {
+            NMSSHLogWarn(@"SOCKS client refused, too many connections");
+            close(fd);
+            continue;
+        }
+
+        int set = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&set, sizeof(set));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        NMSSHSOCKSConnection *connection = [[NMSSHSOCKSConnection alloc] init];
+        [connection setFd:fd];
+        [connection setClientPort:ntohs(address.sin_port)];
+        [connection setState:NMSSHSOCKSStateGreeting];
+        [connection setInbound:[NSMutableData dataWithCapacity:self.bufferSize]];
+        [connection setOutbound:[NSMutableData dataWithCapacity:self.bufferSize]];
+        [self assignConnection:connection];
+    }
+}
+
+- (void)assignConnection:(NMSSHSOCKSConnection *)connection {
+    NMSSHSOCKSSessionPump *pump = [self leastLoadedPump];
+    if (!pump) {
+        NMSSHLogWarn(@"SOCKS client refused, no session available");
+        close(connection.fd);
+        return;
+    }
+
+    [connection setPump:pump];
+    [pump setConnectionCount:pump.connectionCount + 1];
+
+    // From now on the connection only lives on the session queue
+    [pump.session performBlock:^{
+        [self registerConnection:connection];
+    }];
+}
+
+- (void)registerConnection:(NMSSHSOCKSConnection *)connection {
+    NMSSHSOCKSSessionPump *pump = connection.pump;
+    int fd = connection.fd;
+
+    if (!pump.pumpHandler) {
+        // The proxy was stopped before the connection could be registered
+        close(fd);
+        return;
+    }
+
+    if (!pump.session.isConnected || !pump.session.rawSession) {
+        // The session state is only read on its queue, a client assigned to a
+        // session that went away meanwhile is handed over to another one
+        dispatch_async(self.queue, ^{
+            [pump setUnavailable:YES];
+            if (pump.connectionCount > 0) {
+                [pump setConnectionCount:pump.connectionCount - 1];
+            }
+
+            [self assignConnection:connection];
+        });
+
+        return;
+    }
+
+    [pump.connections addObject:connection];
+
+    __weak NMSSHSOCKSProxy *weakSelf = self;
+    __weak NMSSHSOCKSConnection *weakConnection = connection;
+    __block int pendingCancels = 2;
+    void (^cancelHandler)(void) = ^{
+        if (--pendingCancels == 0) {
+            close(fd);
+        }
+    };
+
+    [connection setReadSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, pump.session.queue)];
+    dispatch_source_set_event_handler(connection.readSource, ^{
+        if ([weakSelf preparePump:weakConnection.pump]) {
+            [weakSelf readFromClient:weakConnection];
+        }
+    });
+    dispatch_source_set_cancel_handler(connection.readSource, cancelHandler);
+
+    [connection setWriteSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, pump.session.queue)];
+    dispatch_source_set_event_handler(connection.writeSource, ^{
+        if ([weakSelf preparePump:weakConnection.pump]) {
+            [weakSelf serviceConnection:weakConnection];
+            [weakConnection.pump.session schedulePump];
+        }
+    });
+    dispatch_source_set_cancel_handler(connection.writeSource, cancelHandler);
+    [connection setWriteSuspended:YES];
+
+    dispatch_resume(connection.readSource);
+    NMSSHLogVerbose(@"SOCKS client accepted on port %u", connection.clientPort);
+}
+
+- (void)readFromClient:(NMSSHSOCKSConnection *)connection {
+    if (!connection || connection.state == NMSSHSOCKSStateClosing) {
+        return;
+    }
+
+    // Never buffer more than one chunk per direction, the client is read
+    // again only once the channel accepted everything already read
+    if ([connection hasPendingInbound]) {
+        [connection suspendRead];
+        return;
+    }
+
+    NSUInteger capacity = self.bufferSize;
+    if (connection.state == NMSSHSOCKSStateStreaming) {
+        unsigned long window = libssh2_channel_window_write(connection.channel);
+        if (window > 0) {
+            capacity = MIN(capacity, (NSUInteger)window);
+        }
+    }
+
+    [connection.inbound setLength:capacity];
+    [connection setInboundOffset:0];
+    ssize_t rc = read(connection.fd, [connection.inbound mutableBytes], capacity);
+
+    if (rc < 0) {
+        [connection.inbound setLength:0];
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            NMSSHLogVerbose(@"SOCKS client read failed: %s", strerror(errno));
+            [self closeConnection:connection];
+        }
+
+        return;
+    }
+
+    [connection.inbound setLength:(NSUInteger)rc];
+
+    if (rc == 0) {
+        [connection setClientEOF:YES];
+        [connection suspendRead];
+
+        if (connection.state != NMSSHSOCKSStateStreaming) {
+            [self closeConnection:connection];
+            return;
+        }
+    }
+
+    switch (connection.state) {
+        case NMSSHSOCKSStateGreeting:
+        case NMSSHSOCKSStateRequest:
+            [self parseHandshakeOfConnection:connection];
+            break;
+
+        default:
+            break;
+    }
+
+    // The pump services the channels and waits for the socket as needed
+    [connection.pump.session schedulePump];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SOCKS5 HANDSHAKE
+// -----------------------------------------------------------------------------
+
+- (void)parseHandshakeOfConnection:(NMSSHSOCKSConnection *)connection {
+    // The handshake is small, keep accumulating until a full message arrived
+    if (!connection.handshake) {
+        [connection setHandshake:[NSMutableData data]];
+    }
+
+    NSMutableData *pending = connection.handshake;
+    [pending appendData:connection.inbound];
+    [connection.inbound setLength:0];
+    [connection setInboundOffset:0];
+
+    const uint8_t *bytes = [pending bytes];
+    NSUInteger length = [pending length];
+
+    if (connection.state == NMSSHSOCKSStateGreeting) {
+        if (length < 2) {
+            return;
+        }
+
+        if (bytes[0] != kNMSSHSOCKSVersion) {
+            NMSSHLogWarn(@"Unsupported SOCKS version %u", bytes[0]);
+            [self closeConnection:connection];
+            return;
+        }
+
+        NSUInteger methods = bytes[1];
+        if (length < 2 + methods) {
+            return;
+        }
+
+        BOOL noAuthentication = NO;
+        for (NSUInteger i = 0; i < methods; i++) {
+            if (bytes[2 + i] == kNMSSHSOCKSMethodNone) {
+                noAuthentication = YES;
+            }
+        }
+
+        uint8_t reply[2] = { kNMSSHSOCKSVersion, noAuthentication ? kNMSSHSOCKSMethodNone : kNMSSHSOCKSMethodRejected };
+        [connection.outbound appendBytes:reply length:sizeof(reply)];
+        [pending replaceBytesInRange:NSMakeRange(0, 2 + methods) withBytes:NULL length:0];
+
+        if (!noAuthentication) {
+            NMSSHLogWarn(@"SOCKS client does not support unauthenticated access");
+            [connection setState:NMSSHSOCKSStateClosing];
+            [self flushOutboundOfConnection:connection];
+            [self closeConnection:connection];
+            return;
+        }
+
+        [connection setState:NMSSHSOCKSStateRequest];
+        bytes = [pending bytes];
+        length = [pending length];
+    }
+
+    if (connection.state != NMSSHSOCKSStateRequest || length < 5) {
+        return;
+    }
+
+    if (bytes[0] != kNMSSHSOCKSVersion) {
+        [self closeConnection:connection];
+        return;
+    }
+
+    NSUInteger addressLength;
+    switch (bytes[3]) {
+        case kNMSSHSOCKSAddressIPv4:
+            addressLength = 4;
+            break;
+
+        case kNMSSHSOCKSAddressIPv6:
+            addressLength = 16;
+            break;
+
+        case kNMSSHSOCKSAddressDomain:
+            addressLength = 1 + bytes[4];
+            break;
+
+        default:
+            [self replyToConnection:connection status:NMSSHSOCKSReplyAddressNotSupported];
+            [self closeConnection:connection];
+            return;
+    }
+
+    if (length < 4 + addressLength + 2) {
+        return;
+    }
+
+    if (bytes[1] != kNMSSHSOCKSCommandConnect) {
+        NMSSHLogWarn(@"Unsupported SOCKS command %u", bytes[1]);
+        [self replyToConnection:connection status:NMSSHSOCKSReplyCommandNotSupported];
+        [self closeConnection:connection];
+        return;
+    }
+
+    const uint8_t *address = bytes + 4;
+    NSString *host;
+    if (bytes[3] == kNMSSHSOCKSAddressIPv4) {
+        char str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, address, str, INET_ADDRSTRLEN);
+        host = [NSString stringWithUTF8String:str];
+    }
+    else if (bytes[3] == kNMSSHSOCKSAddressIPv6) {
+        char str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, address, str, INET6_ADDRSTRLEN);
+        host = [NSString stringWithUTF8String:str];
+    }
+    else {
+        host = [[NSString alloc] initWithBytes:address + 1 length:addressLength - 1 encoding:NSUTF8StringEncoding];
+    }
+
+    if (!host) {
+        [self replyToConnection:connection status:NMSSHSOCKSReplyAddressNotSupported];
+        [self closeConnection:connection];
+        return;
+    }
+
+    [connection setTargetHost:host];
+    [connection setTargetPort:(uint16_t)((address[addressLength] << 8) | address[addressLength + 1])];
+
+    // Anything the client sent optimistically after the request is forwarded
+    // as soon as the tunnel is up
+    [pending replaceBytesInRange:NSMakeRange(0, 4 + addressLength + 2) withBytes:NULL length:0];
+    [connection.inbound setData:pending];
+    [connection setHandshake:nil];
+
+    // Nothing is read from the client until the tunnel is established
+    [connection setState:NMSSHSOCKSStateConnecting];
+    [connection suspendRead];
+    [connection.pump.pendingOpens addObject:connection];
+
+    NMSSHLogVerbose(@"SOCKS CONNECT %@:%u", connection.targetHost, connection.targetPort);
+}
+
+- (void)replyToConnection:(NMSSHSOCKSConnection *)connection status:(NMSSHSOCKSReply)status {
+    uint8_t reply[10] = { kNMSSHSOCKSVersion, status, 0x00, kNMSSHSOCKSAddressIPv4, 0, 0, 0, 0, 0, 0 };
+    [connection.outbound appendBytes:reply length:sizeof(reply)];
+    [self flushOutboundOfConnection:connection];
+}
+
+// Returns NO while the open is still in progress
+- (BOOL)openChannelForConnection:(NMSSHSOCKSConnection *)connection {
+    // An open already started must be completed even if the client went away,
+    // libssh2 would otherwise resume it for the next connection in the queue
+    if (connection.state != NMSSHSOCKSStateConnecting && !connection.openInFlight) {
+        return YES;
+    }
+
+    LIBSSH2_SESSION *session = connection.pump.session.rawSession;
+    LIBSSH2_CHANNEL *channel = libssh2_channel_direct_tcpip_ex(session,
+                                                               [connection.targetHost UTF8String],
+                                                               connection.targetPort,
+                                                               "127.0.0.1",
+                                                               connection.clientPort);
+
+    if (channel == NULL) {
+        int rc = libssh2_session_last_errno(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            [connection setOpenInFlight:YES];
+            return NO;
+        }
+
+        [connection setOpenInFlight:NO];
+        if (connection.state == NMSSHSOCKSStateClosing) {
+            [self removeConnection:connection];
+            return YES;
+        }
+
+        NMSSHLogWarn(@"Unable to open a tunnel to %@:%u (Error %i)", connection.targetHost, connection.targetPort, rc);
+        [self replyToConnection:connection
+                         status:(rc == LIBSSH2_ERROR_CHANNEL_FAILURE ? NMSSHSOCKSReplyConnectionRefused : NMSSHSOCKSReplyGeneralFailure)];
+        [self closeConnection:connection];
+
+        return YES;
+    }
+
+    [connection setOpenInFlight:NO];
+    [connection setChannel:channel];
+
+    if (connection.state == NMSSHSOCKSStateClosing) {
+        [self freeChannelOfConnection:connection];
+        return YES;
+    }
+
+    [connection setState:NMSSHSOCKSStateStreaming];
+    [self replyToConnection:connection status:NMSSHSOCKSReplySucceeded];
+    [connection resumeRead];
+
+    NMSSHLogVerbose(@"SOCKS tunnel to %@:%u established", connection.targetHost, connection.targetPort);
+
+    return YES;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - DATA TRANSFER
+// -----------------------------------------------------------------------------
+
+- (void)serviceConnection:(NMSSHSOCKSConnection *)connection {
+    if (!connection) {
+        return;
+    }
+
+    if (connection.state == NMSSHSOCKSStateClosing) {
+        if (!connection.openInFlight) {
+            [self freeChannelOfConnection:connection];
+        }
+
+        return;
+    }
+
+    if (connection.state != NMSSHSOCKSStateStreaming) {
+        [self flushOutboundOfConnection:connection];
+        return;
+    }
+
+    [self flushInboundOfConnection:connection];
+
+    // Read from the channel only when the client drained the previous chunk,
+    // otherwise the unread data keeps the remote window closed
+    while (connection.state == NMSSHSOCKSStateStreaming && ![connection hasPendingOutbound] && !connection.channelEOF) {
+        [connection.outbound setLength:self.bufferSize];
+        [connection setOutboundOffset:0];
+        ssize_t rc = libssh2_channel_read(connection.channel, [connection.outbound mutableBytes], self.bufferSize);
+
+        if (rc > 0) {
+            [connection.outbound setLength:(NSUInteger)rc];
+            [self flushOutboundOfConnection:connection];
+            continue;
+        }
+
+        [connection.outbound setLength:0];
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            break;
+        }
+
+        if (rc < 0) {
+            NMSSHLogVerbose(@"SOCKS tunnel read failed (Error %zi)", rc);
+            [self closeConnection:connection];
+            return;
+        }
+
+        if (libssh2_channel_eof(connection.channel)) {
+            [connection setChannelEOF:YES];
+        }
+        else {
+            break;
+        }
+    }
+
+    if (connection.state != NMSSHSOCKSStateStreaming) {
+        return;
+    }
+
+    // Propagate the remote half close once everything has been delivered
+    if (connection.channelEOF && ![connection hasPendingOutbound] && !connection.clientShutdown) {
+        shutdown(connection.fd, SHUT_WR);
+        [connection setClientShutdown:YES];
+    }
+
+    if (connection.clientShutdown && connection.sentEOF) {
+        [self closeConnection:connection];
+    }
+}
+
+- (void)flushInboundOfConnection:(NMSSHSOCKSConnection *)connection {
+    while ([connection hasPendingInbound]) {
+        const char *bytes = (const char *)[connection.inbound bytes] + connection.inboundOffset;
+        size_t length = [connection.inbound length] - connection.inboundOffset;
+        ssize_t rc = libssh2_channel_write(connection.channel, bytes, length);
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            // Either the socket or the remote window is full, stop reading the
+            // client until the pump makes progress
+            [connection suspendRead];
+            return;
+        }
+
+        if (rc < 0) {
+            NMSSHLogVerbose(@"SOCKS tunnel write failed (Error %zi)", rc);
+            [self closeConnection:connection];
+            return;
+        }
+
+        [connection setInboundOffset:connection.inboundOffset + (NSUInteger)rc];
+    }
+
+    [connection.inbound setLength:0];
+    [connection setInboundOffset:0];
+
+    if (connection.clientEOF) {
+        if (!connection.sentEOF) {
+            int rc = libssh2_channel_send_eof(connection.channel);
+            if (rc == 0) {
+                [connection setSentEOF:YES];
+            }
+            else if (rc != LIBSSH2_ERROR_EAGAIN) {
+                [self closeConnection:connection];
+            }
+        }
+    }
+    else {
+        [connection resumeRead];
+    }
+}
+
+- (void)flushOutboundOfConnection:(NMSSHSOCKSConnection *)connection {
+    while ([connection hasPendingOutbound]) {
+        const uint8_t *bytes = (const uint8_t *)[connection.outbound bytes] + connection.outboundOffset;
+        size_t length = [connection.outbound length] - connection.outboundOffset;
+        ssize_t rc = write(connection.fd, bytes, length);
+
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                [connection resumeWrite];
+            }
+            else {
+                NMSSHLogVerbose(@"SOCKS client write failed: %s", strerror(errno));
+                [self closeConnection:connection];
+            }
+
+            return;
+        }
+
+        [connection setOutboundOffset:connection.outboundOffset + (NSUInteger)rc];
+    }
+
+    [connection.outbound setLength:0];
+    [connection setOutboundOffset:0];
+    [connection suspendWrite];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - TEARDOWN
+// -----------------------------------------------------------------------------
+
+- (void)closeConnection:(NMSSHSOCKSConnection *)connection {
+    if (connection.readSource) {
+        [connection resumeRead];
+        [connection resumeWrite];
+        dispatch_source_cancel(connection.readSource);
+        dispatch_source_cancel(connection.writeSource);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(connection.readSource);
+        dispatch_release(connection.writeSource);
+#endif
+        [connection setReadSource:nil];
+        [connection setWriteSource:nil];
+    }
+
+    [connection setState:NMSSHSOCKSStateClosing];
+
+    if (connection.openInFlight) {
+        return;
+    }
+
+    [connection.pump.pendingOpens removeObject:connection];
+    [self freeChannelOfConnection:connection];
+}
+
+- (void)freeChannelOfConnection:(NMSSHSOCKSConnection *)connection {
+    if (connection.channel) {
+        int rc = libssh2_channel_close(connection.channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return;
+        }
+
+        rc = libssh2_channel_free(connection.channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return;
+        }
+
+        [connection setChannel:NULL];
+    }
+
+    NMSSHLogVerbose(@"SOCKS client on port %u closed", connection.clientPort);
+    [self removeConnection:connection];
+}
+
+@end
@@ -0,0 +1,104 @@
+#import "NMSSH.h"
+
+/**
+ NMSSHScrollbackBuffer keeps the end of a shell output in constant memory.
+
+ Bytes are stored in a ring of `capacity` bytes and lines in a ring of
+ `maximumLines` offsets, the oldest ones are dropped as new output arrives. A
+ line is any run of bytes ended by a line feed, the output after the last line
+ feed is the last line. Appending costs a copy and a scan of the new bytes,
+ reading a line costs a copy of the line, whatever the amount of output seen.
+
+ Attach a buffer to a shell with -[NMSSHChannel scrollbackBuffer], then render
+ from it:
+
+    NSArray *lines = [channel.scrollbackBuffer lastLines:rows];
+
+ The buffer may be read from any thread while it is appended to.
+ */
+@interface NMSSHScrollbackBuffer : NSObject
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ Create an empty buffer.
+
+ @param capacity Bytes kept, at least 1
+ @param maximumLines Lines kept, at least 1
+ @returns Empty buffer
+ */
+- (nonnull instancetype)initWithCapacity:(NSUInteger)capacity maximumLines:(NSUInteger)maximumLines;
+
+/** Bytes kept at most (read-only). */
+@property (nonatomic, readonly) NSUInteger capacity;
+
+/** Lines kept at most (read-only). */
+@property (nonatomic, readonly) NSUInteger maximumLines;
+
+/** Bytes currently kept (read-only). */
+@property (atomic, readonly) NSUInteger length;
+
+/** Lines currently kept, including the unterminated last line (read-only). */
+@property (atomic, readonly) NSUInteger lineCount;
+
+/** Bytes appended since the buffer was created or cleared (read-only). */
+@property (atomic, readonly) uint64_t totalLength;
+
+/** Number of lines dropped since the buffer was created or cleared, i.e. the number of the first line kept (read-only). */
+@property (atomic, readonly) uint64_t firstLineNumber;
+
+/**
+ Append output, dropping the oldest bytes and lines beyond the capacity.
+
+ @param bytes Output
+ @param length Length of the output
+ */
+- (void)appendBytes:(nonnull const void *)bytes length:(NSUInteger)length;
+
+/**
+ Append output, dropping the oldest bytes and lines beyond the capacity.
+
+ @param data Output
+ */
+- (void)appendData:(nonnull NSData *)data;
+
+/**
+ A line kept by the buffer, without its line feed.
+
+ The first line may have lost its beginning to the capacity.
+
+ @param index Index of the line, from 0 for the oldest line kept
+ @returns The bytes of the line, `nil` if the index is out of bounds
+ */
+- (nullable NSData *)dataForLineAtIndex:(NSUInteger)index;
+
+/**
+ The last lines, decoded as UTF-8.
+
+ Invalid UTF-8 sequences are decoded as ISO Latin 1.
+
+ @param count Number of lines wanted
+ @returns Up to `count` lines, the oldest first, without their line feeds
+ */
+- (nonnull NSArray<NSString *> *)lastLines:(NSUInteger)count;
+
+/**
+ A copy of all the bytes kept.
+
+ @returns The end of the output, up to `capacity` bytes
+ */
+- (nonnull NSData *)snapshot;
+
+/**
+ The output appended after a position, for incremental rendering.
+
+ @param position A previous value of totalLength
+ @param nextPosition Set to the current totalLength, to pass on the next call
+ @returns The bytes after `position` still kept
+ */
+- (nonnull NSData *)dataSincePosition:(uint64_t)position nextPosition:(nullable uint64_t *)nextPosition;
+
+/** Drop all the bytes and lines. */
+- (void)clear;
+
+@end
@@ -0,0 +1,239 @@
+#import "NMSSHScrollbackBuffer.h"
+#import "NMSSH+Protected.h"
+
+#import <pthread.h>
+
+@interface NMSSHScrollbackBuffer () {
+    pthread_mutex_t _lock;
+
+    // Byte ring, the byte at position p of the output is at p % capacity
+    char *_bytes;
+    uint64_t _totalLength;
+
+    // Line ring, the output position of each line start
+    uint64_t *_lineStarts;
+    NSUInteger _firstLine;
+    NSUInteger _lineCount;
+    uint64_t _firstLineNumber;
+}
+@end
+
+@implementation NMSSHScrollbackBuffer
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity maximumLines:(NSUInteger)maximumLines {
+    if ((self = [super init])) {
+        _capacity = MAX(capacity, 1);
+        _maximumLines = MAX(maximumLines, 1);
+        _bytes = malloc(_capacity);
+        _lineStarts = malloc(_maximumLines * sizeof(uint64_t));
+        pthread_mutex_init(&_lock, NULL);
+
+        if (!_bytes || !_lineStarts) {
+            return nil;
+        }
+
+        [self reset];
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    pthread_mutex_destroy(&_lock);
+    free(_bytes);
+    free(_lineStarts);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - RINGS
+// -----------------------------------------------------------------------------
+
+- (void)reset {
+    _totalLength = 0;
+    _firstLine = 0;
+    _lineCount = 1;
+    _lineStarts[0] = 0;
+    _firstLineNumber = 0;
+}
+
+/// Output position of the first byte kept
+- (uint64_t)base {
+    return _totalLength > _capacity ? _totalLength - _capacity : 0;
+}
+
+- (uint64_t)startOfLine:(NSUInteger)index {
+    return _lineStarts[(_firstLine + index) % _maximumLines];
+}
+
+- (void)dropFirstLine {
+    _firstLine = (_firstLine + 1) % _maximumLines;
+    _lineCount--;
+    _firstLineNumber++;
+}
+
+- (void)pushLineStart:(uint64_t)start {
+    if (_lineCount == _maximumLines) {
+        [self dropFirstLine];
+    }
+
+    _lineStarts[(_firstLine + _lineCount) % _maximumLines] = start;
+    _lineCount++;
+}
+
+/// Copy the kept bytes between two output positions
+- (NSData *)dataFrom:(uint64_t)start to:(uint64_t)end {
+    NSUInteger length = (NSUInteger)(end - start);
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    NSUInteger offset = (NSUInteger)(start % _capacity);
+    NSUInteger head = MIN(length, _capacity - offset);
+
+    memcpy([data mutableBytes], _bytes + offset, head);
+    memcpy((char *)[data mutableBytes] + head, _bytes, length - head);
+
+    return data;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - APPENDING
+// -----------------------------------------------------------------------------
+
+- (void)appendData:(NSData *)data {
+    [self appendBytes:[data bytes] length:[data length]];
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length {
+    pthread_mutex_lock(&_lock);
+
+    // Only the end of a chunk larger than the ring is kept, its lines are
+    // indexed all the same
+    const char *cursor = bytes;
+    const char *end = cursor + length;
+    uint64_t position = _totalLength;
+
+    while (cursor < end) {
+        const char *lineFeed = memchr(cursor, '\n', end - cursor);
+        if (!lineFeed) {
+            break;
+        }
+
+        position += lineFeed - cursor + 1;
+        cursor = lineFeed + 1;
+        [self pushLineStart:position];
+    }
+
+    const char *kept = length > _capacity ? (const char *)bytes + length - _capacity : bytes;
+    NSUInteger keptLength = (NSUInteger)(end - kept);
+    NSUInteger offset = (NSUInteger)((_totalLength + (kept - (const char *)bytes)) % _capacity);
+    NSUInteger head = MIN(keptLength, _capacity - offset);
+
+    memcpy(_bytes + offset, kept, head);
+    memcpy(_bytes, kept + head, keptLength - head);
+    _totalLength += length;
+
+    // Lines entirely overwritten go, the first one left may be truncated
+    uint64_t base = [self base];
+    while (_lineCount > 1 && [self startOfLine:1] <= base) {
+        [self dropFirstLine];
+    }
+
+    if (_lineStarts[_firstLine] < base) {
+        _lineStarts[_firstLine] = base;
+    }
+
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)clear {
+    pthread_mutex_lock(&_lock);
+    [self reset];
+    pthread_mutex_unlock(&_lock);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - READING
+// -----------------------------------------------------------------------------
+
+- (NSUInteger)length {
+    pthread_mutex_lock(&_lock);
+    NSUInteger length = (NSUInteger)(_totalLength - [self base]);
+    pthread_mutex_unlock(&_lock);
+
+    return length;
+}
+
+- (NSUInteger)lineCount {
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = _lineCount;
+    pthread_mutex_unlock(&_lock);
+
+    return count;
+}
+
+- (uint64_t)totalLength {
+    pthread_mutex_lock(&_lock);
+    uint64_t totalLength = _totalLength;
+    pthread_mutex_unlock(&_lock);
+
+    return totalLength;
+}
+
+- (uint64_t)firstLineNumber {
+    pthread_mutex_lock(&_lock);
+    uint64_t number = _firstLineNumber;
+    pthread_mutex_unlock(&_lock);
+
+    return number;
+}
+
+/// The line without its line feed, the lock must be held
+- (NSData *)lockedDataForLineAtIndex:(NSUInteger)index {
+    uint64_t start = [self startOfLine:index];
+    uint64_t end = index + 1 < _lineCount ? [self startOfLine:index + 1] - 1 : _totalLength;
+
+    return [self dataFrom:start to:MAX(start, end)];
+}
+
+- (NSData *)dataForLineAtIndex:(NSUInteger)index {
+    pthread_mutex_lock(&_lock);
+    NSData *data = index < _lineCount ? [self lockedDataForLineAtIndex:index] : nil;
+    pthread_mutex_unlock(&_lock);
+
+    return data;
+}
+
+- (NSArray *)lastLines:(NSUInteger)count {
+    NSMutableArray *lines = [NSMutableArray arrayWithCapacity:count];
+
+    pthread_mutex_lock(&_lock);
+    NSUInteger first = _lineCount > count ? _lineCount - count : 0;
+    for (NSUInteger index = first; index < _lineCount; index++) {
+        NSData *line = [self lockedDataForLineAtIndex:index];
+        [lines addObject:[[NSString alloc] initWithData:line encoding:NSUTF8StringEncoding] ?:
+                         [[NSString alloc] initWithData:line encoding:NSISOLatin1StringEncoding]];
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return lines;
+}
+
+- (NSData *)snapshot {
+    pthread_mutex_lock(&_lock);
+    NSData *data = [self dataFrom:[self base] to:_totalLength];
+    pthread_mutex_unlock(&_lock);
+
+    return data;
+}
+
+- (NSData *)dataSincePosition:(uint64_t)position nextPosition:(uint64_t *)nextPosition {
+    pthread_mutex_lock(&_lock);
+    uint64_t start = MIN(MAX(position, [self base]), _totalLength);
+    NSData *data = [self dataFrom:start to:_totalLength];
+    if (nextPosition) {
+        *nextPosition = _totalLength;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return data;
+}
+
+@end
@@ -1,6 +1,6 @@
 #import "NMSSH.h"
 
-@class NMSSHHostConfig, NMSFTP;
+@class NMSSHHostConfig, NMSFTP, NMSSHOperation, NMSSHDeadline;
 @protocol NMSSHSessionDelegate;
 
 typedef NS_ENUM(NSInteger, NMSSHSessionHash) {
@@ -8,6 +8,14 @@ typedef NS_ENUM(NSInteger, NMSSHSessionHash) {
     NMSSHSessionHashSHA1
 };
 
+typedef NS_ENUM(NSInteger, NMSSHSessionError) {
+    NMSSHSessionDisconnectedError,
+    NMSSHSessionConnectionError,
+    NMSSHSessionHostRejectedError,
+    NMSSHSessionAuthenticationError,
+    NMSSHSessionTimeoutError
+};
+
 typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
     NMSSHKnownHostStatusMatch,
     NMSSHKnownHostStatusMismatch,
@@ -36,8 +44,23 @@ typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
 
  ## Thread safety
 
- NMSSH classes are not thread safe, you should use them from the same thread
- where you created the NMSSHSession instance.
+ Every NMSSHSession owns a serial queue and all the operations of the session,
+ its channels and its SFTP instance are run on it, one at a time. A session can
+ therefore be shared by any number of threads: concurrent calls are queued in
+ order, calls made from a delegate method or a callback run immediately.
+
+ Each operation starts in blocking mode and switches the session to
+ non-blocking mode itself when it needs to, a shell or a SFTP transfer can
+ safely be used side by side on the same session.
+
+ Use performBlock: to pipeline work on the session without waiting for it, and
+ performBlockAndWait: to run several calls as a single atomic unit.
+
+ ## Asynchronous API
+
+ Most operations also come in an asynchronous flavor taking a completion
+ handler, called on `callbackQueue`. They never block a thread while waiting
+ for the server, see NMSSHOperation.
 
  If you want to use multiple NMSSHSession instances at once you should implement
  the [crypto mutex callbacks](http://trac.libssh2.org/wiki/MultiThreading).
@@ -147,7 +170,26 @@ typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
 /** Username that will authenticate against the server. */
 @property (nonatomic, nonnull, readonly) NSString *username;
 
-/** Timeout for libssh2 blocking functions. */
+/**
+ Command used to connect to the server instead of a direct TCP connection,
+ defaults to `nil`.
+
+ The command is spawned using the user's shell when the session connects, the
+ SSH transport is run over its standard input and output (e.g. `nc %h %p` or
+ `ssh -W %h:%p bastion`). The tokens `%h`, `%p`, `%r` and `%%` are replaced with
+ the host, the port, the username and a literal `%`.
+
+ This is set automatically from the `ProxyCommand` keyword when the session is
+ initialized with a config chain. Not supported on iOS.
+ */
+@property (nonatomic, nullable, strong) NSString *proxyCommand;
+
+/**
+ Timeout for libssh2 blocking functions, in seconds, 0 to wait forever.
+
+ Unlike a deadline, it bounds each wait for the server separately. It can be
+ set before connecting.
+ */
 @property (nonatomic, nonnull, strong) NSNumber *timeout;
 
 /** Last session error. */
@@ -169,7 +211,7 @@ typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
 /** Raw libssh2 session instance. */
 @property (nonatomic, nullable, readonly, getter = rawSession) LIBSSH2_SESSION *session;
 
-/** Raw session socket. */
+/** Raw session socket, a socket pair end connected to the proxy command if any. */
 @property (nonatomic, nullable, readonly) CFSocketRef socket;
 
 /// ----------------------------------------------------------------------------
@@ -192,7 +234,8 @@ typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
 /**
  Connect to the server.
 
- @param timeout The time, in seconds, to wait before giving up.
+ @param timeout The time, in seconds, to wait before giving up. It covers the
+     name resolution, the connection and the handshake.
  @returns Connection status
  */
 - (BOOL)connectWithTimeout:(nonnull NSNumber *)timeout;
@@ -335,6 +378,97 @@ typedef NS_ENUM(NSInteger, NMSSHKnownHostStatus) {
                   toFile:(nullable NSString *)fileName
                 withSalt:(nullable NSString *)salt;
 
+/// ----------------------------------------------------------------------------
+/// @name Serialized access
+/// ----------------------------------------------------------------------------
+
+/**
+ Asynchronously run a block on the session queue.
+
+ Blocks are run in submission order, after every operation already queued.
+
+ @param block The block to run
+ */
+- (void)performBlock:(nonnull void (^)(void))block;
+
+/**
+ Synchronously run a block on the session queue.
+
+ No other operation is run on the session while the block is running. When
+ called from the session queue (e.g. from a delegate method) the block is run
+ immediately.
+
+ @param block The block to run
+ */
+- (void)performBlockAndWait:(nonnull void (^)(void))block;
+
+/**
+ Synchronously run a block on the session queue with a deadline.
+
+ Everything run by the block shares the deadline: name resolution, connection,
+ handshake, authentication, channel and SFTP calls. Blocking libssh2 calls fail
+ with `LIBSSH2_ERROR_TIMEOUT` once it passes and asynchronous operations
+ started by the block fail with a `NMSSHSessionTimeoutError` error, aborting
+ the libssh2 call in progress.
+
+ Nested deadlines can only shorten the enclosing one.
+
+ @param deadline The deadline, see NMSSHDeadline
+ @param block The block to run
+ */
+- (void)performWithDeadline:(nonnull NMSSHDeadline *)deadline block:(nonnull void (^)(void))block;
+
+/// ----------------------------------------------------------------------------
+/// @name Asynchronous operations
+/// ----------------------------------------------------------------------------
+
+/** The queue completion handlers are called on, defaults to the main queue. */
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, nonnull, strong) dispatch_queue_t callbackQueue;
+#else
+@property (nonatomic, nonnull, assign) dispatch_queue_t callbackQueue;
+#endif
+
+/**
+ Asynchronously connect to the server.
+
+ @param completionHandler Called with `nil` once connected, or the reason of
+     the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)connectWithCompletionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously authenticate by password.
+
+ @param password Password for connected user
+ @param completionHandler Called with `nil` once authorized, or the reason of
+     the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)authenticateByPassword:(nonnull NSString *)password
+                                 completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Asynchronously authenticate by private key pair from file(s).
+
+ @param publicKey Filepath to public key
+ @param privateKey Filepath to private key
+ @param password Password for encrypted private key, `nil` when unencrypted
+ @param completionHandler Called with `nil` once authorized, or the reason of
+     the failure
+ @returns The queued operation
+ */
+- (nonnull NMSSHOperation *)authenticateByPublicKey:(nullable NSString *)publicKey
+                                         privateKey:(nonnull NSString *)privateKey
+                                        andPassword:(nullable NSString *)password
+                                  completionHandler:(nullable void (^)(NSError * _Nullable error))completionHandler;
+
+/**
+ Cancel all the queued asynchronous operations, see -[NMSSHOperation cancel].
+ */
+- (void)cancelAllOperations;
+
 /// ----------------------------------------------------------------------------
 /// @name Quick channel/sftp access
 /// ----------------------------------------------------------------------------
@@ -2,8 +2,28 @@
 #import "NMSSH+Protected.h"
 #import "NMSSHConfig.h"
 #import "NMSSHHostConfig.h"
-
-@interface NMSSHSession ()
+#import <spawn.h>
+#import <signal.h>
+#import <sys/wait.h>
+#import <fcntl.h>
+#import <poll.h>
+
+extern char **environ;
+
+static const void * const kNMSSHSessionQueueKey = &kNMSSHSessionQueueKey;
+
+// Share of the session each priority class gets while the others are busy,
+// indexed by priority + 1: bulk, default, interactive
+#define kNMSSHPriorityClasses (3)
+#define kNMSSHPriorityStride (1 << 16)
+static const uint64_t kNMSSHPriorityWeights[kNMSSHPriorityClasses] = { 1, 4, 16 };
+
+@interface NMSSHSession () {
+    // Stride scheduling of the priority classes: the ready class with the
+    // lowest pass runs next, and its pass grows by the inverse of its weight
+    uint64_t _priorityPasses[kNMSSHPriorityClasses];
+    uint64_t _schedulerTime;
+}
 @property (nonatomic, assign) LIBSSH2_AGENT *agent;
 
 @property (nonatomic, assign, getter = rawSession) LIBSSH2_SESSION *session;
@@ -18,6 +38,43 @@
 @property (nonatomic, strong) NSNumber *port;
 @property (nonatomic, strong) NMSSHHostConfig *hostConfig;
 @property (nonatomic, assign) LIBSSH2_SESSION *sessionToFree;
+@property (nonatomic, assign) pid_t proxyCommandPID;
+
+@property (nonatomic, strong) NSMutableArray<NMSSHOperation *> *operations;
+@property (nonatomic, strong) NMSSHOperation *currentOperation;
+@property (nonatomic, assign) int sourceSocket;
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_source_t readSource;
+@property (nonatomic, strong) dispatch_source_t writeSource;
+#else
+@property (nonatomic, assign) dispatch_source_t readSource;
+@property (nonatomic, assign) dispatch_source_t writeSource;
+#endif
+@property (nonatomic, assign) BOOL readSuspended;
+@property (nonatomic, assign) BOOL writeSuspended;
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_source_t deadlineTimer;
+#else
+@property (nonatomic, assign) dispatch_source_t deadlineTimer;
+#endif
+
+// Streaming channels, all read by a single source on the socket
+@property (nonatomic, strong) NSMutableArray<NMSSHChannel *> *pumpedChannels;
+@property (nonatomic, strong) NSMutableArray *pumpHandlers;
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_source_t pumpSource;
+@property (nonatomic, strong) dispatch_source_t pumpWriteSource;
+#else
+@property (nonatomic, assign) dispatch_source_t pumpSource;
+@property (nonatomic, assign) dispatch_source_t pumpWriteSource;
+#endif
+@property (nonatomic, assign) BOOL pumpSuspended;
+@property (nonatomic, assign) BOOL pumpWriteSuspended;
+@property (nonatomic, assign) BOOL pumpHandlersReading;
+@property (nonatomic, assign) BOOL pumpScheduled;
+
+@property (nonatomic, strong) NSNumber *blockingTimeout;
+@property (atomic, strong) NMSSHDeadline *deadline;
 @end
 
 @implementation NMSSHSession
@@ -50,6 +107,15 @@
         [self setUsername:username];
         [self setConnected:NO];
         [self setFingerprintHash:NMSSHSessionHashMD5];
+
+        _queue = dispatch_queue_create("NMSSH.sessionQueue", DISPATCH_QUEUE_SERIAL);
+        dispatch_queue_set_specific(_queue, kNMSSHSessionQueueKey, (__bridge void *)self, NULL);
+
+        [self setCallbackQueue:dispatch_get_main_queue()];
+        [self setOperations:[NSMutableArray array]];
+        [self setPumpedChannels:[NSMutableArray array]];
+        [self setPumpHandlers:[NSMutableArray array]];
+        [self setSourceSocket:-1];
     }
 
     return self;
@@ -81,6 +147,10 @@
                   andUsername:hostConfig.user];
     if (self) {
         [self setHostConfig:hostConfig];
+
+        if (hostConfig.proxyCommand && [hostConfig.proxyCommand caseInsensitiveCompare:@"none"] != NSOrderedSame) {
+            [self setProxyCommand:hostConfig.proxyCommand];
+        }
     }
 
     return self;
@@ -104,9 +174,596 @@
 }
 
 - (void)dealloc {
+    [self cancelSocketSources];
+    [self cancelPump];
+
+    if (self.deadlineTimer) {
+        dispatch_source_cancel(self.deadlineTimer);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(self.deadlineTimer);
+#endif
+    }
+
     if (self.sessionToFree) {
         libssh2_session_free(self.sessionToFree);
     }
+
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(_queue);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - SERIALIZED ACCESS
+// -----------------------------------------------------------------------------
+
+- (BOOL)isOnQueue {
+    return dispatch_get_specific(kNMSSHSessionQueueKey) == (__bridge void *)self;
+}
+
+- (void)performBlock:(void (^)(void))block {
+    dispatch_async(self.queue, ^{
+        [self prepareOperation];
+        block();
+        [self endOperation];
+    });
+}
+
+- (void)performBlockAndWait:(void (^)(void))block {
+    // Nested calls are part of the operation already running
+    if ([self isOnQueue]) {
+        [self applyDeadline];
+        block();
+        return;
+    }
+
+    dispatch_sync(self.queue, ^{
+        [self prepareOperation];
+        block();
+        [self endOperation];
+    });
+}
+
+- (BOOL)performBoolBlockAndWait:(BOOL (^)(void))block {
+    __block BOOL result = NO;
+    [self performBlockAndWait:^{
+        result = block();
+    }];
+
+    return result;
+}
+
+- (id)performObjectBlockAndWait:(id (^)(void))block {
+    __block id result = nil;
+    [self performBlockAndWait:^{
+        result = block();
+    }];
+
+    return result;
+}
+
+- (void)prepareOperation {
+    // Whatever mode the previous operation left the session in, every
+    // operation starts blocking and switches to non-blocking mode on its own
+    if (self.session) {
+        libssh2_session_set_blocking(self.session, 1);
+        [self applyDeadline];
+
+        // A libssh2 call left in progress by an asynchronous operation has to
+        // complete before anything else can use the session
+        [[self waitingOperation] settle];
+    }
+}
+
+- (void)applyDeadline {
+    if (!self.session) {
+        return;
+    }
+
+    // Blocking libssh2 calls give up once the remaining time is spent
+    long timeout = [self.blockingTimeout longValue] * 1000;
+    if (self.deadline && !self.deadline.isDistant) {
+        long remaining = [self.deadline remainingMilliseconds];
+        timeout = timeout > 0 ? MIN(timeout, remaining) : remaining;
+    }
+
+    libssh2_session_set_timeout(self.session, timeout);
+}
+
+- (void)performWithDeadline:(NMSSHDeadline *)deadline block:(void (^)(void))block {
+    [self performBlockAndWait:^{
+        // Nested deadlines can only shorten the budget
+        NMSSHDeadline *previousDeadline = self.deadline;
+        [self setDeadline:[deadline earliestDeadline:previousDeadline]];
+        [self applyDeadline];
+
+        block();
+
+        [self setDeadline:previousDeadline];
+        [self applyDeadline];
+    }];
+}
+
+- (NMSSHDeadline *)deadlineWithTimeout:(NSNumber *)timeout {
+    return [(self.deadline ?: [NMSSHDeadline distantDeadline]) deadlineWithTimeout:[timeout doubleValue]];
+}
+
+- (void)endOperation {
+    // Blocking calls may have read the data asynchronous operations and
+    // streaming channels wait for, the socket won't signal it again
+    if ([self.operations count] > 0) {
+        [self resumeOperations];
+    }
+
+    [self schedulePump];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - ASYNCHRONOUS OPERATIONS
+// -----------------------------------------------------------------------------
+
+- (NMSSHOperation *)enqueueOperation:(NMSSHOperation *)operation {
+    [operation setSession:self];
+
+    // Synchronous wrappers pick their own queue, the caller may be blocking the callback queue
+    if (!operation.callbackQueue) {
+        [operation setCallbackQueue:self.callbackQueue];
+    }
+
+    // Operations started from performWithDeadline:block: share its budget
+    if (!operation.deadline && [self isOnQueue]) {
+        [operation setDeadline:self.deadline];
+    }
+
+    dispatch_async(self.queue, ^{
+        [self.operations addObject:operation];
+        [self runOperations];
+    });
+
+    return operation;
+}
+
+- (void)resumeOperations {
+    dispatch_async(self.queue, ^{
+        [self runOperations];
+    });
+}
+
+- (void)cancelAllOperations {
+    dispatch_async(self.queue, ^{
+        for (NMSSHOperation *operation in self.operations) {
+            [operation cancel];
+        }
+    });
+}
+
+- (void)runOperations {
+    // Operations cancelled or expired before they started are dropped right away
+    NSUInteger index = 0;
+    while (index < [self.operations count]) {
+        NMSSHOperation *operation = self.operations[index];
+        if (!operation.isStarted && [operation finishIfAbandoned]) {
+            [self.operations removeObjectAtIndex:index];
+        }
+        else {
+            index++;
+        }
+    }
+
+    // Operations waiting for something else than the socket hold their class
+    NSMutableSet<NMSSHOperation *> *suspended = nil;
+    NMSSHOperation *operation = nil;
+
+    while ((operation = [self nextOperationExcluding:suspended])) {
+        if (self.session) {
+            libssh2_session_set_blocking(self.session, 0);
+        }
+
+        [self setCurrentOperation:operation];
+        int rc = [operation run];
+        [self setCurrentOperation:nil];
+        [self chargeOperation:operation];
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            [self waitForSocket];
+            [self armDeadlineTimer];
+
+            // The operation may have read packets of the streaming channels
+            [self schedulePump];
+            return;
+        }
+
+        if (rc == kNMSSHStepContinue) {
+            [self armSocketSourcesForDirections:0];
+            [self armDeadlineTimer];
+
+            // Let the other users of the session in before continuing
+            [self resumeOperations];
+            return;
+        }
+
+        if (rc == kNMSSHStepSuspend) {
+            suspended = suspended ?: [NSMutableSet set];
+            [suspended addObject:operation];
+            continue;
+        }
+
+        [self.operations removeObject:operation];
+        [operation finish];
+    }
+
+    [self armSocketSourcesForDirections:0];
+    [self armDeadlineTimer];
+
+    // The operations may have read packets of the streaming channels
+    [self schedulePump];
+}
+
+- (NMSSHOperation *)waitingOperation {
+    for (NMSSHOperation *operation in self.operations) {
+        if (operation.isWaiting) {
+            return operation;
+        }
+    }
+
+    return nil;
+}
+
+- (NSUInteger)classOfOperation:(NMSSHOperation *)operation {
+    return (NSUInteger)(MAX(MIN(operation.priority, NMSSHOperationPriorityInteractive), NMSSHOperationPriorityBulk) + 1);
+}
+
+- (NMSSHOperation *)nextOperationExcluding:(NSSet<NMSSHOperation *> *)suspended {
+    // libssh2 keeps the state of a call in progress in the session and the
+    // SFTP instance, it has to complete before any other call is made
+    NMSSHOperation *waitingOperation = [self waitingOperation];
+    if (waitingOperation) {
+        return waitingOperation;
+    }
+
+    // Every class runs in order, its first operation is a candidate. The
+    // operations queued after an exclusive one wait until it finished.
+    NMSSHOperation *next = nil;
+    NSUInteger seenClasses = 0;
+
+    for (NMSSHOperation *operation in self.operations) {
+        if (operation.isExclusive) {
+            if (seenClasses == 0 && ![suspended containsObject:operation]) {
+                next = operation;
+            }
+            break;
+        }
+
+        NSUInteger priorityClass = [self classOfOperation:operation];
+        if (seenClasses & (1 << priorityClass)) {
+            continue;
+        }
+
+        seenClasses |= 1 << priorityClass;
+        if ([suspended containsObject:operation]) {
+            continue;
+        }
+
+        // An idle class does not bank its share, it starts from the current time
+        _priorityPasses[priorityClass] = MAX(_priorityPasses[priorityClass], _schedulerTime);
+
+        NSUInteger nextClass = next ? [self classOfOperation:next] : 0;
+        if (!next || _priorityPasses[priorityClass] < _priorityPasses[nextClass] ||
+            (_priorityPasses[priorityClass] == _priorityPasses[nextClass] && priorityClass > nextClass)) {
+            next = operation;
+        }
+    }
+
+    return next;
+}
+
+- (void)chargeOperation:(NMSSHOperation *)operation {
+    NSUInteger priorityClass = [self classOfOperation:operation];
+
+    _schedulerTime = MAX(_schedulerTime, _priorityPasses[priorityClass]);
+    _priorityPasses[priorityClass] += kNMSSHPriorityStride / kNMSSHPriorityWeights[priorityClass];
+}
+
+- (BOOL)hasOperationsAbovePriority:(NMSSHOperationPriority)priority {
+    for (NMSSHOperation *operation in self.operations) {
+        if (operation.isExclusive) {
+            break;
+        }
+
+        if (operation.priority > priority) {
+            return YES;
+        }
+    }
+
+    return NO;
+}
+
+- (void)armDeadlineTimer {
+    NMSSHDeadline *earliestDeadline = nil;
+    for (NMSSHOperation *operation in self.operations) {
+        earliestDeadline = [operation.deadline earliestDeadline:earliestDeadline] ?: earliestDeadline;
+    }
+
+    if (!earliestDeadline && !self.deadlineTimer) {
+        return;
+    }
+
+    if (!self.deadlineTimer) {
+        __weak NMSSHSession *weakSelf = self;
+        [self setDeadlineTimer:dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.queue)];
+        dispatch_source_set_event_handler(self.deadlineTimer, ^{
+            [weakSelf runOperations];
+        });
+        dispatch_resume(self.deadlineTimer);
+    }
+
+    // Wake up once the earliest deadline passes, even with a silent socket
+    dispatch_time_t start = earliestDeadline ? [earliestDeadline dispatchTime] : DISPATCH_TIME_FOREVER;
+    dispatch_source_set_timer(self.deadlineTimer, start, DISPATCH_TIME_FOREVER, NSEC_PER_SEC / 100);
+}
+
+- (void)waitForSocket {
+    int fd = CFSocketGetNative(self.socket);
+
+    if (!self.readSource || self.sourceSocket != fd) {
+        [self cancelSocketSources];
+
+        __weak NMSSHSession *weakSelf = self;
+        [self setSourceSocket:fd];
+
+        [self setReadSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, self.queue)];
+        dispatch_source_set_event_handler(self.readSource, ^{
+            [weakSelf runOperations];
+        });
+        [self setReadSuspended:YES];
+
+        [self setWriteSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, self.queue)];
+        dispatch_source_set_event_handler(self.writeSource, ^{
+            [weakSelf runOperations];
+        });
+        [self setWriteSuspended:YES];
+    }
+
+    // Until the session exists, the socket is waited for to get connected
+    int directions = self.session ? libssh2_session_block_directions(self.session) : LIBSSH2_SESSION_BLOCK_OUTBOUND;
+    [self armSocketSourcesForDirections:directions ?: LIBSSH2_SESSION_BLOCK_INBOUND];
+}
+
+- (void)armSocketSourcesForDirections:(int)directions {
+    // Waiting for a direction libssh2 is not blocked on would spin, e.g. on
+    // unread data while an outgoing packet has to be flushed first
+    BOOL inbound = (directions & LIBSSH2_SESSION_BLOCK_INBOUND) != 0;
+    BOOL outbound = (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) != 0;
+
+    if (self.readSource && inbound == self.readSuspended) {
+        if (inbound) {
+            dispatch_resume(self.readSource);
+        }
+        else {
+            dispatch_suspend(self.readSource);
+        }
+
+        [self setReadSuspended:!inbound];
+    }
+
+    if (self.writeSource && outbound == self.writeSuspended) {
+        if (outbound) {
+            dispatch_resume(self.writeSource);
+        }
+        else {
+            dispatch_suspend(self.writeSource);
+        }
+
+        [self setWriteSuspended:!outbound];
+    }
+}
+
+- (void)cancelSocketSources {
+    if (self.readSource) {
+        [self armSocketSourcesForDirections:LIBSSH2_SESSION_BLOCK_INBOUND | LIBSSH2_SESSION_BLOCK_OUTBOUND];
+        dispatch_source_cancel(self.readSource);
+        dispatch_source_cancel(self.writeSource);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(self.readSource);
+        dispatch_release(self.writeSource);
+#endif
+        [self setReadSource:nil];
+        [self setWriteSource:nil];
+    }
+
+    [self setSourceSocket:-1];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - CHANNEL READ PUMP
+// -----------------------------------------------------------------------------
+
+- (void)addPumpedChannel:(NMSSHChannel *)channel {
+    if ([self.pumpedChannels containsObject:channel]) {
+        return;
+    }
+
+    [self.pumpedChannels addObject:channel];
+    [self createPump];
+    [self schedulePump];
+}
+
+- (void)removePumpedChannel:(NMSSHChannel *)channel {
+    [self.pumpedChannels removeObject:channel];
+
+    if (![self hasPumpClients]) {
+        [self cancelPump];
+    }
+}
+
+- (id)addPumpHandler:(BOOL (^)(void))handler {
+    id token = [handler copy];
+    [self.pumpHandlers addObject:token];
+    [self createPump];
+    [self schedulePump];
+
+    return token;
+}
+
+- (void)removePumpHandler:(id)token {
+    [self.pumpHandlers removeObjectIdenticalTo:token];
+
+    if (![self hasPumpClients]) {
+        [self cancelPump];
+    }
+}
+
+- (BOOL)hasPumpClients {
+    return [self.pumpedChannels count] > 0 || [self.pumpHandlers count] > 0;
+}
+
+- (void)createPump {
+    if (self.pumpSource) {
+        return;
+    }
+
+    __weak NMSSHSession *weakSelf = self;
+    int fd = CFSocketGetNative(self.socket);
+
+    [self setPumpSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, self.queue)];
+    dispatch_source_set_event_handler(self.pumpSource, ^{
+        [weakSelf pumpSocket];
+    });
+    [self setPumpSuspended:YES];
+
+    // Only armed while libssh2 has output of the handlers to flush
+    [self setPumpWriteSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, fd, 0, self.queue)];
+    dispatch_source_set_event_handler(self.pumpWriteSource, ^{
+        [weakSelf pumpSocket];
+    });
+    [self setPumpWriteSuspended:YES];
+}
+
+- (void)schedulePump {
+    if (self.pumpScheduled || ![self hasPumpClients]) {
+        return;
+    }
+
+    [self setPumpScheduled:YES];
+    dispatch_async(self.queue, ^{
+        [self pumpChannels];
+    });
+}
+
+- (void)pumpSocket {
+    [self pumpChannels];
+
+    // The packets an operation waits for may have been read along the way
+    if ([self.operations count] > 0) {
+        [self runOperations];
+    }
+}
+
+- (void)pumpChannels {
+    [self setPumpScheduled:NO];
+
+    if (!self.session) {
+        return;
+    }
+
+    // The first read drains the socket into libssh2, which keeps the packets
+    // of every channel, the other channels are only read if they got some
+    BOOL drained = NO;
+    BOOL pending = YES;
+    while (pending) {
+        pending = NO;
+
+        // Handlers service all their channels on every pass, the packets they
+        // read for the streaming channels are picked up right after
+        BOOL handlersReading = NO;
+        for (BOOL (^handler)(void) in [self.pumpHandlers copy]) {
+            handlersReading = handler() || handlersReading;
+        }
+        [self setPumpHandlersReading:handlersReading];
+
+        for (NMSSHChannel *channel in [self.pumpedChannels copy]) {
+            if (![channel canPumpReads] || (drained && ![channel hasBufferedInput])) {
+                continue;
+            }
+
+            [channel readShell];
+            pending = drained;
+            drained = YES;
+        }
+    }
+
+    [self armPump];
+}
+
+- (void)armPump {
+    if (!self.pumpSource) {
+        return;
+    }
+
+    // Nobody to read for, the data stays on the socket until a reader comes back
+    BOOL reading = self.pumpHandlersReading;
+    for (NMSSHChannel *channel in self.pumpedChannels) {
+        if ([channel canPumpReads]) {
+            reading = YES;
+            break;
+        }
+    }
+
+    BOOL writing = [self.pumpHandlers count] > 0 && self.session &&
+                   (libssh2_session_block_directions(self.session) & LIBSSH2_SESSION_BLOCK_OUTBOUND);
+    if (writing == self.pumpWriteSuspended) {
+        if (writing) {
+            dispatch_resume(self.pumpWriteSource);
+        }
+        else {
+            dispatch_suspend(self.pumpWriteSource);
+        }
+
+        [self setPumpWriteSuspended:!writing];
+    }
+
+    if (reading == self.pumpSuspended) {
+        if (reading) {
+            dispatch_resume(self.pumpSource);
+        }
+        else {
+            dispatch_suspend(self.pumpSource);
+        }
+
+        [self setPumpSuspended:!reading];
+    }
+}
+
+- (void)cancelPump {
+    if (!self.pumpSource) {
+        return;
+    }
+
+    // A suspended source is never released
+    if (self.pumpSuspended) {
+        dispatch_resume(self.pumpSource);
+        [self setPumpSuspended:NO];
+    }
+
+    if (self.pumpWriteSuspended) {
+        dispatch_resume(self.pumpWriteSource);
+        [self setPumpWriteSuspended:NO];
+    }
+
+    dispatch_source_cancel(self.pumpSource);
+    dispatch_source_cancel(self.pumpWriteSource);
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(self.pumpSource);
+    dispatch_release(self.pumpWriteSource);
+#endif
+    [self setPumpSource:nil];
+    [self setPumpWriteSource:nil];
+}
+
+- (NSError *)errorWithCode:(NMSSHSessionError)code description:(NSString *)description {
+    return [NSError errorWithDomain:@"NMSSH"
+                               code:code
+                           userInfo:@{ NSLocalizedDescriptionKey : description }];
 }
 
 // -----------------------------------------------------------------------------
@@ -149,41 +806,85 @@
     return addresses;
 }
 
-- (NSNumber *)timeout {
-    if (self.session) {
-        return @(libssh2_session_get_timeout(self.session) / 1000);
+- (NSArray *)hostIPAddressesBeforeDeadline {
+    if (!self.deadline || self.deadline.isDistant) {
+        return [self hostIPAddresses];
     }
 
-    return @0;
+    // The resolver can't be interrupted, it is only waited for until the
+    // deadline and its late result is dropped
+    NSMutableArray *result = [NSMutableArray array];
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_retain(semaphore);
+#endif
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSArray *addresses = [self hostIPAddresses];
+        @synchronized (result) {
+            [result addObjectsFromArray:addresses ?: @[]];
+        }
+
+        dispatch_semaphore_signal(semaphore);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(semaphore);
+#endif
+    });
+
+    long timedOut = dispatch_semaphore_wait(semaphore, [self.deadline dispatchTime]);
+#if !(OS_OBJECT_USE_OBJC)
+    dispatch_release(semaphore);
+#endif
+
+    if (timedOut) {
+        NMSSHLogError(@"Timed out resolving %@", self.host);
+        return nil;
+    }
+
+    @synchronized (result) {
+        return [result copy];
+    }
+}
+
+- (NSNumber *)timeout {
+    return [self performObjectBlockAndWait:^id{
+        return self.blockingTimeout ?: @0;
+    }];
 }
 
 - (void)setTimeout:(NSNumber *)timeout {
-    if (self.session) {
-        libssh2_session_set_timeout(self.session, [timeout longValue] * 1000);
-    }
+    [self performBlockAndWait:^{
+        // Kept until a session exists
+        [self setBlockingTimeout:timeout];
+        [self applyDeadline];
+    }];
 }
 
 - (NSError *)lastError {
-    if(!self.rawSession) {
-        return [NSError errorWithDomain:@"libssh2" code:LIBSSH2_ERROR_NONE userInfo:@{NSLocalizedDescriptionKey : @"Error retrieving last session error due to absence of an active session."}];
-    }
-    
-    char *message;
-    int error = libssh2_session_last_error(self.rawSession, &message, NULL, 0);
+    return [self performObjectBlockAndWait:^id{
+        if(!self.rawSession) {
+            return [NSError errorWithDomain:@"libssh2" code:LIBSSH2_ERROR_NONE userInfo:@{NSLocalizedDescriptionKey : @"Error retrieving last session error due to absence of an active session."}];
+        }
+
+        char *message;
+        int error = libssh2_session_last_error(self.rawSession, &message, NULL, 0);
 
-    return [NSError errorWithDomain:@"libssh2"
-                               code:error
-                           userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithUTF8String:message] }];
+        return [NSError errorWithDomain:@"libssh2"
+                                   code:error
+                               userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithUTF8String:message] }];
+    }];
 }
 
 - (NSString *)remoteBanner {
-    const char *banner = libssh2_session_banner_get(self.session);
+    return [self performObjectBlockAndWait:^id{
+        const char *banner = libssh2_session_banner_get(self.session);
 
-    if (!banner) {
-        return nil;
-    }
+        if (!banner) {
+            return nil;
+        }
 
-    return [[NSString alloc] initWithCString:banner encoding:NSUTF8StringEncoding];
+        return [[NSString alloc] initWithCString:banner encoding:NSUTF8StringEncoding];
+    }];
 }
 
 // -----------------------------------------------------------------------------
@@ -195,83 +896,142 @@
 }
 
 - (BOOL)connectWithTimeout:(NSNumber *)timeout {
+    __block BOOL connected = NO;
+
+    // The timeout covers the resolution, the connection and the handshake
+    NMSSHDeadline *deadline = [[NMSSHDeadline distantDeadline] deadlineWithTimeout:[timeout doubleValue]];
+    [self performWithDeadline:deadline block:^{
+        connected = [self connectBeforeDeadline];
+    }];
+
+    return connected;
+}
+
+- (BOOL)connectBeforeDeadline {
     if (self.isConnected) {
         [self disconnect];
     }
 
-    __block BOOL initialized = YES;
+    if (![self initializeLibrary]) {
+        return NO;
+    }
+
+    // Try to establish a connection to the server
+    BOOL connected = self.proxyCommand ? [self connectProxyCommand] : [self connectSocket];
+    if (!connected) {
+        [self disconnect];
+
+        return NO;
+    }
+
+    [self createSession];
+
+    int rc;
+    while ((rc = libssh2_session_handshake(self.session, CFSocketGetNative(_socket))) == LIBSSH2_ERROR_EAGAIN) {
+        if (self.deadline.isExpired) {
+            rc = LIBSSH2_ERROR_TIMEOUT;
+            break;
+        }
+
+        waitsocket(CFSocketGetNative(_socket), self.session);
+    }
+
+    libssh2_session_set_blocking(self.session, 1);
+
+    if (rc) {
+        NMSSHLogError(@"Failure establishing SSH session (Error %i)", rc);
+        [self disconnect];
+
+        return NO;
+    }
+
+    return [self verifyHost];
+}
+
+- (BOOL)initializeLibrary {
+    static BOOL initialized = NO;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
         // Try to initialize libssh2
         if (libssh2_init(0) != 0) {
             NMSSHLogError(@"libssh2 initialization failed");
-            initialized = NO;
+            return;
         }
 
+        initialized = YES;
         NMSSHLogVerbose(@"libssh2 (v%s) initialized", libssh2_version(0));
     });
 
-    if (!initialized) {
+    return initialized;
+}
+
+- (void)createSession {
+    // Create a session instance
+    [self setSession:libssh2_session_init_ex(NULL, NULL, NULL, (__bridge void *)(self))];
+
+    // Set a callback for disconnection
+    libssh2_session_callback_set(self.session, LIBSSH2_CALLBACK_DISCONNECT, &disconnect_callback);
+
+    // Set the custom banner
+    if (self.banner && libssh2_session_banner_set(self.session, [self.banner UTF8String])) {
+        NMSSHLogError(@"Failure setting the banner");
+    }
+
+    // Start the session without blocking, a proxy command may never answer
+    libssh2_session_set_blocking(self.session, 0);
+    [self applyDeadline];
+}
+
+- (BOOL)verifyHost {
+    NMSSHLogVerbose(@"Remote host banner is %@", [self remoteBanner]);
+
+    // Get the fingerprint of the host
+    NSString *fingerprint = [self fingerprint:self.fingerprintHash];
+    NMSSHLogInfo(@"The host's fingerprint is %@", fingerprint);
+
+    if (self.delegate && [self.delegate respondsToSelector:@selector(session:shouldConnectToHostWithFingerprint:)] &&
+        ![self.delegate session:self shouldConnectToHostWithFingerprint:fingerprint]) {
+        NMSSHLogWarn(@"Fingerprint refused, aborting connection...");
+        [self disconnect];
+
         return NO;
     }
-    // Try to establish a connection to the server
+
+    NMSSHLogVerbose(@"SSH session started");
+
+    // We managed to successfully setup a connection
+    [self setConnected:YES];
+
+    return self.isConnected;
+}
+
+- (BOOL)connectSocket {
     NSUInteger index = -1;
     NSInteger port = [self.port integerValue];
-    NSArray *addresses = [self hostIPAddresses];
+    NSArray *addresses = [self hostIPAddressesBeforeDeadline];
     CFSocketError error = 1;
-    CFDataRef address = NULL;
-    SInt32 addressFamily;
 
     while (addresses && ++index < [addresses count] && error) {
-        NSData *addressData = addresses[index];
-        NSString *ipAddress;
-
-        // IPv4
-        if ([addressData length] == sizeof(struct sockaddr_in)) {
-            struct sockaddr_in address4;
-            [addressData getBytes:&address4 length:sizeof(address4)];
-            address4.sin_port = htons(port);
-
-            char str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(address4.sin_addr), str, INET_ADDRSTRLEN);
-            ipAddress = [NSString stringWithCString:str encoding:NSUTF8StringEncoding];
-            addressFamily = AF_INET;
-            address = CFDataCreate(kCFAllocatorDefault, (UInt8 *)&address4, sizeof(address4));
-        } // IPv6
-        else if([addressData length] == sizeof(struct sockaddr_in6)) {
-            struct sockaddr_in6 address6;
-            [addressData getBytes:&address6 length:sizeof(address6)];
-            address6.sin6_port = htons(port);
-
-            char str[INET6_ADDRSTRLEN];
-            inet_ntop(AF_INET6, &(address6.sin6_addr), str, INET6_ADDRSTRLEN);
-            ipAddress = [NSString stringWithCString:str encoding:NSUTF8StringEncoding];
-            addressFamily = AF_INET6;
-            address = CFDataCreate(kCFAllocatorDefault, (UInt8 *)&address6, sizeof(address6));
+        if (self.deadline.isExpired) {
+            NMSSHLogError(@"Timed out connecting to %@", self.host);
+            break;
         }
-        else {
-            NMSSHLogVerbose(@"Unknown address, it's not IPv4 or IPv6!");
+
+        NSString *ipAddress;
+        SInt32 addressFamily;
+        CFDataRef address = [self copySocketAddressFromData:addresses[index] family:&addressFamily description:&ipAddress];
+        if (!address) {
             continue;
         }
-        
-        // Try to create the socket
-        _socket = CFSocketCreate(kCFAllocatorDefault, addressFamily, SOCK_STREAM, IPPROTO_IP, kCFSocketNoCallBack, NULL, NULL);
-        if (!_socket) {
-            NMSSHLogError(@"Error creating the socket");
+
+        if (![self createSocketWithFamily:addressFamily]) {
             CFRelease(address);
             return NO;
         }
-        
-        // Set NOSIGPIPE
-        int set = 1;
-        if (setsockopt(CFSocketGetNative(_socket), SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set)) != 0) {
-            NMSSHLogError(@"Error setting socket option");
-            CFRelease(address);
-            [self disconnect];
-            return NO;
-        }
-        
-        error = CFSocketConnectToAddress(_socket, address, [timeout doubleValue]);
+
+        // A zero timeout waits for the connection as long as it takes
+        CFTimeInterval timeout = self.deadline.isDistant ? 0 : MAX(self.deadline.remainingTime, 0.001);
+        error = CFSocketConnectToAddress(_socket, address, timeout);
         CFRelease(address);
 
         if (error) {
@@ -284,89 +1044,237 @@
 
     if (error) {
         NMSSHLogError(@"Failure establishing socket connection");
-        [self disconnect];
+        return NO;
+    }
+
+    return YES;
+}
+
+- (CFDataRef)copySocketAddressFromData:(NSData *)addressData family:(SInt32 *)addressFamily description:(NSString **)ipAddress {
+    NSInteger port = [self.port integerValue];
 
+    // IPv4
+    if ([addressData length] == sizeof(struct sockaddr_in)) {
+        struct sockaddr_in address4;
+        [addressData getBytes:&address4 length:sizeof(address4)];
+        address4.sin_port = htons(port);
+
+        char str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(address4.sin_addr), str, INET_ADDRSTRLEN);
+        *ipAddress = [NSString stringWithCString:str encoding:NSUTF8StringEncoding];
+        *addressFamily = AF_INET;
+        return CFDataCreate(kCFAllocatorDefault, (UInt8 *)&address4, sizeof(address4));
+    } // IPv6
+    else if([addressData length] == sizeof(struct sockaddr_in6)) {
+        struct sockaddr_in6 address6;
+        [addressData getBytes:&address6 length:sizeof(address6)];
+        address6.sin6_port = htons(port);
+
+        char str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &(address6.sin6_addr), str, INET6_ADDRSTRLEN);
+        *ipAddress = [NSString stringWithCString:str encoding:NSUTF8StringEncoding];
+        *addressFamily = AF_INET6;
+        return CFDataCreate(kCFAllocatorDefault, (UInt8 *)&address6, sizeof(address6));
+    }
+
+    NMSSHLogVerbose(@"Unknown address, it's not IPv4 or IPv6!");
+    return NULL;
+}
+
+- (BOOL)createSocketWithFamily:(SInt32)addressFamily {
+    // The socket of a failed attempt is not reused
+    [self closeSocket];
+
+    // Try to create the socket
+    _socket = CFSocketCreate(kCFAllocatorDefault, addressFamily, SOCK_STREAM, IPPROTO_IP, kCFSocketNoCallBack, NULL, NULL);
+    if (!_socket) {
+        NMSSHLogError(@"Error creating the socket");
         return NO;
     }
 
-    // Create a session instance
-    [self setSession:libssh2_session_init_ex(NULL, NULL, NULL, (__bridge void *)(self))];
+    // Set NOSIGPIPE
+    int set = 1;
+    if (setsockopt(CFSocketGetNative(_socket), SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set)) != 0) {
+        NMSSHLogError(@"Error setting socket option");
+        return NO;
+    }
 
-    // Set a callback for disconnection
-    libssh2_session_callback_set(self.session, LIBSSH2_CALLBACK_DISCONNECT, &disconnect_callback);
+    return YES;
+}
 
-    // Set blocking mode
-    libssh2_session_set_blocking(self.session, 1);
+- (void)closeSocket {
+    // Dispatch sources must be gone before their descriptor gets closed
+    [self cancelSocketSources];
+    [self cancelPump];
 
-    // Set the custom banner
-    if (self.banner && libssh2_session_banner_set(self.session, [self.banner UTF8String])) {
-        NMSSHLogError(@"Failure setting the banner");
+    if (_socket) {
+        CFSocketInvalidate(_socket);
+        CFRelease(_socket);
+        _socket = NULL;
+    }
+}
+
+- (NSString *)expandedProxyCommand {
+    NSMutableString *command = [NSMutableString stringWithCapacity:[self.proxyCommand length]];
+    NSUInteger length = [self.proxyCommand length];
+
+    for (NSUInteger i = 0; i < length; i++) {
+        unichar character = [self.proxyCommand characterAtIndex:i];
+        if (character != '%' || i + 1 == length) {
+            [command appendFormat:@"%C", character];
+            continue;
+        }
+
+        unichar token = [self.proxyCommand characterAtIndex:++i];
+        switch (token) {
+            case 'h':
+                [command appendString:self.host];
+                break;
+
+            case 'p':
+                [command appendString:[self.port stringValue]];
+                break;
+
+            case 'r':
+                [command appendString:self.username];
+                break;
+
+            case '%':
+                [command appendString:@"%"];
+                break;
+
+            default:
+                NMSSHLogWarn(@"Unknown token %%%C in proxy command", token);
+                [command appendFormat:@"%%%C", token];
+                break;
+        }
+    }
+
+    return [command copy];
+}
+
+- (BOOL)connectProxyCommand {
+#if TARGET_OS_IPHONE
+    NMSSHLogError(@"ProxyCommand is not supported on iOS");
+    return NO;
+#else
+    NSString *command = [self expandedProxyCommand];
+    NSString *shell = [[[NSProcessInfo processInfo] environment] objectForKey:@"SHELL"] ?: @"/bin/sh";
+
+    // One end of the pair is the transport of the session, the other one is
+    // both the standard input and output of the command
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        NMSSHLogError(@"Error creating the proxy command socket pair");
+        return NO;
     }
 
-    // Start the session
-    if (libssh2_session_handshake(self.session, CFSocketGetNative(_socket))) {
-        NMSSHLogError(@"Failure establishing SSH session");
-        [self disconnect];
+    // Close every descriptor of the process in the command except the pair
+    // end and standard error, so it can't keep other connections open
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_CLOEXEC_DEFAULT);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addinherit_np(&actions, STDERR_FILENO);
+
+    NSString *execCommand = [@"exec " stringByAppendingString:command];
+    char *argv[] = { (char *)[shell fileSystemRepresentation], "-c", (char *)[execCommand UTF8String], NULL };
 
+    pid_t pid;
+    int rc = posix_spawn(&pid, [shell fileSystemRepresentation], &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(fds[1]);
+
+    if (rc != 0) {
+        NMSSHLogError(@"Unable to spawn proxy command %@ (%s)", command, strerror(rc));
+        close(fds[0]);
         return NO;
     }
 
-    NMSSHLogVerbose(@"Remote host banner is %@", [self remoteBanner]);
-
-    // Get the fingerprint of the host
-    NSString *fingerprint = [self fingerprint:self.fingerprintHash];
-    NMSSHLogInfo(@"The host's fingerprint is %@", fingerprint);
+    [self setProxyCommandPID:pid];
+    NMSSHLogInfo(@"Proxy command %@ started with pid %d", command, pid);
 
-    if (self.delegate && [self.delegate respondsToSelector:@selector(session:shouldConnectToHostWithFingerprint:)] &&
-        ![self.delegate session:self shouldConnectToHostWithFingerprint:fingerprint]) {
-        NMSSHLogWarn(@"Fingerprint refused, aborting connection...");
-        [self disconnect];
+    int set = 1;
+    if (setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set)) != 0) {
+        NMSSHLogError(@"Error setting socket option");
+        close(fds[0]);
+        return NO;
+    }
 
+    _socket = CFSocketCreateWithNative(kCFAllocatorDefault, fds[0], kCFSocketNoCallBack, NULL, NULL);
+    if (!_socket) {
+        NMSSHLogError(@"Error creating the socket");
+        close(fds[0]);
         return NO;
     }
 
-    NMSSHLogVerbose(@"SSH session started");
+    return YES;
+#endif
+}
 
-    // We managed to successfully setup a connection
-    [self setConnected:YES];
+- (void)disconnect {
+    [self performBlockAndWait:^{
+        if (_channel) {
+            [_channel closeShell];
+            [self setChannel:nil];
+        }
 
-    return self.isConnected;
-}
+        // The other streaming channels lose their socket too
+        for (NMSSHChannel *channel in [self.pumpedChannels copy]) {
+            [channel closeShell];
+        }
 
+        if (_sftp) {
+            if ([_sftp isConnected]) {
+                [_sftp disconnect];
+            }
+            [self setSftp:nil];
+        }
 
-- (void)disconnect {
-    if (_channel) {
-        [_channel closeShell];
-        [self setChannel:nil];
-    }
+        if (self.agent) {
+            libssh2_agent_disconnect(self.agent);
+            libssh2_agent_free(self.agent);
+            [self setAgent:NULL];
+        }
 
-    if (_sftp) {
-        if ([_sftp isConnected]) {
-            [_sftp disconnect];
+        if (self.session) {
+            libssh2_session_disconnect(self.session, "NMSSH: Disconnect");
+            [self setSessionToFree:self.session];
+            [self setSession:NULL];
         }
-        [self setSftp:nil];
-    }
 
-    if (self.agent) {
-        libssh2_agent_disconnect(self.agent);
-        libssh2_agent_free(self.agent);
-        [self setAgent:NULL];
-    }
+        [self closeSocket];
 
-    if (self.session) {
-        libssh2_session_disconnect(self.session, "NMSSH: Disconnect");
-        [self setSessionToFree:self.session];
-        [self setSession:NULL];
-    }
+        if (self.proxyCommandPID > 0) {
+            pid_t pid = self.proxyCommandPID;
+            [self setProxyCommandPID:0];
 
-    if (_socket) {
-        CFSocketInvalidate(_socket);
-        CFRelease(_socket);
-        _socket = NULL;
-    }
+            // The command sees EOF on its input, make sure it goes away and reap
+            // it without blocking the caller
+            kill(pid, SIGTERM);
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+                waitpid(pid, NULL, 0);
+            });
+        }
+
+        // The libssh2 state of the queued operations went away with the session
+        NSError *disconnectionError = [self errorWithCode:NMSSHSessionDisconnectedError
+                                              description:@"Session disconnected"];
+        for (NMSSHOperation *operation in [self.operations copy]) {
+            if (operation != self.currentOperation && operation.requiresSession) {
+                [self.operations removeObject:operation];
+                [operation finishWithError:disconnectionError];
+            }
+        }
 
-    NMSSHLogVerbose(@"Disconnected");
-    [self setConnected:NO];
+        NMSSHLogVerbose(@"Disconnected");
+        [self setConnected:NO];
+    }];
 }
 
 // -----------------------------------------------------------------------------
@@ -374,96 +1282,99 @@
 // -----------------------------------------------------------------------------
 
 - (BOOL)isAuthorized {
-    if (self.session) {
-        return libssh2_userauth_authenticated(self.session) == 1;
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        if (self.session) {
+            return libssh2_userauth_authenticated(self.session) == 1;
+        }
 
-    return NO;
+        return NO;
+    }];
 }
 
 - (BOOL)authenticateByPassword:(NSString *)password {
+    return [self performBoolBlockAndWait:^BOOL{
+        if (!password) {
+            return NO;
+        }
 
-    if (!password) {
-        return NO;
-    }
-
-    if (![self supportsAuthenticationMethod:@"password"]) {
-        return NO;
-    }
+        if (![self supportsAuthenticationMethod:@"password"]) {
+            return NO;
+        }
 
-    // Try to authenticate by password
-    int error = libssh2_userauth_password(self.session, [self.username UTF8String], [password UTF8String]);
-    if (error) {
-        NMSSHLogError(@"Password authentication failed with reason %i", error);
-        return NO;
-    }
+        // Try to authenticate by password
+        int error = libssh2_userauth_password(self.session, [self.username UTF8String], [password UTF8String]);
+        if (error) {
+            NMSSHLogError(@"Password authentication failed with reason %i", error);
+            return NO;
+        }
 
-    NMSSHLogVerbose(@"Password authentication succeeded.");
+        NMSSHLogVerbose(@"Password authentication succeeded.");
 
-    return self.isAuthorized;
+        return self.isAuthorized;
+    }];
 }
 
 - (BOOL)authenticateByPublicKey:(NSString *)publicKey
                      privateKey:(NSString *)privateKey
                     andPassword:(NSString *)password {
-    if (![self supportsAuthenticationMethod:@"publickey"]) {
-        return NO;
-    }
+    NSString *pass = password ?: @"";
 
-    if (password == nil) {
-        password = @"";
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        if (![self supportsAuthenticationMethod:@"publickey"]) {
+            return NO;
+        }
 
-    // Get absolute paths for private/public key pair
-    const char *pubKey = [[publicKey stringByExpandingTildeInPath] UTF8String] ?: NULL;
-    const char *privKey = [[privateKey stringByExpandingTildeInPath] UTF8String] ?: NULL;
+        // Get absolute paths for private/public key pair
+        const char *pubKey = [[publicKey stringByExpandingTildeInPath] UTF8String] ?: NULL;
+        const char *privKey = [[privateKey stringByExpandingTildeInPath] UTF8String] ?: NULL;
 
-    // Try to authenticate with key pair and password
-    int error = libssh2_userauth_publickey_fromfile(self.session,
-                                                    [self.username UTF8String],
-                                                    pubKey,
-                                                    privKey,
-                                                    [password UTF8String]);
+        // Try to authenticate with key pair and password
+        int error = libssh2_userauth_publickey_fromfile(self.session,
+                                                        [self.username UTF8String],
+                                                        pubKey,
+                                                        privKey,
+                                                        [pass UTF8String]);
 
-    if (error) {
-        NMSSHLogError(@"Public key authentication failed with reason %i", error);
-        return NO;
-    }
+        if (error) {
+            NMSSHLogError(@"Public key authentication failed with reason %i", error);
+            return NO;
+        }
 
-    NMSSHLogVerbose(@"Public key authentication succeeded.");
+        NMSSHLogVerbose(@"Public key authentication succeeded.");
 
-    return self.isAuthorized;
+        return self.isAuthorized;
+    }];
 }
 
 - (BOOL)authenticateByInMemoryPublicKey:(NSString *)publicKey
                              privateKey:(NSString *)privateKey
                             andPassword:(NSString *)password {
-    if (![self supportsAuthenticationMethod:@"publickey"]) {
-        return NO;
-    }
+    NSString *pass = password ?: @"";
 
-    if (password == nil) {
-        password = @"";
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        if (![self supportsAuthenticationMethod:@"publickey"]) {
+            return NO;
+        }
 
-    // Try to authenticate with key pair and password
-    int error = libssh2_userauth_publickey_frommemory(self.session,
-                                                    [self.username UTF8String],
-                                                    [self.username length],
-                                                    [publicKey UTF8String] ?: nil,
-                                                    [publicKey length] ?: 0,
-                                                    [privateKey UTF8String] ?: nil,
-                                                    [privateKey length] ?: 0,
-                                                    [password UTF8String]);
+        // Try to authenticate with key pair and password
+        int error = libssh2_userauth_publickey_frommemory(self.session,
+                                                        [self.username UTF8String],
+                                                        [self.username length],
+                                                        [publicKey UTF8String] ?: nil,
+                                                        [publicKey length] ?: 0,
+                                                        [privateKey UTF8String] ?: nil,
+                                                        [privateKey length] ?: 0,
+                                                        [pass UTF8String]);
 
-    if (error) {
-        NMSSHLogError(@"Public key authentication failed with reason %i", error);
-        return NO;
-    }
+        if (error) {
+            NMSSHLogError(@"Public key authentication failed with reason %i", error);
+            return NO;
+        }
 
-    NMSSHLogVerbose(@"Public key authentication succeeded.");
+        NMSSHLogVerbose(@"Public key authentication succeeded.");
 
-    return self.isAuthorized;
+        return self.isAuthorized;
+    }];
 }
 
 - (BOOL)authenticateByKeyboardInteractive {
@@ -471,84 +1382,90 @@
 }
 
 - (BOOL)authenticateByKeyboardInteractiveUsingBlock:(NSString *(^)(NSString *request))authenticationBlock {
-    if (![self supportsAuthenticationMethod:@"keyboard-interactive"]) {
-        return NO;
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        if (![self supportsAuthenticationMethod:@"keyboard-interactive"]) {
+            return NO;
+        }
 
-    self.kbAuthenticationBlock = authenticationBlock;
-    int rc = libssh2_userauth_keyboard_interactive(self.session, [self.username UTF8String], &kb_callback);
-    self.kbAuthenticationBlock = nil;
+        self.kbAuthenticationBlock = authenticationBlock;
+        int rc = libssh2_userauth_keyboard_interactive(self.session, [self.username UTF8String], &kb_callback);
+        self.kbAuthenticationBlock = nil;
 
-    if (rc != 0) {
-        NMSSHLogError(@"Keyboard-interactive authentication failed with reason %i", rc);
-        return NO;
-    }
+        if (rc != 0) {
+            NMSSHLogError(@"Keyboard-interactive authentication failed with reason %i", rc);
+            return NO;
+        }
 
-    NMSSHLogVerbose(@"Keyboard-interactive authentication succeeded.");
+        NMSSHLogVerbose(@"Keyboard-interactive authentication succeeded.");
 
-    return self.isAuthorized;
+        return self.isAuthorized;
+    }];
 }
 
 - (BOOL)connectToAgent {
-    if (![self supportsAuthenticationMethod:@"publickey"]) {
-        return NO;
-    }
-
-    // Try to setup a connection to the SSH-agent
-    [self setAgent:libssh2_agent_init(self.session)];
-    if (!self.agent) {
-        NMSSHLogError(@"Could not start a new agent");
-        return NO;
-    }
-
-    // Try connecting to the agent
-    if (libssh2_agent_connect(self.agent)) {
-        NMSSHLogError(@"Failed connection to agent");
-        return NO;
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        if (![self supportsAuthenticationMethod:@"publickey"]) {
+            return NO;
+        }
 
-    // Try to fetch available SSH identities
-    if (libssh2_agent_list_identities(self.agent)) {
-        NMSSHLogError(@"Failed to request agent identities");
-        return NO;
-    }
+        // Try to setup a connection to the SSH-agent
+        [self setAgent:libssh2_agent_init(self.session)];
+        if (!self.agent) {
+            NMSSHLogError(@"Could not start a new agent");
+            return NO;
+        }
 
-    // Search for the correct identity and try to authenticate
-    struct libssh2_agent_publickey *identity, *prev_identity = NULL;
-    while (1) {
-        int error = libssh2_agent_get_identity(self.agent, &identity, prev_identity);
-        if (error) {
-            NMSSHLogError(@"Failed to find a valid identity for the agent");
+        // Try connecting to the agent
+        if (libssh2_agent_connect(self.agent)) {
+            NMSSHLogError(@"Failed connection to agent");
             return NO;
         }
 
-        error = libssh2_agent_userauth(self.agent, [self.username UTF8String], identity);
-        if (!error) {
-            return self.isAuthorized;
+        // Try to fetch available SSH identities
+        if (libssh2_agent_list_identities(self.agent)) {
+            NMSSHLogError(@"Failed to request agent identities");
+            return NO;
         }
 
-        prev_identity = identity;
-    }
+        // Search for the correct identity and try to authenticate
+        struct libssh2_agent_publickey *identity, *prev_identity = NULL;
+        while (1) {
+            int error = libssh2_agent_get_identity(self.agent, &identity, prev_identity);
+            if (error) {
+                NMSSHLogError(@"Failed to find a valid identity for the agent");
+                return NO;
+            }
+
+            error = libssh2_agent_userauth(self.agent, [self.username UTF8String], identity);
+            if (!error) {
+                return self.isAuthorized;
+            }
+
+            prev_identity = identity;
+        }
 
-    return NO;
+        return NO;
+    }];
 }
 
 - (NSArray *)supportedAuthenticationMethods {
-    if (!self.session) {
-        return nil;
-    }
-    
-    char *userauthlist = libssh2_userauth_list(self.session, [self.username UTF8String],
-                                               (unsigned int)strlen([self.username UTF8String]));
-    if (userauthlist == NULL){
-        NMSSHLogInfo(@"Failed to get authentication method for host %@:%@", self.host, self.port);
-        return nil;
-    }
+    return [self performObjectBlockAndWait:^id{
+        if (!self.session) {
+            return nil;
+        }
+
+        char *userauthlist = libssh2_userauth_list(self.session, [self.username UTF8String],
+                                                   (unsigned int)strlen([self.username UTF8String]));
+        if (userauthlist == NULL){
+            NMSSHLogInfo(@"Failed to get authentication method for host %@:%@", self.host, self.port);
+            return nil;
+        }
 
-    NSString *authList = [NSString stringWithCString:userauthlist encoding:NSUTF8StringEncoding];
-    NMSSHLogVerbose(@"User auth list: %@", authList);
+        NSString *authList = [NSString stringWithCString:userauthlist encoding:NSUTF8StringEncoding];
+        NMSSHLogVerbose(@"User auth list: %@", authList);
 
-    return [authList componentsSeparatedByString:@","];
+        return [authList componentsSeparatedByString:@","];
+    }];
 }
 
 - (BOOL)supportsAuthenticationMethod:(NSString *)method {
@@ -556,36 +1473,297 @@
 }
 
 - (NSString *)fingerprint:(NMSSHSessionHash)hashType {
-    if (!self.session) {
-        return nil;
-    }
+    return [self performObjectBlockAndWait:^id{
+        if (!self.session) {
+            return nil;
+        }
 
-    int libssh2_hash, hashLength;
-    switch (hashType) {
-        case NMSSHSessionHashMD5:
-            libssh2_hash = LIBSSH2_HOSTKEY_HASH_MD5;
-            hashLength = 16;
-            break;
+        int libssh2_hash, hashLength;
+        switch (hashType) {
+            case NMSSHSessionHashMD5:
+                libssh2_hash = LIBSSH2_HOSTKEY_HASH_MD5;
+                hashLength = 16;
+                break;
+
+            case NMSSHSessionHashSHA1:
+                libssh2_hash = LIBSSH2_HOSTKEY_HASH_SHA1;
+                hashLength = 20;
+                break;
+        }
 
-        case NMSSHSessionHashSHA1:
-            libssh2_hash = LIBSSH2_HOSTKEY_HASH_SHA1;
-            hashLength = 20;
-            break;
-    }
+        const char *hash = libssh2_hostkey_hash(self.session, libssh2_hash);
+        if (!hash) {
+            NMSSHLogWarn(@"Unable to retrive host's fingerprint");
+            return nil;
+        }
 
-    const char *hash = libssh2_hostkey_hash(self.session, libssh2_hash);
-    if (!hash) {
-        NMSSHLogWarn(@"Unable to retrive host's fingerprint");
-        return nil;
-    }
+        NSMutableString *fingerprint = [[NSMutableString alloc] initWithFormat:@"%02X", (unsigned char)hash[0]];
 
-    NSMutableString *fingerprint = [[NSMutableString alloc] initWithFormat:@"%02X", (unsigned char)hash[0]];
+        for (int i = 1; i < hashLength; i++) {
+            [fingerprint appendFormat:@":%02X", (unsigned char)hash[i]];
+        }
 
-    for (int i = 1; i < hashLength; i++) {
-        [fingerprint appendFormat:@":%02X", (unsigned char)hash[i]];
-    }
+        return [fingerprint copy];
+    }];
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - ASYNCHRONOUS CONNECTION AND AUTHENTICATION
+// -----------------------------------------------------------------------------
+
+- (NMSSHOperation *)connectWithCompletionHandler:(void (^)(NSError *))completionHandler {
+    __block NSArray *addresses = nil;
+    __block NSUInteger index = 0;
+    __block BOOL resolving = NO;
+    __block NSString *ipAddress = nil;
+
+    NMSSHOperationStep resolve = ^int(NMSSHOperation *operation) {
+        if (addresses) {
+            return kNMSSHStepDone;
+        }
+
+        if (resolving) {
+            return kNMSSHStepSuspend;
+        }
+
+        if (self.isConnected) {
+            [self disconnect];
+        }
+
+        if (![self initializeLibrary]) {
+            [operation setError:[self errorWithCode:NMSSHSessionConnectionError
+                                        description:@"libssh2 initialization failed"]];
+            return kNMSSHStepFailed;
+        }
+
+        if (self.proxyCommand) {
+            if (![self connectProxyCommand]) {
+                [operation setError:[self errorWithCode:NMSSHSessionConnectionError
+                                            description:@"Unable to start the proxy command"]];
+                return kNMSSHStepFailed;
+            }
+
+            addresses = @[];
+            return kNMSSHStepDone;
+        }
+
+        // The resolver blocks, keep it off the session queue
+        resolving = YES;
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSArray *result = [self hostIPAddresses] ?: @[];
+
+            dispatch_async(self.queue, ^{
+                addresses = result;
+                resolving = NO;
+                [self runOperations];
+            });
+        });
+
+        return kNMSSHStepSuspend;
+    };
+
+    NMSSHOperationStep connectSocket = ^int(NMSSHOperation *operation) {
+        if (self.proxyCommand) {
+            return kNMSSHStepDone;
+        }
+
+        NSInteger port = [self.port integerValue];
+
+        // Check the connection in progress
+        if (_socket) {
+            int fd = CFSocketGetNative(_socket);
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, 0) == 0) {
+                return LIBSSH2_ERROR_EAGAIN;
+            }
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+            if (!error) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                NMSSHLogInfo(@"Socket connection to %@ on port %ld succesful", ipAddress, (long)port);
+                return kNMSSHStepDone;
+            }
+
+            NMSSHLogVerbose(@"Socket connection to %@ on port %ld failed with reason %s, trying next address...", ipAddress, (long)port, strerror(error));
+            [self closeSocket];
+        }
+
+        while (index < [addresses count]) {
+            SInt32 addressFamily;
+            NSString *description;
+            CFDataRef address = [self copySocketAddressFromData:addresses[index++] family:&addressFamily description:&description];
+            if (!address) {
+                continue;
+            }
+
+            ipAddress = description;
+            if (![self createSocketWithFamily:addressFamily]) {
+                CFRelease(address);
+                break;
+            }
+
+            int fd = CFSocketGetNative(_socket);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+            int rc = connect(fd, (const struct sockaddr *)CFDataGetBytePtr(address), (socklen_t)CFDataGetLength(address));
+            CFRelease(address);
+
+            if (rc == 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                NMSSHLogInfo(@"Socket connection to %@ on port %ld succesful", ipAddress, (long)port);
+                return kNMSSHStepDone;
+            }
+
+            if (errno == EINPROGRESS) {
+                return LIBSSH2_ERROR_EAGAIN;
+            }
+
+            NMSSHLogVerbose(@"Socket connection to %@ on port %ld failed with reason %s, trying next address...", ipAddress, (long)port, strerror(errno));
+            [self closeSocket];
+        }
+
+        NMSSHLogError(@"Failure establishing socket connection");
+        [operation setError:[self errorWithCode:NMSSHSessionConnectionError
+                                    description:@"Failure establishing socket connection"]];
+        return kNMSSHStepFailed;
+    };
+
+    NMSSHOperationStep handshake = ^int(NMSSHOperation *operation) {
+        if (!self.session) {
+            [self createSession];
+        }
+
+        int rc = libssh2_session_handshake(self.session, CFSocketGetNative(_socket));
+        if (rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+            NMSSHLogError(@"Failure establishing SSH session (Error %i)", rc);
+        }
+
+        return rc;
+    };
+
+    NMSSHOperationStep verify = ^int(NMSSHOperation *operation) {
+        libssh2_session_set_blocking(self.session, 1);
+
+        if (![self verifyHost]) {
+            [operation setError:[self errorWithCode:NMSSHSessionHostRejectedError
+                                        description:@"Fingerprint refused by the delegate"]];
+            return kNMSSHStepFailed;
+        }
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperationStep cleanup = ^int(NMSSHOperation *operation) {
+        if (operation.error) {
+            [self disconnect];
+        }
+
+        return kNMSSHStepDone;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[resolve, connectSocket, handshake, verify]
+                                                              cleanup:cleanup
+                                                           completion:completionHandler];
+
+    // The operation creates the session, nothing can overtake it
+    [operation setRequiresSession:NO];
+    [operation setExclusive:YES];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperationStep)authenticationMethodStep:(NSString *)method {
+    return ^int(NMSSHOperation *operation) {
+        const char *username = [self.username UTF8String];
+        char *userauthlist = libssh2_userauth_list(self.session, username, (unsigned int)strlen(username));
 
-    return [fingerprint copy];
+        if (!userauthlist) {
+            if (libssh2_session_last_errno(self.session) == LIBSSH2_ERROR_EAGAIN) {
+                return LIBSSH2_ERROR_EAGAIN;
+            }
+
+            // The server accepted the "none" method
+            return libssh2_userauth_authenticated(self.session) ? kNMSSHStepDone : kNMSSHStepFailed;
+        }
+
+        NSArray *methods = [[NSString stringWithCString:userauthlist encoding:NSUTF8StringEncoding] componentsSeparatedByString:@","];
+        if (![methods containsObject:method]) {
+            NMSSHLogError(@"The server doesn't support %@ authentication", method);
+            [operation setError:[self errorWithCode:NMSSHSessionAuthenticationError
+                                        description:[NSString stringWithFormat:@"The server doesn't support %@ authentication", method]]];
+            return kNMSSHStepFailed;
+        }
+
+        return kNMSSHStepDone;
+    };
+}
+
+- (NMSSHOperation *)authenticateWithStep:(NMSSHOperationStep)authenticate
+                                  method:(NSString *)method
+                       completionHandler:(void (^)(NSError *))completionHandler {
+    NMSSHOperationStep step = ^int(NMSSHOperation *operation) {
+        if (libssh2_userauth_authenticated(self.session)) {
+            return kNMSSHStepDone;
+        }
+
+        int rc = authenticate(operation);
+        if (rc == 0) {
+            NMSSHLogVerbose(@"%@ authentication succeeded.", method);
+        }
+        else if (rc != LIBSSH2_ERROR_EAGAIN) {
+            NMSSHLogError(@"%@ authentication failed with reason %i", method, rc);
+            [operation setError:[self errorWithCode:NMSSHSessionAuthenticationError
+                                        description:[NSString stringWithFormat:@"%@ authentication failed", method]]];
+        }
+
+        return rc;
+    };
+
+    NMSSHOperation *operation = [[NMSSHOperation alloc] initWithSteps:@[[self authenticationMethodStep:method], step]
+                                                              cleanup:nil
+                                                           completion:completionHandler];
+
+    // Channels can't be opened before the session is authenticated
+    [operation setExclusive:YES];
+
+    return [self enqueueOperation:operation];
+}
+
+- (NMSSHOperation *)authenticateByPassword:(NSString *)password
+                         completionHandler:(void (^)(NSError *))completionHandler {
+    NSString *username = [self.username copy];
+    password = [password copy] ?: @"";
+
+    return [self authenticateWithStep:^int(NMSSHOperation *operation) {
+        return libssh2_userauth_password_ex(self.session,
+                                            [username UTF8String],
+                                            (unsigned int)strlen([username UTF8String]),
+                                            [password UTF8String],
+                                            (unsigned int)strlen([password UTF8String]),
+                                            NULL);
+    } method:@"password" completionHandler:completionHandler];
+}
+
+- (NMSSHOperation *)authenticateByPublicKey:(NSString *)publicKey
+                                 privateKey:(NSString *)privateKey
+                                andPassword:(NSString *)password
+                          completionHandler:(void (^)(NSError *))completionHandler {
+    NSString *username = [self.username copy];
+    NSString *publicKeyPath = [publicKey stringByExpandingTildeInPath];
+    NSString *privateKeyPath = [privateKey stringByExpandingTildeInPath];
+    password = [password copy] ?: @"";
+
+    return [self authenticateWithStep:^int(NMSSHOperation *operation) {
+        return libssh2_userauth_publickey_fromfile_ex(self.session,
+                                                      [username UTF8String],
+                                                      (unsigned int)strlen([username UTF8String]),
+                                                      [publicKeyPath UTF8String],
+                                                      [privateKeyPath UTF8String],
+                                                      [password UTF8String]);
+    } method:@"publickey" completionHandler:completionHandler];
 }
 
 // -----------------------------------------------------------------------------
@@ -630,14 +1808,16 @@
 #endif
     }
 
-    NMSSHKnownHostStatus status = NMSSHKnownHostStatusFailure;
-    for (NSString *filename in files) {
-        status = [self knownHostStatusWithFile:filename];
+    __block NMSSHKnownHostStatus status = NMSSHKnownHostStatusFailure;
+    [self performBlockAndWait:^{
+        for (NSString *filename in files) {
+            status = [self knownHostStatusWithFile:filename];
 
-        if (status != NMSSHKnownHostStatusNotFound && status != NMSSHKnownHostStatusFailure) {
-            return status;
+            if (status != NMSSHKnownHostStatusNotFound && status != NMSSHKnownHostStatusFailure) {
+                return;
+            }
         }
-    }
+    }];
 
     return status;
 }
@@ -710,86 +1890,86 @@
 }
 
 - (BOOL)addKnownHostName:(NSString *)host port:(NSInteger)port toFile:(NSString *)fileName withSalt:(NSString *)salt {
-    const char *hostkey;
-    size_t hklen;
-    int hktype;
-    NSString *hostname;  // Formatted as {host} or [{host}]:{port}.
+    NSString *path = fileName ?: [self userKnownHostsFileName];
 
-    if (port == 22) {
-        hostname = host;
-    }
-    else {
-        hostname = [NSString stringWithFormat:@"[%@]:%d", host, (int)port];
-    }
+    return [self performBoolBlockAndWait:^BOOL{
+        const char *hostkey;
+        size_t hklen;
+        int hktype;
+        NSString *hostname;  // Formatted as {host} or [{host}]:{port}.
 
-    if (!fileName) {
-        fileName = [self userKnownHostsFileName];
-    }
+        if (port == 22) {
+            hostname = host;
+        }
+        else {
+            hostname = [NSString stringWithFormat:@"[%@]:%d", host, (int)port];
+        }
 
-    hostkey = libssh2_session_hostkey(self.session, &hklen, &hktype);
-    if (!hostkey) {
-        NMSSHLogError(@"Failed to get host key.");
-        return NO;
-    }
+        hostkey = libssh2_session_hostkey(self.session, &hklen, &hktype);
+        if (!hostkey) {
+            NMSSHLogError(@"Failed to get host key.");
+            return NO;
+        }
 
-    LIBSSH2_KNOWNHOSTS *knownHosts = libssh2_knownhost_init(self.session);
-    if (!knownHosts) {
-        NMSSHLogError(@"Failed to initialize knownhosts.");
-        return NO;
-    }
+        LIBSSH2_KNOWNHOSTS *knownHosts = libssh2_knownhost_init(self.session);
+        if (!knownHosts) {
+            NMSSHLogError(@"Failed to initialize knownhosts.");
+            return NO;
+        }
 
-    int rc = libssh2_knownhost_readfile(knownHosts, [fileName UTF8String], LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-    if (rc < 0 && rc != LIBSSH2_ERROR_FILE) {
-        NMSSHLogError(@"Failed to read known hosts file.");
-        libssh2_knownhost_free(knownHosts);
+        int rc = libssh2_knownhost_readfile(knownHosts, [path UTF8String], LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+        if (rc < 0 && rc != LIBSSH2_ERROR_FILE) {
+            NMSSHLogError(@"Failed to read known hosts file.");
+            libssh2_knownhost_free(knownHosts);
 
-        return NO;
-    }
+            return NO;
+        }
 
-    int keybit = LIBSSH2_KNOWNHOST_KEYENC_RAW;
-    if (hktype == LIBSSH2_HOSTKEY_TYPE_RSA) {
-        keybit |= LIBSSH2_KNOWNHOST_KEY_SSHRSA;
-    }
-    else {
-        keybit |= LIBSSH2_KNOWNHOST_KEY_SSHDSS;
-    }
+        int keybit = LIBSSH2_KNOWNHOST_KEYENC_RAW;
+        if (hktype == LIBSSH2_HOSTKEY_TYPE_RSA) {
+            keybit |= LIBSSH2_KNOWNHOST_KEY_SSHRSA;
+        }
+        else {
+            keybit |= LIBSSH2_KNOWNHOST_KEY_SSHDSS;
+        }
 
-    if (salt) {
-        keybit |= LIBSSH2_KNOWNHOST_TYPE_SHA1;
-    }
-    else {
-        keybit |= LIBSSH2_KNOWNHOST_TYPE_PLAIN;
-    }
-
-    int result = libssh2_knownhost_addc(knownHosts,
-                                        [hostname UTF8String],
-                                        [salt UTF8String],
-                                        hostkey,
-                                        hklen,
-                                        NULL,
-                                        0,
-                                        keybit,
-                                        NULL);
-    if (result) {
-        NMSSHLogError(@"Failed to add host to known hosts: error %d (%@)",
-                      result,
-                      [self lastError]);
-    }
-    else {
-        result = libssh2_knownhost_writefile(knownHosts,
-                                             [fileName UTF8String],
-                                             LIBSSH2_KNOWNHOST_FILE_OPENSSH);
-        if (result < 0) {
-            NMSSHLogError(@"Couldn't write to %@: %@",
-                          [self userKnownHostsFileName], [self lastError]);
+        if (salt) {
+            keybit |= LIBSSH2_KNOWNHOST_TYPE_SHA1;
         }
         else {
-            NMSSHLogInfo(@"Host added to known hosts.");
+            keybit |= LIBSSH2_KNOWNHOST_TYPE_PLAIN;
         }
-    }
 
-    libssh2_knownhost_free(knownHosts);
-    return result == 0;
+        int result = libssh2_knownhost_addc(knownHosts,
+                                            [hostname UTF8String],
+                                            [salt UTF8String],
+                                            hostkey,
+                                            hklen,
+                                            NULL,
+                                            0,
+                                            keybit,
+                                            NULL);
+        if (result) {
+            NMSSHLogError(@"Failed to add host to known hosts: error %d (%@)",
+                          result,
+                          [self lastError]);
+        }
+        else {
+            result = libssh2_knownhost_writefile(knownHosts,
+                                                 [path UTF8String],
+                                                 LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+            if (result < 0) {
+                NMSSHLogError(@"Couldn't write to %@: %@",
+                              [self userKnownHostsFileName], [self lastError]);
+            }
+            else {
+                NMSSHLogInfo(@"Host added to known hosts.");
+            }
+        }
+
+        libssh2_knownhost_free(knownHosts);
+        return result == 0;
+    }];
 }
 
 - (NSString *)keyboardInteractiveRequest:(NSString *)request {
@@ -854,19 +2034,23 @@ void disconnect_callback(LIBSSH2_SESSION *session, int reason, const char *messa
 // -----------------------------------------------------------------------------
 
 - (NMSSHChannel *)channel {
-    if (!_channel) {
-        _channel = [[NMSSHChannel alloc] initWithSession:self];
-    }
+    return [self performObjectBlockAndWait:^id{
+        if (!_channel) {
+            _channel = [[NMSSHChannel alloc] initWithSession:self];
+        }
 
-    return _channel;
+        return _channel;
+    }];
 }
 
 - (NMSFTP *)sftp {
-    if (!_sftp) {
-        _sftp = [[NMSFTP alloc] initWithSession:self];
-    }
+    return [self performObjectBlockAndWait:^id{
+        if (!_sftp) {
+            _sftp = [[NMSFTP alloc] initWithSession:self];
+        }
 
-    return _sftp;
+        return _sftp;
+    }];
 }
 
 @end
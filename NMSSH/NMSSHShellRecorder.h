@@ -0,0 +1,130 @@
+#import "NMSSH.h"
+
+typedef NS_ENUM(NSInteger, NMSSHShellRecorderError) {
+    NMSSHShellRecorderFileError
+};
+
+typedef NS_ENUM(NSInteger, NMSSHShellRecordingFormat) {
+    NMSSHShellRecordingFormatAsciicast, // asciicast v2: output, input and terminal resizes
+    NMSSHShellRecordingFormatTypescript // script(1) typescript: output, with an optional scriptreplay timing file
+};
+
+/**
+ NMSSHShellRecorder records an interactive shell to a file.
+
+ Attach a recorder to a channel before starting its shell:
+
+    NMSSHShellRecorder *recorder = [[NMSSHShellRecorder alloc] initWithPath:@"session.cast"
+                                                                      format:NMSSHShellRecordingFormatAsciicast
+                                                                       error:&error];
+    channel.recorder = recorder;
+    [channel startShell:&error];
+
+ The channel hands every byte read and written to the recorder, which
+ timestamps it into a lock-free ring buffer and returns. Formatting and file
+ writes happen on a background queue, they never delay the shell reads. When
+ the writer falls behind by more than `bufferCapacity` bytes, new records are
+ dropped and counted in `droppedBytes` rather than blocking the shell.
+
+ The record methods must not be called from several threads at once, a
+ channel calls them on its session queue.
+ */
+@interface NMSSHShellRecorder : NSObject
+
+/** Path of the recording (read-only). */
+@property (nonatomic, nonnull, readonly) NSString *path;
+
+/** Path of the scriptreplay timing file of a typescript, if any (read-only). */
+@property (nonatomic, nullable, readonly) NSString *timingPath;
+
+/** Format of the recording (read-only). */
+@property (nonatomic, readonly) NMSSHShellRecordingFormat format;
+
+/** Size of the ring buffer between the shell and the writer, defaults to 4 MiB (read-only). */
+@property (nonatomic, readonly) NSUInteger bufferCapacity;
+
+/** Terminal width in the asciicast header, defaults to 80. Set it before recording. */
+@property (nonatomic, assign) NSUInteger width;
+
+/** Terminal height in the asciicast header, defaults to 24. Set it before recording. */
+@property (nonatomic, assign) NSUInteger height;
+
+/** Title in the asciicast header, if any. Set it before recording. */
+@property (nonatomic, nullable, copy) NSString *title;
+
+/** Bytes that could not be recorded because the writer fell behind (read-only). */
+@property (atomic, readonly) uint64_t droppedBytes;
+
+/** A Boolean value indicating whether the recording was closed (read-only). */
+@property (atomic, readonly, getter = isClosed) BOOL closed;
+
+/// ----------------------------------------------------------------------------
+/// @name Initializer
+/// ----------------------------------------------------------------------------
+
+- (nonnull instancetype)init NS_UNAVAILABLE;
+
+/**
+ Create a recording, truncating the file if it exists.
+
+ @param path Path of the recording
+ @param format Format of the recording
+ @param error Error handler
+ @returns Recorder, `nil` if the file could not be created
+ */
+- (nullable instancetype)initWithPath:(nonnull NSString *)path
+                               format:(NMSSHShellRecordingFormat)format
+                                error:(NSError * _Nullable * _Nullable)error;
+
+/**
+ Create a recording, truncating the files if they exist.
+
+ @param path Path of the recording
+ @param format Format of the recording
+ @param timingPath Path of the scriptreplay timing file, ignored by asciicast
+ @param bufferCapacity Size of the ring buffer, in bytes
+ @param error Error handler
+ @returns Recorder, `nil` if a file could not be created
+ */
+- (nullable instancetype)initWithPath:(nonnull NSString *)path
+                               format:(NMSSHShellRecordingFormat)format
+                           timingPath:(nullable NSString *)timingPath
+                       bufferCapacity:(NSUInteger)bufferCapacity
+                                error:(NSError * _Nullable * _Nullable)error;
+
+/// ----------------------------------------------------------------------------
+/// @name Recording
+/// ----------------------------------------------------------------------------
+
+/**
+ Record bytes printed by the shell.
+
+ @param bytes Output
+ @param length Length of the output
+ */
+- (void)recordOutput:(nonnull const void *)bytes length:(NSUInteger)length;
+
+/**
+ Record bytes sent to the shell, only asciicast keeps them.
+
+ @param bytes Input
+ @param length Length of the input
+ */
+- (void)recordInput:(nonnull const void *)bytes length:(NSUInteger)length;
+
+/**
+ Record a terminal resize, only asciicast keeps it.
+
+ @param width New width
+ @param height New height
+ */
+- (void)recordResizeWidth:(NSUInteger)width height:(NSUInteger)height;
+
+/**
+ Write what is left in the buffer and close the files.
+
+ Later records are ignored. Called by the channel when its shell closes.
+ */
+- (void)close;
+
+@end
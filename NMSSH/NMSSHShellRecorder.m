@@ -0,0 +1,441 @@
+#import "NMSSHShellRecorder.h"
+#import "NMSSH+Protected.h"
+#import "NMSSHUTF8Decoder.h"
+
+#import <mach/mach_time.h>
+#import <time.h>
+
+#define kNMSSHShellRecorderDefaultCapacity (4 * 1024 * 1024)
+
+// Formatted records are written to the file in batches of this size
+#define kNMSSHShellRecorderWriteSize (64 * 1024)
+
+static const void * const kNMSSHShellRecorderQueueKey = &kNMSSHShellRecorderQueueKey;
+
+typedef NS_ENUM(uint32_t, NMSSHShellRecordKind) {
+    NMSSHShellRecordOutput,
+    NMSSHShellRecordInput,
+    NMSSHShellRecordResize
+};
+
+// Precedes the payload of every record in the ring
+typedef struct {
+    uint64_t time;
+    uint32_t length;
+    uint32_t kind;
+} NMSSHShellRecordHeader;
+
+@interface NMSSHShellRecorder () {
+    // Single producer, single consumer ring: the producer only moves _head,
+    // the writer only moves _tail, both count bytes since the start
+    char *_ring;
+    uint64_t _head;
+    uint64_t _tail;
+    uint64_t _droppedBytes;
+    BOOL _closed;
+
+    mach_timebase_info_data_t _timebase;
+    uint64_t _startTime;
+    uint64_t _lastOutputTime;
+    int _file;
+    int _timingFile;
+}
+@property (nonatomic, strong) NSString *path;
+@property (nonatomic, strong) NSString *timingPath;
+@property (nonatomic, readwrite) NMSSHShellRecordingFormat format;
+@property (nonatomic, readwrite) NSUInteger bufferCapacity;
+
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_queue_t writerQueue;
+@property (nonatomic, strong) dispatch_source_t wakeup;
+#else
+@property (nonatomic, assign) dispatch_queue_t writerQueue;
+@property (nonatomic, assign) dispatch_source_t wakeup;
+#endif
+
+// Only touched on the writer queue
+@property (nonatomic, strong) NSMutableData *payload;
+@property (nonatomic, strong) NSMutableData *staging;
+@property (nonatomic, strong) NSMutableData *timingStaging;
+@property (nonatomic, strong) NMSSHUTF8Decoder *outputDecoder;
+@property (nonatomic, strong) NMSSHUTF8Decoder *inputDecoder;
+@property (nonatomic, assign) BOOL headerWritten;
+@property (nonatomic, assign) BOOL failed;
+@end
+
+@implementation NMSSHShellRecorder
+
+// -----------------------------------------------------------------------------
+#pragma mark - INITIALIZER
+// -----------------------------------------------------------------------------
+
+- (instancetype)initWithPath:(NSString *)path format:(NMSSHShellRecordingFormat)format error:(NSError *__autoreleasing *)error {
+    return [self initWithPath:path format:format timingPath:nil bufferCapacity:kNMSSHShellRecorderDefaultCapacity error:error];
+}
+
+- (instancetype)initWithPath:(NSString *)path
+                      format:(NMSSHShellRecordingFormat)format
+                  timingPath:(NSString *)timingPath
+              bufferCapacity:(NSUInteger)bufferCapacity
+                       error:(NSError *__autoreleasing *)error {
+    if ((self = [super init])) {
+        [self setPath:path];
+        [self setFormat:format];
+        [self setTimingPath:format == NMSSHShellRecordingFormatTypescript ? timingPath : nil];
+        [self setBufferCapacity:MAX(bufferCapacity, sizeof(NMSSHShellRecordHeader) * 2)];
+        [self setWidth:80];
+        [self setHeight:24];
+        [self setPayload:[NSMutableData data]];
+        [self setStaging:[NSMutableData dataWithCapacity:kNMSSHShellRecorderWriteSize]];
+        [self setTimingStaging:[NSMutableData data]];
+        [self setOutputDecoder:[[NMSSHUTF8Decoder alloc] init]];
+        [self setInputDecoder:[[NMSSHUTF8Decoder alloc] init]];
+
+        _timingFile = -1;
+        _file = open([path fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (_file >= 0 && self.timingPath) {
+            _timingFile = open([self.timingPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        }
+
+        if (_file < 0 || (self.timingPath && _timingFile < 0)) {
+            NMSSHLogError(@"Unable to create the recording %@", _file < 0 ? path : self.timingPath);
+            if (error) {
+                *error = [NSError errorWithDomain:@"NMSSH"
+                                             code:NMSSHShellRecorderFileError
+                                         userInfo:@{ NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(errno)] }];
+            }
+
+            if (_file >= 0) {
+                close(_file);
+            }
+
+            _closed = YES;
+            return nil;
+        }
+
+        _ring = malloc(self.bufferCapacity);
+        mach_timebase_info(&_timebase);
+        _startTime = mach_absolute_time();
+        _lastOutputTime = _startTime;
+
+        [self setWriterQueue:dispatch_queue_create("NMSSH.shellRecorder", DISPATCH_QUEUE_SERIAL)];
+        dispatch_queue_set_specific(self.writerQueue, kNMSSHShellRecorderQueueKey, (__bridge void *)self, NULL);
+
+        // Merging data into the source is a lock-free way to wake the writer,
+        // wakeups are coalesced while it is busy
+        [self setWakeup:dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_OR, 0, 0, self.writerQueue)];
+        __weak NMSSHShellRecorder *weakSelf = self;
+        dispatch_source_set_event_handler(self.wakeup, ^{
+            [weakSelf drain];
+        });
+        dispatch_resume(self.wakeup);
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    if (!_closed) {
+        if (dispatch_get_specific(kNMSSHShellRecorderQueueKey) == (__bridge void *)self) {
+            [self finishWriting];
+        }
+        else {
+            [self close];
+        }
+    }
+
+    if (self.wakeup) {
+        dispatch_source_cancel(self.wakeup);
+#if !(OS_OBJECT_USE_OBJC)
+        dispatch_release(self.wakeup);
+        dispatch_release(self.writerQueue);
+#endif
+    }
+
+    free(_ring);
+}
+
+- (uint64_t)droppedBytes {
+    return __atomic_load_n(&_droppedBytes, __ATOMIC_RELAXED);
+}
+
+- (BOOL)isClosed {
+    return __atomic_load_n(&_closed, __ATOMIC_ACQUIRE);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - RECORDING
+// -----------------------------------------------------------------------------
+
+- (void)recordOutput:(const void *)bytes length:(NSUInteger)length {
+    [self record:NMSSHShellRecordOutput bytes:bytes length:length];
+}
+
+- (void)recordInput:(const void *)bytes length:(NSUInteger)length {
+    [self record:NMSSHShellRecordInput bytes:bytes length:length];
+}
+
+- (void)recordResizeWidth:(NSUInteger)width height:(NSUInteger)height {
+    uint32_t size[2] = { (uint32_t)width, (uint32_t)height };
+    [self record:NMSSHShellRecordResize bytes:size length:sizeof(size)];
+}
+
+- (void)record:(NMSSHShellRecordKind)kind bytes:(const void *)bytes length:(NSUInteger)length {
+    if (length == 0 || [self isClosed]) {
+        return;
+    }
+
+    uint64_t head = _head;
+    uint64_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    NSUInteger needed = sizeof(NMSSHShellRecordHeader) + length;
+
+    // Never wait for the writer
+    if (needed > self.bufferCapacity - (head - tail)) {
+        __atomic_add_fetch(&_droppedBytes, length, __ATOMIC_RELAXED);
+        return;
+    }
+
+    NMSSHShellRecordHeader header = { mach_absolute_time(), (uint32_t)length, kind };
+    [self copyIn:&header length:sizeof(header) at:head];
+    [self copyIn:bytes length:length at:head + sizeof(header)];
+
+    // The record is complete before the writer can see it
+    __atomic_store_n(&_head, head + needed, __ATOMIC_RELEASE);
+    dispatch_source_merge_data(self.wakeup, 1);
+}
+
+- (void)copyIn:(const void *)bytes length:(NSUInteger)length at:(uint64_t)position {
+    NSUInteger offset = (NSUInteger)(position % self.bufferCapacity);
+    NSUInteger head = MIN(length, self.bufferCapacity - offset);
+
+    memcpy(_ring + offset, bytes, head);
+    memcpy(_ring, (const char *)bytes + head, length - head);
+}
+
+- (void)copyOut:(void *)bytes length:(NSUInteger)length at:(uint64_t)position {
+    NSUInteger offset = (NSUInteger)(position % self.bufferCapacity);
+    NSUInteger head = MIN(length, self.bufferCapacity - offset);
+
+    memcpy(bytes, _ring + offset, head);
+    memcpy((char *)bytes + head, _ring, length - head);
+}
+
+- (void)close {
+    if (__atomic_exchange_n(&_closed, YES, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    dispatch_sync(self.writerQueue, ^{
+        [self finishWriting];
+    });
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - WRITER
+// -----------------------------------------------------------------------------
+
+- (void)drain {
+    uint64_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = _tail;
+
+    while (tail < head) {
+        NMSSHShellRecordHeader header;
+        [self copyOut:&header length:sizeof(header) at:tail];
+
+        [self.payload setLength:header.length];
+        [self copyOut:[self.payload mutableBytes] length:header.length at:tail + sizeof(header)];
+
+        // The space is given back before the record is formatted
+        tail += sizeof(header) + header.length;
+        __atomic_store_n(&_tail, tail, __ATOMIC_RELEASE);
+
+        [self formatRecord:header];
+
+        if ([self.staging length] >= kNMSSHShellRecorderWriteSize) {
+            [self flushStaging];
+        }
+    }
+
+    [self flushStaging];
+}
+
+- (void)finishWriting {
+    if (_file < 0) {
+        return;
+    }
+
+    [self drain];
+    [self writeHeaderIfNeeded];
+
+    // Characters left incomplete are written as U+FFFD
+    if (self.format == NMSSHShellRecordingFormatAsciicast) {
+        [self appendEvent:"o" time:mach_absolute_time() text:[self.outputDecoder finish]];
+        [self appendEvent:"i" time:mach_absolute_time() text:[self.inputDecoder finish]];
+    }
+    else {
+        [self appendString:[NSString stringWithFormat:@"\nScript done on %@\n", [self dateString]] to:self.staging];
+    }
+
+    [self flushStaging];
+
+    close(_file);
+    _file = -1;
+    if (_timingFile >= 0) {
+        close(_timingFile);
+        _timingFile = -1;
+    }
+}
+
+- (void)formatRecord:(NMSSHShellRecordHeader)header {
+    [self writeHeaderIfNeeded];
+
+    if (self.format == NMSSHShellRecordingFormatTypescript) {
+        if (header.kind != NMSSHShellRecordOutput) {
+            return;
+        }
+
+        [self.staging appendData:self.payload];
+
+        if (_timingFile >= 0) {
+            double delay = [self secondsFrom:_lastOutputTime to:header.time];
+            [self appendString:[NSString stringWithFormat:@"%.6f %u\n", delay, header.length] to:self.timingStaging];
+            _lastOutputTime = header.time;
+        }
+
+        return;
+    }
+
+    switch ((NMSSHShellRecordKind)header.kind) {
+        case NMSSHShellRecordOutput:
+            [self appendEvent:"o" time:header.time text:[self.outputDecoder decodeData:self.payload]];
+            break;
+
+        case NMSSHShellRecordInput:
+            [self appendEvent:"i" time:header.time text:[self.inputDecoder decodeData:self.payload]];
+            break;
+
+        case NMSSHShellRecordResize: {
+            const uint32_t *size = [self.payload bytes];
+            [self appendEvent:"r" time:header.time text:[NSString stringWithFormat:@"%ux%u", size[0], size[1]]];
+            break;
+        }
+    }
+}
+
+- (void)writeHeaderIfNeeded {
+    if (self.headerWritten) {
+        return;
+    }
+
+    [self setHeaderWritten:YES];
+
+    if (self.format == NMSSHShellRecordingFormatTypescript) {
+        [self appendString:[NSString stringWithFormat:@"Script started on %@\n", [self dateString]] to:self.staging];
+        return;
+    }
+
+    NSMutableDictionary *header = [@{ @"version"   : @2,
+                                      @"width"     : @(self.width),
+                                      @"height"    : @(self.height),
+                                      @"timestamp" : @((long long)[[NSDate date] timeIntervalSince1970]) } mutableCopy];
+    if (self.title) {
+        header[@"title"] = self.title;
+    }
+
+    [self.staging appendData:[NSJSONSerialization dataWithJSONObject:header options:0 error:nil]];
+    [self.staging appendBytes:"\n" length:1];
+}
+
+/// An asciicast v2 event line: [time, code, data]
+- (void)appendEvent:(const char *)code time:(uint64_t)time text:(NSString *)text {
+    // A character split between two records waits for the next one
+    if ([text length] == 0) {
+        return;
+    }
+
+    [self appendString:[NSString stringWithFormat:@"[%.6f, \"%s\", \"", [self secondsFrom:_startTime to:time], code] to:self.staging];
+    [self appendJSONEscaped:text];
+    [self.staging appendBytes:"\"]\n" length:3];
+}
+
+- (void)appendJSONEscaped:(NSString *)text {
+    const unsigned char *bytes = (const unsigned char *)[text UTF8String];
+    NSUInteger length = strlen((const char *)bytes);
+    NSUInteger run = 0;
+
+    for (NSUInteger i = 0; i < length; i++) {
+        unsigned char c = bytes[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7F) {
+            continue;
+        }
+
+        [self.staging appendBytes:bytes + run length:i - run];
+        run = i + 1;
+
+        char escape[8];
+        switch (c) {
+            case '"':  [self.staging appendBytes:"\\\"" length:2]; break;
+            case '\\': [self.staging appendBytes:"\\\\" length:2]; break;
+            case '\n': [self.staging appendBytes:"\\n" length:2]; break;
+            case '\r': [self.staging appendBytes:"\\r" length:2]; break;
+            case '\t': [self.staging appendBytes:"\\t" length:2]; break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                [self.staging appendBytes:escape length:6];
+                break;
+        }
+    }
+
+    [self.staging appendBytes:bytes + run length:length - run];
+}
+
+- (void)appendString:(NSString *)string to:(NSMutableData *)data {
+    [data appendData:[string dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+- (void)flushStaging {
+    [self writeData:self.staging toFile:_file];
+    [self writeData:self.timingStaging toFile:_timingFile];
+}
+
+- (void)writeData:(NSMutableData *)data toFile:(int)file {
+    if ([data length] == 0 || file < 0 || self.failed) {
+        [data setLength:0];
+        return;
+    }
+
+    const char *bytes = [data bytes];
+    NSUInteger offset = 0;
+    while (offset < [data length]) {
+        ssize_t written = write(file, bytes + offset, [data length] - offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            NMSSHLogError(@"Unable to write the recording %@: %s", self.path, strerror(errno));
+            [self setFailed:YES];
+            break;
+        }
+
+        offset += written;
+    }
+
+    [data setLength:0];
+}
+
+- (double)secondsFrom:(uint64_t)start to:(uint64_t)end {
+    uint64_t elapsed = end > start ? end - start : 0;
+    return (double)elapsed * _timebase.numer / _timebase.denom / NSEC_PER_SEC;
+}
+
+- (NSString *)dateString {
+    char date[64];
+    time_t now = time(NULL);
+    struct tm local;
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", localtime_r(&now, &local));
+
+    return [NSString stringWithUTF8String:date];
+}
+
+@end
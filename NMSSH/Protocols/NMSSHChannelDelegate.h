@@ -12,6 +12,9 @@
 /**
  Called when a channel read new data on the socket.
 
+ The data is decoded as UTF-8. A character split between two reads is
+ delivered with the second one, invalid sequences are replaced by U+FFFD.
+
  @param channel The channel that read the message
  @param message The message that the channel has read
  */
@@ -20,6 +23,8 @@
 /**
  Called when a channel read new error on the socket.
 
+ The error is decoded like the data of channel:didReadData:.
+
  @param channel The channel that read the error
  @param error The error that the channel has read
  */
@@ -41,6 +46,14 @@
  */
 - (void)channel:(nonnull NMSSHChannel *)channel didReadRawError:(nonnull NSData *)error;
 
+/**
+ Called when a channel with a messageFramer read a complete message.
+
+ @param channel The channel that read the message
+ @param message The message, without its framing
+ */
+- (void)channel:(nonnull NMSSHChannel *)channel didReadMessage:(nonnull NSData *)message;
+
 /**
  Called when a channel in shell mode has been closed.
 
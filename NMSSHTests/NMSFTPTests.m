@@ -204,4 +204,114 @@
     XCTAssertTrue([sftp removeDirectoryAtPath:destDirectoryPath], @"Remove directory");
 }
 
+// -----------------------------------------------------------------------------
+// TEST CONCURRENT ACCESS
+// -----------------------------------------------------------------------------
+
+- (void)testConcurrentOperationsOnSharedSession {
+    NSString *basePath = [settings objectForKey:@"writable_dir"];
+    NSData *contents = [@"test" dataUsingEncoding:NSUTF8StringEncoding];
+    __block NSUInteger failures = 0;
+
+    dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        NSString *path = [basePath stringByAppendingPathComponent:[NSString stringWithFormat:@"concurrent_%zu.txt", i]];
+        BOOL success = [sftp writeContents:contents toFileAtPath:path] &&
+                       [[sftp contentsAtPath:path] isEqualToData:contents] &&
+                       [sftp removeFileAtPath:path];
+
+        NSError *error = nil;
+        success = success && [[session.channel execute:@"echo ok" error:&error] length] > 0;
+
+        if (!success) {
+            [session performBlockAndWait:^{
+                failures++;
+            }];
+        }
+    });
+
+    XCTAssertEqual(failures, (NSUInteger)0, @"Operations from several threads should not interfere");
+}
+
+// -----------------------------------------------------------------------------
+// TEST ASYNCHRONOUS OPERATIONS
+// -----------------------------------------------------------------------------
+
+- (void)testAsynchronousWriteReadAndRemoveWorks {
+    NSString *path = [NSString stringWithFormat:@"%@async.txt", [settings objectForKey:@"writable_dir"]];
+    NSData *contents = [@"hello async" dataUsingEncoding:NSUTF8StringEncoding];
+
+    XCTestExpectation *written = [self expectationWithDescription:@"written"];
+    XCTestExpectation *read = [self expectationWithDescription:@"read"];
+    XCTestExpectation *removed = [self expectationWithDescription:@"removed"];
+
+    [sftp writeContents:contents toFileAtPath:path completionHandler:^(NSError *error) {
+        XCTAssertNil(error, @"Asynchronous write should work");
+        [written fulfill];
+    }];
+
+    [sftp contentsAtPath:path completionHandler:^(NSData *data, NSError *error) {
+        XCTAssertEqualObjects(data, contents, @"Asynchronous read should return the written contents");
+        [read fulfill];
+    }];
+
+    [sftp removeFileAtPath:path completionHandler:^(NSError *error) {
+        XCTAssertNil(error, @"Asynchronous remove should work");
+        [removed fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testAsynchronousExecuteWorks {
+    XCTestExpectation *executed = [self expectationWithDescription:@"executed"];
+
+    [session.channel execute:@"echo ok" completionHandler:^(NSString *response, NSError *error) {
+        XCTAssertEqualObjects(response, @"ok\n", @"Asynchronous execution should return the output");
+        [executed fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
+- (void)testInteractiveOperationsOvertakeBulkTransfers {
+    NSString *path = [NSString stringWithFormat:@"%@bulk.bin", [settings objectForKey:@"writable_dir"]];
+    NSData *contents = [NSMutableData dataWithLength:64 * 1024 * 1024];
+
+    [sftp setPriority:NMSSHOperationPriorityBulk];
+    [session.channel setPriority:NMSSHOperationPriorityInteractive];
+
+    XCTestExpectation *written = [self expectationWithDescription:@"written"];
+    XCTestExpectation *executed = [self expectationWithDescription:@"executed"];
+    __block BOOL commandFinished = NO;
+    __block BOOL commandQueued = NO;
+
+    // The command is queued from the first chunk, while the synchronous
+    // transfer still has most of the file to send. The callback queue is
+    // serial, the completion of the command is delivered first only if the
+    // transfer did not finish ahead of it.
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        BOOL success = [sftp writeContents:contents toFileAtPath:path progress:^BOOL(NSUInteger sent) {
+            if (!commandQueued) {
+                commandQueued = YES;
+                [session.channel execute:@"echo ok" completionHandler:^(NSString *response, NSError *error) {
+                    XCTAssertEqualObjects(response, @"ok\n", @"Interactive execution should return the output");
+                    commandFinished = YES;
+                    [executed fulfill];
+                }];
+            }
+
+            return YES;
+        }];
+
+        XCTAssertTrue(success, @"The bulk transfer still completes");
+        dispatch_async(dispatch_get_main_queue(), ^{
+            XCTAssertTrue(commandFinished, @"The command does not wait for the transfer");
+            [written fulfill];
+        });
+    });
+
+    [self waitForExpectationsWithTimeout:120 handler:nil];
+    [sftp removeFileAtPath:path];
+}
+
 @end
\ No newline at end of file
@@ -0,0 +1,56 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHBufferPoolTests : XCTestCase
+
+@end
+
+@implementation NMSSHBufferPoolTests
+
+- (void)setUp {
+    [[NMSSHBufferPool sharedPool] purge];
+}
+
+/**
+ Tests that a released buffer is reused by the next allocation of its class.
+ */
+- (void)testReleasedBufferIsReused {
+    NMSSHBufferPool *pool = [NMSSHBufferPool sharedPool];
+    void *bytes;
+
+    @autoreleasepool {
+        NMSSHBuffer *buffer = [pool newBufferWithLength:5000];
+        XCTAssertEqual([buffer length], (NSUInteger)5000, @"The requested length is kept");
+        bytes = [buffer mutableBytes];
+    }
+
+    NMSSHBufferPoolStatistics before = [pool statistics];
+    NMSSHBuffer *buffer = [pool newBufferWithLength:8192];
+    NMSSHBufferPoolStatistics after = [pool statistics];
+
+    XCTAssertEqual([buffer mutableBytes], bytes, @"Buffers of the same class are recycled");
+    XCTAssertEqual(after.threadCacheHits, before.threadCacheHits + 1, @"The thread cache served the buffer");
+    XCTAssertEqual(after.systemAllocations, before.systemAllocations, @"No memory was allocated");
+    XCTAssertEqual(after.bytesInUse, before.bytesInUse + 8192, @"The buffer is accounted for");
+}
+
+/**
+ Tests that megabyte buffers are usable and counted in the statistics.
+ */
+- (void)testLargeBuffersAreAccounted {
+    NMSSHBufferPool *pool = [NMSSHBufferPool sharedPool];
+    NSUInteger length = 4 * 1024 * 1024;
+
+    @autoreleasepool {
+        NMSSHBuffer *buffer = [pool newBufferWithLength:length];
+        memset([buffer mutableBytes], 0xAB, [buffer length]);
+        XCTAssertGreaterThanOrEqual([pool statistics].peakBytesInUse, (uint64_t)length, @"The peak usage is tracked");
+    }
+
+    XCTAssertEqual([pool statistics].bytesCached, (uint64_t)length, @"Large buffers go to the shared cache");
+
+    [pool purge];
+    XCTAssertEqual([pool statistics].bytesCached, (uint64_t)0, @"Purging releases the cached memory");
+}
+
+@end
@@ -1,14 +1,22 @@
 #import "NMSSHChannelTests.h"
 #import "ConfigHelper.h"
+#import "DelayProxy.h"
 
 #import <NMSSH/NMSSH.h>
 
-@interface NMSSHChannelTests () {
+@interface NMSSHChannelTests () <NMSSHChannelDelegate> {
     NSDictionary *settings;
     NSString *localFilePath;
 
     NMSSHChannel *channel;
     NMSSHSession *session;
+
+    NSMutableArray *messages;
+    dispatch_semaphore_t messageReceived;
+
+    NSMutableData *shellOutput;
+    NSMutableArray *deliveries;
+    dispatch_semaphore_t shellClosed;
 }
 @end
 
@@ -73,6 +81,464 @@
                          @"Execution returns the expected response");
 }
 
+- (void)testStreamingShellCommandSeparatesOutputs {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+
+    NSMutableData *output = [NSMutableData data];
+    NSMutableData *errorOutput = [NSMutableData data];
+    NSError *error = nil;
+    BOOL completed = [channel execute:@"printf 'out\\000'; echo err >&2; exit 3"
+                       standardOutput:^(NSData *data) {
+                           [output appendData:data];
+                       } standardError:^(NSData *data) {
+                           [errorOutput appendData:data];
+                       } error:&error timeout:@10];
+
+    XCTAssertTrue(completed, @"Streaming execution should complete: %@", error);
+    XCTAssertEqualObjects(output, [NSData dataWithBytes:"out\0" length:4],
+                          @"Standard output is streamed untouched");
+    XCTAssertEqualObjects(errorOutput, [@"err\n" dataUsingEncoding:NSUTF8StringEncoding],
+                          @"Standard error is streamed separately");
+    XCTAssertEqual([channel lastExitStatus], 3, @"Exit status is reported");
+    XCTAssertNil([channel lastExitSignal], @"No signal killed the command");
+}
+
+- (void)testAsyncExecutionReturnsOutputOfFailedCommand {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+
+    __block NSString *response = nil;
+    __block NSError *error = nil;
+    XCTestExpectation *completed = [self expectationWithDescription:@"completed"];
+    [channel execute:@"echo partial; echo failed >&2; exit 2" completionHandler:^(NSString *blockResponse, NSError *blockError) {
+        response = blockResponse;
+        error = blockError;
+        [completed fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqual([error code], NMSSHChannelExecutionError, @"A non-zero exit status is an error");
+    XCTAssertEqualObjects([error localizedDescription], @"failed\n", @"The error is described by the standard error");
+    XCTAssertEqualObjects(response, @"partial\n", @"The output is passed along the error");
+}
+
+- (void)testStreamingStandardInputReachesCommand {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    [channel setRequestPty:NO];
+
+    // Larger than the default window, the input has to wait for adjustments
+    NSMutableData *input = [NSMutableData dataWithLength:4 * 1024 * 1024];
+    memset([input mutableBytes], 'x', [input length]);
+
+    NSMutableData *output = [NSMutableData data];
+    NSError *error = nil;
+    BOOL completed = [channel execute:@"wc -c"
+                        standardInput:[NSInputStream inputStreamWithData:input]
+                       standardOutput:^(NSData *data) {
+                           [output appendData:data];
+                       } standardError:nil error:&error timeout:@30];
+
+    XCTAssertTrue(completed, @"Streaming execution should complete: %@", error);
+    NSString *count = [[[NSString alloc] initWithData:output encoding:NSUTF8StringEncoding]
+                       stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    XCTAssertEqualObjects(count, @"4194304", @"The whole input is received, followed by EOF");
+}
+
+- (void)testStandardInputOpenedByCallerIsLeftOpen {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    [channel setRequestPty:NO];
+
+    NSInputStream *input = [NSInputStream inputStreamWithData:[@"hello" dataUsingEncoding:NSUTF8StringEncoding]];
+    [input open];
+
+    NSError *error = nil;
+    BOOL completed = [channel execute:@"cat > /dev/null" standardInput:input standardOutput:nil standardError:nil error:&error timeout:@10];
+
+    XCTAssertTrue(completed, @"Streaming execution should complete: %@", error);
+    XCTAssertNotEqual([input streamStatus], NSStreamStatusClosed, @"The caller closes the stream it opened");
+    [input close];
+}
+
+- (void)testCommandServerPipelinesCommands {
+    NMSSHCommandServer *server = [[NMSSHCommandServer alloc] initWithSession:session];
+    NSError *error = nil;
+    XCTAssertTrue([server start:&error], @"The command server should start: %@", error);
+
+    // Queued back to back, the results come back in order
+    // Handlers run on the callback queue of the session, the main queue
+    NSMutableArray *results = [NSMutableArray array];
+    XCTestExpectation *completed = [self expectationWithDescription:@"completed"];
+    for (int i = 0; i < 100; i++) {
+        [server execute:[NSString stringWithFormat:@"printf %d; echo e >&2; exit %d", i, i % 3] completionHandler:^(NMSSHCommandResult *result, NSError *blockError) {
+            [results addObject:result ?: blockError];
+            if ([results count] == 100) {
+                [completed fulfill];
+            }
+        }];
+    }
+
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+    for (int i = 0; i < 100; i++) {
+        NMSSHCommandResult *result = results[i];
+        XCTAssertEqualObjects(result.output, ([NSString stringWithFormat:@"%d", i]), @"Outputs are framed per command");
+        XCTAssertEqualObjects(result.standardError, [@"e\n" dataUsingEncoding:NSUTF8StringEncoding], @"Errors are framed per command");
+        XCTAssertEqual(result.exitStatus, i % 3, @"Exit statuses are reported per command");
+    }
+
+    NMSSHCommandResult *result = [server execute:@"cd /; pwd" error:&error timeout:@10];
+    XCTAssertEqualObjects(result.output, @"/\n", @"Synchronous commands work");
+    XCTAssertNotEqualObjects([server execute:@"pwd" error:&error timeout:@10].output, @"/\n", @"Commands do not affect each other");
+
+    [server stop];
+}
+
+- (void)testCommandServerTimeoutAbandonsCommand {
+    NMSSHCommandServer *server = [[NMSSHCommandServer alloc] initWithSession:session];
+    NSError *error = nil;
+    XCTAssertTrue([server start:&error], @"The command server should start: %@", error);
+
+    NMSSHCommandResult *result = [server execute:@"sleep 2; echo late" error:&error timeout:@0.5];
+    XCTAssertNil(result, @"The command does not complete in time");
+    XCTAssertEqual([error code], NMSSHChannelExecutionTimeout, @"The timeout is reported");
+    XCTAssertEqualObjects([error localizedDescription], @"The command timed out", @"The command is what timed out");
+
+    // The abandoned command still runs first, its output is not mistaken for the next one
+    error = nil;
+    result = [server execute:@"echo next" error:&error timeout:@10];
+    XCTAssertEqualObjects(result.output, @"next\n", @"The next command gets its own output: %@", error);
+
+    [server stop];
+}
+
+- (void)testLineExecutionDeliversEveryLine {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+
+    __block NSUInteger lines = 0;
+    __block BOOL ordered = YES;
+    __block NSString *errorLine = nil;
+    XCTestExpectation *completed = [self expectationWithDescription:@"completed"];
+
+    [channel execute:@"seq 1 1000000; printf tail >&2" lineHandler:^(const char *line, NSUInteger length, BOOL standardError) {
+        if (standardError) {
+            errorLine = [[NSString alloc] initWithBytes:line length:length encoding:NSUTF8StringEncoding];
+            return;
+        }
+
+        lines++;
+        ordered = ordered && strtoul([[[NSString alloc] initWithBytes:line length:length encoding:NSUTF8StringEncoding] UTF8String], NULL, 10) == lines;
+    } completionHandler:^(int exitStatus, NSString *exitSignal, NSError *error) {
+        XCTAssertNil(error, @"The command should complete");
+        [completed fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+
+    XCTAssertEqual(lines, (NSUInteger)1000000, @"Every line is delivered");
+    XCTAssertTrue(ordered, @"Lines are delivered whole and in order");
+    XCTAssertEqualObjects(errorLine, @"tail", @"The last line does not need a line feed");
+}
+
+- (void)testBatchExecutionRunsEveryCommand {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+
+    NSMutableArray *commands = [NSMutableArray array];
+    for (int i = 0; i < 50; i++) {
+        [commands addObject:[NSString stringWithFormat:@"echo %d; exit %d", i, i % 3]];
+    }
+
+    NSMutableDictionary *results = [NSMutableDictionary dictionary];
+    XCTestExpectation *completed = [self expectationWithDescription:@"completed"];
+    [channel executeCommands:commands resultHandler:^(NSUInteger index, NMSSHCommandResult *result, NSError *error) {
+        XCTAssertNil(error, @"Command %lu should run", (unsigned long)index);
+        if (result) {
+            results[@(index)] = result;
+        }
+    } completionHandler:^(NSError *error) {
+        XCTAssertNil(error, @"The batch should complete");
+        [completed fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+
+    XCTAssertEqual([results count], [commands count], @"Every command reports its result");
+    for (int i = 0; i < 50; i++) {
+        NMSSHCommandResult *result = results[@(i)];
+        XCTAssertEqualObjects(result.output, ([NSString stringWithFormat:@"%d\n", i]), @"Outputs are kept per command");
+        XCTAssertEqual(result.exitStatus, i % 3, @"Exit statuses are kept per command");
+    }
+}
+
+- (void)testSubsystemExchangesFramedMessages {
+    messages = [NSMutableArray array];
+    messageReceived = dispatch_semaphore_create(0);
+
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    [channel setDelegate:self];
+    [channel setMessageFramer:[NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingLengthPrefixed]];
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startSubsystem:@"sftp" error:&error], @"The sftp subsystem should start: %@", error);
+    XCTAssertEqual([channel type], NMSSHChannelTypeSubsystem, @"The channel runs a subsystem");
+
+    // SSH_FXP_INIT, version 3
+    const uint8_t init[] = { 1, 0, 0, 0, 3 };
+    [channel writeMessage:[NSData dataWithBytes:init length:sizeof(init)] completionHandler:nil];
+
+    long timedOut = dispatch_semaphore_wait(messageReceived, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC));
+    XCTAssertEqual(timedOut, 0, @"The server answers");
+
+    NSData *reply = nil;
+    @synchronized (messages) {
+        reply = [messages firstObject];
+    }
+    XCTAssertGreaterThanOrEqual([reply length], (NSUInteger)5, @"The reply is received whole");
+    XCTAssertEqual(((const uint8_t *)[reply bytes])[0], 2, @"The reply is SSH_FXP_VERSION");
+
+    [channel closeShell];
+}
+
+- (void)testStreamsShareTheSessionSocket {
+    messages = [NSMutableArray array];
+    messageReceived = dispatch_semaphore_create(0);
+
+    NSMutableArray *channels = [NSMutableArray array];
+    NSError *error = nil;
+    for (int i = 0; i < 8; i++) {
+        NMSSHChannel *subsystemChannel = [[NMSSHChannel alloc] initWithSession:session];
+        [subsystemChannel setDelegate:self];
+        [subsystemChannel setMessageFramer:[NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingLengthPrefixed]];
+        XCTAssertTrue([subsystemChannel startSubsystem:@"sftp" error:&error], @"The sftp subsystem should start: %@", error);
+        [channels addObject:subsystemChannel];
+    }
+
+    // Every request is in flight before the first reply is read
+    const uint8_t init[] = { 1, 0, 0, 0, 3 };
+    for (NMSSHChannel *subsystemChannel in channels) {
+        [subsystemChannel writeMessage:[NSData dataWithBytes:init length:sizeof(init)] completionHandler:nil];
+    }
+
+    for (NSUInteger i = 0; i < [channels count]; i++) {
+        long timedOut = dispatch_semaphore_wait(messageReceived, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC));
+        XCTAssertEqual(timedOut, 0, @"Every channel gets its reply");
+    }
+
+    for (NMSSHChannel *subsystemChannel in channels) {
+        [subsystemChannel closeShell];
+    }
+}
+
+- (void)channel:(NMSSHChannel *)aChannel didReadMessage:(NSData *)message {
+    @synchronized (messages) {
+        [messages addObject:message];
+    }
+    dispatch_semaphore_signal(messageReceived);
+}
+
+// -----------------------------------------------------------------------------
+// SHELL DELIVERY TESTS
+// -----------------------------------------------------------------------------
+
+- (NMSSHChannel *)shellChannelRunning:(NSString *)command deliveryMode:(NMSSHChannelDeliveryMode)mode {
+    shellOutput = [NSMutableData data];
+    deliveries = [NSMutableArray array];
+    shellClosed = dispatch_semaphore_create(0);
+
+    NMSSHChannel *shellChannel = [[NMSSHChannel alloc] initWithSession:session];
+    [shellChannel setDelegate:self];
+    [shellChannel setRequestPty:NO];
+    [shellChannel setShellCommand:command];
+    [shellChannel setDeliveryMode:mode];
+
+    return shellChannel;
+}
+
+- (void)testImmediateDeliveryKeepsReadOrder {
+    channel = [self shellChannelRunning:@"seq 1 20000" deliveryMode:NMSSHChannelDeliveryImmediate];
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+    XCTAssertEqual(dispatch_semaphore_wait(shellClosed, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0,
+                   @"The shell closes once the command exited");
+
+    NSMutableString *expected = [NSMutableString string];
+    for (int i = 1; i <= 20000; i++) {
+        [expected appendFormat:@"%d\n", i];
+    }
+
+    // Delivered off the session queue, one read at a time
+    XCTAssertEqualObjects([[NSString alloc] initWithData:shellOutput encoding:NSUTF8StringEncoding], expected,
+                          @"Reads are delivered in order");
+}
+
+- (void)testCoalescedDeliveryWaitsForCoalescingSize {
+    channel = [self shellChannelRunning:@"head -c 65536 /dev/zero" deliveryMode:NMSSHChannelDeliveryCoalesced];
+    [channel setDeliveryQueue:dispatch_queue_create("NMSSHChannelTests.delivery", DISPATCH_QUEUE_SERIAL)];
+    [channel setCoalescingSize:4096];
+    [channel setCoalescingInterval:60];
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+    XCTAssertEqual(dispatch_semaphore_wait(shellClosed, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0,
+                   @"The shell closes once the command exited");
+
+    // Only the output left when the shell closed may be shorter
+    for (NSUInteger i = 0; i + 1 < [deliveries count]; i++) {
+        XCTAssertGreaterThanOrEqual([deliveries[i] unsignedIntegerValue], (NSUInteger)4096,
+                                    @"Output is held until coalescingSize bytes are pending");
+    }
+    XCTAssertEqual([shellOutput length], (NSUInteger)65536, @"Every byte is delivered");
+}
+
+- (void)testCoalescedDeliveryFlushesAfterCoalescingInterval {
+    channel = [self shellChannelRunning:@"printf a; sleep 1; printf b" deliveryMode:NMSSHChannelDeliveryCoalesced];
+    [channel setDeliveryQueue:dispatch_queue_create("NMSSHChannelTests.delivery", DISPATCH_QUEUE_SERIAL)];
+    [channel setCoalescingSize:1024 * 1024];
+    [channel setCoalescingInterval:0.05];
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+    XCTAssertEqual(dispatch_semaphore_wait(shellClosed, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0,
+                   @"The shell closes once the command exited");
+
+    XCTAssertEqualObjects(deliveries, (@[ @1, @1 ]), @"Each write is flushed before the next one");
+    XCTAssertEqualObjects(shellOutput, [@"ab" dataUsingEncoding:NSUTF8StringEncoding], @"Every byte is delivered");
+}
+
+- (void)testSlowDelegateSuspendsReads {
+    channel = [self shellChannelRunning:@"head -c 4194304 /dev/zero" deliveryMode:NMSSHChannelDeliveryCoalesced];
+    dispatch_queue_t deliveryQueue = dispatch_queue_create("NMSSHChannelTests.delivery", DISPATCH_QUEUE_SERIAL);
+    [channel setDeliveryQueue:deliveryQueue];
+    [channel setCoalescingSize:16 * 1024];
+    [channel setCoalescingInterval:0];
+    [channel setMaximumPendingBytes:64 * 1024];
+
+    // A delegate that does not keep up at all
+    dispatch_suspend(deliveryQueue);
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+    [NSThread sleepForTimeInterval:2];
+
+    // Everything queued before the marker was read while the delegate stalled
+    __block NSUInteger stalledBytes = 0;
+    dispatch_async(deliveryQueue, ^{
+        stalledBytes = [shellOutput length];
+    });
+    dispatch_resume(deliveryQueue);
+
+    XCTAssertEqual(dispatch_semaphore_wait(shellClosed, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0,
+                   @"Reads resume once the delegate caught up");
+    XCTAssertGreaterThan(stalledBytes, (NSUInteger)0, @"Output is read until the limit is reached");
+    XCTAssertLessThanOrEqual(stalledBytes, 64 * 1024 + 16 * 1024 + 2 * [channel bufferSize],
+                             @"Reads stop past maximumPendingBytes");
+    XCTAssertEqual([shellOutput length], (NSUInteger)4194304, @"Every byte is delivered");
+}
+
+- (void)channel:(NMSSHChannel *)aChannel didReadRawData:(NSData *)data {
+    [shellOutput appendData:data];
+    [deliveries addObject:@([data length])];
+}
+
+- (void)channelShellDidClose:(NMSSHChannel *)aChannel {
+    if (shellClosed) {
+        dispatch_semaphore_signal(shellClosed);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// SHELL WRITE QUEUE TESTS
+// -----------------------------------------------------------------------------
+
+- (void)testQueuedWritesAreCoalesced {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    NSError *error = nil;
+    channel = [self shellChannelRunning:@"cat > /dev/null" deliveryMode:NMSSHChannelDeliveryImmediate];
+    [channel setRecorder:[[NMSSHShellRecorder alloc] initWithPath:path format:NMSSHShellRecordingFormatAsciicast error:&error]];
+    [channel setWriteCoalescingInterval:0.5];
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+
+    // Keystrokes well within the latency budget
+    XCTestExpectation *written = [self expectationWithDescription:@"written"];
+    __block NSUInteger completed = 0;
+    for (int i = 0; i < 50; i++) {
+        [channel writeData:[@"a" dataUsingEncoding:NSUTF8StringEncoding] completionHandler:^(NSError *blockError) {
+            XCTAssertNil(blockError, @"The write should succeed");
+            if (++completed == 50) {
+                [written fulfill];
+            }
+        }];
+    }
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    [channel closeShell];
+
+    // The recorder sees every libssh2 write as an input event
+    NSString *contents = [NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:nil];
+    NSUInteger inputs = 0;
+    for (NSString *line in [contents componentsSeparatedByString:@"\n"]) {
+        NSArray *event = [NSJSONSerialization JSONObjectWithData:[line dataUsingEncoding:NSUTF8StringEncoding] options:0 error:nil];
+        if ([event isKindOfClass:[NSArray class]] && [event[1] isEqual:@"i"]) {
+            XCTAssertEqualObjects(event[2], [@"" stringByPaddingToLength:50 withString:@"a" startingAtIndex:0],
+                                  @"The writes are sent together");
+            inputs++;
+        }
+    }
+    XCTAssertEqual(inputs, (NSUInteger)1, @"The writes are merged into a single write");
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
+- (void)testQueuedWritesCompleteInOrder {
+    channel = [self shellChannelRunning:@"cat > /dev/null" deliveryMode:NMSSHChannelDeliveryImmediate];
+    [channel setWriteCoalescingInterval:0];
+
+    NSError *error = nil;
+    XCTAssertTrue([channel startShell:&error], @"The shell should start: %@", error);
+
+    // Large enough writes that batches are in flight while others queue up
+    NSMutableData *chunk = [NSMutableData dataWithLength:64 * 1024];
+    NSMutableArray *order = [NSMutableArray array];
+    XCTestExpectation *written = [self expectationWithDescription:@"written"];
+    for (int i = 0; i < 200; i++) {
+        [channel writeData:chunk completionHandler:^(NSError *blockError) {
+            XCTAssertNil(blockError, @"The write should succeed");
+            [order addObject:@(i)];
+            if ([order count] == 200) {
+                [written fulfill];
+            }
+        }];
+    }
+
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+    for (int i = 0; i < 200; i++) {
+        XCTAssertEqualObjects(order[i], @(i), @"Completions are called in the order of the writes");
+    }
+
+    [channel closeShell];
+}
+
+- (void)testFailedWriteFailsEveryQueuedWrite {
+    // No shell is running, the batch can't be sent
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    [channel setWriteCoalescingInterval:0.1];
+
+    NSMutableArray *errors = [NSMutableArray array];
+    XCTestExpectation *failed = [self expectationWithDescription:@"failed"];
+    for (int i = 0; i < 3; i++) {
+        [channel writeData:[@"ls\n" dataUsingEncoding:NSUTF8StringEncoding] completionHandler:^(NSError *blockError) {
+            [errors addObject:blockError ?: [NSNull null]];
+            if ([errors count] == 3) {
+                [failed fulfill];
+            }
+        }];
+    }
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    for (NSError *writeError in errors) {
+        XCTAssertTrue([writeError isKindOfClass:[NSError class]], @"Every queued write gets the error");
+        XCTAssertEqual([writeError code], NMSSHChannelWriteError, @"The write error is reported");
+    }
+}
+
 // -----------------------------------------------------------------------------
 // SCP FILE TRANSFER TESTS
 // -----------------------------------------------------------------------------
@@ -89,6 +555,27 @@
     XCTAssertTrue(result, @"Uploading to writable dir should work.");
 }
 
+- (void)testUploadingTruncatedFileFails {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    NSString *dir = [settings objectForKey:@"writable_dir"];
+
+    NSMutableData *contents = [NSMutableData dataWithLength:16 * 1024 * 1024];
+    [contents writeToFile:localFilePath atomically:NO];
+
+    // The file shrinks under the upload, as a log being rotated would
+    __block BOOL truncated = NO;
+    BOOL result = [channel uploadFile:localFilePath to:dir progress:^BOOL(NSUInteger sent) {
+        if (!truncated) {
+            truncate([localFilePath fileSystemRepresentation], 0);
+            truncated = YES;
+        }
+        return YES;
+    }];
+
+    XCTAssertTrue(truncated, @"Progress should be reported");
+    XCTAssertFalse(result, @"Uploading a file truncated meanwhile should fail");
+}
+
 - (void)testUploadingFileToNonWritableDirFails {
     channel = [[NMSSHChannel alloc] initWithSession:session];
     NSString *dir = [settings objectForKey:@"non_writable_dir"];
@@ -132,4 +619,135 @@
                  @"A file has not been created");
 }
 
+- (void)testRecursiveTransferPreservesTree {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+
+    NSString *localTree = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nmssh-tree"];
+    NSString *downloadedTree = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nmssh-tree-copy"];
+    [fileManager removeItemAtPath:localTree error:nil];
+    [fileManager removeItemAtPath:downloadedTree error:nil];
+
+    [fileManager createDirectoryAtPath:[localTree stringByAppendingPathComponent:@"sub"]
+           withIntermediateDirectories:YES
+                            attributes:nil
+                                 error:nil];
+    [fileManager createFileAtPath:[localTree stringByAppendingPathComponent:@"a.txt"]
+                         contents:[@"a" dataUsingEncoding:NSUTF8StringEncoding]
+                       attributes:@{ NSFilePosixPermissions : @0600 }];
+    [fileManager createFileAtPath:[localTree stringByAppendingPathComponent:@"sub/b.txt"]
+                         contents:[@"bb" dataUsingEncoding:NSUTF8StringEncoding]
+                       attributes:nil];
+
+    NSString *remoteTree = [[settings objectForKey:@"writable_dir"] stringByAppendingPathComponent:@"nmssh-tree"];
+    XCTAssertTrue([channel uploadDirectory:localTree to:remoteTree progress:nil],
+                  @"Uploading a tree to a writable dir should work");
+    XCTAssertTrue([channel downloadDirectory:remoteTree to:downloadedTree progress:nil],
+                  @"Downloading a tree should work");
+
+    NSString *b = [NSString stringWithContentsOfFile:[downloadedTree stringByAppendingPathComponent:@"sub/b.txt"]
+                                            encoding:NSUTF8StringEncoding
+                                               error:nil];
+    XCTAssertEqualObjects(b, @"bb", @"Nested files are transferred");
+
+    NSDictionary *attributes = [fileManager attributesOfItemAtPath:[downloadedTree stringByAppendingPathComponent:@"a.txt"] error:nil];
+    XCTAssertEqualObjects(attributes[NSFilePosixPermissions], @0600, @"Modes are preserved");
+
+    [channel execute:[NSString stringWithFormat:@"rm -rf '%@'", remoteTree] error:nil];
+    [fileManager removeItemAtPath:localTree error:nil];
+    [fileManager removeItemAtPath:downloadedTree error:nil];
+}
+
+- (void)testTarTransferPreservesTree {
+    channel = [[NMSSHChannel alloc] initWithSession:session];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+
+    NSString *localTree = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nmssh-tar"];
+    NSString *downloadedTree = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nmssh-tar-copy"];
+    [fileManager removeItemAtPath:localTree error:nil];
+    [fileManager removeItemAtPath:downloadedTree error:nil];
+
+    // Enough compressible files to exceed the compression sample
+    NSString *nested = [localTree stringByAppendingPathComponent:@"sub"];
+    [fileManager createDirectoryAtPath:nested withIntermediateDirectories:YES attributes:nil error:nil];
+    NSData *contents = [[@"" stringByPaddingToLength:4096 withString:@"nmssh " startingAtIndex:0] dataUsingEncoding:NSUTF8StringEncoding];
+    for (int i = 0; i < 100; i++) {
+        [fileManager createFileAtPath:[nested stringByAppendingPathComponent:[NSString stringWithFormat:@"%d.txt", i]]
+                             contents:contents
+                           attributes:nil];
+    }
+
+    NSString *longName = [@"" stringByPaddingToLength:150 withString:@"n" startingAtIndex:0];
+    [fileManager createFileAtPath:[localTree stringByAppendingPathComponent:longName]
+                         contents:[@"a" dataUsingEncoding:NSUTF8StringEncoding]
+                       attributes:@{ NSFilePosixPermissions : @0600 }];
+
+    NSString *remoteDir = [settings objectForKey:@"writable_dir"];
+    NSString *remoteTree = [remoteDir stringByAppendingPathComponent:@"nmssh-tar"];
+    XCTAssertTrue([channel uploadDirectoryWithTar:localTree to:remoteDir compression:NMSSHChannelCompressionAutomatic progress:nil],
+                  @"Uploading a tree as a tar stream should work");
+    XCTAssertTrue([channel downloadDirectoryWithTar:remoteTree to:downloadedTree compression:NMSSHChannelCompressionAutomatic progress:nil],
+                  @"Downloading a tree as a tar stream should work");
+
+    NSString *copy = [downloadedTree stringByAppendingPathComponent:@"nmssh-tar"];
+    XCTAssertEqualObjects([NSData dataWithContentsOfFile:[copy stringByAppendingPathComponent:@"sub/99.txt"]], contents,
+                          @"Nested files are transferred");
+
+    NSDictionary *attributes = [fileManager attributesOfItemAtPath:[copy stringByAppendingPathComponent:longName] error:nil];
+    XCTAssertEqualObjects(attributes[NSFilePosixPermissions], @0600, @"Long names and modes are preserved");
+
+    [channel execute:[NSString stringWithFormat:@"rm -rf '%@'", remoteTree] error:nil];
+    [fileManager removeItemAtPath:localTree error:nil];
+    [fileManager removeItemAtPath:downloadedTree error:nil];
+}
+
+// -----------------------------------------------------------------------------
+// CHANNEL WINDOW BENCHMARKS
+// -----------------------------------------------------------------------------
+
+- (NSTimeInterval)timeToReceive:(NSUInteger)length throughProxy:(DelayProxy *)proxy windowSize:(NSUInteger)windowSize {
+    NSString *host = [NSString stringWithFormat:@"127.0.0.1:%d", proxy.port];
+    NMSSHSession *delayedSession = [NMSSHSession connectToHost:host withUsername:[settings objectForKey:@"user"]];
+    [delayedSession authenticateByPassword:[settings objectForKey:@"password"]];
+    XCTAssertTrue([delayedSession isAuthorized], @"The proxy should reach the server");
+
+    NMSSHChannel *delayedChannel = [[NMSSHChannel alloc] initWithSession:delayedSession];
+    [delayedChannel setWindowSize:windowSize];
+
+    __block NSUInteger received = 0;
+    NSString *command = [NSString stringWithFormat:@"head -c %lu /dev/zero", (unsigned long)length];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [delayedChannel execute:command standardOutput:^(NSData *data) {
+        received += [data length];
+    } standardError:nil error:nil timeout:@120];
+    NSTimeInterval elapsed = CFAbsoluteTimeGetCurrent() - start;
+
+    XCTAssertEqual(received, length, @"The whole output should be received");
+    [delayedSession disconnect];
+
+    // Kept with the test results rather than in the console
+    NSString *name = [NSString stringWithFormat:@"%lu KiB window", (unsigned long)windowSize / 1024];
+    [XCTContext runActivityNamed:name block:^(id<XCTActivity> activity) {
+        NSString *throughput = [NSString stringWithFormat:@"%.1f MiB/s", length / elapsed / (1024 * 1024)];
+        XCTAttachment *attachment = [XCTAttachment attachmentWithString:throughput];
+        [attachment setName:@"Throughput"];
+        [attachment setLifetime:XCTAttachmentLifetimeKeepAlways];
+        [activity addAttachment:attachment];
+    }];
+
+    return elapsed;
+}
+
+- (void)testLargeWindowImprovesThroughputOnSlowLinks {
+    // 100 ms round trip, the default 2 MiB window caps the link at 20 MiB/s
+    DelayProxy *proxy = [[DelayProxy alloc] initWithHost:[settings objectForKey:@"host"] delay:0.05];
+    NSUInteger length = 64 * 1024 * 1024;
+
+    NSTimeInterval defaultWindow = [self timeToReceive:length throughProxy:proxy windowSize:2 * 1024 * 1024];
+    NSTimeInterval largeWindow = [self timeToReceive:length throughProxy:proxy windowSize:16 * 1024 * 1024];
+    [proxy stop];
+
+    XCTAssertLessThan(largeWindow, defaultWindow, @"A larger window should speed up high-latency transfers");
+}
+
 @end
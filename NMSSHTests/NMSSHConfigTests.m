@@ -159,6 +159,27 @@
     XCTAssertEqualObjects(hostConfig.hostPatterns, expected, @"Patterns don't match");
 }
 
+/**
+ Tests that "=" separates keywords from their arguments
+ */
+- (void)testEqualsSeparator {
+    NSString *contents =
+        @"Host=pattern\n"
+        @"    HostName = hostname\n"
+        @"    Port =2222\n"
+        @"    User= user\n";
+
+    NMSSHConfig *config = [[NMSSHConfig alloc] initWithString:contents];
+    NSArray *hostConfigs = config.hostConfigs;
+    XCTAssertEqual([hostConfigs count], 1, @"Wrong number of configs read");
+
+    NMSSHHostConfig *hostConfig = hostConfigs[0];
+    XCTAssertEqualObjects(hostConfig.hostPatterns, @[ @"pattern" ], @"Patterns don't match");
+    XCTAssertEqualObjects(hostConfig.hostname, @"hostname", @"Hostnames don't match");
+    XCTAssertEqualObjects(hostConfig.port, @2222, @"Ports don't match");
+    XCTAssertEqualObjects(hostConfig.user, @"user", @"Users don't match");
+}
+
 /**
  Tests that quoted patterns are parsed properly
  */
@@ -609,4 +630,44 @@
                           @"Identity files don't match");
 }
 
+/**
+ Tests that the whole ProxyCommand line is read, including blanks.
+ */
+- (void)testProxyCommand {
+    NSString *contents =
+        @"Host pattern\n"
+        @"    ProxyCommand ssh -W %h:%p bastion\n"
+        @"Host other\n"
+        @"    ProxyCommand=nc %h %p\n";
+
+    NMSSHConfig *config = [[NMSSHConfig alloc] initWithString:contents];
+    NSArray *hostConfigs = config.hostConfigs;
+    XCTAssertEqual([hostConfigs count], 2, @"Wrong number of configs read");
+
+    NMSSHHostConfig *hostConfig = hostConfigs[0];
+    XCTAssertEqualObjects(hostConfig.proxyCommand, @"ssh -W %h:%p bastion", @"Proxy commands don't match");
+
+    hostConfig = hostConfigs[1];
+    XCTAssertEqualObjects(hostConfig.proxyCommand, @"nc %h %p", @"Proxy commands don't match");
+}
+
+/**
+ Tests that the first matching ProxyCommand wins, "none" included.
+ */
+- (void)testMergeProxyCommand {
+    NSString *contents =
+        @"Host direct\n"
+        @"    ProxyCommand none\n"
+        @"Host *\n"
+        @"    ProxyCommand nc %h %p\n";
+
+    NMSSHConfig *config = [[NMSSHConfig alloc] initWithString:contents];
+
+    NMSSHHostConfig *hostConfig = [config hostConfigForHost:@"direct"];
+    XCTAssertEqualObjects(hostConfig.proxyCommand, @"none", @"Proxy commands don't match");
+
+    hostConfig = [config hostConfigForHost:@"proxied"];
+    XCTAssertEqualObjects(hostConfig.proxyCommand, @"nc %h %p", @"Proxy commands don't match");
+}
+
 @end
@@ -0,0 +1,127 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHExpectTests : XCTestCase
+
+@end
+
+@implementation NMSSHExpectTests
+
+- (NMSSHExpectMatch *)scan:(NSArray *)chunks withMatcher:(NMSSHExpect *)matcher {
+    NMSSHExpectMatch *match = nil;
+    for (NSString *chunk in chunks) {
+        NSData *data = [chunk dataUsingEncoding:NSUTF8StringEncoding];
+        match = [matcher scanBytes:[data bytes] length:[data length]];
+        if (match) {
+            break;
+        }
+    }
+
+    return match;
+}
+
+/**
+ Tests that a literal split over several chunks is found on its last byte.
+ */
+- (void)testLiteralSpanningChunksIsFound {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[[NMSSHExpectPattern patternWithString:@"Password:"],
+                                                                   [NMSSHExpectPattern patternWithString:@"$ "]]];
+    NMSSHExpectMatch *match = [self scan:@[@"Last login\nPass", @"wo", @"rd: trailing"] withMatcher:matcher];
+
+    XCTAssertNotNil(match, @"The literal is found across chunks");
+    XCTAssertEqual(match.patternIndex, (NSUInteger)0, @"The first pattern matched");
+    XCTAssertEqual(match.range.location, (NSUInteger)11, @"The match starts after the first line");
+    XCTAssertEqual(match.range.length, (NSUInteger)9, @"The match covers the literal");
+    XCTAssertEqualObjects(match.captures, @[@"Password:"], @"The literal is the whole match");
+}
+
+/**
+ Tests that the match ending first wins, and earlier patterns win ties.
+ */
+- (void)testEarliestMatchWins {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[[NMSSHExpectPattern patternWithString:@"abcd"],
+                                                                   [NMSSHExpectPattern patternWithString:@"bc"],
+                                                                   [NMSSHExpectPattern patternWithString:@"c"]]];
+    NMSSHExpectMatch *match = [self scan:@[@"xabcd"] withMatcher:matcher];
+
+    XCTAssertEqual(match.patternIndex, (NSUInteger)1, @"Both suffixes end together, the earlier pattern wins");
+}
+
+/**
+ Tests that disabled patterns, e.g. timed out ones, are ignored.
+ */
+- (void)testDisabledPatternIsIgnored {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[[NMSSHExpectPattern patternWithString:@"--More--"],
+                                                                   [NMSSHExpectPattern patternWithString:@"--More--"],
+                                                                   [NMSSHExpectPattern patternWithString:@"#"]]];
+    [matcher disablePatternAtIndex:0];
+    XCTAssertEqual([self scan:@[@"--More--"] withMatcher:matcher].patternIndex, (NSUInteger)1,
+                   @"An identical enabled literal still matches");
+
+    [matcher reset];
+    [matcher disablePatternAtIndex:0];
+    [matcher disablePatternAtIndex:1];
+    XCTAssertEqual([self scan:@[@"--More--\nrouter#"] withMatcher:matcher].patternIndex, (NSUInteger)2,
+                   @"The remaining pattern matches");
+
+    [matcher disablePatternAtIndex:2];
+    XCTAssertFalse(matcher.hasEnabledPatterns, @"No pattern is left");
+}
+
+/**
+ Tests that regular expressions are matched against lines, with captures.
+ */
+- (void)testRegularExpressionCapturesGroups {
+    NSError *error = nil;
+    NMSSHExpectPattern *prompt = [NMSSHExpectPattern patternWithRegularExpression:@"^([a-z]+)@([a-z]+) ?[$#] $"
+                                                                         options:0
+                                                                           error:&error];
+    XCTAssertNotNil(prompt, @"The expression is valid: %@", error);
+
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[prompt]];
+    NMSSHExpectMatch *match = [self scan:@[@"welcome\nroot@h", @"ost $ "] withMatcher:matcher];
+
+    XCTAssertNotNil(match, @"The prompt is found at the end of a chunk");
+    XCTAssertEqualObjects(match.captures, (@[@"root@host $ ", @"root", @"host"]), @"Groups are captured");
+    XCTAssertEqual(match.range.location, (NSUInteger)8, @"The range is counted from the start of the stream");
+}
+
+/**
+ Tests that a regular expression ending before a literal of the same chunk wins.
+ */
+- (void)testRegularExpressionEndingFirstBeatsLiteral {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[[NMSSHExpectPattern patternWithString:@"$ "],
+                                                                   [NMSSHExpectPattern patternWithRegularExpression:@"[Pp]assword:" options:0 error:nil]]];
+    NMSSHExpectMatch *match = [self scan:@[@"sudo password: $ "] withMatcher:matcher];
+
+    XCTAssertEqual(match.patternIndex, (NSUInteger)1, @"The match ending first wins whatever its kind");
+    XCTAssertEqual(match.range.location, (NSUInteger)5, @"The regular expression is located in the stream");
+
+    [matcher reset];
+    match = [self scan:@[@"x$ y"] withMatcher:matcher];
+    XCTAssertEqual(match.patternIndex, (NSUInteger)0, @"A literal ending first still wins");
+}
+
+/**
+ Tests that an empty literal, which would match any output, is rejected.
+ */
+- (void)testEmptyLiteralIsRejected {
+    XCTAssertNil([NMSSHExpectPattern patternWithString:@""], @"An empty literal is not a pattern");
+}
+
+/**
+ Tests that overlong lines do not grow the memory used.
+ */
+- (void)testOverlongLinesAreBounded {
+    NMSSHExpect *matcher = [[NMSSHExpect alloc] initWithPatterns:@[[NMSSHExpectPattern patternWithRegularExpression:@"END$" options:0 error:nil]]];
+    [matcher setMaximumLineLength:64];
+
+    NSMutableData *noise = [NSMutableData dataWithLength:1024 * 1024];
+    memset([noise mutableBytes], 'x', [noise length]);
+    XCTAssertNil([matcher scanBytes:[noise bytes] length:[noise length]], @"Noise does not match");
+
+    NMSSHExpectMatch *match = [self scan:@[@"END"] withMatcher:matcher];
+    XCTAssertEqual(match.range.location, [noise length], @"The end of an overlong line still matches");
+}
+
+@end
@@ -0,0 +1,84 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHLineSplitterTests : XCTestCase
+
+@end
+
+@implementation NMSSHLineSplitterTests
+
+/**
+ Feeds a stream in chunks of the given size and returns every line.
+ */
+- (NSArray *)linesFromStream:(NSData *)stream chunkSize:(NSUInteger)chunkSize splitter:(NMSSHLineSplitter *)splitter {
+    NSMutableArray *lines = [NSMutableArray array];
+    NMSSHLineHandler handler = ^(const char *line, NSUInteger length) {
+        [lines addObject:[[NSString alloc] initWithBytes:line length:length encoding:NSUTF8StringEncoding]];
+    };
+
+    for (NSUInteger offset = 0; offset < [stream length]; offset += chunkSize) {
+        NSUInteger length = MIN(chunkSize, [stream length] - offset);
+        [splitter splitBytes:(const char *)[stream bytes] + offset length:length handler:handler];
+    }
+
+    [splitter finishWithHandler:handler];
+
+    return lines;
+}
+
+/**
+ Tests that lines come back whole, whatever the chunks and their alignment.
+ */
+- (void)testLinesSpanningChunks {
+    NSMutableArray *expected = [NSMutableArray array];
+    NSMutableString *text = [NSMutableString string];
+    for (NSUInteger i = 0; i < 200; i++) {
+        NSString *line = [@"" stringByPaddingToLength:(i * 7) % 41 withString:@"é-line" startingAtIndex:0];
+        [expected addObject:line];
+        [text appendFormat:@"%@\n", line];
+    }
+    [expected addObject:@"no line feed"];
+    [text appendString:@"no line feed"];
+
+    NSData *stream = [text dataUsingEncoding:NSUTF8StringEncoding];
+    for (NSUInteger chunkSize = 1; chunkSize <= 40; chunkSize++) {
+        NMSSHLineSplitter *splitter = [[NMSSHLineSplitter alloc] init];
+        XCTAssertEqualObjects([self linesFromStream:stream chunkSize:chunkSize splitter:splitter], expected,
+                              @"Lines should survive chunks of %lu bytes", (unsigned long)chunkSize);
+        XCTAssertEqual([splitter bufferedLength], (NSUInteger)0, @"Nothing is left once finished");
+    }
+}
+
+/**
+ Tests that carriage returns ending lines are dropped, even split from their line feed.
+ */
+- (void)testCarriageReturnsAreStripped {
+    NSData *stream = [@"one\r\ntwo\r\n\r\nin\rside\n" dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *expected = @[@"one", @"two", @"", @"in\rside"];
+
+    for (NSUInteger chunkSize = 1; chunkSize <= [stream length]; chunkSize++) {
+        NMSSHLineSplitter *splitter = [[NMSSHLineSplitter alloc] init];
+        XCTAssertEqualObjects([self linesFromStream:stream chunkSize:chunkSize splitter:splitter], expected);
+    }
+
+    NMSSHLineSplitter *splitter = [[NMSSHLineSplitter alloc] init];
+    [splitter setStripsCarriageReturns:NO];
+    XCTAssertEqualObjects([self linesFromStream:stream chunkSize:[stream length] splitter:splitter],
+                          (@[@"one\r", @"two\r", @"\r", @"in\rside"]));
+}
+
+/**
+ Tests that a reset drops the incomplete line.
+ */
+- (void)testResetDropsIncompleteLine {
+    NMSSHLineSplitter *splitter = [[NMSSHLineSplitter alloc] init];
+    [splitter splitBytes:"partial" length:7 handler:^(const char *line, NSUInteger length) {
+        XCTFail(@"No line is complete");
+    }];
+    XCTAssertEqual([splitter bufferedLength], (NSUInteger)7);
+
+    [splitter reset];
+    XCTAssertEqual([splitter bufferedLength], (NSUInteger)0);
+}
+
+@end
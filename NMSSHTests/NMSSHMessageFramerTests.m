@@ -0,0 +1,94 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHMessageFramerTests : XCTestCase
+
+@end
+
+@implementation NMSSHMessageFramerTests
+
+/**
+ Feeds a stream one byte at a time and returns every message completed.
+ */
+- (NSArray *)messagesFromStream:(NSData *)stream framer:(NMSSHMessageFramer *)framer {
+    NSMutableArray *messages = [NSMutableArray array];
+    for (NSUInteger i = 0; i < [stream length]; i++) {
+        NSError *error = nil;
+        NSArray *completed = [framer messagesFromData:[stream subdataWithRange:NSMakeRange(i, 1)] error:&error];
+        XCTAssertNotNil(completed, @"%@", error);
+        [messages addObjectsFromArray:completed ?: @[]];
+    }
+
+    return messages;
+}
+
+- (NSData *)data:(NSString *)string {
+    return [string dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+/**
+ Tests that every framing gives back the messages it framed, whatever the reads.
+ */
+- (void)testFramedMessagesRoundTrip {
+    NSArray *sent = @[[self data:@"<hello/>"], [self data:@"]]>]] not yet"], [NSData data], [self data:@"<rpc/>"]];
+
+    for (NSNumber *framing in @[@(NMSSHMessageFramingDelimiter), @(NMSSHMessageFramingChunked), @(NMSSHMessageFramingLengthPrefixed)]) {
+        NMSSHMessageFramer *framer = [NMSSHMessageFramer framerWithFraming:[framing integerValue]];
+        NSMutableData *stream = [NSMutableData data];
+        NSMutableArray *expected = [NSMutableArray array];
+
+        for (NSData *message in sent) {
+            // Chunked framing has no empty message
+            if ([message length] == 0 && [framing integerValue] == NMSSHMessageFramingChunked) {
+                continue;
+            }
+
+            [stream appendData:[framer frameMessage:message]];
+            [expected addObject:message];
+        }
+
+        XCTAssertEqualObjects([self messagesFromStream:stream framer:framer], expected, @"Framing %@", framing);
+        XCTAssertEqual(framer.bufferedLength, (NSUInteger)0, @"Nothing is left over");
+    }
+}
+
+/**
+ Tests a multi-chunk NETCONF 1.1 message, from RFC 6242.
+ */
+- (void)testChunkedMessageOfSeveralChunks {
+    NMSSHMessageFramer *framer = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingChunked];
+    NSData *stream = [self data:@"\n#4\n<rpc\n#18\n message-id=\"102\"\n\n##\n"];
+
+    NSArray *messages = [framer messagesFromData:stream error:nil];
+    XCTAssertEqualObjects(messages, @[[self data:@"<rpc message-id=\"102\"\n"]]);
+}
+
+/**
+ Tests that broken streams are reported.
+ */
+- (void)testInvalidStreamsFail {
+    NSError *error = nil;
+
+    NMSSHMessageFramer *chunked = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingChunked];
+    XCTAssertNil([chunked messagesFromData:[self data:@"\n#04\nabcd"] error:&error], @"Leading zeros are invalid");
+    XCTAssertEqual(error.code, NMSSHMessageFramerInvalidFrame);
+
+    NMSSHMessageFramer *prefixed = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingLengthPrefixed];
+    [prefixed setMaximumMessageLength:16];
+    const uint8_t header[] = { 0, 0, 1, 0 };
+    XCTAssertNil([prefixed messagesFromData:[NSData dataWithBytes:header length:sizeof(header)] error:&error], @"Long messages are refused");
+    XCTAssertEqual(error.code, NMSSHMessageFramerMessageTooLong);
+}
+
+/**
+ Tests switching from the NETCONF 1.0 delimiter to chunks between messages.
+ */
+- (void)testFramingSwitchesBetweenMessages {
+    NMSSHMessageFramer *framer = [NMSSHMessageFramer framerWithFraming:NMSSHMessageFramingDelimiter];
+
+    XCTAssertEqualObjects([framer messagesFromData:[self data:@"<hello/>]]>]]>"] error:nil], @[[self data:@"<hello/>"]]);
+    [framer setFraming:NMSSHMessageFramingChunked];
+    XCTAssertEqualObjects([framer messagesFromData:[self data:@"\n#5\n<ok/>\n##\n"] error:nil], @[[self data:@"<ok/>"]]);
+}
+
+@end
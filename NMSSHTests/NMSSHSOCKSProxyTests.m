@@ -0,0 +1,296 @@
+#import <XCTest/XCTest.h>
+#import "ConfigHelper.h"
+
+#import <NMSSH/NMSSH.h>
+#import <arpa/inet.h>
+#import <netinet/in.h>
+#import <sys/socket.h>
+
+@interface NMSSHSOCKSProxyTests : XCTestCase {
+    NSDictionary *settings;
+
+    NMSSHSession *session;
+    NMSSHSOCKSProxy *proxy;
+}
+@end
+
+@implementation NMSSHSOCKSProxyTests
+
+// -----------------------------------------------------------------------------
+// TEST SETUP
+// -----------------------------------------------------------------------------
+
+- (void)setUp {
+    settings = [ConfigHelper valueForKey:@"valid_password_protected_server"];
+
+    session = [NMSSHSession connectToHost:[settings objectForKey:@"host"]
+                             withUsername:[settings objectForKey:@"user"]];
+    [session authenticateByPassword:[settings objectForKey:@"password"]];
+    assert([session isAuthorized]);
+
+    proxy = [[NMSSHSOCKSProxy alloc] initWithSession:session];
+}
+
+- (void)tearDown {
+    if (proxy) {
+        [proxy stop];
+        proxy = nil;
+    }
+
+    if (session) {
+        [session disconnect];
+        session = nil;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// HELPERS
+// -----------------------------------------------------------------------------
+
+// Plain blocking SOCKS5 client, returns the socket or -1 and the reply status
+- (int)connectThroughProxyToPort:(uint16_t)port reply:(uint8_t *)reply {
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct timeval timeout = { 10, 0 };
+    int set = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set));
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_len = sizeof(sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(proxy.port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    uint8_t greeting[3] = { 0x05, 0x01, 0x00 };
+    uint8_t method[2];
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        write(fd, greeting, sizeof(greeting)) != sizeof(greeting) ||
+        recv(fd, method, sizeof(method), MSG_WAITALL) != sizeof(method) ||
+        method[1] != 0x00) {
+        close(fd);
+        return -1;
+    }
+
+    // CONNECT to the loopback interface of the SSH server
+    uint8_t request[10] = { 0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, port >> 8, port & 0xFF };
+    uint8_t response[10];
+    if (write(fd, request, sizeof(request)) != sizeof(request) ||
+        recv(fd, response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+        close(fd);
+        return -1;
+    }
+
+    *reply = response[1];
+
+    return fd;
+}
+
+// The test server runs on the loopback interface, see config.sample.yml, so
+// the tunnels can reach a listener of the test itself
+- (int)listenOnLoopback:(uint16_t *)port {
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_len = sizeof(sin);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t length = sizeof(sin);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(fd, 1) != 0 ||
+        getsockname(fd, (struct sockaddr *)&sin, &length) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(sin.sin_port);
+
+    return fd;
+}
+
+- (BOOL)waitForActiveConnections:(NSUInteger)count {
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:10];
+    while (proxy.activeConnections != count) {
+        if ([deadline timeIntervalSinceNow] < 0) {
+            return NO;
+        }
+
+        [NSThread sleepForTimeInterval:0.05];
+    }
+
+    return YES;
+}
+
+// -----------------------------------------------------------------------------
+// CONNECT TESTS
+// -----------------------------------------------------------------------------
+
+/**
+ Tests that a CONNECT request is tunneled to its target.
+ */
+- (void)testConnectReachesTarget {
+    NSError *error = nil;
+    XCTAssertTrue([proxy startOnPort:0 error:&error], @"The proxy starts: %@", error);
+
+    uint16_t port = (uint16_t)[[[[settings objectForKey:@"host"] componentsSeparatedByString:@":"] lastObject] intValue];
+    uint8_t reply = 0xFF;
+    int fd = [self connectThroughProxyToPort:port reply:&reply];
+    XCTAssertTrue(fd >= 0, @"The SOCKS handshake completes");
+    XCTAssertEqual(reply, 0x00, @"The tunnel is established");
+
+    char banner[4];
+    XCTAssertEqual(recv(fd, banner, sizeof(banner), MSG_WAITALL), (ssize_t)sizeof(banner), @"The target answers");
+    XCTAssertEqual(strncmp(banner, "SSH-", sizeof(banner)), 0, @"The SSH server itself was reached");
+
+    close(fd);
+    XCTAssertTrue([self waitForActiveConnections:0], @"The client is released once closed");
+}
+
+/**
+ Tests that a CONNECT to a closed port is refused with a SOCKS error.
+ */
+- (void)testConnectToClosedPortIsRefused {
+    NSError *error = nil;
+    XCTAssertTrue([proxy startOnPort:0 error:&error], @"The proxy starts: %@", error);
+
+    uint8_t reply = 0x00;
+    int fd = [self connectThroughProxyToPort:1 reply:&reply];
+    XCTAssertTrue(fd >= 0, @"The SOCKS handshake completes");
+    XCTAssertTrue(reply == 0x05 || reply == 0x01, @"The tunnel is refused (reply %u)", reply);
+
+    char byte;
+    XCTAssertEqual(recv(fd, &byte, 1, 0), (ssize_t)0, @"The proxy closes the client");
+
+    close(fd);
+    XCTAssertTrue([self waitForActiveConnections:0], @"The refused client is released");
+}
+
+// -----------------------------------------------------------------------------
+// STREAMING TESTS
+// -----------------------------------------------------------------------------
+
+/**
+ Tests that the end of stream is propagated in both directions separately.
+ */
+- (void)testHalfCloseIsPropagated {
+    NSError *error = nil;
+    XCTAssertTrue([proxy startOnPort:0 error:&error], @"The proxy starts: %@", error);
+
+    // Echo everything back only once the client finished sending
+    uint16_t port = 0;
+    int listener = [self listenOnLoopback:&port];
+    XCTAssertTrue(listener >= 0, @"The echo server listens");
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int client = accept(listener, NULL, NULL);
+        NSMutableData *received = [NSMutableData data];
+        char buffer[256];
+        ssize_t rc;
+        while ((rc = read(client, buffer, sizeof(buffer))) > 0) {
+            [received appendBytes:buffer length:(NSUInteger)rc];
+        }
+
+        write(client, [received bytes], [received length]);
+        close(client);
+    });
+
+    uint8_t reply = 0xFF;
+    int fd = [self connectThroughProxyToPort:port reply:&reply];
+    XCTAssertEqual(reply, 0x00, @"The tunnel is established");
+
+    XCTAssertEqual(write(fd, "hello", 5), (ssize_t)5, @"The request is sent");
+    shutdown(fd, SHUT_WR);
+
+    NSMutableData *echoed = [NSMutableData data];
+    char buffer[256];
+    ssize_t rc;
+    while ((rc = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        [echoed appendBytes:buffer length:(NSUInteger)rc];
+    }
+
+    XCTAssertEqual(rc, (ssize_t)0, @"The remote end of stream reaches the client");
+    XCTAssertEqualObjects(echoed, [@"hello" dataUsingEncoding:NSUTF8StringEncoding],
+                          @"The target answered after the end of the request");
+
+    close(fd);
+    close(listener);
+    XCTAssertTrue([self waitForActiveConnections:0], @"The client is released once closed");
+}
+
+/**
+ Tests that a client not reading stalls its target without stalling the session.
+ */
+- (void)testSlowClientStallsItsTarget {
+    [proxy setBufferSize:0x1000];
+
+    NSError *error = nil;
+    XCTAssertTrue([proxy startOnPort:0 error:&error], @"The proxy starts: %@", error);
+
+    uint16_t port = 0;
+    int listener = [self listenOnLoopback:&port];
+    XCTAssertTrue(listener >= 0, @"The sender listens");
+
+    // Far more than the channel window and the socket buffers can hold
+    const NSUInteger total = 32 * 1024 * 1024;
+    NSMutableData *progress = [NSMutableData dataWithLength:sizeof(NSUInteger)];
+    dispatch_semaphore_t sent = dispatch_semaphore_create(0);
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int client = accept(listener, NULL, NULL);
+        int set = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set));
+
+        char chunk[0x4000];
+        memset(chunk, 'x', sizeof(chunk));
+        NSUInteger written = 0;
+        while (written < total) {
+            ssize_t rc = write(client, chunk, MIN(sizeof(chunk), total - written));
+            if (rc <= 0) {
+                break;
+            }
+
+            written += (NSUInteger)rc;
+            @synchronized (progress) {
+                *(NSUInteger *)[progress mutableBytes] = written;
+            }
+        }
+
+        close(client);
+        dispatch_semaphore_signal(sent);
+    });
+
+    uint8_t reply = 0xFF;
+    int fd = [self connectThroughProxyToPort:port reply:&reply];
+    XCTAssertEqual(reply, 0x00, @"The tunnel is established");
+
+    // Leave the data unread, the session keeps serving other requests
+    [NSThread sleepForTimeInterval:1.0];
+    NSError *executeError = nil;
+    XCTAssertEqualObjects([session.channel execute:@"echo ok" error:&executeError], @"ok\n",
+                          @"The session is not stalled by the client: %@", executeError);
+
+    NSUInteger stalled;
+    @synchronized (progress) {
+        stalled = *(NSUInteger *)[progress bytes];
+    }
+    XCTAssertLessThan(stalled, total, @"The target is stalled by the flow control");
+
+    NSUInteger received = 0;
+    char buffer[0x10000];
+    ssize_t rc;
+    while ((rc = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        received += (NSUInteger)rc;
+    }
+
+    XCTAssertEqual(dispatch_semaphore_wait(sent, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L,
+                   @"The target resumes sending");
+    XCTAssertEqual(received, total, @"Every byte is delivered once the client reads");
+
+    close(fd);
+    close(listener);
+    XCTAssertTrue([self waitForActiveConnections:0], @"The client is released once closed");
+}
+
+@end
@@ -0,0 +1,82 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHScrollbackBufferTests : XCTestCase
+
+@end
+
+@implementation NMSSHScrollbackBufferTests
+
+/**
+ Tests that lines split across appends are indexed as one.
+ */
+- (void)testLinesAreIndexedAcrossAppends {
+    NMSSHScrollbackBuffer *buffer = [[NMSSHScrollbackBuffer alloc] initWithCapacity:1024 maximumLines:16];
+
+    [buffer appendData:[@"first\nsec" dataUsingEncoding:NSUTF8StringEncoding]];
+    [buffer appendData:[@"ond\nthird" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    XCTAssertEqual(buffer.lineCount, (NSUInteger)3, @"The unterminated last line is counted");
+    XCTAssertEqualObjects([buffer lastLines:2], (@[@"second", @"third"]), @"Lines are returned without line feeds");
+    XCTAssertEqualObjects([buffer lastLines:10], (@[@"first", @"second", @"third"]), @"At most the lines kept are returned");
+    XCTAssertNil([buffer dataForLineAtIndex:3], @"Indexes past the last line have no data");
+}
+
+/**
+ Tests that the oldest bytes are overwritten and the first line truncated.
+ */
+- (void)testRingKeepsTheEndOfTheOutput {
+    NMSSHScrollbackBuffer *buffer = [[NMSSHScrollbackBuffer alloc] initWithCapacity:10 maximumLines:16];
+
+    [buffer appendData:[@"abcdef\n" dataUsingEncoding:NSUTF8StringEncoding]];
+    [buffer appendData:[@"ghij\nkl" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    XCTAssertEqual(buffer.length, (NSUInteger)10, @"The buffer is full");
+    XCTAssertEqual(buffer.totalLength, (uint64_t)14, @"Every byte is counted");
+    XCTAssertEqualObjects([buffer snapshot], [@"ef\nghij\nkl" dataUsingEncoding:NSUTF8StringEncoding], @"The snapshot wraps around");
+    XCTAssertEqualObjects([buffer lastLines:3], (@[@"ef", @"ghij", @"kl"]), @"The first line lost its beginning");
+
+    [buffer appendData:[@"mnopqrstuvwxyz" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    XCTAssertEqualObjects([buffer snapshot], [@"qrstuvwxyz" dataUsingEncoding:NSUTF8StringEncoding], @"Chunks larger than the ring keep their end");
+    XCTAssertEqual(buffer.lineCount, (NSUInteger)1, @"Lines overwritten are dropped");
+    XCTAssertEqual(buffer.firstLineNumber, (uint64_t)2, @"Dropped lines are counted");
+}
+
+/**
+ Tests that only the newest lines are kept beyond maximumLines.
+ */
+- (void)testLineLimitDropsOldestLines {
+    NMSSHScrollbackBuffer *buffer = [[NMSSHScrollbackBuffer alloc] initWithCapacity:1024 maximumLines:3];
+
+    for (int i = 0; i < 10; i++) {
+        [buffer appendData:[[NSString stringWithFormat:@"%d\n", i] dataUsingEncoding:NSUTF8StringEncoding]];
+    }
+
+    XCTAssertEqual(buffer.lineCount, (NSUInteger)3, @"The line limit holds");
+    XCTAssertEqual(buffer.firstLineNumber, (uint64_t)8, @"Dropped lines are counted");
+    XCTAssertEqualObjects([buffer lastLines:3], (@[@"8", @"9", @""]), @"The newest lines are kept");
+}
+
+/**
+ Tests that incremental reads return each byte once.
+ */
+- (void)testDataSincePositionIsIncremental {
+    NMSSHScrollbackBuffer *buffer = [[NMSSHScrollbackBuffer alloc] initWithCapacity:8 maximumLines:4];
+    uint64_t position = 0;
+
+    [buffer appendData:[@"abc" dataUsingEncoding:NSUTF8StringEncoding]];
+    XCTAssertEqualObjects([buffer dataSincePosition:position nextPosition:&position], [@"abc" dataUsingEncoding:NSUTF8StringEncoding]);
+    XCTAssertEqual(position, (uint64_t)3, @"The position moves to the end");
+
+    [buffer appendData:[@"defghijklm" dataUsingEncoding:NSUTF8StringEncoding]];
+    XCTAssertEqualObjects([buffer dataSincePosition:position nextPosition:&position], [@"fghijklm" dataUsingEncoding:NSUTF8StringEncoding],
+                          @"Bytes no longer kept are skipped");
+    XCTAssertEqual([[buffer dataSincePosition:position nextPosition:&position] length], (NSUInteger)0, @"Nothing new was appended");
+
+    [buffer clear];
+    XCTAssertEqual(buffer.length, (NSUInteger)0, @"The buffer is empty");
+    XCTAssertEqual(buffer.lineCount, (NSUInteger)1, @"An empty line remains");
+}
+
+@end
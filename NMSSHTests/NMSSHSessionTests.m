@@ -224,6 +224,87 @@
                   @"work");
 }
 
+// -----------------------------------------------------------------------------
+// ASYNCHRONOUS API TESTS
+// -----------------------------------------------------------------------------
+
+- (void)testAsynchronousConnectionAndAuthenticationWorks {
+    NSString *host = [validPasswordProtectedServer objectForKey:@"host"];
+    NSString *username = [validPasswordProtectedServer objectForKey:@"user"];
+    NSString *password = [validPasswordProtectedServer objectForKey:@"password"];
+
+    session = [[NMSSHSession alloc] initWithHost:host andUsername:username];
+
+    XCTestExpectation *connected = [self expectationWithDescription:@"connected"];
+    XCTestExpectation *authorized = [self expectationWithDescription:@"authorized"];
+
+    // The authentication is queued behind the connection
+    [session connectWithCompletionHandler:^(NSError *error) {
+        XCTAssertNil(error, @"Asynchronous connection to valid server should work");
+        [connected fulfill];
+    }];
+
+    [session authenticateByPassword:password completionHandler:^(NSError *error) {
+        XCTAssertNil(error, @"Asynchronous authentication with valid password should work");
+        [authorized fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertTrue([session isAuthorized], @"Session should be authorized");
+}
+
+- (void)testCancelledAsynchronousOperationFails {
+    NSString *host = [validPasswordProtectedServer objectForKey:@"host"];
+    NSString *username = [validPasswordProtectedServer objectForKey:@"user"];
+
+    session = [NMSSHSession connectToHost:host withUsername:username];
+
+    XCTestExpectation *cancelled = [self expectationWithDescription:@"cancelled"];
+    NMSSHOperation *operation = [session authenticateByPassword:@"" completionHandler:^(NSError *error) {
+        XCTAssertEqual([error code], (NSInteger)NSUserCancelledError, @"Cancelled operation should report cancellation");
+        [cancelled fulfill];
+    }];
+    [operation cancel];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertFalse([session isAuthorized], @"Cancelled authentication should not work");
+}
+
+// -----------------------------------------------------------------------------
+// DEADLINE TESTS
+// -----------------------------------------------------------------------------
+
+- (void)testDeadlinesCombineToTheEarliest {
+    NMSSHDeadline *distant = [NMSSHDeadline distantDeadline];
+    NMSSHDeadline *deadline = [distant deadlineWithTimeout:60];
+
+    XCTAssertFalse([deadline isDistant], @"A timeout should shorten a distant deadline");
+    XCTAssertTrue([deadline remainingTime] <= 60, @"Remaining time should not exceed the timeout");
+    XCTAssertEqual([deadline deadlineWithTimeout:0], deadline, @"A zero timeout should be ignored");
+    XCTAssertEqual([deadline earliestDeadline:distant], deadline, @"The earliest deadline should win");
+    XCTAssertTrue([[NMSSHDeadline deadlineWithTimeout:0] isExpired], @"A zero deadline should be expired");
+}
+
+- (void)testExpiredDeadlineAbortsSessionCalls {
+    NSString *host = [validPasswordProtectedServer objectForKey:@"host"];
+    NSString *username = [validPasswordProtectedServer objectForKey:@"user"];
+    NSString *password = [validPasswordProtectedServer objectForKey:@"password"];
+
+    session = [[NMSSHSession alloc] initWithHost:host andUsername:username];
+
+    XCTestExpectation *timedOut = [self expectationWithDescription:@"timed out"];
+    [session performWithDeadline:[NMSSHDeadline deadlineWithTimeout:0] block:^{
+        XCTAssertFalse([session connect], @"Connecting past the deadline should fail");
+
+        [session authenticateByPassword:password completionHandler:^(NSError *error) {
+            XCTAssertEqual([error code], (NSInteger)NMSSHSessionTimeoutError, @"Operations past the deadline should time out");
+            [timedOut fulfill];
+        }];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+}
+
 // -----------------------------------------------------------------------------
 // CONFIG TESTS
 // -----------------------------------------------------------------------------
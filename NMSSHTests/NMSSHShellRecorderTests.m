@@ -0,0 +1,116 @@
+#import <XCTest/XCTest.h>
+#import <NMSSH/NMSSH.h>
+
+@interface NMSSHShellRecorderTests : XCTestCase
+
+@property (nonatomic, strong) NSString *path;
+
+@end
+
+@implementation NMSSHShellRecorderTests
+
+- (void)setUp {
+    [super setUp];
+    self.path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:self.path error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:[self.path stringByAppendingString:@".timing"] error:nil];
+    [super tearDown];
+}
+
+/**
+ Tests that an asciicast recording holds a header and one event per record.
+ */
+- (void)testAsciicastRecording {
+    NSError *error = nil;
+    NMSSHShellRecorder *recorder = [[NMSSHShellRecorder alloc] initWithPath:self.path
+                                                                      format:NMSSHShellRecordingFormatAsciicast
+                                                                       error:&error];
+    XCTAssertNotNil(recorder, @"%@", error);
+    recorder.width = 120;
+    recorder.height = 40;
+
+    // A character split between two reads is written with the second one
+    [recorder recordOutput:"$ caf\xC3" length:6];
+    [recorder recordOutput:"\xA9\r\n" length:3];
+    [recorder recordInput:"ls \"x\"\n" length:7];
+    [recorder recordResizeWidth:100 height:30];
+    [recorder close];
+
+    XCTAssertTrue(recorder.closed);
+    XCTAssertEqual(recorder.droppedBytes, (uint64_t)0);
+
+    NSString *contents = [NSString stringWithContentsOfFile:self.path encoding:NSUTF8StringEncoding error:nil];
+    NSArray *lines = [[contents stringByTrimmingCharactersInSet:[NSCharacterSet newlineCharacterSet]] componentsSeparatedByString:@"\n"];
+    XCTAssertEqual([lines count], (NSUInteger)5, @"A header and four events");
+
+    NSMutableArray *objects = [NSMutableArray array];
+    for (NSString *line in lines) {
+        id object = [NSJSONSerialization JSONObjectWithData:[line dataUsingEncoding:NSUTF8StringEncoding] options:0 error:&error];
+        XCTAssertNotNil(object, @"Every line is JSON: %@", error);
+        [objects addObject:object ?: [NSNull null]];
+    }
+
+    XCTAssertEqualObjects(objects[0][@"version"], @2);
+    XCTAssertEqualObjects(objects[0][@"width"], @120);
+    XCTAssertEqualObjects(objects[0][@"height"], @40);
+    XCTAssertEqualObjects([objects[1] subarrayWithRange:NSMakeRange(1, 2)], (@[@"o", @"$ caf"]));
+    XCTAssertEqualObjects([objects[2] subarrayWithRange:NSMakeRange(1, 2)], (@[@"o", @"é\r\n"]));
+    XCTAssertEqualObjects([objects[3] subarrayWithRange:NSMakeRange(1, 2)], (@[@"i", @"ls \"x\"\n"]));
+    XCTAssertEqualObjects([objects[4] subarrayWithRange:NSMakeRange(1, 2)], (@[@"r", @"100x30"]));
+    XCTAssertLessThanOrEqual([objects[1][0] doubleValue], [objects[4][0] doubleValue], @"Times increase");
+
+    [recorder recordOutput:"late" length:4];
+    NSString *after = [NSString stringWithContentsOfFile:self.path encoding:NSUTF8StringEncoding error:nil];
+    XCTAssertEqualObjects(after, contents, @"Records after close are ignored");
+}
+
+/**
+ Tests that a typescript holds the output between its banners and a timing
+ line per output record.
+ */
+- (void)testTypescriptRecording {
+    NSString *timingPath = [self.path stringByAppendingString:@".timing"];
+    NMSSHShellRecorder *recorder = [[NMSSHShellRecorder alloc] initWithPath:self.path
+                                                                      format:NMSSHShellRecordingFormatTypescript
+                                                                  timingPath:timingPath
+                                                              bufferCapacity:1024
+                                                                       error:nil];
+
+    [recorder recordOutput:"hello " length:6];
+    [recorder recordInput:"secret\n" length:7];
+    [recorder recordOutput:"world\n" length:6];
+    [recorder close];
+
+    NSString *contents = [NSString stringWithContentsOfFile:self.path encoding:NSUTF8StringEncoding error:nil];
+    XCTAssertTrue([contents hasPrefix:@"Script started on "]);
+    XCTAssertTrue([contents rangeOfString:@"\nhello world\n\nScript done on "].location != NSNotFound);
+    XCTAssertTrue([contents rangeOfString:@"secret"].location == NSNotFound, @"Input is not part of a typescript");
+
+    NSString *timing = [NSString stringWithContentsOfFile:timingPath encoding:NSUTF8StringEncoding error:nil];
+    NSArray *lines = [[timing stringByTrimmingCharactersInSet:[NSCharacterSet newlineCharacterSet]] componentsSeparatedByString:@"\n"];
+    XCTAssertEqual([lines count], (NSUInteger)2);
+    XCTAssertTrue([lines[0] hasSuffix:@" 6"]);
+}
+
+/**
+ Tests that records are dropped rather than waited for when the ring is full.
+ */
+- (void)testFullBufferDropsRecords {
+    NMSSHShellRecorder *recorder = [[NMSSHShellRecorder alloc] initWithPath:self.path
+                                                                      format:NMSSHShellRecordingFormatTypescript
+                                                                  timingPath:nil
+                                                              bufferCapacity:64
+                                                                       error:nil];
+
+    char chunk[100];
+    memset(chunk, 'x', sizeof(chunk));
+    [recorder recordOutput:chunk length:sizeof(chunk)];
+    [recorder close];
+
+    XCTAssertEqual(recorder.droppedBytes, (uint64_t)100, @"A record larger than the ring is dropped");
+}
+
+@end
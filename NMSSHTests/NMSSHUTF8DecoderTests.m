@@ -0,0 +1,76 @@
+#import <XCTest/XCTest.h>
+#import "NMSSHUTF8Decoder.h"
+
+@interface NMSSHUTF8DecoderTests : XCTestCase
+
+@end
+
+@implementation NMSSHUTF8DecoderTests
+
+/**
+ Tests that a character split at every possible byte is decoded once complete.
+ */
+- (void)testCharactersSplitAcrossChunks {
+    NSString *text = @"café € \U0001F600 done";
+    NSData *data = [text dataUsingEncoding:NSUTF8StringEncoding];
+
+    for (NSUInteger split = 0; split <= [data length]; split++) {
+        NMSSHUTF8Decoder *decoder = [[NMSSHUTF8Decoder alloc] init];
+        NSMutableString *decoded = [NSMutableString string];
+
+        [decoded appendString:[decoder decodeBytes:[data bytes] length:split]];
+        [decoded appendString:[decoder decodeBytes:(const char *)[data bytes] + split length:[data length] - split]];
+        [decoded appendString:[decoder finish]];
+
+        XCTAssertEqualObjects(decoded, text, @"Split at %lu", (unsigned long)split);
+    }
+}
+
+/**
+ Tests that a character fed one byte at a time is delivered with its last byte.
+ */
+- (void)testByteByByte {
+    NMSSHUTF8Decoder *decoder = [[NMSSHUTF8Decoder alloc] init];
+    const uint8_t bytes[] = { 0xF0, 0x9F, 0x98, 0x80 };
+
+    XCTAssertEqualObjects([decoder decodeBytes:bytes length:1], @"");
+    XCTAssertEqualObjects([decoder decodeBytes:bytes + 1 length:1], @"");
+    XCTAssertEqualObjects([decoder decodeBytes:bytes + 2 length:1], @"");
+    XCTAssertEqualObjects([decoder decodeBytes:bytes + 3 length:1], @"\U0001F600");
+}
+
+/**
+ Tests that invalid sequences are replaced instead of failing the chunk.
+ */
+- (void)testInvalidSequencesAreReplaced {
+    NMSSHUTF8Decoder *decoder = [[NMSSHUTF8Decoder alloc] init];
+
+    // A stray continuation byte, an overlong form and a surrogate
+    const uint8_t bytes[] = { 'a', 0x80, 'b', 0xC0, 0xAF, 'c', 0xED, 0xA0, 0x80, 'd' };
+    XCTAssertEqualObjects([decoder decodeBytes:bytes length:sizeof(bytes)], @"a\uFFFDb\uFFFD\uFFFDc\uFFFD\uFFFD\uFFFDd");
+
+    // A sequence interrupted by ASCII loses only its valid start
+    const uint8_t interrupted[] = { 0xE2, 0x82 };
+    XCTAssertEqualObjects([decoder decodeBytes:interrupted length:sizeof(interrupted)], @"");
+    XCTAssertEqualObjects([decoder decodeBytes:"x" length:1], @"\uFFFDx");
+
+    // A sequence cut by the end of the stream
+    XCTAssertEqualObjects([decoder decodeBytes:interrupted length:1], @"");
+    XCTAssertEqualObjects([decoder finish], @"\uFFFD");
+}
+
+/**
+ Tests the valid prefix around the 16-byte ASCII blocks.
+ */
+- (void)testValidPrefixLength {
+    NSMutableData *data = [[@"0123456789abcdef0123456789abcdef" dataUsingEncoding:NSUTF8StringEncoding] mutableCopy];
+    XCTAssertEqual(NMSSHUTF8ValidPrefixLength([data bytes], [data length]), [data length], @"ASCII is valid");
+
+    [data appendBytes:"\xE2\x82" length:2];
+    XCTAssertEqual(NMSSHUTF8ValidPrefixLength([data bytes], [data length]), (NSUInteger)32, @"A cut sequence is excluded");
+
+    [data replaceBytesInRange:NSMakeRange(17, 1) withBytes:"\xFF" length:1];
+    XCTAssertEqual(NMSSHUTF8ValidPrefixLength([data bytes], [data length]), (NSUInteger)17, @"The first invalid byte ends the prefix");
+}
+
+@end
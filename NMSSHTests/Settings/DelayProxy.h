@@ -0,0 +1,26 @@
+#import <Foundation/Foundation.h>
+
+@interface DelayProxy : NSObject
+
+/**
+ * TCP proxy to a test server adding latency to every chunk it forwards, in
+ * both directions, to benchmark high-latency links against a local server.
+ *
+ * Example:
+ *
+ *     DelayProxy *proxy = [[DelayProxy alloc] initWithHost:@"127.0.0.1:22"
+ *                                                    delay:0.05];
+ *     NSString *host = [NSString stringWithFormat:@"127.0.0.1:%d", proxy.port];
+ *
+ * Only the macOS project has a test target, the iOS project builds the
+ * library alone.
+ */
+- (instancetype)initWithHost:(NSString *)host delay:(NSTimeInterval)delay;
+
+/** The local port to connect to */
+@property (nonatomic, readonly) uint16_t port;
+
+/** Stop accepting connections */
+- (void)stop;
+
+@end
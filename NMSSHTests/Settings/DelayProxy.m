@@ -0,0 +1,196 @@
+#import "DelayProxy.h"
+
+#import <fcntl.h>
+#import <netdb.h>
+#import <netinet/in.h>
+#import <sys/socket.h>
+
+@interface DelayProxy ()
+@property (nonatomic, strong) NSString *host;
+@property (nonatomic, strong) NSString *hostPort;
+@property (nonatomic, assign) NSTimeInterval delay;
+@property (nonatomic, assign) int listener;
+@property (nonatomic, readwrite) uint16_t port;
+@property (nonatomic, strong) dispatch_queue_t queue;
+@property (nonatomic, strong) dispatch_source_t acceptSource;
+@end
+
+@implementation DelayProxy
+
+- (instancetype)initWithHost:(NSString *)host delay:(NSTimeInterval)delay {
+    if ((self = [super init])) {
+        NSArray *hostParts = [host componentsSeparatedByString:@":"];
+        [self setHost:hostParts[0]];
+        [self setHostPort:[hostParts count] > 1 ? hostParts[1] : @"22"];
+        [self setDelay:delay];
+        [self setQueue:dispatch_queue_create("DelayProxy", DISPATCH_QUEUE_SERIAL)];
+
+        struct sockaddr_in address = { 0 };
+        address.sin_len = sizeof(address);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int yes = 1;
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        bind(listener, (struct sockaddr *)&address, sizeof(address));
+        listen(listener, 8);
+
+        socklen_t length = sizeof(address);
+        getsockname(listener, (struct sockaddr *)&address, &length);
+        [self setListener:listener];
+        [self setPort:ntohs(address.sin_port)];
+
+        [self setAcceptSource:dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, listener, 0, self.queue)];
+        dispatch_source_set_event_handler(self.acceptSource, ^{
+            [self acceptClient];
+        });
+        dispatch_source_set_cancel_handler(self.acceptSource, ^{
+            close(listener);
+        });
+        dispatch_resume(self.acceptSource);
+    }
+
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+}
+
+- (void)stop {
+    if (self.acceptSource) {
+        dispatch_source_cancel(self.acceptSource);
+        [self setAcceptSource:nil];
+    }
+}
+
+- (int)connectToHost {
+    struct addrinfo hints = { 0 };
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // The test server may be named, or listen on IPv6 only
+    struct addrinfo *addresses = NULL;
+    if (getaddrinfo([self.host UTF8String], [self.hostPort UTF8String], &hints, &addresses) != 0) {
+        return -1;
+    }
+
+    int server = -1;
+    for (struct addrinfo *address = addresses; address != NULL && server < 0; address = address->ai_next) {
+        server = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (server >= 0 && connect(server, address->ai_addr, address->ai_addrlen) != 0) {
+            close(server);
+            server = -1;
+        }
+    }
+
+    freeaddrinfo(addresses);
+    return server;
+}
+
+- (void)makeNonBlocking:(int)socket {
+    int yes = 1;
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+}
+
+- (void)acceptClient {
+    int client = accept(self.listener, NULL, NULL);
+    if (client < 0) {
+        return;
+    }
+
+    int server = [self connectToHost];
+    if (server < 0) {
+        close(client);
+        return;
+    }
+
+    // Neither direction may hold up the queue while the other one waits
+    [self makeNonBlocking:client];
+    [self makeNonBlocking:server];
+
+    // The sockets are closed once both directions reached their end
+    dispatch_group_t group = dispatch_group_create();
+    [self forwardFrom:client to:server group:group];
+    [self forwardFrom:server to:client group:group];
+    dispatch_group_notify(group, self.queue, ^{
+        close(client);
+        close(server);
+    });
+}
+
+- (void)forwardFrom:(int)from to:(int)to group:(dispatch_group_t)group {
+    // Chunks are written in arrival order whatever order the timers fire in
+    NSMutableArray *chunks = [NSMutableArray array];
+    NSMutableArray *dueChunks = [NSMutableArray array];
+    dispatch_queue_t queue = self.queue;
+    NSTimeInterval delay = self.delay;
+
+    // Due chunks are written as the socket accepts them, the source only runs
+    // while some are left
+    __block NSUInteger offset = 0;
+    __block BOOL writing = NO;
+    dispatch_source_t writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, to, 0, queue);
+    dispatch_source_set_event_handler(writeSource, ^{
+        while ([dueChunks count] > 0) {
+            id chunk = dueChunks[0];
+
+            // The end of the stream, or a peer that went away, ends the direction
+            ssize_t written = -1;
+            if (chunk != [NSNull null]) {
+                written = write(to, (const uint8_t *)[chunk bytes] + offset, [chunk length] - offset);
+                if (written < 0 && errno == EAGAIN) {
+                    return;
+                }
+            }
+
+            if (written < 0) {
+                shutdown(to, SHUT_WR);
+                [dueChunks removeAllObjects];
+                dispatch_source_cancel(writeSource);
+                dispatch_group_leave(group);
+                return;
+            }
+
+            offset += written;
+            if (offset == [chunk length]) {
+                [dueChunks removeObjectAtIndex:0];
+                offset = 0;
+            }
+        }
+
+        writing = NO;
+        dispatch_suspend(writeSource);
+    });
+
+    dispatch_group_enter(group);
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, from, 0, queue);
+    dispatch_source_set_event_handler(source, ^{
+        uint8_t buffer[0x10000];
+        ssize_t length = read(from, buffer, sizeof(buffer));
+        if (length < 0 && errno == EAGAIN) {
+            return;
+        }
+
+        // The end of the stream is forwarded with the same delay as the data
+        [chunks addObject:length > 0 ? [NSData dataWithBytes:buffer length:length] : [NSNull null]];
+        if (length <= 0) {
+            dispatch_source_cancel(source);
+        }
+
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), queue, ^{
+            [dueChunks addObject:chunks[0]];
+            [chunks removeObjectAtIndex:0];
+
+            if (!writing && !dispatch_source_testcancel(writeSource)) {
+                writing = YES;
+                dispatch_resume(writeSource);
+            }
+        });
+    });
+    dispatch_resume(source);
+}
+
+@end